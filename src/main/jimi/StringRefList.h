@@ -73,33 +73,34 @@ private:
     size_type capacity_;
     EntryChunk * head_;
     EntryChunk * tail_;
+    EntryChunk * current_;
 public:
     EntryPair items[kInitCapacity];
 
 public:
     BasicStringRefList(std::size_t capacity = kInitCapacity)
-        : ref(), size_(0), capacity_(capacity), head_(nullptr), tail_(nullptr) {
+        : ref(), size_(0), capacity_(capacity), head_(nullptr), tail_(nullptr), current_(nullptr) {
         initList();
     }
     BasicStringRefList(const char_type * data)
-        : ref(data), size_(0), capacity_(kInitCapacity), head_(nullptr), tail_(nullptr) {
+        : ref(data), size_(0), capacity_(kInitCapacity), head_(nullptr), tail_(nullptr), current_(nullptr) {
         initList();
     }
     BasicStringRefList(const char_type * data, size_type size)
-        : ref(data, size), size_(0), capacity_(kInitCapacity), head_(nullptr), tail_(nullptr) {
+        : ref(data, size), size_(0), capacity_(kInitCapacity), head_(nullptr), tail_(nullptr), current_(nullptr) {
         initList();
     }
     template <size_type N>
     BasicStringRefList(const char_type (&src)[N])
-        : ref(src, N - 1), size_(0), capacity_(kInitCapacity), head_(nullptr), tail_(nullptr) {
+        : ref(src, N - 1), size_(0), capacity_(kInitCapacity), head_(nullptr), tail_(nullptr), current_(nullptr) {
         initList();
     }
     BasicStringRefList(const string_type & src)
-        : ref(src), size_(0), capacity_(kInitCapacity), head_(nullptr), tail_(nullptr) {
+        : ref(src), size_(0), capacity_(kInitCapacity), head_(nullptr), tail_(nullptr), current_(nullptr) {
         initList();
     }
     BasicStringRefList(const stringref_type & src)
-        : ref(src), size_(0), capacity_(kInitCapacity), head_(nullptr), tail_(nullptr) {
+        : ref(src), size_(0), capacity_(kInitCapacity), head_(nullptr), tail_(nullptr), current_(nullptr) {
         initList();
     }
 
@@ -108,10 +109,11 @@ public:
     }
 
 private:
-    void appendItem(std::size_t index,
+    static const std::size_t kChunkSize = 64;
+
+    void appendItem(EntryPair & item,
                     const char * key, std::size_t key_len,
                     const char * value, std::size_t value_len) {
-        EntryPair & item = this->items[index];
         item.key.offset = static_cast<uint16_t>(key - ref.data());
         item.key.length = static_cast<uint16_t>(key_len);
         item.value.offset = static_cast<uint16_t>(value - ref.data());
@@ -128,17 +130,23 @@ public:
 
     bool is_empty() const { return (this->size() == 0); }
 
+    // Rewind the list in O(1), the entries chunks are kept for reuse.
     void reset() {
         this->ref.clear();
         this->size_ = 0;
-        this->capacity_ = kInitCapacity;
-        this->destroyChunks();
+        this->current_ = this->head_;
     }
 
     void clear() {
         this->reset();
     }
 
+    // Free the entries chunks.
+    void shrink() {
+        this->reset();
+        this->destroyChunks();
+    }
+
     void setRef(const char_type * data) {
         this->ref.assign(data);
     }
@@ -179,6 +187,8 @@ public:
         }
         this->head_ = nullptr;
         this->tail_ = nullptr;
+        this->current_ = nullptr;
+        this->capacity_ = kInitCapacity;
     }
 
     EntryChunk * findLastChunk() {
@@ -198,36 +208,49 @@ public:
         assert(value != nullptr);
         if (likely(this->size_ < kInitCapacity)) {
             assert(this->size_ < this->capacity_);
-            this->appendItem(this->size_, key, key_len, value, value_len);
+            this->appendItem(this->items[this->size_], key, key_len, value, value_len);
             ++(this->size_);
         }
         else {
-            if (unlikely(this->size_ >= this->capacity_)) {
-                // Add a new entries chunk
-                static const std::size_t kChunkSize = 64;
-                EntryChunk * newChunk = new EntryChunk(kChunkSize);
-                if (newChunk != nullptr) {
+            std::size_t offset = (this->size_ - kInitCapacity) % kChunkSize;
+            if (unlikely(offset == 0)) {
+                // Move to the next entries chunk, reuse it if it's exists.
+                EntryChunk * nextChunk = (this->size_ == kInitCapacity) ? this->head_
+                                         : this->current_->next;
+                if (unlikely(nextChunk == nullptr)) {
+                    nextChunk = new EntryChunk(kChunkSize);
                     if (this->head_ == nullptr)
-                        this->head_ = newChunk;
-                    if (this->tail_ == nullptr) {
-                        this->tail_ = newChunk;
-                    }
-                    else {
-                        this->tail_->next = newChunk;
-                        this->tail_ = newChunk;
-                    }
+                        this->head_ = nextChunk;
+                    else
+                        this->tail_->next = nextChunk;
+                    this->tail_ = nextChunk;
                     this->capacity_ += kChunkSize;
                 }
+                this->current_ = nextChunk;
             }
+            assert(this->current_ != nullptr);
             assert(this->size_ < this->capacity_);
-            //
-            // TODO: If the item count more than fixed kInitCapacity size,
-            //       append to the last position of last chunk.
-            //
-            appendItem(this->size_, key, key_len, value, value_len);
+            this->appendItem(this->current_->entries[offset], key, key_len, value, value_len);
             ++(this->size_);
         }
     }
+
+    const EntryPair & at(std::size_t index) const {
+        assert(index < this->size_);
+        if (likely(index < kInitCapacity)) {
+            return this->items[index];
+        }
+        else {
+            std::size_t chunk_index = (index - kInitCapacity) / kChunkSize;
+            EntryChunk * chunk = this->head_;
+            while (chunk_index-- != 0) {
+                assert(chunk != nullptr);
+                chunk = chunk->next;
+            }
+            assert(chunk != nullptr);
+            return chunk->entries[(index - kInitCapacity) % kChunkSize];
+        }
+    }
 };
 
 template <std::size_t InitCapacity>
@@ -0,0 +1,165 @@
+
+#ifndef JIMI_HTTP_CHUNKED_SCANNER_H
+#define JIMI_HTTP_CHUNKED_SCANNER_H
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <cstddef>
+
+#include "jimi/basic/stddef.h"
+
+namespace jimi {
+namespace http {
+
+//
+// Incremental scanner of a chunked body ("Transfer-Encoding: chunked"), it
+// finds where the body ends without decoding it, so that a relay (the
+// reverse proxy) can pass the chunks through as they arrive.
+//
+// Every call of scan() takes the next bytes of the body and returns how
+// many of them belong to it: all of them until the last chunk and the
+// trailer section have been seen, then the bytes up to the end of the body.
+// The chunk data is skipped without looking at it.
+//
+class ChunkedScanner {
+public:
+    typedef std::size_t size_type;
+
+    // A chunk size of more than 15 hex digits is rejected.
+    static const uint32_t kMaxSizeDigits = 15;
+
+private:
+    enum State {
+        kChunkSize,         // The hex digits of the chunk size.
+        kChunkExtension,    // ";name=value" up to the CR.
+        kChunkSizeLf,
+        kChunkData,
+        kChunkDataCr,
+        kChunkDataLf,
+        kTrailerStart,      // The start of a trailer line, or of the final CRLF.
+        kTrailerLine,
+        kFinalLf,
+        kDone,
+        kError
+    };
+
+    State    state_;
+    uint32_t digits_;
+    uint64_t remain_;
+
+public:
+    ChunkedScanner() : state_(kChunkSize), digits_(0), remain_(0) {}
+    ~ChunkedScanner() {}
+
+    bool isDone() const { return (this->state_ == kDone); }
+    bool isError() const { return (this->state_ == kError); }
+
+    void reset() {
+        this->state_ = kChunkSize;
+        this->digits_ = 0;
+        this->remain_ = 0;
+    }
+
+    // Return the number of the bytes of [data, data + len) which belong to
+    // the body, check isDone() and isError() after it.
+    size_type scan(const char * data, size_type len) {
+        const char * cur = data;
+        const char * end = data + len;
+        while (likely(cur < end)) {
+            switch (this->state_) {
+            case kChunkData: {
+                size_type avail = (size_type)(end - cur);
+                if (likely(this->remain_ > avail)) {
+                    this->remain_ -= avail;
+                    return len;
+                }
+                cur += this->remain_;
+                this->remain_ = 0;
+                this->state_ = kChunkDataCr;
+                continue;
+            }
+            case kChunkSize: {
+                char ch = *cur;
+                int digit;
+                if (ch >= '0' && ch <= '9')
+                    digit = ch - '0';
+                else if (ch >= 'a' && ch <= 'f')
+                    digit = ch - 'a' + 10;
+                else if (ch >= 'A' && ch <= 'F')
+                    digit = ch - 'A' + 10;
+                else
+                    digit = -1;
+                if (likely(digit >= 0)) {
+                    if (unlikely(++this->digits_ > kMaxSizeDigits))
+                        return this->fail(data, cur);
+                    this->remain_ = (this->remain_ << 4) | (uint64_t)digit;
+                }
+                else if (this->digits_ != 0 && (ch == ';' || ch == ' ' || ch == '\t')) {
+                    this->state_ = kChunkExtension;
+                }
+                else if (this->digits_ != 0 && ch == '\r') {
+                    this->state_ = kChunkSizeLf;
+                }
+                else {
+                    return this->fail(data, cur);
+                }
+                break;
+            }
+            case kChunkExtension:
+                if (*cur == '\r')
+                    this->state_ = kChunkSizeLf;
+                break;
+            case kChunkSizeLf:
+                if (unlikely(*cur != '\n'))
+                    return this->fail(data, cur);
+                this->digits_ = 0;
+                this->state_ = (this->remain_ != 0) ? kChunkData : kTrailerStart;
+                break;
+            case kChunkDataCr:
+                if (unlikely(*cur != '\r'))
+                    return this->fail(data, cur);
+                this->state_ = kChunkDataLf;
+                break;
+            case kChunkDataLf:
+                if (unlikely(*cur != '\n'))
+                    return this->fail(data, cur);
+                this->state_ = kChunkSize;
+                break;
+            case kTrailerStart:
+                this->state_ = (*cur == '\r') ? kFinalLf : kTrailerLine;
+                break;
+            case kTrailerLine:
+                if (*cur == '\n')
+                    this->state_ = kTrailerStart;
+                break;
+            case kFinalLf:
+                if (unlikely(*cur != '\n'))
+                    return this->fail(data, cur);
+                this->state_ = kDone;
+                return (size_type)(cur + 1 - data);
+            case kDone:
+                return (size_type)(cur - data);
+            default:
+                return (size_type)(cur - data);
+            }
+            cur++;
+        }
+        return len;
+    }
+
+private:
+    size_type fail(const char * data, const char * cur) {
+        this->state_ = kError;
+        return (size_type)(cur - data);
+    }
+};
+
+} // namespace http
+} // namespace jimi
+
+#endif // JIMI_HTTP_CHUNKED_SCANNER_H
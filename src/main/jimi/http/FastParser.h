@@ -16,6 +16,10 @@
 #include "jimi/StringRef.h"
 #include "jimi/StringRefList.h"
 #include "jimi/http/Common.h"
+#include "jimi/http/Version.h"
+#include "jimi/http/HeaderEndDetector.h"
+#include "jimi/http/ParserStats.h"
+#include "jimi/http/RequestLineMatcher.h"
 #include "jimi/http/Request.h"
 #include "jimi/http/Response.h"
 
@@ -24,17 +28,22 @@ using namespace std;
 namespace jimi {
 namespace http {
 
-template <typename StringType = std::string, std::size_t InitContentSize = 1024>
+template <typename StringType = std::string, std::size_t InitContentSize = 1024,
+          typename RequestLinePrefixes = DefaultRequestLinePrefixes>
 class BasicFastParser {
 public:
+    typedef BasicFastParser<StringType, InitContentSize, RequestLinePrefixes> this_type;
     typedef StringType      string_type;
     typedef std::uint32_t   hash_type;
+    typedef RequestLineMatcher<RequestLinePrefixes> matcher_type;
 
     // kInitContentSize minimize value is 256.
     static const std::size_t kMinContentSize = 256;
     // kInitContentSize = max(InitContentSize, 256);
     static const std::size_t kInitContentSize = (InitContentSize > kMinContentSize)
                                                 ? InitContentSize : kMinContentSize;
+    // The header fields keep 16-bit offsets into the header block, see StringRefList.
+    static const std::size_t kMaxHeaderSize = 64 * 1024;
 
 private:
     int32_t status_code_;
@@ -66,19 +75,66 @@ public:
         }
     }
 
+    // Prepare for the next request, it's only a handful of stores:
+    // the strings keep their capacity and the header fields keep their chunks.
     void reset() {
+        status_code_ = 0;
+        method_ = Method::UNKNOWN;
+        version_ = Version::UNKNOWN;
         method_str_.clear();
         uri_str_.clear();
         version_str_.clear();
+        content_length_ = 0;
         content_size_ = 0;
-        content_ = nullptr;
-        header_fields_.clear();
+        if (unlikely(content_ != nullptr)) {
+            delete[] content_;
+            content_ = nullptr;
+        }
+        header_fields_.reset();
     }
 
     std::size_t getFieldSize() const {
         return header_fields_.size();
     }
 
+    // Find the value of the field-name @key (case insensitive), return false if not found.
+    bool findField(const char * key, std::size_t key_len, StringRef & value) const {
+        const char * data = header_fields_.data();
+        for (std::size_t i = 0; i < header_fields_.size(); ++i) {
+            const auto & item = header_fields_.at(i);
+            if (item.key.length == key_len && equalsIgnoreCase(data + item.key.offset, key, key_len)) {
+                value.assign(data + item.value.offset, item.value.length);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template <std::size_t N>
+    bool findField(const char (&key)[N], StringRef & value) const {
+        return findField(key, N - 1, value);
+    }
+
+    // The @index-th header field, in the order of the request, e.g. to copy
+    // the header with some fields rewritten (the reverse proxy).
+    void getField(std::size_t index, StringRef & key, StringRef & value) const {
+        const char * data = header_fields_.data();
+        const auto & item = header_fields_.at(index);
+        key.assign(data + item.key.offset, item.key.length);
+        value.assign(data + item.value.offset, item.value.length);
+    }
+
+    static bool equalsIgnoreCase(const char * s1, const char * s2, std::size_t len) {
+        for (std::size_t i = 0; i < len; ++i) {
+            char c1 = s1[i], c2 = s2[i];
+            if (c1 >= 'A' && c1 <= 'Z') c1 += 'a' - 'A';
+            if (c2 >= 'A' && c2 <= 'Z') c2 += 'a' - 'A';
+            if (c1 != c2)
+                return false;
+        }
+        return true;
+    }
+
     uint32_t getMethod() const {
         return method_;
     }
@@ -486,6 +542,7 @@ scan_restart:
             std::ptrdiff_t len = is.current() - mark;
             assert(len > 0);
             method_str_.assign(mark, len);
+            method_ = Method::parse(mark, len);
         }
         return is_ok;
     }
@@ -502,6 +559,7 @@ scan_restart:
             std::ptrdiff_t len = is.current() - mark;
             assert(len > 0);
             method_str_.assign(mark, len);
+            method_ = Method::parse(mark, len);
         }
         return is_ok;
     }
@@ -533,6 +591,7 @@ scan_restart:
             std::ptrdiff_t len = is.current() - mark;
             if (likely(len >= kLenHTTPVersion)) {
                 version_str_.assign(mark, len);
+                version_ = Version::parse(mark, len);
                 return true;
             }
             else {
@@ -542,7 +601,70 @@ scan_restart:
         return is_ok;
     }
 
+    //
+    // Parse the request line which head is matched with a well-known prefix,
+    // in the same phases as the generic path: the method, the URI, then the
+    // version and the CrLf.
+    //
+    void parseKnownMethod(InputStream & is, const RequestLinePrefix & prefix) {
+        method_ = prefix.method;
+        method_str_.assign(is.current(), prefix.method_len);
+        moveTo(is, (int)prefix.method_len + 1);
+    }
+
+    bool parseKnownURI(InputStream & is, const RequestLinePrefix & prefix) {
+        // The length of " HTTP/1.1\r\n" at the tail of a whole request line.
+        static const std::size_t kVersionTailLen = sizeof(" HTTP/1.1\r\n") - 1;
+
+        const char * uri = is.current();
+        std::size_t prefix_uri_len = prefix.length - (prefix.method_len + 1);
+        if (likely(prefix.version != Version::UNKNOWN)) {
+            // The whole request line is matched, the URI ends before the version.
+            assert(prefix_uri_len > kVersionTailLen);
+            uri_str_.assign(uri, prefix_uri_len - kVersionTailLen);
+            moveTo(is, (int)(prefix_uri_len - kVersionTailLen + 1));
+            return true;
+        }
+        else {
+            // Scan the rest of the URI after the prefix.
+            moveTo(is, (int)prefix_uri_len);
+            bool is_ok = findToken<' '>(is);
+            if (likely(is_ok)) {
+                assert(is.current() >= uri);
+                uri_str_.assign(uri, is.current() - uri);
+                next(is);
+                skipWhiteSpaces(is);
+            }
+            return is_ok;
+        }
+    }
+
+    bool parseKnownVersion(InputStream & is, const RequestLinePrefix & prefix) {
+        static const std::size_t kVersionLen = sizeof("HTTP/1.1") - 1;
+
+        if (likely(prefix.version != Version::UNKNOWN)) {
+            version_str_.assign(is.current(), kVersionLen);
+            version_ = prefix.version;
+            moveTo(is, (int)kVersionLen + 2);
+            return true;
+        }
+        else {
+            bool is_ok = parseVersion(is);
+            if (likely(is_ok)) {
+                // Skip the CrLf, move the cursor 2 bytes.
+                assert(is.remain() >= 2);
+                moveTo(is, 2);
+            }
+            return is_ok;
+        }
+    }
+
     bool parseHeaderFields(InputStream & is) {
+        // A request without any header field, such as "GET / HTTP/1.0\r\n\r\n".
+        if (unlikely(is.remain() >= 2 && is.get() == '\r' && is.peek(1) == '\n')) {
+            moveTo(is, 2);
+            return true;
+        }
         do {
             // Skip the whitespaces ahead of every entry.
             //skipWhiteSpaces(is);
@@ -597,29 +719,61 @@ scan_restart:
 
         const char * start = is.current();
         std::size_t length = is.remain();
+        JIMI_PARSER_STATS_BEGIN(is);
+
+        // Try the well-known request line prefixes first.
+        const RequestLinePrefix * prefix = matcher_type::match(is.current(), is.remain());
+        if (likely(prefix != nullptr)) {
+            parseKnownMethod(is, *prefix);
+            JIMI_PARSER_STATS_PHASE(is, ParsePhase::Method, 0);
+
+            is_ok = parseKnownURI(is, *prefix);
+            JIMI_PARSER_STATS_PHASE(is, ParsePhase::URI, 0);
+            if (likely(is_ok))
+                is_ok = parseKnownVersion(is, *prefix);
+            if (likely(is_ok)) {
+                JIMI_PARSER_STATS_PHASE(is, ParsePhase::Version, 0);
+
+                assert(is.current() >= start);
+                assert(length >= (std::size_t)(is.current() - start));
+                header_fields_.setRef(is.current(), length - (is.current() - start));
+
+                is_ok = parseHeaderFields(is);
+                JIMI_PARSER_STATS_PHASE(is, ParsePhase::HeaderFields, header_fields_.size());
+                if (unlikely(!is_ok))
+                    return error_code::HttpParserError;
+            }
+            else {
+                ec = error_code::HttpParserError;
+            }
+        }
         // Http method characters must be upper case letters.
-        if (likely(is.get() >= 'A' && is.get() <= 'Z')) {
+        else if (likely(is.get() >= 'A' && is.get() <= 'Z')) {
             is_ok = parseMethod(is);
             if (likely(is_ok)) {
                 next(is);
                 skipWhiteSpaces(is);
+                JIMI_PARSER_STATS_PHASE(is, ParsePhase::Method, 0);
 
                 is_ok = parseURI(is);
                 if (likely(is_ok)) {
                     next(is);
                     skipWhiteSpaces(is);
+                    JIMI_PARSER_STATS_PHASE(is, ParsePhase::URI, 0);
 
                     is_ok = parseVersion(is);
                     if (likely(is_ok)) {
                         // Skip the CrLf, move the cursor 2 bytes.
                         assert(is.remain() >= 2);
                         moveTo(is, 2);
+                        JIMI_PARSER_STATS_PHASE(is, ParsePhase::Version, 0);
  
                         assert(is.current() >= start);
                         assert(length >= (std::size_t)(is.current() - start));
                         header_fields_.setRef(is.current(), length - (is.current() - start));
 
                         is_ok = parseHeaderFields(is);
+                        JIMI_PARSER_STATS_PHASE(is, ParsePhase::HeaderFields, header_fields_.size());
                         if (unlikely(!is_ok))
                             return error_code::HttpParserError;
                     }
@@ -671,6 +825,8 @@ scan_restart:
     int parseRequest(const char * data, size_t len) {
         int ec = 0;
         assert(data != nullptr);
+        if (unlikely(len > kMaxHeaderSize))
+            return error_code::HttpParserError;
         if (likely(len != 0)) {
             // Copy the input http header data.
             const char * content = data;    //copyContent(data, len);
@@ -693,6 +849,13 @@ scan_restart:
         return parseRequest(data.data(), data.size());
     }
 
+    // Parse the header block that the read loop's detector has found complete,
+    // the parser needn't to scan past the "\r\n\r\n" terminator again.
+    int parseRequest(const char * data, const HeaderEndDetector & detector) {
+        assert(detector.is_completed());
+        return parseRequest(data, detector.header_size());
+    }
+
     void displayFields() {
         std::cout << "Http entries: (length = " << header_fields_.ref.size() << " bytes)" << std::endl << std::endl;
         std::cout << header_fields_.ref.c_str() << std::endl;
@@ -719,6 +882,9 @@ scan_restart:
 template <std::size_t InitContentSize = 1024>
 using FastParser = BasicFastParser<std::string>;
 
+template <typename RequestLinePrefixes, std::size_t InitContentSize = 1024>
+using FastParserWith = BasicFastParser<std::string, InitContentSize, RequestLinePrefixes>;
+
 template <std::size_t InitContentSize = 1024>
 using FastParserRef = BasicFastParser<StringRef>;
 
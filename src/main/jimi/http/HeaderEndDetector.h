@@ -0,0 +1,127 @@
+
+#ifndef JIMI_HTTP_HEADER_END_DETECTOR_H
+#define JIMI_HTTP_HEADER_END_DETECTOR_H
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+#include <stdint.h>
+#include <assert.h>
+#include <cstddef>
+
+#include <emmintrin.h>  // For SSE 2
+
+#include "jimi/basic/stddef.h"
+#include "jimi/support/bitscan_forward.h"
+
+namespace jimi {
+namespace http {
+
+//
+// Incremental end-of-headers ("\r\n\r\n") detector for the read loop.
+//
+// The detector remembers how many bytes of the receive buffer have already been
+// scanned, so every read only scans the newly arrived bytes (plus 3 bytes of
+// overlap, in case the terminator is split across two reads). Once the header
+// block is complete, header_size() is the length of the block including the
+// terminator, and the parser can start directly at the known-complete block.
+//
+class HeaderEndDetector {
+public:
+    typedef std::size_t size_type;
+
+    // The length of "\r\n\r\n".
+    static const size_type kTerminatorLen = 4;
+
+private:
+    size_type scanned_;
+    size_type header_size_;
+
+public:
+    HeaderEndDetector() : scanned_(0), header_size_(0) {}
+    ~HeaderEndDetector() {}
+
+    size_type scanned() const { return this->scanned_; }
+    size_type header_size() const { return this->header_size_; }
+
+    bool is_completed() const { return (this->header_size_ != 0); }
+
+    void reset() {
+        this->scanned_ = 0;
+        this->header_size_ = 0;
+    }
+
+    // Discard the first @n bytes of the buffer (e.g. a consumed pipelined request),
+    // keeping the scan position relative to the new buffer head.
+    void consume(size_type n) {
+        this->scanned_ = (this->scanned_ > n) ? (this->scanned_ - n) : 0;
+        this->header_size_ = 0;
+    }
+
+    // Return the size of the header block including "\r\n\r\n",
+    // or 0 if the terminator has not arrived yet.
+    size_type detect(const char * data, size_type len) {
+        assert(data != nullptr);
+        if (likely(this->header_size_ == 0)) {
+            if (likely(len >= kTerminatorLen)) {
+                assert(this->scanned_ <= len);
+                const char * found = find(data + this->scanned_, data + len);
+                if (likely(found != nullptr)) {
+                    this->header_size_ = (size_type)(found - data) + kTerminatorLen;
+                    this->scanned_ = this->header_size_;
+                }
+                else {
+                    // The last 3 bytes may be the head of a split terminator.
+                    this->scanned_ = len - (kTerminatorLen - 1);
+                }
+            }
+        }
+        return this->header_size_;
+    }
+
+    // Find the first "\r\n\r\n" in [first, last), return nullptr if not found.
+    static const char * find(const char * first, const char * last) {
+        assert(first != nullptr);
+        assert(first <= last);
+        const char * cur = first;
+        if (likely((last - cur) >= (std::ptrdiff_t)(16 + kTerminatorLen - 1))) {
+            const __m128i cr = _mm_set1_epi8('\r');
+            const __m128i lf = _mm_set1_epi8('\n');
+            // Every load reads 16 bytes at cur + 3, so stop 19 bytes before the end.
+            const char * limit = last - (16 + kTerminatorLen - 1);
+            do {
+                __m128i b0 = _mm_loadu_si128((const __m128i *)(cur + 0));
+                __m128i b1 = _mm_loadu_si128((const __m128i *)(cur + 1));
+                __m128i b2 = _mm_loadu_si128((const __m128i *)(cur + 2));
+                __m128i b3 = _mm_loadu_si128((const __m128i *)(cur + 3));
+                __m128i eq01 = _mm_and_si128(_mm_cmpeq_epi8(b0, cr), _mm_cmpeq_epi8(b1, lf));
+                __m128i eq23 = _mm_and_si128(_mm_cmpeq_epi8(b2, cr), _mm_cmpeq_epi8(b3, lf));
+                int mask = _mm_movemask_epi8(_mm_and_si128(eq01, eq23));
+                if (likely(mask != 0)) {
+                    unsigned long index;
+                    __BitScanForward(index, mask);
+                    return (cur + index);
+                }
+                cur += 16;
+            } while (likely(cur <= limit));
+        }
+
+        // Scan the tail bytes.
+        while (likely((last - cur) >= (std::ptrdiff_t)kTerminatorLen)) {
+            if (likely(cur[0] != '\r')) {
+                cur++;
+                continue;
+            }
+            if (likely(cur[1] == '\n' && cur[2] == '\r' && cur[3] == '\n'))
+                return cur;
+            cur++;
+        }
+        return nullptr;
+    }
+};
+
+} // namespace http
+} // namespace jimi
+
+#endif // JIMI_HTTP_HEADER_END_DETECTOR_H
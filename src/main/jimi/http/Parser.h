@@ -16,6 +16,8 @@
 #include "jimi/StringRef.h"
 #include "jimi/StringRefList.h"
 #include "jimi/http/Common.h"
+#include "jimi/http/HeaderEndDetector.h"
+#include "jimi/http/ParserStats.h"
 #include "jimi/http/Version.h"
 #include "jimi/http/Request.h"
 #include "jimi/http/Response.h"
@@ -63,9 +65,14 @@ public:
     ~ParseErrorCode() {}
 };
 
+//
+// The generic parser. It's kept as the baseline of the parser benchmarks, so
+// it has no request line fast path, see BasicFastParser for the server one.
+//
 template <typename StringType = std::string, std::size_t InitContentSize = 1024>
 class BasicParser {
 public:
+    typedef BasicParser<StringType, InitContentSize> this_type;
     typedef StringType      string_type;
     typedef std::uint32_t   hash_type;
 
@@ -74,6 +81,8 @@ public:
     // kInitContentSize = max(InitContentSize, 256);
     static const std::size_t kInitContentSize = (InitContentSize > kMinContentSize)
                                                 ? InitContentSize : kMinContentSize;
+    // The header fields keep 16-bit offsets into the header block, see StringRefList.
+    static const std::size_t kMaxHeaderSize = 64 * 1024;
 
 private:
     int32_t status_code_;
@@ -105,19 +114,57 @@ public:
         }
     }
 
+    // Prepare for the next request, it's only a handful of stores:
+    // the strings keep their capacity and the header fields keep their chunks.
     void reset() {
+        status_code_ = 0;
+        method_ = Method::UNKNOWN;
+        version_ = Version::UNKNOWN;
         method_str_.clear();
         uri_str_.clear();
         version_str_.clear();
+        content_length_ = 0;
         content_size_ = 0;
-        content_ = nullptr;
-        header_fields_.clear();
+        if (unlikely(content_ != nullptr)) {
+            delete[] content_;
+            content_ = nullptr;
+        }
+        header_fields_.reset();
     }
 
     std::size_t getFieldSize() const {
         return header_fields_.size();
     }
 
+    // Find the value of the field-name @key (case insensitive), return false if not found.
+    bool findField(const char * key, std::size_t key_len, StringRef & value) const {
+        const char * data = header_fields_.data();
+        for (std::size_t i = 0; i < header_fields_.size(); ++i) {
+            const auto & item = header_fields_.at(i);
+            if (item.key.length == key_len && equalsIgnoreCase(data + item.key.offset, key, key_len)) {
+                value.assign(data + item.value.offset, item.value.length);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template <std::size_t N>
+    bool findField(const char (&key)[N], StringRef & value) const {
+        return findField(key, N - 1, value);
+    }
+
+    static bool equalsIgnoreCase(const char * s1, const char * s2, std::size_t len) {
+        for (std::size_t i = 0; i < len; ++i) {
+            char c1 = s1[i], c2 = s2[i];
+            if (c1 >= 'A' && c1 <= 'Z') c1 += 'a' - 'A';
+            if (c2 >= 'A' && c2 <= 'Z') c2 += 'a' - 'A';
+            if (c1 != c2)
+                return false;
+        }
+        return true;
+    }
+
     uint32_t getMethod() const {
         return method_;
     }
@@ -525,6 +572,7 @@ scan_restart:
             std::ptrdiff_t len = is.current() - mark;
             assert(len > 0);
             method_str_.assign(mark, len);
+            method_ = Method::parse(mark, len);
         }
         return is_ok;
     }
@@ -541,6 +589,7 @@ scan_restart:
             std::ptrdiff_t len = is.current() - mark;
             assert(len > 0);
             method_str_.assign(mark, len);
+            method_ = Method::parse(mark, len);
         }
         return is_ok;
     }
@@ -572,6 +621,7 @@ scan_restart:
             std::ptrdiff_t len = is.current() - mark;
             if (likely(len >= kLenHTTPVersion)) {
                 version_str_.assign(mark, len);
+                version_ = Version::parse(mark, len);
                 return true;
             }
             else {
@@ -582,6 +632,11 @@ scan_restart:
     }
 
     bool parseHeaderFields(InputStream & is) {
+        // A request without any header field, such as "GET / HTTP/1.0\r\n\r\n".
+        if (unlikely(is.remain() >= 2 && is.get() == '\r' && is.peek(1) == '\n')) {
+            moveTo(is, 2);
+            return true;
+        }
         do {
             // Skip the whitespaces ahead of every entry.
             //skipWhiteSpaces(is);
@@ -636,29 +691,34 @@ scan_restart:
 
         const char * start = is.current();
         std::size_t length = is.remain();
+        JIMI_PARSER_STATS_BEGIN(is);
         // Http method characters must be upper case letters.
         if (likely(is.get() >= 'A' && is.get() <= 'Z')) {
             is_ok = parseMethod(is);
             if (likely(is_ok)) {
                 next(is);
                 skipWhiteSpaces(is);
+                JIMI_PARSER_STATS_PHASE(is, ParsePhase::Method, 0);
 
                 is_ok = parseURI(is);
                 if (likely(is_ok)) {
                     next(is);
                     skipWhiteSpaces(is);
+                    JIMI_PARSER_STATS_PHASE(is, ParsePhase::URI, 0);
 
                     is_ok = parseVersion(is);
                     if (likely(is_ok)) {
                         // Skip the CrLf, move the cursor 2 bytes.
                         assert(is.remain() >= 2);
                         moveTo(is, 2);
+                        JIMI_PARSER_STATS_PHASE(is, ParsePhase::Version, 0);
  
                         assert(is.current() >= start);
                         assert(length >= (std::size_t)(is.current() - start));
                         header_fields_.setRef(is.current(), length - (is.current() - start));
 
                         is_ok = parseHeaderFields(is);
+                        JIMI_PARSER_STATS_PHASE(is, ParsePhase::HeaderFields, header_fields_.size());
                         if (unlikely(!is_ok))
                             return error_code::HttpParserError;
                     }
@@ -710,6 +770,8 @@ scan_restart:
     int parseRequest(const char * data, size_t len) {
         int ec = 0;
         assert(data != nullptr);
+        if (unlikely(len > kMaxHeaderSize))
+            return error_code::HttpParserError;
         if (likely(len != 0)) {
             // Copy the input http header data.
             const char * content = data;    //copyContent(data, len);
@@ -732,6 +794,13 @@ scan_restart:
         return parseRequest(data.data(), data.size());
     }
 
+    // Parse the header block that the read loop's detector has found complete,
+    // the parser needn't to scan past the "\r\n\r\n" terminator again.
+    int parseRequest(const char * data, const HeaderEndDetector & detector) {
+        assert(detector.is_completed());
+        return parseRequest(data, detector.header_size());
+    }
+
     void displayFields() {
         std::cout << "Http entries: (length = " << header_fields_.ref.size() << " bytes)" << std::endl << std::endl;
         std::cout << header_fields_.ref.c_str() << std::endl;
@@ -0,0 +1,120 @@
+
+#ifndef JIMI_HTTP_PARSERPOOL_H
+#define JIMI_HTTP_PARSERPOOL_H
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+#include <stdint.h>
+#include <assert.h>
+#include <cstddef>
+#include <vector>
+
+#include "jimi/basic/stddef.h"
+
+namespace jimi {
+namespace http {
+
+//
+// Per-thread pool of ready parsers.
+//
+// acquire() pops a parser from the free list (or creates one), release()
+// resets it with ParserTy::reset() and pushes it back, neither of them frees
+// or clears memory on the hot path. A parser must be released on the thread
+// it was acquired from.
+//
+template <typename ParserTy>
+class BasicParserPool {
+public:
+    typedef ParserTy        parser_type;
+    typedef std::size_t     size_type;
+
+    static const size_type kDefaultMaxCached = 4096;
+
+    struct Counters {
+        uint64_t acquired;
+        uint64_t released;
+        uint64_t created;
+        uint64_t destroyed;
+    };
+
+private:
+    std::vector<parser_type *> free_list_;
+    size_type max_cached_;
+    Counters counters_;
+
+public:
+    BasicParserPool(size_type max_cached = kDefaultMaxCached) : max_cached_(max_cached) {
+        this->counters_.acquired = 0;
+        this->counters_.released = 0;
+        this->counters_.created = 0;
+        this->counters_.destroyed = 0;
+        this->free_list_.reserve(max_cached);
+    }
+
+    ~BasicParserPool() {
+        this->shrink(0);
+    }
+
+    static BasicParserPool & local() {
+        static thread_local BasicParserPool pool;
+        return pool;
+    }
+
+    size_type cached() const { return this->free_list_.size(); }
+    size_type in_use() const { return (size_type)(this->counters_.acquired - this->counters_.released); }
+    size_type max_cached() const { return this->max_cached_; }
+
+    const Counters & counters() const { return this->counters_; }
+
+    // Create @count parsers ahead of time.
+    void reserve(size_type count) {
+        if (count > this->max_cached_)
+            count = this->max_cached_;
+        while (this->free_list_.size() < count) {
+            this->free_list_.push_back(new parser_type());
+            this->counters_.created++;
+        }
+    }
+
+    void shrink(size_type max_cached) {
+        while (this->free_list_.size() > max_cached) {
+            delete this->free_list_.back();
+            this->free_list_.pop_back();
+            this->counters_.destroyed++;
+        }
+    }
+
+    parser_type * acquire() {
+        parser_type * parser;
+        if (likely(!this->free_list_.empty())) {
+            parser = this->free_list_.back();
+            this->free_list_.pop_back();
+        }
+        else {
+            parser = new parser_type();
+            this->counters_.created++;
+        }
+        this->counters_.acquired++;
+        return parser;
+    }
+
+    void release(parser_type * parser) {
+        assert(parser != nullptr);
+        this->counters_.released++;
+        if (likely(this->free_list_.size() < this->max_cached_)) {
+            parser->reset();
+            this->free_list_.push_back(parser);
+        }
+        else {
+            delete parser;
+            this->counters_.destroyed++;
+        }
+    }
+};
+
+} // namespace http
+} // namespace jimi
+
+#endif // JIMI_HTTP_PARSERPOOL_H
@@ -0,0 +1,179 @@
+
+#ifndef JIMI_HTTP_PARSER_STATS_H
+#define JIMI_HTTP_PARSER_STATS_H
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+//
+// Per-phase cycle counters of the http parsers (instrumentation build).
+//
+// Define JIMI_HTTP_PARSER_STATS to 1 before including the parser headers
+// (or add -DJIMI_HTTP_PARSER_STATS=1) to record the rdtsc deltas, bytes and
+// fields of every phase of parseRequestHeader(). In the default build the
+// probes expand to nothing, and neither the counters nor their includes are
+// compiled. Off x86, the counters are in nanoseconds.
+//
+#ifndef JIMI_HTTP_PARSER_STATS
+#define JIMI_HTTP_PARSER_STATS      0
+#endif
+
+#if JIMI_HTTP_PARSER_STATS
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <cstddef>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+
+#if (defined(__x86_64__) || defined(__i386__) || \
+     defined(_M_X64) || defined(_M_IX86))
+#define JIMI_HTTP_PARSER_STATS_RDTSC    1
+#if defined(_MSC_VER) || defined(__ICL) || defined(__INTEL_COMPILER)
+#include <intrin.h>         // For __rdtsc()
+#else
+#include <x86intrin.h>      // For __rdtsc()
+#endif
+#else
+#define JIMI_HTTP_PARSER_STATS_RDTSC    0
+#endif
+
+#include "jimi/basic/stddef.h"
+
+namespace jimi {
+namespace http {
+
+struct ParsePhase {
+    enum Type {
+        Method,
+        URI,
+        Version,
+        HeaderFields,
+        MaxPhase
+    };
+
+    static const char * name(int phase) {
+        static const char * const kNames[] = {
+            "method", "uri", "version", "header fields"
+        };
+        assert(phase >= 0 && phase < MaxPhase);
+        return kNames[phase];
+    }
+};
+
+struct PhaseCounter {
+    uint64_t cycles;
+    uint64_t bytes;
+    uint64_t fields;
+    uint64_t calls;
+};
+
+class ParserStats {
+private:
+    PhaseCounter phases_[ParsePhase::MaxPhase];
+    uint64_t requests_;
+
+public:
+    ParserStats() {
+        this->reset();
+    }
+    ~ParserStats() {}
+
+    // The per-thread counters of the parser type ParserTy.
+    template <typename ParserTy>
+    static ParserStats & local() {
+        static thread_local ParserStats stats;
+        return stats;
+    }
+
+    static uint64_t rdtsc() {
+#if JIMI_HTTP_PARSER_STATS_RDTSC
+        return static_cast<uint64_t>(__rdtsc());
+#else
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+    }
+
+    void reset() {
+        ::memset((void *)&this->phases_[0], 0, sizeof(this->phases_));
+        this->requests_ = 0;
+    }
+
+    uint64_t requests() const { return this->requests_; }
+
+    const PhaseCounter & phase(int phase) const {
+        assert(phase >= 0 && phase < ParsePhase::MaxPhase);
+        return this->phases_[phase];
+    }
+
+    void addRequest() {
+        this->requests_++;
+    }
+
+    void record(int phase, uint64_t cycles, std::size_t bytes, std::size_t fields) {
+        assert(phase >= 0 && phase < ParsePhase::MaxPhase);
+        PhaseCounter & counter = this->phases_[phase];
+        counter.cycles += cycles;
+        counter.bytes  += bytes;
+        counter.fields += fields;
+        counter.calls++;
+    }
+
+    // Merge the counters of another thread into this snapshot.
+    ParserStats & operator += (const ParserStats & rhs) {
+        for (int i = 0; i < ParsePhase::MaxPhase; ++i) {
+            this->phases_[i].cycles += rhs.phases_[i].cycles;
+            this->phases_[i].bytes  += rhs.phases_[i].bytes;
+            this->phases_[i].fields += rhs.phases_[i].fields;
+            this->phases_[i].calls  += rhs.phases_[i].calls;
+        }
+        this->requests_ += rhs.requests_;
+        return *this;
+    }
+
+    void dump(std::ostream & os, const char * title = "ParserStats") const {
+        os << title << ": requests = " << this->requests_ << std::endl;
+        for (int i = 0; i < ParsePhase::MaxPhase; ++i) {
+            const PhaseCounter & counter = this->phases_[i];
+            double calls = (counter.calls != 0) ? (double)counter.calls : 1.0;
+            double bytes = (counter.bytes != 0) ? (double)counter.bytes : 1.0;
+            os << "  " << std::left << std::setw(14) << ParsePhase::name(i) << std::right
+               << "  cycles = "      << std::setw(12) << counter.cycles
+               << ", bytes = "       << std::setw(10) << counter.bytes
+               << ", fields = "      << std::setw(8)  << counter.fields
+               << ", cycles/call = " << std::fixed << std::setprecision(1) << ((double)counter.cycles / calls)
+               << ", cycles/byte = " << std::fixed << std::setprecision(2) << ((double)counter.cycles / bytes)
+               << std::endl;
+        }
+    }
+};
+
+} // namespace http
+} // namespace jimi
+
+#define JIMI_PARSER_STATS_BEGIN(is) \
+    uint64_t jimi_stats_tsc_ = jimi::http::ParserStats::rdtsc(); \
+    const char * jimi_stats_pos_ = (is).current(); \
+    jimi::http::ParserStats::local<this_type>().addRequest()
+
+#define JIMI_PARSER_STATS_PHASE(is, phase, fields) \
+    do { \
+        uint64_t jimi_stats_now_ = jimi::http::ParserStats::rdtsc(); \
+        jimi::http::ParserStats::local<this_type>().record((phase), jimi_stats_now_ - jimi_stats_tsc_, \
+            (std::size_t)((is).current() - jimi_stats_pos_), (std::size_t)(fields)); \
+        jimi_stats_tsc_ = jimi_stats_now_; \
+        jimi_stats_pos_ = (is).current(); \
+    } while (0)
+
+#else
+
+#define JIMI_PARSER_STATS_BEGIN(is)                 ((void)0)
+#define JIMI_PARSER_STATS_PHASE(is, phase, fields)  ((void)0)
+
+#endif // JIMI_HTTP_PARSER_STATS
+
+#endif // JIMI_HTTP_PARSER_STATS_H
@@ -6,6 +6,10 @@
 #pragma once
 #endif
 
+#include <stdint.h>
+#include <string.h>
+#include <cstddef>
+
 namespace jimi {
 namespace http {
 
@@ -32,6 +36,41 @@ public:
 
     Method() {}
     ~Method() {}
+
+    // The method of the token @method, UNKNOWN if it isn't one of the above.
+    static uint32_t parse(const char * method, std::size_t len) {
+        switch (len) {
+        case 3:
+            if (::memcmp(method, "GET", 3) == 0)
+                return GET;
+            if (::memcmp(method, "PUT", 3) == 0)
+                return PUT;
+            break;
+        case 4:
+            if (::memcmp(method, "POST", 4) == 0)
+                return POST;
+            if (::memcmp(method, "HEAD", 4) == 0)
+                return HEAD;
+            break;
+        case 5:
+            if (::memcmp(method, "TRACE", 5) == 0)
+                return TRACE;
+            break;
+        case 6:
+            if (::memcmp(method, "DELETE", 6) == 0)
+                return DELETE;
+            break;
+        case 7:
+            if (::memcmp(method, "OPTIONS", 7) == 0)
+                return OPTIONS;
+            if (::memcmp(method, "CONNECT", 7) == 0)
+                return CONNECT;
+            break;
+        default:
+            break;
+        }
+        return UNKNOWN;
+    }
 };
 
 class Request {
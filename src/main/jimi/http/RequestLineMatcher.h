@@ -0,0 +1,93 @@
+
+#ifndef JIMI_HTTP_REQUEST_LINE_MATCHER_H
+#define JIMI_HTTP_REQUEST_LINE_MATCHER_H
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+#include <stdint.h>
+#include <assert.h>
+#include <cstddef>
+
+#include <emmintrin.h>  // For SSE 2
+
+#include "jimi/basic/stddef.h"
+#include "jimi/http/Request.h"
+#include "jimi/http/Version.h"
+
+namespace jimi {
+namespace http {
+
+//
+// A well-known request line prefix, such as "GET / HTTP/1.1\r\n" or "GET /api/".
+//
+// If version is not Version::UNKNOWN, the pattern is a whole request line
+// (ended with " HTTP/1.x\r\n"), otherwise it's a prefix of the method and URI,
+// and the rest of the URI and the version are parsed by the generic path.
+//
+struct RequestLinePrefix {
+    static const std::size_t kMaxLength = 16;
+
+    char     pattern[kMaxLength + 1];
+    uint32_t length;
+    uint32_t method;
+    uint32_t method_len;
+    uint32_t version;
+};
+
+//
+// The default prefixes, a deployment can supply its own traits class
+// with the same interface to BasicFastParser.
+//
+struct DefaultRequestLinePrefixes {
+    static const std::size_t kCount = 6;
+
+    static const RequestLinePrefix * prefixes() {
+        static const RequestLinePrefix kPrefixes[kCount] = {
+            { "GET / HTTP/1.1\r\n", 16, Method::GET,  3, Version::HTTP_1_1 },
+            { "GET / HTTP/1.0\r\n", 16, Method::GET,  3, Version::HTTP_1_0 },
+            { "GET /api/",           9, Method::GET,  3, Version::UNKNOWN  },
+            { "POST /api/",         10, Method::POST, 4, Version::UNKNOWN  },
+            { "GET /",               5, Method::GET,  3, Version::UNKNOWN  },
+            { "POST /",              6, Method::POST, 4, Version::UNKNOWN  },
+        };
+        return &kPrefixes[0];
+    }
+};
+
+//
+// Match the head of the request against the prefixes of PrefixTraits
+// with one 16-byte SIMD compare per prefix, the first matched prefix wins.
+//
+template <typename PrefixTraits = DefaultRequestLinePrefixes>
+class RequestLineMatcher {
+public:
+    typedef PrefixTraits traits_type;
+
+    static const std::size_t kLoadSize = 16;
+
+    static const RequestLinePrefix * match(const char * data, std::size_t len) {
+        assert(data != nullptr);
+        // Fall back to the generic path if there is less than one 16-byte load.
+        if (likely(len >= kLoadSize)) {
+            const RequestLinePrefix * prefixes = traits_type::prefixes();
+            __m128i input = _mm_loadu_si128((const __m128i *)data);
+            for (std::size_t i = 0; i < traits_type::kCount; ++i) {
+                const RequestLinePrefix & prefix = prefixes[i];
+                assert(prefix.length > 0 && prefix.length <= RequestLinePrefix::kMaxLength);
+                __m128i pattern = _mm_loadu_si128((const __m128i *)&prefix.pattern[0]);
+                int equal_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(input, pattern));
+                int prefix_mask = (int)((1U << prefix.length) - 1U);
+                if ((equal_mask & prefix_mask) == prefix_mask)
+                    return &prefix;
+            }
+        }
+        return nullptr;
+    }
+};
+
+} // namespace http
+} // namespace jimi
+
+#endif // JIMI_HTTP_REQUEST_LINE_MATCHER_H
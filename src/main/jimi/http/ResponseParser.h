@@ -0,0 +1,224 @@
+
+#ifndef JIMI_HTTP_RESPONSEPARSER_H
+#define JIMI_HTTP_RESPONSEPARSER_H
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <cstddef>
+
+#include "jimi/basic/stddef.h"
+#include "jimi/StringRef.h"
+#include "jimi/StringRefList.h"
+#include "jimi/http/Common.h"
+#include "jimi/http/Version.h"
+#include "jimi/http/HeaderEndDetector.h"
+
+namespace jimi {
+namespace http {
+
+//
+// A minimal http response header parser for the clients (the load generator
+// and the reverse proxy): it picks the status line and the fields which are
+// needed to frame the response, that is Content-Length, Transfer-Encoding and
+// Connection, and keeps the views of all the fields, in order, so that the
+// header can be copied with some fields rewritten.
+//
+// The input must be a complete header block, found by HeaderEndDetector.
+//
+class ResponseParser {
+public:
+    typedef std::size_t size_type;
+
+    static const int64_t kUnknownLength = -1;
+
+private:
+    uint32_t  version_;
+    int       status_code_;
+    bool      keep_alive_;
+    bool      chunked_;
+    int64_t   content_length_;
+    size_type header_size_;
+    size_type status_line_size_;
+    StringRefList<32> header_fields_;
+
+public:
+    ResponseParser() : version_(Version::UNKNOWN), status_code_(0), keep_alive_(true),
+        chunked_(false), content_length_(kUnknownLength), header_size_(0),
+        status_line_size_(0) {}
+    ~ResponseParser() {}
+
+    uint32_t getVersion() const { return this->version_; }
+    int getStatusCode() const { return this->status_code_; }
+    bool isKeepAlive() const { return this->keep_alive_; }
+    bool isChunked() const { return this->chunked_; }
+    int64_t getContentLength() const { return this->content_length_; }
+    size_type getHeaderSize() const { return this->header_size_; }
+    // The status line, without its CRLF.
+    size_type getStatusLineSize() const { return this->status_line_size_; }
+
+    size_type getFieldSize() const { return this->header_fields_.size(); }
+
+    // The @index-th header field, in the order of the response.
+    void getField(size_type index, StringRef & key, StringRef & value) const {
+        const char * data = this->header_fields_.data();
+        const auto & item = this->header_fields_.at(index);
+        key.assign(data + item.key.offset, item.key.length);
+        value.assign(data + item.value.offset, item.value.length);
+    }
+
+    // Find the value of the field-name @key (case insensitive), return false if not found.
+    bool findField(const char * key, size_type key_len, StringRef & value) const {
+        const char * data = this->header_fields_.data();
+        for (size_type i = 0; i < this->header_fields_.size(); ++i) {
+            const auto & item = this->header_fields_.at(i);
+            if (item.key.length == key_len && equalsIgnoreCase(data + item.key.offset, key, key_len)) {
+                value.assign(data + item.value.offset, item.value.length);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template <size_type N>
+    bool findField(const char (&key)[N], StringRef & value) const {
+        return this->findField(key, N - 1, value);
+    }
+
+    static bool equalsIgnoreCase(const char * s1, const char * s2, size_type len) {
+        for (size_type i = 0; i < len; ++i) {
+            char c1 = s1[i], c2 = s2[i];
+            if (c1 >= 'A' && c1 <= 'Z') c1 += 'a' - 'A';
+            if (c2 >= 'A' && c2 <= 'Z') c2 += 'a' - 'A';
+            if (c1 != c2)
+                return false;
+        }
+        return true;
+    }
+
+    void reset() {
+        this->version_ = Version::UNKNOWN;
+        this->status_code_ = 0;
+        this->keep_alive_ = true;
+        this->chunked_ = false;
+        this->content_length_ = kUnknownLength;
+        this->header_size_ = 0;
+        this->status_line_size_ = 0;
+        this->header_fields_.reset();
+    }
+
+    int parseResponse(const char * data, const HeaderEndDetector & detector) {
+        assert(detector.is_completed());
+        return this->parseResponse(data, detector.header_size());
+    }
+
+    int parseResponse(const char * data, size_type header_size) {
+        this->reset();
+        const char * cur = data;
+        const char * end = data + header_size;
+
+        // Status line: "HTTP/1.1 200 OK\r\n"
+        static const size_type kStatusLineMinLen = sizeof("HTTP/1.1 200\r\n") - 1;
+        if (unlikely(header_size < kStatusLineMinLen || ::memcmp(cur, "HTTP/1.", 7) != 0))
+            return error_code::HttpParserError;
+        if (likely(cur[7] == '1'))
+            this->version_ = Version::HTTP_1_1;
+        else if (cur[7] == '0')
+            this->version_ = Version::HTTP_1_0;
+        else
+            return error_code::HttpParserError;
+        this->keep_alive_ = (this->version_ == Version::HTTP_1_1);
+
+        cur += 8;
+        if (unlikely(*cur != ' '))
+            return error_code::HttpParserError;
+        cur++;
+        int status = 0;
+        for (int i = 0; i < 3; ++i) {
+            char ch = cur[i];
+            if (unlikely(ch < '0' || ch > '9'))
+                return error_code::HttpParserError;
+            status = status * 10 + (ch - '0');
+        }
+        this->status_code_ = status;
+        cur = findCrLf(cur + 3, end);
+        if (unlikely(cur == nullptr))
+            return error_code::HttpParserError;
+        this->status_line_size_ = (size_type)(cur - data);
+        cur += 2;
+        // The offsets of the fields are relative to the whole header.
+        this->header_fields_.setRef(data, header_size);
+
+        // Header fields, until the empty line.
+        while (cur + 2 <= end && !(cur[0] == '\r' && cur[1] == '\n')) {
+            const char * line_end = findCrLf(cur, end);
+            if (unlikely(line_end == nullptr))
+                return error_code::HttpParserError;
+            const char * colon = (const char *)::memchr(cur, ':', line_end - cur);
+            if (unlikely(colon == nullptr || colon == cur))
+                return error_code::HttpParserError;
+
+            const char * value = colon + 1;
+            while (value < line_end && (*value == ' ' || *value == '\t'))
+                value++;
+            const char * value_end = line_end;
+            while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+                value_end--;
+
+            if (!this->onField(cur, colon - cur, value, value_end - value))
+                return error_code::HttpParserError;
+            this->header_fields_.append(cur, colon - cur, value, value_end - value);
+            cur = line_end + 2;
+        }
+
+        this->header_size_ = header_size;
+        return error_code::Succeed;
+    }
+
+private:
+    static const char * findCrLf(const char * cur, const char * end) {
+        while (cur + 1 < end) {
+            const char * cr = (const char *)::memchr(cur, '\r', end - cur - 1);
+            if (cr == nullptr)
+                return nullptr;
+            if (likely(cr[1] == '\n'))
+                return cr;
+            cur = cr + 1;
+        }
+        return nullptr;
+    }
+
+    bool onField(const char * key, size_type key_len, const char * value, size_type value_len) {
+        if (key_len == 14 && equalsIgnoreCase(key, "Content-Length", 14)) {
+            if (unlikely(value_len == 0 || value_len > 18))
+                return false;
+            int64_t length = 0;
+            for (size_type i = 0; i < value_len; ++i) {
+                if (unlikely(value[i] < '0' || value[i] > '9'))
+                    return false;
+                length = length * 10 + (value[i] - '0');
+            }
+            this->content_length_ = length;
+        }
+        else if (key_len == 17 && equalsIgnoreCase(key, "Transfer-Encoding", 17)) {
+            this->chunked_ = (value_len >= 7 &&
+                              equalsIgnoreCase(value + value_len - 7, "chunked", 7));
+        }
+        else if (key_len == 10 && equalsIgnoreCase(key, "Connection", 10)) {
+            if (value_len == 5 && equalsIgnoreCase(value, "close", 5))
+                this->keep_alive_ = false;
+            else if (value_len == 10 && equalsIgnoreCase(value, "keep-alive", 10))
+                this->keep_alive_ = true;
+        }
+        return true;
+    }
+};
+
+} // namespace http
+} // namespace jimi
+
+#endif // JIMI_HTTP_RESPONSEPARSER_H
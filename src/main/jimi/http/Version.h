@@ -94,6 +94,16 @@ public:
         return version.value;
     }
 
+    // The Type of the token @version, "HTTP/1.1" is HTTP_1_1, UNKNOWN if it isn't one.
+    static uint32_t parse(const char * version, std::size_t len) {
+        if (len >= 8 && version[0] == 'H' && version[1] == 'T' && version[2] == 'T' &&
+            version[3] == 'P' && version[4] == '/' && version[6] == '.' &&
+            version[5] >= '0' && version[5] <= '9' && version[7] >= '0' && version[7] <= '9') {
+            return ((uint32_t)(version[5] - '0') << 16) | (uint32_t)(version[7] - '0');
+        }
+        return Type::UNKNOWN;
+    }
+
     uint16_t getMajor() const {
         return this->version_.major_;
     }
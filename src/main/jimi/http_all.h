@@ -10,9 +10,15 @@
 #include "jimi/StringRef.h"
 #include "jimi/StringRefList.h"
 #include "jimi/http/Common.h"
+#include "jimi/http/HeaderEndDetector.h"
+#include "jimi/http/ParserStats.h"
+#include "jimi/http/RequestLineMatcher.h"
 #include "jimi/http/Request.h"
 #include "jimi/http/Response.h"
 #include "jimi/http/Parser.h"
+#include "jimi/http/ParserPool.h"
+#include "jimi/http/ResponseParser.h"
+#include "jimi/http/ChunkedScanner.h"
 
 namespace jimi {
 namespace http {
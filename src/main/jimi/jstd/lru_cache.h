@@ -0,0 +1,208 @@
+
+#ifndef JSTD_LRU_CACHE_H
+#define JSTD_LRU_CACHE_H
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+#include "jimi/basic/stddef.h"
+#include "jimi/basic/stdint.h"
+#include "jimi/basic/stdsize.h"
+
+#include <assert.h>
+
+#include <cstddef>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+namespace jstd {
+
+//
+// A fixed capacity LRU cache, promoted from the LeetCode LRUCache of the
+// http_parser_test: the nodes are preallocated in one continuous array and
+// linked into a double linked list (the most recently used at the front),
+// the unused nodes are kept in a free list, and the keys are indexed by a
+// hash table. It's not thread safe, use one cache per thread.
+//
+// Unlike the LeetCode version, the keys and values may be any type, and the
+// value which is evicted or replaced is returned to the caller, so that the
+// resources it holds can be released.
+//
+template <typename Key, typename Value,
+          typename Hasher = std::hash<Key>,
+          typename KeyEqual = std::equal_to<Key>>
+class lru_cache {
+public:
+    typedef Key         key_type;
+    typedef Value       value_type;
+    typedef std::size_t size_type;
+
+    struct node_type {
+        key_type    key;
+        value_type  value;
+        node_type * prev;
+        node_type * next;
+    };
+
+    typedef std::unordered_map<key_type, node_type *, Hasher, KeyEqual> hash_table_type;
+
+    static const size_type kDefaultCapacity = 32;
+
+private:
+    size_type               capacity_;
+    // The sentinel node of the circular list: head_.next is the most
+    // recently used node, and head_.prev is the least recently used one.
+    node_type               head_;
+    node_type *             freelist_;
+    std::vector<node_type>  list_;
+    hash_table_type         cache_;
+
+public:
+    lru_cache(size_type capacity = kDefaultCapacity) : capacity_(0), freelist_(nullptr) {
+        this->init(capacity);
+    }
+
+    ~lru_cache() {}
+
+    size_type size() const { return this->cache_.size(); }
+    size_type capacity() const { return this->capacity_; }
+
+    bool is_empty() const { return (this->size() == 0); }
+    bool is_full() const { return (this->size() >= this->capacity()); }
+
+    // The least recently used node, or nullptr.
+    node_type * back() {
+        return (this->head_.prev != &this->head_) ? this->head_.prev : nullptr;
+    }
+
+    // Find the value of @key and mark it as the most recently used one.
+    value_type * find(const key_type & key) {
+        typename hash_table_type::iterator iter = this->cache_.find(key);
+        if (likely(iter != this->cache_.end())) {
+            node_type * node = iter->second;
+            assert(node != nullptr);
+            this->move_to_front(node);
+            return &node->value;
+        }
+        return nullptr;
+    }
+
+    //
+    // Insert or replace the value of @key. If a value was replaced, or the
+    // least recently used one was evicted to make room, it's moved to @evicted
+    // and the return value is true.
+    //
+    bool insert(const key_type & key, const value_type & value, value_type * evicted = nullptr) {
+        typename hash_table_type::iterator iter = this->cache_.find(key);
+        if (iter != this->cache_.end()) {
+            node_type * node = iter->second;
+            if (evicted != nullptr)
+                *evicted = node->value;
+            node->value = value;
+            this->move_to_front(node);
+            return true;
+        }
+
+        bool is_evicted = false;
+        node_type * node;
+        if (likely(this->freelist_ != nullptr)) {
+            node = this->freelist_;
+            this->freelist_ = node->next;
+        }
+        else {
+            // Reuse the least recently used node.
+            node = this->head_.prev;
+            assert(node != &this->head_);
+            this->cache_.erase(node->key);
+            this->unlink(node);
+            if (evicted != nullptr)
+                *evicted = node->value;
+            is_evicted = true;
+        }
+        node->key = key;
+        node->value = value;
+        this->push_front(node);
+        this->cache_.insert(std::make_pair(key, node));
+        return is_evicted;
+    }
+
+    // Remove @key, the removed value is moved to @erased.
+    bool erase(const key_type & key, value_type * erased = nullptr) {
+        typename hash_table_type::iterator iter = this->cache_.find(key);
+        if (iter != this->cache_.end()) {
+            node_type * node = iter->second;
+            this->cache_.erase(iter);
+            this->unlink(node);
+            if (erased != nullptr)
+                *erased = node->value;
+            node->key = key_type();
+            node->value = value_type();
+            node->next = this->freelist_;
+            this->freelist_ = node;
+            return true;
+        }
+        return false;
+    }
+
+    // Remove all the values, @on_erase is called with each of them.
+    template <typename Func>
+    void clear(Func && on_erase) {
+        node_type * node = this->head_.next;
+        while (node != &this->head_) {
+            on_erase(node->value);
+            node = node->next;
+        }
+        this->init(this->capacity_);
+    }
+
+    void clear() {
+        this->init(this->capacity_);
+    }
+
+private:
+    void init(size_type capacity) {
+        if (capacity == 0)
+            capacity = 1;
+        this->cache_.clear();
+        this->cache_.reserve(capacity);
+        this->list_.clear();
+        this->list_.resize(capacity);
+        this->capacity_ = capacity;
+
+        this->head_.prev = &this->head_;
+        this->head_.next = &this->head_;
+
+        // All the nodes are free.
+        for (size_type i = 0; i < capacity - 1; ++i) {
+            this->list_[i].next = &this->list_[i + 1];
+        }
+        this->list_[capacity - 1].next = nullptr;
+        this->freelist_ = &this->list_[0];
+    }
+
+    void unlink(node_type * node) {
+        assert(node != &this->head_);
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+    }
+
+    void push_front(node_type * node) {
+        node->prev = &this->head_;
+        node->next = this->head_.next;
+        this->head_.next->prev = node;
+        this->head_.next = node;
+    }
+
+    void move_to_front(node_type * node) {
+        if (node != this->head_.next) {
+            this->unlink(node);
+            this->push_front(node);
+        }
+    }
+};
+
+} // namespace jstd
+
+#endif // JSTD_LRU_CACHE_H
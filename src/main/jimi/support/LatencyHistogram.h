@@ -0,0 +1,241 @@
+
+#ifndef JIMI_SUPPORT_LATENCYHISTOGRAM_H
+#define JIMI_SUPPORT_LATENCYHISTOGRAM_H
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+#include "jimi/basic/stddef.h"
+#include "jimi/basic/stdint.h"
+
+#include "jimi/support/bitscan_reverse.h"
+#include "jimi/support/StopWatch.h"
+
+#include <assert.h>
+
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+namespace jimi {
+
+//
+// An HDR style log-linear histogram of latencies in nanoseconds.
+//
+// The values below 2^SubBucketBits are counted exactly, every higher power
+// of 2 range is split into 2^SubBucketBits linear sub-buckets, so a value is
+// known to within 1 / 2^SubBucketBits of itself (0.8% for 7 bits) whatever
+// its magnitude, and the values above 2^MaxValueBits are counted in the top
+// bucket. With the defaults it's 4352 buckets, up to 18 minutes.
+//
+// The histogram is recorded by one thread only: a record is a plain load and
+// store of one bucket, without any lock or locked instruction. Any thread may
+// take a snapshot() at the same time, the snapshots of the threads can be
+// merged, and the percentiles are queried on the snapshots.
+//
+template <uint32_t SubBucketBits = 7, uint32_t MaxValueBits = 40>
+class BasicLatencyHistogram {
+public:
+    typedef std::size_t                 size_type;
+    typedef StopWatch::time_point_t     time_point_t;
+
+    static const uint32_t kSubBucketBits  = SubBucketBits;
+    static const uint32_t kSubBucketCount = 1U << SubBucketBits;
+    static const uint32_t kSubBucketMask  = kSubBucketCount - 1;
+    static const uint64_t kMaxValue = (MaxValueBits >= 64) ? ~0ULL : ((1ULL << MaxValueBits) - 1);
+    static const uint32_t kBucketCount = (MaxValueBits - SubBucketBits + 1) * kSubBucketCount;
+
+    //
+    // The plain counts of one or more histograms.
+    //
+    class Snapshot {
+    private:
+        std::vector<uint64_t> counts_;
+        uint64_t total_;
+        uint64_t sum_;
+        uint64_t min_;
+        uint64_t max_;
+
+        friend class BasicLatencyHistogram;
+
+    public:
+        Snapshot() : counts_(kBucketCount, 0), total_(0), sum_(0), min_(~0ULL), max_(0) {}
+        ~Snapshot() {}
+
+        uint64_t count() const { return this->total_; }
+        uint64_t min() const { return ((this->total_ != 0) ? this->min_ : 0); }
+        uint64_t max() const { return this->max_; }
+
+        double mean() const {
+            return ((this->total_ != 0) ? ((double)this->sum_ / (double)this->total_) : 0.0);
+        }
+
+        void merge(const Snapshot & other) {
+            for (uint32_t i = 0; i < kBucketCount; ++i) {
+                this->counts_[i] += other.counts_[i];
+            }
+            this->total_ += other.total_;
+            this->sum_ += other.sum_;
+            if (other.min_ < this->min_)
+                this->min_ = other.min_;
+            if (other.max_ > this->max_)
+                this->max_ = other.max_;
+        }
+
+        //
+        // The value which @percentile (0.0 - 100.0) of the values are less
+        // than or equal to, as the highest value of its bucket, but no more
+        // than the max value recorded.
+        //
+        uint64_t valueAtPercentile(double percentile) const {
+            if (this->total_ == 0)
+                return 0;
+            if (percentile > 100.0)
+                percentile = 100.0;
+            uint64_t rank = (uint64_t)((percentile / 100.0) * (double)this->total_ + 0.5);
+            if (rank == 0)
+                rank = 1;
+            uint64_t seen = 0;
+            for (uint32_t i = 0; i < kBucketCount; ++i) {
+                seen += this->counts_[i];
+                if (seen >= rank) {
+                    uint64_t value = highestValueOf(i);
+                    return ((value < this->max_) ? value : this->max_);
+                }
+            }
+            return this->max_;
+        }
+
+        uint64_t p50() const  { return this->valueAtPercentile(50.0); }
+        uint64_t p99() const  { return this->valueAtPercentile(99.0); }
+        uint64_t p999() const { return this->valueAtPercentile(99.9); }
+    };
+
+private:
+    std::atomic<uint64_t> counts_[kBucketCount];
+    std::atomic<uint64_t> total_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> min_;
+    std::atomic<uint64_t> max_;
+
+public:
+    BasicLatencyHistogram() {
+        this->reset();
+    }
+    ~BasicLatencyHistogram() {}
+
+    // Not thread safe with record().
+    void reset() {
+        for (uint32_t i = 0; i < kBucketCount; ++i) {
+            this->counts_[i].store(0, std::memory_order_relaxed);
+        }
+        this->total_.store(0, std::memory_order_relaxed);
+        this->sum_.store(0, std::memory_order_relaxed);
+        this->min_.store(~0ULL, std::memory_order_relaxed);
+        this->max_.store(0, std::memory_order_relaxed);
+    }
+
+    // Record a value in nanoseconds, by the owner thread only.
+    void record(uint64_t value) {
+        if (unlikely(value > kMaxValue))
+            value = kMaxValue;
+        add(this->counts_[bucketIndexOf(value)], 1);
+        add(this->total_, 1);
+        add(this->sum_, value);
+        if (unlikely(value < this->min_.load(std::memory_order_relaxed)))
+            this->min_.store(value, std::memory_order_relaxed);
+        if (unlikely(value > this->max_.load(std::memory_order_relaxed)))
+            this->max_.store(value, std::memory_order_relaxed);
+    }
+
+    // Record the time from @start to @stop, the StopWatch::now() time points.
+    void record(const time_point_t & start, const time_point_t & stop) {
+        int64_t ns = (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
+        // The clock may not be monotonic.
+        this->record((ns > 0) ? (uint64_t)ns : 0);
+    }
+
+    static time_point_t now() {
+        return StopWatch::now();
+    }
+
+    // A copy of the counts, it may be taken by any thread.
+    Snapshot snapshot() const {
+        Snapshot result;
+        this->snapshot(result);
+        return result;
+    }
+
+    // Merge the counts into @snapshot.
+    void snapshot(Snapshot & snapshot) const {
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < kBucketCount; ++i) {
+            uint64_t count = this->counts_[i].load(std::memory_order_relaxed);
+            snapshot.counts_[i] += count;
+            total += count;
+        }
+        // The buckets are the truth, the other fields may be a bit behind them.
+        snapshot.total_ += total;
+        snapshot.sum_ += this->sum_.load(std::memory_order_relaxed);
+        uint64_t min = this->min_.load(std::memory_order_relaxed);
+        uint64_t max = this->max_.load(std::memory_order_relaxed);
+        if (min < snapshot.min_)
+            snapshot.min_ = min;
+        if (max > snapshot.max_)
+            snapshot.max_ = max;
+    }
+
+    static uint32_t bucketIndexOf(uint64_t value) {
+        if (value < kSubBucketCount)
+            return (uint32_t)value;
+        uint32_t msb = highestBit(value);
+        uint32_t shift = msb - kSubBucketBits;
+        // (value >> shift) is in [kSubBucketCount, kSubBucketCount * 2).
+        return (((shift + 1) << kSubBucketBits) + (uint32_t)((value >> shift) & kSubBucketMask));
+    }
+
+    static uint64_t lowestValueOf(uint32_t index) {
+        if (index < kSubBucketCount)
+            return index;
+        uint32_t shift = (index >> kSubBucketBits) - 1;
+        return ((uint64_t)((index & kSubBucketMask) | kSubBucketCount) << shift);
+    }
+
+    static uint64_t highestValueOf(uint32_t index) {
+        if (index < kSubBucketCount)
+            return index;
+        uint32_t shift = (index >> kSubBucketBits) - 1;
+        return (lowestValueOf(index) + ((1ULL << shift) - 1));
+    }
+
+private:
+    static void add(std::atomic<uint64_t> & counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static uint32_t highestBit(uint64_t value) {
+        assert(value != 0);
+        unsigned long index;
+#if defined(WIN64) || defined(_WIN64) || defined(_M_X64) || defined(_M_AMD64) \
+ || defined(_M_IA64) || defined(__amd64__) || defined(__x86_64__) || defined(_M_ARM64)
+        __BitScanReverse64(index, value);
+#else
+        if ((value >> 32) != 0) {
+            __BitScanReverse(index, (uint32_t)(value >> 32));
+            index += 32;
+        }
+        else {
+            __BitScanReverse(index, (uint32_t)value);
+        }
+#endif
+        return (uint32_t)index;
+    }
+};
+
+typedef BasicLatencyHistogram<>     LatencyHistogram;
+
+} // namespace jimi
+
+#endif // JIMI_SUPPORT_LATENCYHISTOGRAM_H
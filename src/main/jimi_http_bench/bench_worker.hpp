@@ -0,0 +1,356 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "jimi/basic/stddef.h"
+#include "jimi/http/Common.h"
+#include "jimi/http/HeaderEndDetector.h"
+#include "jimi/http/ResponseParser.h"
+
+#include "jimi_http_serv/socket_utils.hpp"
+#include "latency_stats.hpp"
+
+namespace jimi {
+
+struct bench_config {
+    struct sockaddr_in addr;
+    std::string request;        // One request, the template.
+    uint32_t connections;       // The connections of this worker.
+    uint32_t pipeline;
+    bool     nodelay;
+
+    bench_config() : connections(1), pipeline(1), nodelay(true) {
+        ::memset(&addr, 0, sizeof(addr));
+    }
+};
+
+struct bench_result {
+    uint64_t requests;
+    uint64_t responses;
+    uint64_t non_2xx;
+    uint64_t connect_errors;
+    uint64_t read_errors;
+    uint64_t parse_errors;
+    uint64_t reconnects;
+    uint64_t recv_bytes;
+    latency_stats latency;
+
+    bench_result() : requests(0), responses(0), non_2xx(0), connect_errors(0),
+        read_errors(0), parse_errors(0), reconnects(0), recv_bytes(0) {}
+
+    void merge(const bench_result & other) {
+        this->requests += other.requests;
+        this->responses += other.responses;
+        this->non_2xx += other.non_2xx;
+        this->connect_errors += other.connect_errors;
+        this->read_errors += other.read_errors;
+        this->parse_errors += other.parse_errors;
+        this->reconnects += other.reconnects;
+        this->recv_bytes += other.recv_bytes;
+        this->latency.merge(other.latency);
+    }
+};
+
+static inline
+uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+//
+// One load generator thread: an epoll loop over its own connections, each
+// of them keeps @pipeline requests in flight, and sends one new request for
+// every complete response, so the pipeline stays full.
+//
+class bench_worker {
+public:
+    static const int kMaxEvents = 256;
+    static const std::size_t kReadChunkSize = 64 * 1024;
+
+private:
+    struct client {
+        int fd;
+        bool connected;
+        bool want_write;
+        std::vector<char> rbuf;
+        std::size_t rlen;
+        std::string wbuf;
+        std::size_t wpos;
+        http::HeaderEndDetector detector;
+        // The send times of the in-flight requests, a ring of pipeline entries.
+        std::vector<uint64_t> sent;
+        std::size_t sent_head;
+        std::size_t inflight;
+
+        client() : fd(-1), connected(false), want_write(false), rlen(0), wpos(0),
+            sent_head(0), inflight(0) {}
+    };
+
+    const bench_config & config_;
+    int epoll_fd_;
+    std::vector<client> clients_;
+    http::ResponseParser parser_;
+
+public:
+    bench_result result;
+
+public:
+    bench_worker(const bench_config & config) : config_(config), epoll_fd_(-1) {}
+    ~bench_worker() {
+        for (std::size_t i = 0; i < this->clients_.size(); ++i) {
+            if (this->clients_[i].fd >= 0)
+                ::close(this->clients_[i].fd);
+        }
+        if (this->epoll_fd_ >= 0)
+            ::close(this->epoll_fd_);
+    }
+
+    //
+    // Run until @stop is set, the statistics are only recorded while
+    // @measuring is set, so the warm up is excluded.
+    //
+    void run(const std::atomic<bool> & stop, const std::atomic<bool> & measuring) {
+        this->epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+        if (this->epoll_fd_ < 0) {
+            std::cerr << "Error: epoll_create1() failed, errno = " << errno << std::endl;
+            return;
+        }
+
+        this->clients_.resize(this->config_.connections);
+        for (std::size_t i = 0; i < this->clients_.size(); ++i) {
+            client & c = this->clients_[i];
+            c.rbuf.resize(kReadChunkSize);
+            c.sent.resize(this->config_.pipeline);
+            this->connect(c);
+        }
+
+        struct epoll_event events[kMaxEvents];
+        while (likely(!stop.load(std::memory_order_relaxed))) {
+            int nfds = ::epoll_wait(this->epoll_fd_, events, kMaxEvents, 100);
+            if (unlikely(nfds < 0)) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            bool measure = measuring.load(std::memory_order_relaxed);
+            for (int i = 0; i < nfds; ++i) {
+                client & c = *static_cast<client *>(events[i].data.ptr);
+                uint32_t ev = events[i].events;
+                if (unlikely(!c.connected)) {
+                    if ((ev & (EPOLLERR | EPOLLHUP)) != 0) {
+                        this->result.connect_errors++;
+                        this->reconnect(c);
+                        continue;
+                    }
+                    c.connected = true;
+                    if (this->config_.nodelay)
+                        set_nodelay(c.fd, true);
+                    this->fill_pipeline(c, monotonic_ns(), measure);
+                    continue;
+                }
+                if ((ev & EPOLLIN) != 0) {
+                    if (!this->handle_read(c, measure))
+                        continue;
+                }
+                else if (unlikely((ev & (EPOLLERR | EPOLLHUP)) != 0)) {
+                    this->result.read_errors++;
+                    this->reconnect(c);
+                    continue;
+                }
+                if ((ev & EPOLLOUT) != 0) {
+                    this->flush(c);
+                }
+            }
+        }
+    }
+
+private:
+    void connect(client & c) {
+        c.fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (c.fd < 0) {
+            this->result.connect_errors++;
+            return;
+        }
+        c.connected = false;
+        c.want_write = true;
+        c.rlen = 0;
+        c.wbuf.clear();
+        c.wpos = 0;
+        c.detector.reset();
+        c.sent_head = 0;
+        c.inflight = 0;
+
+        int ret = ::connect(c.fd, (const struct sockaddr *)&this->config_.addr, sizeof(this->config_.addr));
+        if (ret != 0 && errno != EINPROGRESS) {
+            this->result.connect_errors++;
+            ::close(c.fd);
+            c.fd = -1;
+            return;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT;
+        event.data.ptr = &c;
+        ::epoll_ctl(this->epoll_fd_, EPOLL_CTL_ADD, c.fd, &event);
+    }
+
+    void reconnect(client & c) {
+        if (c.fd >= 0) {
+            ::epoll_ctl(this->epoll_fd_, EPOLL_CTL_DEL, c.fd, nullptr);
+            ::close(c.fd);
+            c.fd = -1;
+        }
+        this->result.reconnects++;
+        this->connect(c);
+    }
+
+    void set_want_write(client & c, bool want_write) {
+        if (c.want_write != want_write) {
+            struct epoll_event event;
+            event.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+            event.data.ptr = &c;
+            ::epoll_ctl(this->epoll_fd_, EPOLL_CTL_MOD, c.fd, &event);
+            c.want_write = want_write;
+        }
+    }
+
+    // Queue requests until @pipeline requests are in flight, then send them at once.
+    void fill_pipeline(client & c, uint64_t now, bool measure) {
+        const std::string & request = this->config_.request;
+        std::size_t pipeline = c.sent.size();
+        while (c.inflight < pipeline) {
+            c.wbuf.append(request);
+            c.sent[(c.sent_head + c.inflight) % pipeline] = now;
+            c.inflight++;
+            if (measure)
+                this->result.requests++;
+        }
+        this->flush(c);
+    }
+
+    void flush(client & c) {
+        while (c.wpos < c.wbuf.size()) {
+            ssize_t n = ::send(c.fd, c.wbuf.data() + c.wpos, c.wbuf.size() - c.wpos, MSG_NOSIGNAL);
+            if (likely(n > 0)) {
+                c.wpos += (std::size_t)n;
+            }
+            else if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                this->set_want_write(c, true);
+                return;
+            }
+            else {
+                this->result.read_errors++;
+                this->reconnect(c);
+                return;
+            }
+        }
+        c.wbuf.clear();
+        c.wpos = 0;
+        this->set_want_write(c, false);
+    }
+
+    // Return false if the connection has been reconnected.
+    bool handle_read(client & c, bool measure) {
+        for (;;) {
+            if (c.rbuf.size() - c.rlen < kReadChunkSize / 4)
+                c.rbuf.resize(c.rbuf.size() * 2);
+            std::size_t space = c.rbuf.size() - c.rlen;
+            ssize_t n = ::recv(c.fd, &c.rbuf[c.rlen], space, 0);
+            if (likely(n > 0)) {
+                c.rlen += (std::size_t)n;
+                if (measure)
+                    this->result.recv_bytes += (uint64_t)n;
+                if ((std::size_t)n < space) {
+                    // The socket receive buffer is drained.
+                    break;
+                }
+            }
+            else if (n == 0) {
+                this->result.read_errors++;
+                this->reconnect(c);
+                return false;
+            }
+            else {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                this->result.read_errors++;
+                this->reconnect(c);
+                return false;
+            }
+        }
+
+        uint64_t now = monotonic_ns();
+        std::size_t pos = 0;
+        bool keep_alive = true;
+        while (pos < c.rlen) {
+            const char * data = &c.rbuf[pos];
+            std::size_t header_size = c.detector.detect(data, c.rlen - pos);
+            if (header_size == 0)
+                break;
+            int ec = this->parser_.parseResponse(data, c.detector);
+            if (unlikely(ec != http::error_code::Succeed || this->parser_.isChunked() ||
+                         this->parser_.getContentLength() < 0)) {
+                // Chunked or unframed responses are not supported.
+                this->result.parse_errors++;
+                this->reconnect(c);
+                return false;
+            }
+            std::size_t total = header_size + (std::size_t)this->parser_.getContentLength();
+            if (total > c.rlen - pos)
+                break;
+
+            if (likely(c.inflight > 0)) {
+                uint64_t sent = c.sent[c.sent_head];
+                c.sent_head = (c.sent_head + 1) % c.sent.size();
+                c.inflight--;
+                if (measure) {
+                    this->result.responses++;
+                    this->result.latency.record(now - sent);
+                    int status = this->parser_.getStatusCode();
+                    if (status < 200 || status >= 300)
+                        this->result.non_2xx++;
+                }
+            }
+            keep_alive = this->parser_.isKeepAlive();
+            c.detector.consume(total);
+            pos += total;
+            if (!keep_alive)
+                break;
+        }
+
+        if (pos > 0) {
+            if (pos < c.rlen)
+                ::memmove(&c.rbuf[0], &c.rbuf[pos], c.rlen - pos);
+            c.rlen -= pos;
+        }
+
+        if (unlikely(!keep_alive)) {
+            this->reconnect(c);
+            return false;
+        }
+        this->fill_pipeline(c, now, measure);
+        return true;
+    }
+};
+
+} // namespace jimi
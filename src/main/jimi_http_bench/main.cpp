@@ -0,0 +1,422 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <exception>
+#include <boost/program_options.hpp>
+
+#include "jimi_http_serv/utils.hpp"
+#include "jimi_http_serv/socket_utils.hpp"
+
+#include "bench_worker.hpp"
+
+static std::atomic<bool> s_stop(false);
+
+static void on_signal(int sig)
+{
+    s_stop.store(true, std::memory_order_relaxed);
+}
+
+//
+// Normalize the line endings of a request template which is read from a file
+// to CRLF, and make sure it's terminated by an empty line.
+//
+static std::string normalize_request(const std::string & text)
+{
+    std::string request;
+    request.reserve(text.size() + 64);
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        char ch = text[i];
+        if (ch == '\r')
+            continue;
+        if (ch == '\n')
+            request += "\r\n";
+        else
+            request += ch;
+    }
+    std::size_t header_end = request.find("\r\n\r\n");
+    if (header_end == std::string::npos) {
+        while (request.size() >= 2 && request.compare(request.size() - 2, 2, "\r\n") == 0)
+            request.resize(request.size() - 2);
+        request += "\r\n\r\n";
+    }
+    return request;
+}
+
+// Parse the reactor counts of --scaling, like "1,2,4,8".
+static bool parse_steps(const std::string & list, std::vector<int> & steps)
+{
+    steps.clear();
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        char * tail;
+        long n = ::strtol(item.c_str(), &tail, 10);
+        if (item.empty() || *tail != '\0' || n <= 0 || n > 4096)
+            return false;
+        steps.push_back((int)n);
+    }
+    return !steps.empty();
+}
+
+static std::string make_request(const std::string & method, const std::string & uri,
+                                const std::string & host, const std::vector<std::string> & headers,
+                                const std::string & body)
+{
+    std::string request = method + " " + uri + " HTTP/1.1\r\n";
+    request += "Host: " + host + "\r\n";
+    for (std::size_t i = 0; i < headers.size(); ++i) {
+        request += headers[i] + "\r\n";
+    }
+    if (!body.empty() || method == "POST" || method == "PUT") {
+        request += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    }
+    request += "\r\n";
+    request += body;
+    return request;
+}
+
+static void print_latency(const char * name, uint64_t ns)
+{
+    printf("    %-8s %10.3f ms\n", name, (double)ns / 1000000.0);
+}
+
+static void print_result(const jimi::bench_result & result, double seconds,
+                         uint32_t connections, uint32_t threads, uint32_t pipeline)
+{
+    printf("\n");
+    printf("  %u threads, %u connections, pipeline %u, %0.2f seconds\n\n",
+           threads, connections, pipeline, seconds);
+    printf("  Requests:     %llu\n", (unsigned long long)result.requests);
+    printf("  Responses:    %llu\n", (unsigned long long)result.responses);
+    printf("  Requests/sec: %0.2f\n", (double)result.responses / seconds);
+    printf("  Transfer/sec: %0.2f MB\n", (double)result.recv_bytes / seconds / (1024.0 * 1024.0));
+    printf("\n");
+    printf("  Latency:\n");
+    print_latency("min",    result.latency.min());
+    printf("    %-8s %10.3f ms\n", "mean", result.latency.mean() / 1000000.0);
+    print_latency("p50",    result.latency.percentile(50.0));
+    print_latency("p75",    result.latency.percentile(75.0));
+    print_latency("p90",    result.latency.percentile(90.0));
+    print_latency("p99",    result.latency.percentile(99.0));
+    print_latency("p99.9",  result.latency.percentile(99.9));
+    print_latency("p99.99", result.latency.percentile(99.99));
+    print_latency("max",    result.latency.max());
+    printf("\n");
+    if (result.non_2xx != 0 || result.connect_errors != 0 || result.read_errors != 0 ||
+        result.parse_errors != 0) {
+        printf("  Non-2xx responses: %llu\n", (unsigned long long)result.non_2xx);
+        printf("  Errors: connect %llu, read %llu, parse %llu, reconnects %llu\n",
+               (unsigned long long)result.connect_errors, (unsigned long long)result.read_errors,
+               (unsigned long long)result.parse_errors, (unsigned long long)result.reconnects);
+        printf("\n");
+    }
+}
+
+//
+// Run the load with @thread_num workers for @duration seconds after @warmup
+// seconds, return the measured seconds. It stops early on SIGINT.
+//
+static double run_load(const jimi::bench_config & base_config, int32_t thread_num,
+                       int32_t connections, int32_t duration, int32_t warmup,
+                       jimi::bench_result & total)
+{
+    std::atomic<bool> stop(false);
+    std::atomic<bool> measuring(false);
+    std::vector<jimi::bench_config> configs(thread_num, base_config);
+    std::vector<std::unique_ptr<jimi::bench_worker>> workers;
+    std::vector<std::thread> threads;
+    for (int32_t i = 0; i < thread_num; ++i) {
+        configs[i].connections = connections / thread_num + ((i < connections % thread_num) ? 1 : 0);
+        workers.push_back(std::unique_ptr<jimi::bench_worker>(new jimi::bench_worker(configs[i])));
+    }
+    for (int32_t i = 0; i < thread_num; ++i) {
+        jimi::bench_worker * worker = workers[i].get();
+        threads.push_back(std::thread([worker, &stop, &measuring]() {
+            worker->run(stop, measuring);
+        }));
+    }
+
+    uint64_t warmup_end = jimi::monotonic_ns() + (uint64_t)warmup * 1000000000ULL;
+    while (!s_stop.load(std::memory_order_relaxed) && jimi::monotonic_ns() < warmup_end) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    measuring.store(true, std::memory_order_relaxed);
+    uint64_t start_time = jimi::monotonic_ns();
+    uint64_t end_time = start_time + (uint64_t)duration * 1000000000ULL;
+    while (!s_stop.load(std::memory_order_relaxed) && jimi::monotonic_ns() < end_time) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    measuring.store(false, std::memory_order_relaxed);
+    double seconds = (double)(jimi::monotonic_ns() - start_time) / 1000000000.0;
+    stop.store(true, std::memory_order_relaxed);
+
+    for (int32_t i = 0; i < thread_num; ++i) {
+        threads[i].join();
+        total.merge(workers[i]->result);
+    }
+    return seconds;
+}
+
+//
+// The scaling benchmark: for each reactor count N of --scaling, start the
+// server with --server-cmd, in which "{n}" is replaced by N and "{cpus}" by
+// the cpu list "0-(N-1)", run the load against it, and stop it with SIGINT.
+// The throughput of N reactors is compared to N times the throughput of the
+// first step, so with a shared-nothing server the efficiency stays near 100%
+// as long as the load generator isn't the bottleneck (run it on other cpus,
+// or on another box, with enough threads and connections).
+//
+static std::string expand_server_cmd(const std::string & cmd, int32_t n)
+{
+    std::string cpus = (n > 1) ? ("0-" + std::to_string(n - 1)) : "0";
+    std::string result;
+    std::size_t pos = 0;
+    while (pos < cmd.size()) {
+        if (cmd.compare(pos, 3, "{n}") == 0) {
+            result += std::to_string(n);
+            pos += 3;
+        }
+        else if (cmd.compare(pos, 6, "{cpus}") == 0) {
+            result += cpus;
+            pos += 6;
+        }
+        else {
+            result += cmd[pos++];
+        }
+    }
+    return result;
+}
+
+static pid_t start_server(const std::string & cmd)
+{
+    pid_t pid = ::fork();
+    if (pid == 0) {
+        // Its own process group, so that SIGINT reaches the server, not the shell only.
+        ::setpgid(0, 0);
+        // Keep its errors, not its banner.
+        int null_fd = ::open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            ::dup2(null_fd, STDOUT_FILENO);
+            ::close(null_fd);
+        }
+        ::execl("/bin/sh", "sh", "-c", ("exec " + cmd).c_str(), (char *)nullptr);
+        ::_exit(127);
+    }
+    return pid;
+}
+
+// Wait until the server accepts connections, at most @timeout_ms.
+static bool wait_for_server(const struct sockaddr_in & addr, pid_t pid, uint32_t timeout_ms)
+{
+    uint64_t deadline = jimi::monotonic_ns() + (uint64_t)timeout_ms * 1000000ULL;
+    while (jimi::monotonic_ns() < deadline && !s_stop.load(std::memory_order_relaxed)) {
+        int status;
+        if (::waitpid(pid, &status, WNOHANG) == pid)
+            return false;
+        int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0) {
+            int ret = ::connect(fd, (const struct sockaddr *)&addr, sizeof(addr));
+            ::close(fd);
+            if (ret == 0)
+                return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return false;
+}
+
+static void stop_server(pid_t pid)
+{
+    ::kill(-pid, SIGINT);
+    for (int i = 0; i < 100; ++i) {
+        int status;
+        if (::waitpid(pid, &status, WNOHANG) == pid)
+            return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    ::kill(-pid, SIGKILL);
+    ::waitpid(pid, nullptr, 0);
+}
+
+static int run_scaling(const jimi::bench_config & base_config, const std::vector<int> & steps,
+                       const std::string & server_cmd, int32_t thread_num, int32_t connections,
+                       int32_t duration, int32_t warmup)
+{
+    std::vector<double> rates;
+    for (std::size_t i = 0; i < steps.size() && !s_stop.load(std::memory_order_relaxed); ++i) {
+        std::string cmd = expand_server_cmd(server_cmd, steps[i]);
+        std::cout << "[" << steps[i] << " reactors] " << cmd << std::endl;
+        pid_t pid = start_server(cmd);
+        if (pid < 0) {
+            std::cerr << "Error: fork() failed, errno = " << errno << std::endl;
+            return -1;
+        }
+        if (!wait_for_server(base_config.addr, pid, 10000)) {
+            std::cerr << "Error: the server didn't start listening." << std::endl;
+            stop_server(pid);
+            return -1;
+        }
+        jimi::bench_result total;
+        double seconds = run_load(base_config, thread_num, connections, duration, warmup, total);
+        stop_server(pid);
+        rates.push_back((double)total.responses / seconds);
+        std::cout << "    " << (uint64_t)rates.back() << " req/s, p99 "
+                  << (double)total.latency.percentile(99.0) / 1000000.0 << " ms" << std::endl;
+    }
+
+    printf("\n");
+    printf("  %8s %14s %10s %12s\n", "reactors", "requests/sec", "speedup", "efficiency");
+    for (std::size_t i = 0; i < rates.size(); ++i) {
+        double speedup = (rates[0] > 0.0) ? (rates[i] / rates[0]) : 0.0;
+        double ideal = (double)steps[i] / (double)steps[0];
+        printf("  %8d %14.0f %9.2fx %11.1f%%\n", steps[i], rates[i], speedup,
+               speedup / ideal * 100.0);
+    }
+    printf("\n");
+    return 0;
+}
+
+void print_usage(const std::string & app_name, const boost::program_options::options_description & options_desc)
+{
+    std::cerr << std::endl;
+    std::cerr << options_desc << std::endl;
+
+    std::cerr << "Usage: " << std::endl << std::endl
+              << "  " << app_name.c_str() << " --host=<host> --port=<port> [--connections=64] [--thread-num=1]" << std::endl
+              << "  " << std::string(app_name.size(), ' ') << " [--pipeline=1] [--duration=10] [--uri=/]" << std::endl
+              << std::endl
+              << "For example: " << std::endl << std::endl
+              << "  " << app_name.c_str() << " -s 127.0.0.1 -p 9000 -c 256 -n 4 -l 16 -d 10" << std::endl
+              << "  " << app_name.c_str() << " -p 9000 -c 256 -n 4 -l 16 -d 10 --scaling=1,2,4,8 \\" << std::endl
+              << "  " << std::string(app_name.size(), ' ') << " --server-cmd=\"./jimi_http_serv -p 9000 -n {n} --cpu-affinity={cpus}\"" << std::endl;
+    std::cerr << std::endl;
+}
+
+int main(int argc, char * argv[])
+{
+    std::string app_name;
+    std::string server_ip, server_port, method, uri, body, request_file;
+    std::string scaling, server_cmd;
+    std::vector<std::string> headers;
+    int32_t connections = 64, thread_num = 1, pipeline = 1, duration = 10, warmup = 1;
+
+    namespace options = boost::program_options;
+    options::options_description desc("Command list");
+    desc.add_options()
+        ("help,h",                                                                                      "usage info")
+        ("host,s",          options::value<std::string>(&server_ip)->default_value("127.0.0.1"),        "server host or ip address")
+        ("port,p",          options::value<std::string>(&server_port)->default_value("9000"),           "server port")
+        ("connections,c",   options::value<int32_t>(&connections)->default_value(64),                   "total connections")
+        ("thread-num,n",    options::value<int32_t>(&thread_num)->default_value(1),                     "thread numbers")
+        ("pipeline,l",      options::value<int32_t>(&pipeline)->default_value(1),                       "requests in flight per connection")
+        ("duration,d",      options::value<int32_t>(&duration)->default_value(10),                      "test duration in seconds")
+        ("warmup,w",        options::value<int32_t>(&warmup)->default_value(1),                         "warm up seconds, not measured")
+        ("method,X",        options::value<std::string>(&method)->default_value("GET"),                 "request method")
+        ("uri,u",           options::value<std::string>(&uri)->default_value("/"),                      "request uri")
+        ("header,H",        options::value<std::vector<std::string>>(&headers),                         "extra request header, can be repeated")
+        ("body,b",          options::value<std::string>(&body)->default_value(""),                      "request body")
+        ("request-file,f",  options::value<std::string>(&request_file)->default_value(""),              "raw request template file")
+        ("scaling",         options::value<std::string>(&scaling)->default_value(""),                   "the reactor counts of the scaling benchmark, e.g. 1,2,4,8")
+        ("server-cmd",      options::value<std::string>(&server_cmd)->default_value(""),                "the server command of the scaling benchmark, {n} and {cpus} are replaced")
+        ;
+
+    options::variables_map args_map;
+    try {
+        options::store(options::parse_command_line(argc, argv, desc), args_map);
+        options::notify(args_map);
+    }
+    catch (const std::exception & ex) {
+        std::cerr << "Exception is: " << ex.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    app_name = get_app_name(argv[0]);
+    if (args_map.count("help") > 0) {
+        print_usage(app_name, desc);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!is_valid_ip_v4(server_ip)) {
+        std::cerr << "Error: ip address \"" << server_ip.c_str() << "\" format is wrong." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!is_socket_port(server_port)) {
+        std::cerr << "Error: port [" << server_port.c_str() << "] number must be range in (0, 65535]." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (thread_num <= 0)
+        thread_num = 1;
+    if (connections < thread_num)
+        connections = thread_num;
+    if (pipeline <= 0)
+        pipeline = 1;
+    if (duration <= 0)
+        duration = 1;
+    if (warmup < 0)
+        warmup = 0;
+
+    std::string request;
+    if (!request_file.empty()) {
+        std::ifstream file(request_file.c_str(), std::ios::in | std::ios::binary);
+        if (!file) {
+            std::cerr << "Error: can not open the request file \"" << request_file.c_str() << "\"." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::stringstream text;
+        text << file.rdbuf();
+        request = normalize_request(text.str());
+    }
+    else {
+        request = make_request(method, uri, server_ip + ":" + server_port, headers, body);
+    }
+
+    jimi::bench_config base_config;
+    if (!jimi::resolve_ip_v4(server_ip, server_port, base_config.addr)) {
+        std::cerr << "Error: invalid address " << server_ip.c_str() << ":" << server_port.c_str() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    base_config.request = request;
+    base_config.pipeline = pipeline;
+
+    ::signal(SIGPIPE, SIG_IGN);
+    ::signal(SIGINT, on_signal);
+
+    std::cout << "Running " << duration << "s test @ http://" << server_ip << ":" << server_port << uri << std::endl;
+
+    if (!scaling.empty()) {
+        std::vector<int> steps;
+        if (!parse_steps(scaling, steps)) {
+            std::cerr << "Error: scaling \"" << scaling.c_str() << "\" format is wrong." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (server_cmd.empty()) {
+            std::cerr << "Error: scaling needs the server-cmd." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        int ret = run_scaling(base_config, steps, server_cmd, thread_num, connections, duration, warmup);
+        return ((ret == 0) ? 0 : EXIT_FAILURE);
+    }
+
+    jimi::bench_result total;
+    double seconds = run_load(base_config, thread_num, connections, duration, warmup, total);
+    print_result(total, seconds, connections, thread_num, pipeline);
+    return 0;
+}
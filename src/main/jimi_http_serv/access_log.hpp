@@ -0,0 +1,265 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "jimi/basic/stddef.h"
+#include "jimi/StringRef.h"
+
+#include "connection.hpp"
+#include "spsc_ring.hpp"
+#include "server_stats.hpp"
+#include "response_header.hpp"
+
+namespace jimi {
+
+//
+// A request of the access log, in binary: the reactor threads only copy
+// the fields, the writer thread formats them. The method and the URI are
+// truncated to fit.
+//
+struct access_record {
+    static const std::size_t kMaxMethodSize = 15;
+    static const std::size_t kMaxUriSize = 150;
+
+    uint64_t time;          // In seconds since the epoch.
+    uint64_t bytes;         // The size of the response body.
+    uint16_t status;
+    uint8_t  family;        // Of the client address, AF_UNSPEC if it's unknown.
+    uint8_t  minor;         // HTTP/1.<minor>
+    uint8_t  method_size;
+    uint8_t  uri_size;
+    uint8_t  addr[16];
+    char     method[kMaxMethodSize];
+    char     uri[kMaxUriSize];
+};
+
+//
+// The access log: every reactor thread pushes its access_records into an
+// spsc_ring of its own, and the writer thread (see run()) pops them, formats
+// them in the Common Log Format and appends them to the file with a write()
+// per batch of up to kFlushSize bytes.
+//
+// The request path never waits for the writer or the disk: a record which
+// finds its ring full is dropped, and counted (see stats_shard).
+//
+class access_log {
+public:
+    typedef spsc_ring<access_record> ring_type;
+
+    static const std::size_t kRingSize = 4096;
+    static const std::size_t kFlushSize = 64 * 1024;
+    // How long the writer sleeps when all the rings are empty.
+    static const uint32_t kPollMs = 1;
+
+private:
+    std::mutex                  mutex_;
+    std::vector<ring_type *>    rings_;
+    int                         fd_;
+    bool                        owns_fd_;
+
+public:
+    access_log() : fd_(-1), owns_fd_(false) {}
+    ~access_log() {
+        this->close();
+        for (std::size_t i = 0; i < this->rings_.size(); ++i) {
+            delete this->rings_[i];
+        }
+    }
+
+    static access_log & instance() {
+        static access_log log;
+        return log;
+    }
+
+    // Append to the file @path, or to the stdout if it's "-".
+    bool open(const std::string & path) {
+        if (path == "-") {
+            this->fd_ = STDOUT_FILENO;
+            this->owns_fd_ = false;
+            return true;
+        }
+        this->fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (this->fd_ < 0) {
+            std::cerr << "Error: open access log \"" << path.c_str() << "\" failed, errno = "
+                      << errno << std::endl;
+            return false;
+        }
+        this->owns_fd_ = true;
+        return true;
+    }
+
+    void close() {
+        if (this->fd_ >= 0 && this->owns_fd_)
+            ::close(this->fd_);
+        this->fd_ = -1;
+    }
+
+    bool is_open() const { return (this->fd_ >= 0); }
+
+    //
+    // Log a request of @conn, answered with @status and a body of @bytes.
+    // Called by the reactor threads, it doesn't block.
+    //
+    void append(connection & conn, const StringRef & method, const StringRef & uri,
+                uint32_t minor, uint32_t status, uint64_t bytes) {
+        access_record record;
+        record.time = (uint64_t)::time(nullptr);
+        record.bytes = bytes;
+        record.status = (uint16_t)status;
+        record.minor = (uint8_t)minor;
+        const peer_address & peer = conn.load_peer();
+        record.family = peer.family;
+        ::memcpy(record.addr, peer.bytes, sizeof(record.addr));
+        record.method_size = (uint8_t)copy_field(record.method, access_record::kMaxMethodSize, method);
+        record.uri_size = (uint8_t)copy_field(record.uri, access_record::kMaxUriSize, uri);
+        if (unlikely(!local_ring().push(record)))
+            stats_shard::local().log_dropped.inc();
+    }
+
+    //
+    // The writer thread: drain the rings until @stop is set, then once more,
+    // so set it after the reactors have exited to lose nothing.
+    //
+    void run(const std::atomic<bool> & stop) {
+        std::string out;
+        out.reserve(kFlushSize * 2);
+        std::vector<ring_type *> rings;
+        time_t now = 0;
+        char date[32];
+        date[0] = '\0';
+        for (;;) {
+            bool stopping = stop.load(std::memory_order_acquire);
+            {
+                std::lock_guard<std::mutex> lock(this->mutex_);
+                rings = this->rings_;
+            }
+            std::size_t count = 0;
+            access_record record;
+            for (std::size_t i = 0; i < rings.size(); ++i) {
+                while (rings[i]->pop(record)) {
+                    if (unlikely((time_t)record.time != now)) {
+                        now = (time_t)record.time;
+                        format_date(now, date, sizeof(date));
+                    }
+                    format(record, date, out);
+                    count++;
+                    if (out.size() >= kFlushSize)
+                        this->flush(out);
+                }
+            }
+            this->flush(out);
+            if (stopping)
+                break;
+            if (count == 0) {
+                // By value, kPollMs has no out-of-class definition to bind to.
+                std::this_thread::sleep_for(std::chrono::milliseconds((uint32_t)kPollMs));
+            }
+        }
+    }
+
+private:
+    // The ring of the calling thread, registered on the first call.
+    ring_type & local_ring() {
+        static thread_local ring_type * s_ring = nullptr;
+        if (unlikely(s_ring == nullptr)) {
+            ring_type * ring = new ring_type(kRingSize);
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            this->rings_.push_back(ring);
+            s_ring = ring;
+        }
+        return *s_ring;
+    }
+
+    static std::size_t copy_field(char * dest, std::size_t capacity, const StringRef & value) {
+        std::size_t size = (value.size() < capacity) ? value.size() : capacity;
+        ::memcpy(dest, value.data(), size);
+        return size;
+    }
+
+    // "[10/Oct/2000:13:55:36 +0000]"
+    static void format_date(time_t time, char * buf, std::size_t size) {
+        struct tm tm;
+        ::gmtime_r(&time, &tm);
+        ::strftime(buf, size, "[%d/%b/%Y:%H:%M:%S +0000]", &tm);
+    }
+
+    // Escape the quotes, the backslashes and the control characters.
+    static void append_escaped(std::string & out, const char * data, std::size_t size) {
+        static const char kHex[] = "0123456789abcdef";
+        for (std::size_t i = 0; i < size; ++i) {
+            unsigned char ch = (unsigned char)data[i];
+            if (likely(ch >= 0x20 && ch < 0x7F && ch != '"' && ch != '\\')) {
+                out += (char)ch;
+            }
+            else {
+                char escaped[4] = { '\\', 'x', kHex[ch >> 4], kHex[ch & 0x0F] };
+                out.append(escaped, 4);
+            }
+        }
+    }
+
+    // 127.0.0.1 - - [10/Oct/2000:13:55:36 +0000] "GET /index.html HTTP/1.1" 200 2326
+    static void format(const access_record & record, const char * date, std::string & out) {
+        char buf[64];
+        if (record.family == AF_INET || record.family == AF_INET6) {
+            if (::inet_ntop(record.family, record.addr, buf, sizeof(buf)) != nullptr)
+                out += buf;
+            else
+                out += '-';
+        }
+        else {
+            out += '-';
+        }
+        out += " - - ";
+        out += date;
+        out += " \"";
+        append_escaped(out, record.method, record.method_size);
+        out += ' ';
+        append_escaped(out, record.uri, record.uri_size);
+        out += " HTTP/1.";
+        out += (char)('0' + (record.minor % 10));
+        out += "\" ";
+        char * last = response_header::format_uint(record.status, buf);
+        *last++ = ' ';
+        last = response_header::format_uint(record.bytes, last);
+        *last++ = '\n';
+        out.append(buf, (std::size_t)(last - buf));
+    }
+
+    void flush(std::string & out) {
+        const char * data = out.data();
+        std::size_t remain = out.size();
+        while (remain > 0) {
+            ssize_t n = ::write(this->fd_, data, remain);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                // Lost, the reactors mustn't be held by a broken log.
+                break;
+            }
+            data += n;
+            remain -= (std::size_t)n;
+        }
+        out.clear();
+    }
+};
+
+} // namespace jimi
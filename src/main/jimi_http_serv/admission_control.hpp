@@ -0,0 +1,69 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include <cstddef>
+
+#include "jimi/basic/stddef.h"
+
+#include "server_config.hpp"
+
+namespace jimi {
+
+//
+// The CoDel-style admission control of a reactor.
+//
+// The queueing delay of an input is the time from when its connection was
+// readable, which is taken as when the wait of the reactor returned it, until
+// the reactor hands it to the handler. The minimum delay of an interval is the
+// standing queue of the reactor: a burst raises the delays of some inputs, an
+// overload raises all of them.
+//
+// So when the minimum delay of a whole interval is above the target, the
+// reactor is overloaded until an interval ends whose minimum is below it
+// again, and meanwhile the inputs which have waited longer than the target
+// are rejected. Otherwise only the inputs which have waited longer than the
+// interval are, a burst is absorbed.
+//
+class admission_control {
+private:
+    uint64_t target_us_;
+    uint64_t interval_us_;
+    uint64_t interval_end_;
+    uint64_t min_delay_;
+    bool     overloaded_;
+
+public:
+    admission_control(const server_config & config)
+        : target_us_((uint64_t)config.shed_target * 1000),
+          interval_us_((uint64_t)((config.shed_interval != 0) ? config.shed_interval : 100) * 1000),
+          interval_end_(0), min_delay_(UINT64_MAX), overloaded_(false) {}
+    ~admission_control() {}
+
+    bool enabled() const { return (this->target_us_ != 0); }
+    bool overloaded() const { return this->overloaded_; }
+
+    static uint64_t now_us() {
+        struct timespec ts;
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000);
+    }
+
+    // Whether to admit an input which has been ready since @ready_us, at @now_us.
+    bool admit(uint64_t ready_us, uint64_t now_us) {
+        uint64_t delay = (now_us > ready_us) ? (now_us - ready_us) : 0;
+        if (unlikely(now_us >= this->interval_end_)) {
+            if (this->interval_end_ != 0)
+                this->overloaded_ = (this->min_delay_ > this->target_us_);
+            this->min_delay_ = UINT64_MAX;
+            this->interval_end_ = now_us + this->interval_us_;
+        }
+        if (delay < this->min_delay_)
+            this->min_delay_ = delay;
+        return (delay <= (this->overloaded_ ? this->target_us_ : this->interval_us_));
+    }
+};
+
+} // namespace jimi
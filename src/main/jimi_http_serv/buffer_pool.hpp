@@ -0,0 +1,286 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#include "jimi/basic/stddef.h"
+#include "jimi/jstd/fixed_freelist.h"
+
+#if defined(__linux__) && !defined(MPOL_LOCAL)
+#define MPOL_LOCAL  4
+#endif
+
+namespace jimi {
+
+//
+// A buffer borrowed from the buffer_pool of the current thread.
+//
+struct io_buffer {
+    char *   data;
+    uint32_t capacity;
+    uint32_t size_class;
+
+    io_buffer() : data(nullptr), capacity(0), size_class(0) {}
+
+    bool empty() const { return (this->data == nullptr); }
+
+    void swap(io_buffer & other) {
+        io_buffer tmp = *this;
+        *this = other;
+        other = tmp;
+    }
+};
+
+//
+// Per-thread pool of fixed-size io buffers (2/4/16/64 KB classes) carved from
+// large slabs, so that mostly idle connections don't hold any buffer, and the
+// buffers of the busy ones don't fragment the heap.
+//
+// The slabs are backed by huge pages when possible and bound to the local
+// NUMA node of the thread, the free buffers of every class are kept in a
+// jstd::fixed_freelist. There are no locks: a buffer must be given back on
+// the thread it was borrowed from. A request larger than the biggest class
+// falls back on the heap.
+//
+class buffer_pool {
+public:
+    typedef std::size_t size_type;
+    typedef jstd::fixed_freelist<char> freelist_type;
+
+    static const uint32_t  kNumClasses = 4;
+    static const uint32_t  kHeapClass = kNumClasses;
+    static const size_type kSlabSize = 2 * 1024 * 1024;
+
+    struct class_stats {
+        size_type buffer_size;
+        size_type total;
+        size_type in_use;
+    };
+
+private:
+    struct slab {
+        void *    addr;
+        size_type size;
+        bool      is_mmap;
+    };
+
+    freelist_type free_lists_[kNumClasses];
+    size_type     totals_[kNumClasses];
+    size_type     in_use_[kNumClasses];
+    size_type     heap_in_use_;
+    std::vector<slab> slabs_;
+
+public:
+    buffer_pool() : heap_in_use_(0) {
+        for (uint32_t i = 0; i < kNumClasses; ++i) {
+            this->totals_[i] = 0;
+            this->in_use_[i] = 0;
+        }
+    }
+
+    ~buffer_pool() {
+        for (size_type i = 0; i < this->slabs_.size(); ++i) {
+            free_slab(this->slabs_[i]);
+        }
+        this->slabs_.clear();
+    }
+
+    static buffer_pool & local() {
+        static thread_local buffer_pool pool;
+        return pool;
+    }
+
+    static size_type class_size(uint32_t size_class) {
+        static const size_type kClassSizes[kNumClasses] = {
+            2 * 1024, 4 * 1024, 16 * 1024, 64 * 1024
+        };
+        assert(size_class < kNumClasses);
+        return kClassSizes[size_class];
+    }
+
+    static uint32_t size_to_class(size_type size) {
+        for (uint32_t i = 0; i < kNumClasses; ++i) {
+            if (size <= class_size(i))
+                return i;
+        }
+        return kHeapClass;
+    }
+
+    size_type slabs() const { return this->slabs_.size(); }
+    size_type heap_in_use() const { return this->heap_in_use_; }
+
+    class_stats stats(uint32_t size_class) const {
+        class_stats stats;
+        stats.buffer_size = class_size(size_class);
+        stats.total = this->totals_[size_class];
+        stats.in_use = this->in_use_[size_class];
+        return stats;
+    }
+
+    // Borrow a buffer of at least @size bytes.
+    io_buffer borrow(size_type size) {
+        io_buffer buf;
+        uint32_t size_class = size_to_class(size);
+        if (likely(size_class < kNumClasses)) {
+            freelist_type & free_list = this->free_lists_[size_class];
+            if (unlikely(free_list.is_empty())) {
+                if (!this->grow(size_class))
+                    return buf;
+            }
+            buf.data = free_list.pop_back();
+            buf.capacity = (uint32_t)class_size(size_class);
+            buf.size_class = size_class;
+            this->in_use_[size_class]++;
+        }
+        else {
+            buf.data = (char *)::malloc(size);
+            if (likely(buf.data != nullptr)) {
+                buf.capacity = (uint32_t)size;
+                buf.size_class = kHeapClass;
+                this->heap_in_use_++;
+            }
+        }
+        return buf;
+    }
+
+    void give_back(io_buffer & buf) {
+        if (likely(buf.data != nullptr)) {
+            if (likely(buf.size_class < kNumClasses)) {
+                assert(this->in_use_[buf.size_class] > 0);
+                this->free_lists_[buf.size_class].safe_push_back(buf.data);
+                this->in_use_[buf.size_class]--;
+            }
+            else {
+                ::free(buf.data);
+                this->heap_in_use_--;
+            }
+            buf.data = nullptr;
+            buf.capacity = 0;
+            buf.size_class = 0;
+        }
+    }
+
+    // Replace @buf with a bigger one, and keep the first @used bytes.
+    // Return false if out of memory, @buf is unchanged then.
+    bool grow(io_buffer & buf, size_type new_size, size_type used) {
+        io_buffer new_buf = this->borrow(new_size);
+        if (unlikely(new_buf.empty()))
+            return false;
+        if (used > 0)
+            ::memcpy(new_buf.data, buf.data, used);
+        this->give_back(buf);
+        buf = new_buf;
+        return true;
+    }
+
+private:
+    // Carve a new slab into the buffers of @size_class.
+    bool grow(uint32_t size_class) {
+        slab new_slab;
+        if (!alloc_slab(new_slab))
+            return false;
+
+        size_type buffer_size = class_size(size_class);
+        size_type count = new_slab.size / buffer_size;
+        size_type total = this->totals_[size_class] + count;
+
+        freelist_type & free_list = this->free_lists_[size_class];
+        size_type capacity = 1;
+        while (capacity < total)
+            capacity <<= 1;
+        // Make room for the slab and the free buffers first, then the carving
+        // below doesn't allocate. A free list which fails to grow is unchanged.
+        try {
+            if (this->slabs_.size() == this->slabs_.capacity())
+                this->slabs_.reserve(this->slabs_.size() * 2 + 4);
+            if (free_list.is_valid())
+                free_list.resize(capacity);
+            else
+                free_list.reserve(capacity);
+        }
+        catch (const std::bad_alloc &) {
+            free_slab(new_slab);
+            return false;
+        }
+
+        char * data = (char *)new_slab.addr + (count - 1) * buffer_size;
+        for (size_type i = 0; i < count; ++i) {
+            free_list.push_back(data);
+            data -= buffer_size;
+        }
+        this->totals_[size_class] = total;
+        this->slabs_.push_back(new_slab);
+        return true;
+    }
+
+    static bool alloc_slab(slab & new_slab) {
+        new_slab.size = kSlabSize;
+#if defined(__linux__)
+        void * addr = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+        // Explicit huge pages, if the administrator has reserved some.
+        addr = ::mmap(nullptr, kSlabSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (addr == MAP_FAILED) {
+            // A transparent huge page must be aligned to its size, over-map
+            // and trim the slack on both sides.
+            size_type map_size = kSlabSize * 2;
+            char * base = (char *)::mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (base == (char *)MAP_FAILED)
+                return false;
+            char * aligned = (char *)(((uintptr_t)base + (kSlabSize - 1)) & ~(uintptr_t)(kSlabSize - 1));
+            size_type head = (size_type)(aligned - base);
+            if (head > 0)
+                ::munmap(base, head);
+            size_type tail = map_size - head - kSlabSize;
+            if (tail > 0)
+                ::munmap(aligned + kSlabSize, tail);
+            addr = aligned;
+#if defined(MADV_HUGEPAGE)
+            // Transparent huge pages otherwise.
+            ::madvise(addr, kSlabSize, MADV_HUGEPAGE);
+#endif
+        }
+#if defined(SYS_mbind)
+        // Keep the slab on the NUMA node of the thread which touches it first,
+        // the pool is per-thread. It may fail without NUMA support, that's fine.
+        ::syscall(SYS_mbind, addr, kSlabSize, MPOL_LOCAL, nullptr, 0, 0);
+#endif
+        new_slab.addr = addr;
+        new_slab.is_mmap = true;
+#else
+        new_slab.addr = ::malloc(kSlabSize);
+        if (new_slab.addr == nullptr)
+            return false;
+        new_slab.is_mmap = false;
+#endif
+        return true;
+    }
+
+    static void free_slab(slab & old_slab) {
+#if defined(__linux__)
+        if (old_slab.is_mmap) {
+            ::munmap(old_slab.addr, old_slab.size);
+            return;
+        }
+#endif
+        ::free(old_slab.addr);
+    }
+};
+
+} // namespace jimi
@@ -0,0 +1,161 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <assert.h>
+
+#include <cstddef>
+#include <atomic>
+#include <vector>
+
+#include "jimi/basic/stddef.h"
+
+namespace jimi {
+
+//
+// The Chase-Lev work-stealing deque of pointers, with the memory orders of
+// "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al.).
+//
+// The owner thread pushes and pops at the bottom, like a stack, so it keeps
+// working on its most recent (and hottest) items; the other threads steal
+// the oldest items from the top. Only the owner and a thief racing for the
+// last item touch the same index with a CAS.
+//
+// The circular array grows when it's full. The old arrays are kept until the
+// deque is destroyed, because a thief may still be reading from them.
+//
+template <typename T>
+class chase_lev_deque {
+public:
+    typedef T *         value_type;
+    typedef std::size_t size_type;
+
+    static const size_type kCacheLineSize = 64;
+
+private:
+    struct array_type {
+        int64_t                         mask;
+        std::atomic<T *> *              items;
+
+        explicit array_type(int64_t capacity)
+            : mask(capacity - 1), items(new std::atomic<T *>[(std::size_t)capacity]) {}
+        ~array_type() {
+            delete[] this->items;
+        }
+
+        int64_t capacity() const { return (this->mask + 1); }
+
+        T * get(int64_t index) const {
+            return this->items[index & this->mask].load(std::memory_order_relaxed);
+        }
+        void put(int64_t index, T * item) {
+            this->items[index & this->mask].store(item, std::memory_order_relaxed);
+        }
+    };
+
+    // The thieves' side.
+    std::atomic<int64_t>        top_;
+    char                        padding0_[kCacheLineSize];
+
+    // The owner's side.
+    std::atomic<int64_t>        bottom_;
+    std::atomic<array_type *>   array_;
+    std::vector<array_type *>   retired_;
+    char                        padding1_[kCacheLineSize];
+
+public:
+    // The capacity is rounded up to a power of 2.
+    chase_lev_deque(size_type capacity = 256) : top_(0), bottom_(0), array_(nullptr) {
+        int64_t size = 2;
+        while (size < (int64_t)capacity)
+            size <<= 1;
+        this->array_.store(new array_type(size), std::memory_order_relaxed);
+    }
+    ~chase_lev_deque() {
+        delete this->array_.load(std::memory_order_relaxed);
+        for (size_type i = 0; i < this->retired_.size(); ++i) {
+            delete this->retired_[i];
+        }
+    }
+
+    chase_lev_deque(const chase_lev_deque &) = delete;
+    chase_lev_deque & operator = (const chase_lev_deque &) = delete;
+
+    // A snapshot, it may be stale as soon as it returns.
+    size_type size() const {
+        int64_t bottom = this->bottom_.load(std::memory_order_relaxed);
+        int64_t top = this->top_.load(std::memory_order_relaxed);
+        return ((bottom > top) ? (size_type)(bottom - top) : 0);
+    }
+
+    bool is_empty() const { return (this->size() == 0); }
+
+    // By the owner only.
+    void push(T * item) {
+        int64_t bottom = this->bottom_.load(std::memory_order_relaxed);
+        int64_t top = this->top_.load(std::memory_order_acquire);
+        array_type * array = this->array_.load(std::memory_order_relaxed);
+        if (unlikely(bottom - top > array->mask))
+            array = this->grow(array, top, bottom);
+        array->put(bottom, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        this->bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    // By the owner only, the most recent item or nullptr.
+    T * pop() {
+        int64_t bottom = this->bottom_.load(std::memory_order_relaxed) - 1;
+        array_type * array = this->array_.load(std::memory_order_relaxed);
+        this->bottom_.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = this->top_.load(std::memory_order_relaxed);
+
+        T * item = nullptr;
+        if (likely(top <= bottom)) {
+            item = array->get(bottom);
+            if (top == bottom) {
+                // The last item, race the thieves for it.
+                if (!this->top_.compare_exchange_strong(top, top + 1,
+                                                        std::memory_order_seq_cst,
+                                                        std::memory_order_relaxed))
+                    item = nullptr;
+                this->bottom_.store(bottom + 1, std::memory_order_relaxed);
+            }
+        }
+        else {
+            this->bottom_.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // By any thread, the oldest item, or nullptr if it's empty or another
+    // thread won the race for the item.
+    T * steal() {
+        int64_t top = this->top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t bottom = this->bottom_.load(std::memory_order_acquire);
+        if (top < bottom) {
+            array_type * array = this->array_.load(std::memory_order_acquire);
+            T * item = array->get(top);
+            if (!this->top_.compare_exchange_strong(top, top + 1,
+                                                    std::memory_order_seq_cst,
+                                                    std::memory_order_relaxed))
+                return nullptr;
+            return item;
+        }
+        return nullptr;
+    }
+
+private:
+    array_type * grow(array_type * array, int64_t top, int64_t bottom) {
+        array_type * new_array = new array_type(array->capacity() * 2);
+        for (int64_t i = top; i < bottom; ++i) {
+            new_array->put(i, array->get(i));
+        }
+        this->retired_.push_back(array);
+        this->array_.store(new_array, std::memory_order_release);
+        return new_array;
+    }
+};
+
+} // namespace jimi
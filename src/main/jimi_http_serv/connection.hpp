@@ -0,0 +1,308 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+#include <cstddef>
+
+#include "jimi/basic/stddef.h"
+#include "jimi/http/HeaderEndDetector.h"
+
+#include "buffer_pool.hpp"
+#include "write_queue.hpp"
+#include "timer_wheel.hpp"
+
+namespace jimi {
+
+//
+// The address of a peer, without the port, loaded when it's first needed.
+//
+struct peer_address {
+    bool    loaded;
+    uint8_t family;     // AF_INET, AF_INET6, or AF_UNSPEC if it has none.
+    uint8_t bytes[16];
+
+    peer_address() : loaded(false), family(0) {
+        ::memset(this->bytes, 0, sizeof(this->bytes));
+    }
+};
+
+//
+// An open file which is sent as a response body, shared by reference count
+// between the open-file cache of a handler and the connections which are
+// still sending it. It belongs to one reactor thread, so no atomics.
+//
+// A body which isn't a regular file (the pipe of a spliced proxy response)
+// overrides transfer().
+//
+class shared_file {
+public:
+    int      fd;
+    uint32_t refs;
+
+public:
+    shared_file(int _fd = -1) : fd(_fd), refs(1) {}
+    virtual ~shared_file() {
+        if (this->fd >= 0) {
+            ::close(this->fd);
+            this->fd = -1;
+        }
+    }
+
+#if defined(__linux__)
+    // Send up to @count bytes from @offset to the socket @sock_fd, with the
+    // return value and errno of sendfile().
+    virtual ssize_t transfer(int sock_fd, uint64_t offset, std::size_t count) {
+        off_t off = (off_t)offset;
+        return ::sendfile(sock_fd, this->fd, &off, count);
+    }
+#endif
+
+    void retain() { this->refs++; }
+    void release() {
+        assert(this->refs > 0);
+        if (--this->refs == 0)
+            delete this;
+    }
+};
+
+//
+// The per-connection state shared by the I/O engines and the handlers.
+//
+// The engine appends the received bytes to the read buffer [rpos, rlen),
+// the handler consumes complete requests from the front and queues the
+// responses to the write queue, then the engine flushes all of them at once.
+//
+// The buffers are borrowed from the buffer_pool of the reactor thread only
+// while there are bytes in them, an idle connection doesn't hold any buffer.
+//
+// A response body may also be a file range, which the engine sends with
+// sendfile() after the write queue is flushed. The handler must not append
+// anything else until the file is sent, see pending_file().
+//
+class connection {
+public:
+    typedef std::size_t size_type;
+
+    enum flag_t {
+        kCloseAfterWrite = 0x0001,
+        kReadPaused      = 0x0002,
+        kOverloaded      = 0x0004,
+    };
+
+    static const size_type kReadChunkSize = 4096;
+
+    int          fd;
+    uint32_t     flags;
+
+    // The intrusive list of the connections of a reactor.
+    connection * prev;
+    connection * next;
+
+    io_buffer    rbuf;
+    size_type    rpos;
+    size_type    rlen;
+
+    write_queue  wq;
+
+    // The file body which follows the write queue.
+    shared_file * file;
+    uint64_t     file_offset;
+    uint64_t     file_remain;
+
+    // The minimum size of the read buffer to borrow.
+    uint32_t     read_hint;
+
+    // The idle, header or body timeout, see connection_timers.
+    timer_node   timer;
+    uint32_t     timer_state;
+    // The bytes consumed by the handler, and their number when the header
+    // timer was started: it's restarted only for the next request.
+    uint64_t     consumed;
+    uint64_t     timer_mark;
+
+    http::HeaderEndDetector detector;
+
+    // The peer address, see load_peer().
+    peer_address peer;
+
+    // The per-connection state of the handler, if it has any.
+    void *       context;
+
+public:
+    connection(int _fd = -1) : fd(_fd), flags(0), prev(nullptr), next(nullptr),
+        rpos(0), rlen(0), file(nullptr), file_offset(0), file_remain(0),
+        read_hint((uint32_t)kReadChunkSize), timer_state(0), consumed(0), timer_mark(0),
+        context(nullptr) {
+        this->timer.owner = this;
+    }
+    ~connection() {
+        this->release_buffers();
+    }
+
+    const char * data() const { return (this->rbuf.data + this->rpos); }
+    size_type size() const { return (this->rlen - this->rpos); }
+
+    size_type pending_write() const { return this->wq.pending(); }
+    uint64_t pending_file() const { return this->file_remain; }
+
+    bool is_close_after_write() const { return ((this->flags & kCloseAfterWrite) != 0); }
+    void set_close_after_write() { this->flags |= kCloseAfterWrite; }
+
+    // Set by the reactor around the on_read() of an input which has waited
+    // too long (see admission_control): its new requests are rejected.
+    bool is_overloaded() const { return ((this->flags & kOverloaded) != 0); }
+
+    // The address of the peer, queried once for the access log, the rate
+    // limiter and the proxy.
+    const peer_address & load_peer() {
+        peer_address & peer = this->peer;
+        if (unlikely(!peer.loaded)) {
+            peer.loaded = true;
+            struct sockaddr_storage addr;
+            socklen_t addr_len = sizeof(addr);
+            if (::getpeername(this->fd, (struct sockaddr *)&addr, &addr_len) == 0) {
+                if (addr.ss_family == AF_INET) {
+                    peer.family = AF_INET;
+                    ::memcpy(peer.bytes, &((struct sockaddr_in *)&addr)->sin_addr, 4);
+                }
+                else if (addr.ss_family == AF_INET6) {
+                    peer.family = AF_INET6;
+                    ::memcpy(peer.bytes, &((struct sockaddr_in6 *)&addr)->sin6_addr, 16);
+                }
+            }
+        }
+        return peer;
+    }
+
+    // Set the minimum size of the read and write buffers to borrow.
+    void reserve(size_type read_size, size_type write_size) {
+        if (read_size > this->read_hint)
+            this->read_hint = (uint32_t)read_size;
+        if (write_size > this->wq.hint)
+            this->wq.hint = (uint32_t)write_size;
+    }
+
+    // Make sure there is at least @size free bytes at the tail of the read buffer,
+    // return nullptr if out of memory.
+    char * prepare_read(size_type size = kReadChunkSize) {
+        if (likely(this->rpos == this->rlen)) {
+            this->rpos = this->rlen = 0;
+        }
+        if (unlikely(this->rbuf.capacity - this->rlen < size)) {
+            if (this->rpos > 0) {
+                // Move the unconsumed bytes to the head of buffer.
+                ::memmove(this->rbuf.data, this->rbuf.data + this->rpos, this->rlen - this->rpos);
+                this->rlen -= this->rpos;
+                this->rpos = 0;
+            }
+            if (this->rbuf.capacity - this->rlen < size) {
+                size_type new_size = this->rlen + size;
+                if (new_size < this->read_hint)
+                    new_size = this->read_hint;
+                if (unlikely(!buffer_pool::local().grow(this->rbuf, new_size, this->rlen)))
+                    return nullptr;
+            }
+        }
+        return (this->rbuf.data + this->rlen);
+    }
+
+    size_type read_space() const { return (this->rbuf.capacity - this->rlen); }
+
+    void commit_read(size_type n) {
+        assert(this->rlen + n <= this->rbuf.capacity);
+        this->rlen += n;
+    }
+
+    // Consume @n bytes from the front of the unconsumed data.
+    void consume(size_type n) {
+        assert(n <= this->size());
+        this->rpos += n;
+        this->consumed += n;
+        this->detector.consume(n);
+    }
+
+    // Queue a copy of @data.
+    void write(const char * data, size_type len) {
+        if (unlikely(!this->wq.write(data, len)))
+            this->set_close_after_write();
+    }
+
+    // Queue a reference to @data, which must stay unchanged until it's flushed.
+    void write_ref(const char * data, size_type len) {
+        if (unlikely(!this->wq.write_ref(data, len)))
+            this->set_close_after_write();
+    }
+
+    int gather_write(struct iovec * iov, int max_iov) const {
+        return this->wq.gather(iov, max_iov);
+    }
+
+    void commit_write(size_type n) {
+        this->wq.commit(n);
+    }
+
+    // Send [@offset, @offset + @length) of @file after the write queue.
+    void send_file(shared_file * file, uint64_t offset, uint64_t length) {
+        assert(this->file == nullptr);
+        if (length != 0) {
+            file->retain();
+            this->file = file;
+            this->file_offset = offset;
+            this->file_remain = length;
+        }
+    }
+
+    // @length more bytes of the current file are to be sent, e.g. the bytes
+    // which have been spliced into the pipe of a streamed body since.
+    void extend_file(uint64_t length) {
+        assert(this->file != nullptr);
+        this->file_remain += length;
+    }
+
+    void commit_file(uint64_t n) {
+        assert(n <= this->file_remain);
+        this->file_offset += n;
+        this->file_remain -= n;
+        if (this->file_remain == 0)
+            this->release_file();
+    }
+
+    void release_file() {
+        if (this->file != nullptr) {
+            this->file->release();
+            this->file = nullptr;
+        }
+        this->file_offset = 0;
+        this->file_remain = 0;
+    }
+
+    // Give the read buffer back to the pool if it's empty, call it when the
+    // engine waits for the next event of the connection. The write queue
+    // gives back its buffers as soon as it's flushed.
+    void release_idle_buffers() {
+        if (this->rpos == this->rlen && !this->rbuf.empty()) {
+            this->rpos = this->rlen = 0;
+            buffer_pool::local().give_back(this->rbuf);
+        }
+    }
+
+    void release_buffers() {
+        this->release_file();
+        buffer_pool & pool = buffer_pool::local();
+        pool.give_back(this->rbuf);
+        this->rpos = this->rlen = 0;
+        this->wq.release();
+    }
+};
+
+} // namespace jimi
@@ -0,0 +1,106 @@
+
+#pragma once
+
+#include <stdint.h>
+
+#include "jimi/basic/stddef.h"
+
+#include "server_config.hpp"
+#include "connection.hpp"
+#include "timer_wheel.hpp"
+
+namespace jimi {
+
+//
+// The timeouts of the connections of one reactor, on one timer wheel:
+//
+//   idle:   no request is pending, the keep-alive timeout. It's also used
+//           while the output is pending, and pushed back by every event of
+//           the connection, so it only fires when the peer stops reading.
+//   header: a request header is incomplete. The deadline is fixed when the
+//           first byte of the request is received, the next bytes don't push
+//           it back (slowloris), only the next request does.
+//   body:   the header is complete and the body is not, it's pushed back
+//           whenever more of the body is received.
+//
+// A timeout of 0 disables the timer of that state.
+//
+class connection_timers {
+public:
+    enum timer_state_t {
+        kTimerIdle,
+        kTimerHeader,
+        kTimerBody,
+        kTimerStates
+    };
+
+    static const uint32_t kTickMs = 100;
+
+private:
+    timer_wheel wheel_;
+    uint64_t    ticks_[kTimerStates];
+
+public:
+    connection_timers(const server_config & config) : wheel_(kTickMs) {
+        this->ticks_[kTimerIdle]   = this->wheel_.to_ticks((uint64_t)config.idle_timeout * 1000);
+        this->ticks_[kTimerHeader] = this->wheel_.to_ticks((uint64_t)config.header_timeout * 1000);
+        this->ticks_[kTimerBody]   = this->wheel_.to_ticks((uint64_t)config.body_timeout * 1000);
+    }
+    ~connection_timers() {}
+
+    std::size_t size() const { return this->wheel_.size(); }
+
+    // Call it when the reactor is done with an event of @conn, @writing is
+    // whether any output of @conn is still pending.
+    void update(connection * conn, bool writing) {
+        uint32_t state;
+        if (likely(writing || conn->size() == 0))
+            state = kTimerIdle;
+        else if (conn->detector.is_completed())
+            state = kTimerBody;
+        else
+            state = kTimerHeader;
+
+        uint64_t ticks = this->ticks_[state];
+        if (unlikely(ticks == 0)) {
+            this->wheel_.cancel(&conn->timer);
+        }
+        else if (state == kTimerHeader) {
+            if (conn->timer_state != kTimerHeader || conn->timer_mark != conn->consumed ||
+                !conn->timer.is_scheduled()) {
+                conn->timer_mark = conn->consumed;
+                this->wheel_.schedule(&conn->timer, ticks);
+            }
+        }
+        else if (state == conn->timer_state) {
+            this->wheel_.reset(&conn->timer, ticks);
+        }
+        else {
+            this->wheel_.schedule(&conn->timer, ticks);
+        }
+        conn->timer_state = state;
+    }
+
+    void cancel(connection * conn) {
+        this->wheel_.cancel(&conn->timer);
+    }
+
+    // Call @on_timeout(Connection *) for each connection which has timed out,
+    // once per loop iteration.
+    template <typename Connection, typename Func>
+    void expire(Func && on_timeout) {
+        this->wheel_.advance([&on_timeout](timer_node * node) {
+            on_timeout(static_cast<Connection *>(static_cast<connection *>(node->owner)));
+        });
+    }
+
+    // Like expire(), at the tick @now of the wheel.
+    template <typename Connection, typename Func>
+    void expire_at(uint64_t now, Func && on_timeout) {
+        this->wheel_.advance_to(now, [&on_timeout](timer_node * node) {
+            on_timeout(static_cast<Connection *>(static_cast<connection *>(node->owner)));
+        });
+    }
+};
+
+} // namespace jimi
@@ -0,0 +1,30 @@
+
+#pragma once
+
+#include <stdint.h>
+
+#include "spsc_ring.hpp"
+
+namespace jimi {
+
+enum control_type_t {
+    // Drop everything the handler has cached (SIGHUP).
+    kControlFlushCaches = 1,
+};
+
+struct control_message {
+    uint32_t type;
+    uint32_t arg;
+
+    control_message() : type(0), arg(0) {}
+    control_message(uint32_t _type, uint32_t _arg = 0) : type(_type), arg(_arg) {}
+};
+
+//
+// The inbox of one reactor. Nothing the reactors own is touched by another
+// thread: the main thread posts the messages here, and the reactor handles
+// them on its own thread, once per loop iteration, with Handler::on_control().
+//
+typedef spsc_ring<control_message> control_mailbox;
+
+} // namespace jimi
@@ -0,0 +1,112 @@
+
+#pragma once
+
+#include "coro_task.hpp"
+
+#if JIMI_HAS_COROUTINES
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <cstddef>
+#include <string>
+
+#include "jimi/StringRef.h"
+
+#include "server_config.hpp"
+#include "coro_scheduler.hpp"
+#include "coro_handler.hpp"
+#include "offload_pool.hpp"
+
+namespace jimi {
+
+//
+// The application of the coro mode (--mode=coro), a sample of the handlers
+// which are written as coroutines:
+//
+//   GET  /sleep?ms=N    answers after N milliseconds, without blocking the
+//                       other connections of the reactor.
+//   POST /echo          answers with the request body, read chunk by chunk.
+//   GET  /compute?n=N   answers with a hash of N thousand rounds, computed on
+//                       the offload pool (--offload-threads).
+//   any other request   answers with the packet-size body of the http mode.
+//
+class coro_demo_app {
+public:
+    // The longest sleep of /sleep, and the most rounds of /compute, in thousands.
+    static const uint32_t kMaxSleepMs = 60 * 1000;
+    static const uint32_t kMaxComputeRounds = 1000 * 1000;
+
+private:
+    std::string body_;
+
+public:
+    coro_demo_app(const server_config & config) {
+        std::size_t body_size = (config.packet_size > 0) ? config.packet_size : 1;
+        this->body_.resize(body_size);
+        for (std::size_t i = 0; i < body_size; ++i) {
+            this->body_[i] = (char)('a' + (i % 26));
+        }
+    }
+    ~coro_demo_app() {}
+
+    // A CPU bound job, the FNV-1a hash of a counter, @rounds times.
+    static uint64_t compute_hash(uint64_t rounds) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (uint64_t i = 0; i < rounds; ++i) {
+            hash ^= i;
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    static uint32_t query_number(coro_request & req, const char * name, uint32_t max_value) {
+        StringRef value;
+        if (req.query(name, value)) {
+            std::string str(value.data(), value.size());
+            unsigned long n = ::strtoul(str.c_str(), nullptr, 10);
+            return ((n < max_value) ? (uint32_t)n : max_value);
+        }
+        return 0;
+    }
+
+    task<coro_response> handle(coro_request & req) {
+        if (req.is_path("/sleep")) {
+            uint32_t ms = query_number(req, "ms", kMaxSleepMs);
+            co_await sleep_for(ms);
+            coro_response response;
+            response.body = "slept " + std::to_string(ms) + " ms\n";
+            co_return response;
+        }
+        else if (req.is_path("/compute")) {
+            uint64_t rounds = (uint64_t)query_number(req, "n", kMaxComputeRounds) * 1000;
+            uint64_t hash = co_await offload([rounds]() {
+                return compute_hash(rounds);
+            });
+            coro_response response;
+            response.body = "hash " + std::to_string(hash) + "\n";
+            co_return response;
+        }
+        else if (req.is_path("/echo")) {
+            if (!req.is_method("POST"))
+                co_return coro_response(405);
+            coro_response response;
+            response.content_type = "application/octet-stream";
+            response.body.reserve(req.content_length());
+            for (;;) {
+                StringRef chunk = co_await req.read_body();
+                if (chunk.size() == 0)
+                    break;
+                response.body.append(chunk.data(), chunk.size());
+            }
+            co_return response;
+        }
+        coro_response response;
+        response.body = this->body_;
+        co_return response;
+    }
+};
+
+} // namespace jimi
+
+#endif // JIMI_HAS_COROUTINES
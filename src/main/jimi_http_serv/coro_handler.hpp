@@ -0,0 +1,424 @@
+
+#pragma once
+
+#include "coro_task.hpp"
+
+#if JIMI_HAS_COROUTINES
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <exception>
+#include <coroutine>
+
+#include "jimi/basic/stddef.h"
+#include "jimi/StringRef.h"
+#include "jimi/http/FastParser.h"
+#include "jimi/http/ParserPool.h"
+
+#include "server_config.hpp"
+#include "connection.hpp"
+#include "control_mailbox.hpp"
+#include "coro_scheduler.hpp"
+#include "http_handler.hpp"
+#include "http_date.hpp"
+#include "response_header.hpp"
+#include "access_log.hpp"
+#include "server_stats.hpp"
+
+namespace jimi {
+
+struct coro_response {
+    // Its line comes from status_lines, "Unknown" if it has none.
+    uint32_t    status;
+    std::string content_type;
+    // The extra header fields, each one ends with CRLF.
+    std::string headers;
+    std::string body;
+
+    coro_response(uint32_t _status = 200) : status(_status), content_type("text/plain") {}
+
+    void add_header(const char * name, const std::string & value) {
+        this->headers += name;
+        this->headers += ": ";
+        this->headers += value;
+        this->headers += "\r\n";
+    }
+};
+
+//
+// The part of a connection's session which the request reads from: the
+// read buffer of the connection, and the coroutine waiting for more input.
+//
+class coro_session_base {
+public:
+    connection *            conn;
+    // The coroutine waiting for more input, resumed by on_read().
+    std::coroutine_handle<> reader;
+    std::size_t             body_remain;
+
+    coro_session_base(connection * _conn) : conn(_conn), reader(nullptr), body_remain(0) {}
+
+    struct input_awaiter {
+        coro_session_base & session;
+
+        bool await_ready() const noexcept { return (this->session.conn->size() > 0); }
+        void await_suspend(std::coroutine_handle<> handle) noexcept {
+            this->session.reader = handle;
+        }
+        void await_resume() const noexcept {}
+    };
+
+    // Wait until there are unconsumed bytes in the read buffer.
+    input_awaiter wait_input() { return input_awaiter{*this}; }
+};
+
+//
+// A request of a coroutine handler. The header is parsed from a copy which
+// lives as long as the request, the body is read with co_await read_body().
+//
+class coro_request {
+public:
+    typedef http_handler::parser_type parser_type;
+
+private:
+    coro_session_base & session_;
+    const parser_type & parser_;
+    std::size_t         content_length_;
+    bool                keep_alive_;
+
+public:
+    coro_request(coro_session_base & session, const parser_type & parser,
+                 std::size_t content_length, bool keep_alive)
+        : session_(session), parser_(parser), content_length_(content_length),
+          keep_alive_(keep_alive) {}
+
+    StringRef method() const { return this->parser_.getMethodStr(); }
+    StringRef uri() const { return this->parser_.getURI(); }
+    StringRef version() const { return this->parser_.getVersionStr(); }
+    std::size_t content_length() const { return this->content_length_; }
+    bool keep_alive() const { return this->keep_alive_; }
+    const parser_type & parser() const { return this->parser_; }
+
+    template <std::size_t N>
+    bool header(const char (&name)[N], StringRef & value) const {
+        return this->parser_.findField(name, value);
+    }
+
+    bool is_method(const char * method) const {
+        StringRef str = this->method();
+        std::size_t len = ::strlen(method);
+        return (str.size() == len && ::memcmp(str.data(), method, len) == 0);
+    }
+
+    // The path of the URI, without the query.
+    StringRef path() const {
+        StringRef uri = this->uri();
+        const char * query = (const char *)::memchr(uri.data(), '?', uri.size());
+        return ((query != nullptr) ? StringRef(uri.data(), query) : uri);
+    }
+
+    bool is_path(const char * path) const {
+        StringRef str = this->path();
+        std::size_t len = ::strlen(path);
+        return (str.size() == len && ::memcmp(str.data(), path, len) == 0);
+    }
+
+    // Find the value of @name in the query of the URI.
+    bool query(const char * name, StringRef & value) const {
+        StringRef uri = this->uri();
+        const char * first = (const char *)::memchr(uri.data(), '?', uri.size());
+        if (first == nullptr)
+            return false;
+        const char * last = uri.data() + uri.size();
+        std::size_t len = ::strlen(name);
+        ++first;
+        while (first < last) {
+            const char * end = std::find(first, last, '&');
+            if ((std::size_t)(end - first) > len && ::memcmp(first, name, len) == 0 && first[len] == '=') {
+                value = StringRef(first + len + 1, end);
+                return true;
+            }
+            first = (end < last) ? (end + 1) : last;
+        }
+        return false;
+    }
+
+    struct body_awaiter {
+        coro_session_base & session;
+
+        bool await_ready() const noexcept {
+            return (this->session.body_remain == 0 || this->session.conn->size() > 0);
+        }
+        void await_suspend(std::coroutine_handle<> handle) noexcept {
+            this->session.reader = handle;
+        }
+        StringRef await_resume() noexcept {
+            connection & conn = *this->session.conn;
+            std::size_t n = std::min(this->session.body_remain, conn.size());
+            StringRef chunk(conn.data(), n);
+            conn.consume(n);
+            this->session.body_remain -= n;
+            return chunk;
+        }
+    };
+
+    //
+    // The next chunk of the body, empty at its end. The chunk is in the read
+    // buffer of the connection, it's only valid until the next co_await.
+    //
+    body_awaiter read_body() { return body_awaiter{this->session_}; }
+
+    bool is_body_complete() const { return (this->session_.body_remain == 0); }
+};
+
+//
+// The adapter from the reactor's Handler API to the coroutine handlers:
+//
+//   task<coro_response> App::handle(coro_request & req);
+//
+// Each connection runs one coroutine, which waits for a request header,
+// awaits App::handle() and queues the response, then waits for the next
+// one. handle() may co_await the request body, sleep_for(), coro_events and
+// any other task<>, it's resumed on the reactor thread: by on_read() when
+// more input arrives, or by on_tick() for the sleeps and events, in which
+// case the reactor is asked to flush the connection.
+//
+// The pipelined requests are served one by one, in order.
+//
+template <typename App>
+class coro_handler {
+public:
+    typedef App                         app_type;
+    typedef http_handler::parser_type   parser_type;
+    typedef http_handler::parser_pool   parser_pool;
+
+private:
+    class session : public coro_session_base {
+    public:
+        coro_handler &  handler;
+        task<void>      main;
+        std::string     header;
+        // Resumed inside on_read(), the reactor flushes it afterwards.
+        bool            in_read;
+        bool            dirty;
+        bool            close;
+
+        session(coro_handler & _handler, connection * _conn)
+            : coro_session_base(_conn), handler(_handler), in_read(false),
+              dirty(false), close(false) {}
+    };
+
+    app_type                app_;
+    std::vector<session *>  dirty_;
+    bool                    stats_endpoint_;
+    bool                    rate_limit_;
+    bool                    access_log_;
+
+public:
+    coro_handler(const server_config & config)
+        : app_(config), stats_endpoint_(config.stats_endpoint != 0),
+          rate_limit_(config.rate_limit != 0), access_log_(!config.access_log.empty()) {}
+    ~coro_handler() {}
+
+    app_type & app() { return this->app_; }
+
+    void on_accept(connection & conn) {
+        session * s = new session(*this, &conn);
+        conn.context = s;
+        s->main = this->serve(*s);
+        s->main.start();
+    }
+
+    void on_close(connection & conn) {
+        session * s = static_cast<session *>(conn.context);
+        if (s != nullptr) {
+            if (s->dirty) {
+                this->dirty_.erase(std::find(this->dirty_.begin(), this->dirty_.end(), s));
+            }
+            conn.context = nullptr;
+            // Destroys the suspended coroutines, their sleeps and waits are cancelled.
+            delete s;
+        }
+    }
+
+    void on_control(const control_message & msg) {}
+
+    // Return false to close the connection after the responses are flushed.
+    bool on_read(connection & conn) {
+        session * s = static_cast<session *>(conn.context);
+        if (s->reader && conn.size() > 0) {
+            std::coroutine_handle<> reader = s->reader;
+            s->reader = nullptr;
+            s->in_read = true;
+            reader.resume();
+            s->in_read = false;
+        }
+        return !s->close;
+    }
+
+    //
+    // Resume the coroutines of the scheduler, and call @flush(connection &)
+    // for each connection they have queued a response to, return the longest
+    // time the reactor may wait, -1 for no limit.
+    //
+    template <typename Func>
+    int on_tick(Func && flush) {
+        int timeout = coro_scheduler::local().run_once();
+        while (!this->dirty_.empty()) {
+            session * s = this->dirty_.back();
+            this->dirty_.pop_back();
+            s->dirty = false;
+            if (s->close)
+                s->conn->set_close_after_write();
+            // It may close the connection, and destroy the session.
+            flush(*s->conn);
+        }
+        return timeout;
+    }
+
+    int event_fd() const { return -1; }
+    void on_event() {}
+
+private:
+    void mark_dirty(session & s) {
+        if (!s.in_read && !s.dirty) {
+            s.dirty = true;
+            this->dirty_.push_back(&s);
+        }
+    }
+
+    // The coroutine of a connection.
+    task<void> serve(session & s) {
+        connection & conn = *s.conn;
+        parser_pool & pool = parser_pool::local();
+        for (;;) {
+            http_handler::framed_request req;
+            while (!http_handler::detect_request(conn, req)) {
+                if (unlikely(req.error != 0)) {
+                    this->finish(s, req.error);
+                    co_return;
+                }
+                co_await s.wait_input();
+            }
+
+            // The read buffer may move while the handler is suspended.
+            s.header.assign(conn.data(), req.header_size);
+            conn.consume(req.header_size);
+
+            if (unlikely(!http_handler::parse_request(s.header.data(), req))) {
+                this->finish(s, req.error);
+                co_return;
+            }
+            parser_type * parser = req.parser;
+            std::size_t content_length = req.content_length;
+
+            bool keep_alive = http_handler::is_keep_alive(*parser);
+            bool is_head = (parser->getMethodStr().size() == 4 &&
+                            ::memcmp(parser->getMethodStr().data(), "HEAD", 4) == 0);
+            s.body_remain = content_length;
+            // In s.header, which is kept until the next request.
+            StringRef method = parser->getMethodStr();
+            StringRef uri = parser->getURI();
+            uint32_t minor = http_handler::is_http_1_0(*parser) ? 0 : 1;
+            uint32_t status = 200;
+            std::size_t body_size = 0;
+
+            if (unlikely(this->stats_endpoint_ && http_handler::is_stats_request(*parser))) {
+                pool.release(parser);
+                co_await this->skip_body(s);
+                http_date::local().update();
+                body_size = http_handler::write_stats(conn, keep_alive, is_head);
+            }
+            else if (unlikely(conn.is_overloaded())) {
+                // Closed, the body isn't read.
+                pool.release(parser);
+                http_handler::write_overloaded(conn);
+                keep_alive = false;
+                status = 503;
+            }
+            else if (unlikely(this->rate_limit_ && !http_handler::admit(conn, *parser))) {
+                pool.release(parser);
+                co_await this->skip_body(s);
+                http_handler::write_limited(conn, keep_alive);
+                status = 429;
+            }
+            else {
+                coro_response response;
+                bool failed = false;
+                {
+                    coro_request request(s, *parser, content_length, keep_alive);
+                    try {
+                        response = co_await this->app_.handle(request);
+                    }
+                    catch (...) {
+                        failed = true;
+                    }
+                }
+                pool.release(parser);
+                if (unlikely(failed)) {
+                    if (unlikely(this->access_log_))
+                        access_log::instance().append(conn, method, uri, minor, 500, 0);
+                    this->finish(s, 500);
+                    co_return;
+                }
+                // The part of the body the handler hasn't read.
+                co_await this->skip_body(s);
+                this->write_response(s, response, keep_alive, is_head);
+                status = response.status;
+                body_size = is_head ? 0 : response.body.size();
+            }
+            if (unlikely(this->access_log_))
+                access_log::instance().append(conn, method, uri, minor, status, body_size);
+            stats_shard::local().queries.inc();
+
+            if (unlikely(!keep_alive)) {
+                s.close = true;
+                this->mark_dirty(s);
+                co_return;
+            }
+            this->mark_dirty(s);
+        }
+    }
+
+    task<void> skip_body(session & s) {
+        while (s.body_remain > 0) {
+            if (s.conn->size() == 0)
+                co_await s.wait_input();
+            std::size_t n = std::min(s.body_remain, s.conn->size());
+            s.conn->consume(n);
+            s.body_remain -= n;
+        }
+    }
+
+    void write_response(session & s, const coro_response & response, bool keep_alive, bool is_head) {
+        http_date::local().update();
+        response_header & out = response_header::local();
+        out.begin(response.status);
+        out.add_field("Content-Type", response.content_type);
+        out.add_content_length(response.body.size());
+        out.add_connection(keep_alive);
+        out.append(response.headers.data(), response.headers.size());
+        out.add_date();
+        out.end();
+        s.conn->write(out.data(), out.size());
+        if (!is_head)
+            s.conn->write(response.body.data(), response.body.size());
+    }
+
+    // Answer with an error and close the connection.
+    void finish(session & s, uint32_t status) {
+        http_handler::write_error(*s.conn, status);
+        s.close = true;
+        this->mark_dirty(s);
+    }
+};
+
+} // namespace jimi
+
+#endif // JIMI_HAS_COROUTINES
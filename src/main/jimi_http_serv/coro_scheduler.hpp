@@ -0,0 +1,223 @@
+
+#pragma once
+
+#include "coro_task.hpp"
+
+#if JIMI_HAS_COROUTINES
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <vector>
+#include <coroutine>
+
+#include "jimi/basic/stddef.h"
+
+#include "timer_wheel.hpp"
+
+namespace jimi {
+
+//
+// A suspended coroutine which is waiting to be resumed by the scheduler,
+// embedded in the awaiter it's suspended on.
+//
+struct coro_waiter {
+    std::coroutine_handle<> handle;
+    bool                    posted;
+
+    coro_waiter() : handle(nullptr), posted(false) {}
+};
+
+//
+// The per-thread scheduler of the coroutines which don't wait for their
+// connection: the sleeps (on a timer wheel of kTickMs ticks) and the events.
+// The reactor runs it once per loop iteration through Handler::on_tick(),
+// so the coroutines are resumed on the reactor thread, without any extra
+// thread or lock.
+//
+class coro_scheduler {
+public:
+    static const uint32_t kTickMs = 5;
+
+private:
+    timer_wheel                 wheel_;
+    std::vector<coro_waiter *>  ready_;
+    std::vector<coro_waiter *>  running_;
+
+public:
+    coro_scheduler() : wheel_(kTickMs) {}
+    ~coro_scheduler() {}
+
+    static coro_scheduler & local() {
+        static thread_local coro_scheduler scheduler;
+        return scheduler;
+    }
+
+    bool is_idle() const { return (this->ready_.empty() && this->wheel_.size() == 0); }
+
+    // Resume @waiter in the next run_once().
+    void post(coro_waiter * waiter) {
+        if (!waiter->posted) {
+            waiter->posted = true;
+            this->ready_.push_back(waiter);
+        }
+    }
+
+    // @waiter is destroyed before it's resumed.
+    void cancel(coro_waiter * waiter) {
+        if (unlikely(waiter->posted)) {
+            waiter->posted = false;
+            for (std::size_t i = 0; i < this->ready_.size(); ++i) {
+                if (this->ready_[i] == waiter)
+                    this->ready_[i] = nullptr;
+            }
+            for (std::size_t i = 0; i < this->running_.size(); ++i) {
+                if (this->running_[i] == waiter)
+                    this->running_[i] = nullptr;
+            }
+        }
+    }
+
+    // @node->owner is the coro_waiter to post when it expires.
+    void add_timer(timer_node * node, uint32_t ms) {
+        // The wheel isn't advanced while it's empty, catch up with the time first.
+        if (this->wheel_.size() == 0)
+            this->wheel_.advance([](timer_node * node) {});
+        this->wheel_.schedule(node, this->wheel_.to_ticks(ms));
+    }
+
+    void cancel_timer(timer_node * node) {
+        this->wheel_.cancel(node);
+    }
+
+    //
+    // Resume the coroutines whose sleep has expired or whose event is set,
+    // return the longest time in milliseconds the reactor may wait before
+    // the next call, or -1 if nothing is waiting.
+    //
+    int run_once() {
+        if (this->wheel_.size() != 0) {
+            this->wheel_.advance([this](timer_node * node) {
+                this->post(static_cast<coro_waiter *>(node->owner));
+            });
+        }
+        // The coroutines posted while these run wait for the next call.
+        this->running_.swap(this->ready_);
+        for (std::size_t i = 0; i < this->running_.size(); ++i) {
+            coro_waiter * waiter = this->running_[i];
+            if (waiter != nullptr) {
+                waiter->posted = false;
+                this->running_[i] = nullptr;
+                waiter->handle.resume();
+            }
+        }
+        this->running_.clear();
+
+        if (!this->ready_.empty())
+            return 0;
+        return ((this->wheel_.size() != 0) ? (int)kTickMs : -1);
+    }
+};
+
+//
+// co_await sleep_for(ms): resume the coroutine after @ms milliseconds,
+// rounded up to the tick of the scheduler.
+//
+class coro_sleep {
+private:
+    timer_node  node_;
+    coro_waiter waiter_;
+    uint32_t    ms_;
+
+public:
+    explicit coro_sleep(uint32_t ms) : ms_(ms) {}
+    ~coro_sleep() {
+        coro_scheduler & scheduler = coro_scheduler::local();
+        scheduler.cancel_timer(&this->node_);
+        scheduler.cancel(&this->waiter_);
+    }
+
+    coro_sleep(const coro_sleep &) = delete;
+    coro_sleep & operator = (const coro_sleep &) = delete;
+
+    bool await_ready() const noexcept { return (this->ms_ == 0); }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        this->waiter_.handle = handle;
+        this->node_.owner = &this->waiter_;
+        coro_scheduler::local().add_timer(&this->node_, this->ms_);
+    }
+
+    void await_resume() const noexcept {}
+};
+
+static inline
+coro_sleep sleep_for(uint32_t ms)
+{
+    return coro_sleep(ms);
+}
+
+//
+// A one-shot event with one waiter, set by the code of the same thread, e.g.
+// the completion of an upstream call. co_await returns at once if it's set.
+// The other threads must post to the reactor's control mailbox instead.
+//
+class coro_event {
+private:
+    coro_waiter * waiter_;
+    bool          is_set_;
+
+public:
+    coro_event() : waiter_(nullptr), is_set_(false) {}
+    ~coro_event() {
+        if (this->waiter_ != nullptr)
+            coro_scheduler::local().cancel(this->waiter_);
+    }
+
+    coro_event(const coro_event &) = delete;
+    coro_event & operator = (const coro_event &) = delete;
+
+    bool is_set() const { return this->is_set_; }
+
+    // The waiter is resumed by the scheduler, not inside set().
+    void set() {
+        this->is_set_ = true;
+        if (this->waiter_ != nullptr) {
+            coro_scheduler::local().post(this->waiter_);
+            this->waiter_ = nullptr;
+        }
+    }
+
+    void reset() { this->is_set_ = false; }
+
+    class awaiter {
+    private:
+        coro_event & event_;
+        coro_waiter  waiter_;
+
+    public:
+        explicit awaiter(coro_event & event) : event_(event) {}
+        ~awaiter() {
+            if (this->event_.waiter_ == &this->waiter_)
+                this->event_.waiter_ = nullptr;
+            coro_scheduler::local().cancel(&this->waiter_);
+        }
+
+        bool await_ready() const noexcept { return this->event_.is_set_; }
+
+        void await_suspend(std::coroutine_handle<> handle) noexcept {
+            this->waiter_.handle = handle;
+            this->event_.waiter_ = &this->waiter_;
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    awaiter operator co_await () noexcept {
+        return awaiter(*this);
+    }
+};
+
+} // namespace jimi
+
+#endif // JIMI_HAS_COROUTINES
@@ -0,0 +1,300 @@
+
+#pragma once
+
+//
+// The coroutine handlers need C++20 (configure with -DJIMI_HTTP_COROUTINES=ON),
+// everything below compiles to nothing in the default C++11 build.
+//
+#if defined(__has_include)
+#if __has_include(<coroutine>) && defined(__cpp_impl_coroutine)
+#define JIMI_HAS_COROUTINES     1
+#endif
+#endif
+
+#ifndef JIMI_HAS_COROUTINES
+#define JIMI_HAS_COROUTINES     0
+#endif
+
+#if JIMI_HAS_COROUTINES
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <utility>
+#include <optional>
+#include <exception>
+#include <coroutine>
+
+#include "jimi/basic/stddef.h"
+
+namespace jimi {
+
+//
+// Per-thread pool of the coroutine frames, small size classes carved from
+// 64 KB chunks, with a free list per class. A frame is allocated when the
+// coroutine is called and freed when it's destroyed, both on the reactor
+// thread, so there are no locks; the frames larger than the biggest class
+// come from the heap.
+//
+class coro_frame_pool {
+public:
+    typedef std::size_t size_type;
+
+    static const uint32_t  kNumClasses = 6;
+    static const uint32_t  kHeapClass = kNumClasses;
+    static const size_type kChunkSize = 64 * 1024;
+
+private:
+    struct free_block {
+        free_block * next;
+    };
+
+    free_block *        free_lists_[kNumClasses];
+    size_type           in_use_;
+    std::vector<void *> chunks_;
+
+public:
+    coro_frame_pool() : in_use_(0) {
+        for (uint32_t i = 0; i < kNumClasses; ++i) {
+            this->free_lists_[i] = nullptr;
+        }
+    }
+    ~coro_frame_pool() {
+        for (size_type i = 0; i < this->chunks_.size(); ++i) {
+            ::free(this->chunks_[i]);
+        }
+        this->chunks_.clear();
+    }
+
+    static coro_frame_pool & local() {
+        static thread_local coro_frame_pool pool;
+        return pool;
+    }
+
+    static size_type class_size(uint32_t size_class) {
+        assert(size_class < kNumClasses);
+        return ((size_type)128 << size_class);
+    }
+
+    static uint32_t size_to_class(size_type size) {
+        for (uint32_t i = 0; i < kNumClasses; ++i) {
+            if (size <= class_size(i))
+                return i;
+        }
+        return kHeapClass;
+    }
+
+    size_type in_use() const { return this->in_use_; }
+    size_type chunks() const { return this->chunks_.size(); }
+
+    void * allocate(size_type size) {
+        uint32_t size_class = size_to_class(size);
+        if (unlikely(size_class >= kNumClasses))
+            return ::operator new(size);
+        if (unlikely(this->free_lists_[size_class] == nullptr))
+            this->grow(size_class);
+        free_block * block = this->free_lists_[size_class];
+        this->free_lists_[size_class] = block->next;
+        this->in_use_++;
+        return block;
+    }
+
+    // @size must be the size it was allocated with.
+    void deallocate(void * ptr, size_type size) {
+        uint32_t size_class = size_to_class(size);
+        if (unlikely(size_class >= kNumClasses)) {
+            ::operator delete(ptr);
+            return;
+        }
+        free_block * block = static_cast<free_block *>(ptr);
+        block->next = this->free_lists_[size_class];
+        this->free_lists_[size_class] = block;
+        assert(this->in_use_ > 0);
+        this->in_use_--;
+    }
+
+private:
+    void grow(uint32_t size_class) {
+        void * chunk = ::malloc(kChunkSize);
+        if (chunk == nullptr)
+            throw std::bad_alloc();
+        this->chunks_.push_back(chunk);
+        size_type block_size = class_size(size_class);
+        size_type count = kChunkSize / block_size;
+        char * data = (char *)chunk + (count - 1) * block_size;
+        for (size_type i = 0; i < count; ++i) {
+            free_block * block = (free_block *)data;
+            block->next = this->free_lists_[size_class];
+            this->free_lists_[size_class] = block;
+            data -= block_size;
+        }
+    }
+};
+
+template <typename T>
+class task;
+
+namespace detail {
+
+struct task_promise_base {
+    // The coroutine which awaits this one, resumed when it finishes.
+    std::coroutine_handle<> continuation;
+    std::exception_ptr      error;
+
+    static void * operator new(std::size_t size) {
+        return coro_frame_pool::local().allocate(size);
+    }
+    static void operator delete(void * ptr, std::size_t size) {
+        coro_frame_pool::local().deallocate(ptr, size);
+    }
+
+    struct final_awaiter {
+        bool await_ready() const noexcept { return false; }
+
+        // Transfer to the awaiting coroutine directly, without nesting the stack.
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            std::coroutine_handle<> next = handle.promise().continuation;
+            return (next ? next : std::noop_coroutine());
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    final_awaiter final_suspend() const noexcept { return {}; }
+
+    void unhandled_exception() noexcept {
+        this->error = std::current_exception();
+    }
+};
+
+template <typename T>
+struct task_promise : public task_promise_base {
+    std::optional<T> value;
+
+    task<T> get_return_object() noexcept;
+
+    template <typename U>
+    void return_value(U && result) {
+        this->value.emplace(std::forward<U>(result));
+    }
+
+    T take() {
+        if (this->error)
+            std::rethrow_exception(this->error);
+        return std::move(*this->value);
+    }
+};
+
+template <>
+struct task_promise<void> : public task_promise_base {
+    task<void> get_return_object() noexcept;
+
+    void return_void() noexcept {}
+
+    void take() {
+        if (this->error)
+            std::rethrow_exception(this->error);
+    }
+};
+
+} // namespace detail
+
+//
+// A lazy coroutine which returns a T: it starts when it's co_await'ed, and
+// its awaiter is resumed by symmetric transfer when it finishes. The frame
+// comes from the coro_frame_pool of the thread. A task owns its frame, so
+// destroying a suspended task destroys its whole chain of awaited tasks.
+//
+// The top-level task (nobody awaits it) is started with start().
+//
+template <typename T = void>
+class task {
+public:
+    typedef detail::task_promise<T>                 promise_type;
+    typedef std::coroutine_handle<promise_type>     handle_type;
+
+private:
+    handle_type handle_;
+
+public:
+    task() noexcept : handle_(nullptr) {}
+    explicit task(handle_type handle) noexcept : handle_(handle) {}
+    task(task && other) noexcept : handle_(other.handle_) {
+        other.handle_ = nullptr;
+    }
+    ~task() {
+        this->destroy();
+    }
+
+    task & operator = (task && other) noexcept {
+        if (this != &other) {
+            this->destroy();
+            this->handle_ = other.handle_;
+            other.handle_ = nullptr;
+        }
+        return *this;
+    }
+
+    task(const task &) = delete;
+    task & operator = (const task &) = delete;
+
+    bool is_valid() const { return (this->handle_ != nullptr); }
+    bool is_done() const { return (!this->handle_ || this->handle_.done()); }
+
+    // Run the top-level task until its first suspension.
+    void start() {
+        if (this->handle_ && !this->handle_.done())
+            this->handle_.resume();
+    }
+
+    void destroy() {
+        if (this->handle_) {
+            this->handle_.destroy();
+            this->handle_ = nullptr;
+        }
+    }
+
+    struct awaiter {
+        handle_type handle;
+
+        bool await_ready() const noexcept {
+            return (!this->handle || this->handle.done());
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            this->handle.promise().continuation = awaiting;
+            return this->handle;
+        }
+
+        T await_resume() {
+            return this->handle.promise().take();
+        }
+    };
+
+    awaiter operator co_await () const & noexcept {
+        return awaiter{this->handle_};
+    }
+};
+
+namespace detail {
+
+template <typename T>
+inline task<T> task_promise<T>::get_return_object() noexcept {
+    return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() noexcept {
+    return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+} // namespace jimi
+
+#endif // JIMI_HAS_COROUTINES
@@ -0,0 +1,203 @@
+
+#pragma once
+
+#if defined(__linux__)
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+#include "jimi/basic/stddef.h"
+
+#if !defined(MPOL_LOCAL)
+#define MPOL_LOCAL  4
+#endif
+
+namespace jimi {
+
+//
+// Parse a cpu list like "0-3,8,10-11" (the format of the /sys cpulist files
+// and taskset -c), return false if it's malformed.
+//
+static inline
+bool parse_cpu_list(const std::string & list, std::vector<int> & cpus)
+{
+    cpus.clear();
+    std::size_t pos = 0;
+    while (pos < list.size()) {
+        std::size_t end = list.find(',', pos);
+        if (end == std::string::npos)
+            end = list.size();
+        std::string item = list.substr(pos, end - pos);
+        pos = end + 1;
+        while (!item.empty() && (item[item.size() - 1] == '\n' || item[item.size() - 1] == ' '))
+            item.resize(item.size() - 1);
+        if (item.empty())
+            continue;
+
+        char * tail;
+        long first = ::strtol(item.c_str(), &tail, 10);
+        long last = first;
+        if (*tail == '-')
+            last = ::strtol(tail + 1, &tail, 10);
+        if (*tail != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+            return false;
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back((int)cpu);
+        }
+    }
+    return !cpus.empty();
+}
+
+// The CPUs the process is allowed to run on.
+static inline
+std::vector<int> get_allowed_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (::sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// The CPUs of each NUMA node, empty without NUMA support.
+static inline
+std::vector<std::vector<int>> get_numa_nodes()
+{
+    std::vector<std::vector<int>> nodes;
+    for (int node = 0; node < 1024; ++node) {
+        char path[64];
+        ::snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        std::ifstream file(path);
+        if (!file.is_open())
+            break;
+        std::string list;
+        std::getline(file, list);
+        std::vector<int> cpus;
+        parse_cpu_list(list, cpus);
+        nodes.push_back(cpus);
+    }
+    return nodes;
+}
+
+//
+// Where each reactor thread runs: the set of CPUs it's pinned to, and the
+// CPU its SO_REUSEPORT listening socket is steered to (SO_INCOMING_CPU), -1
+// if it isn't pinned to one CPU. With numa, the thread's memory policy is
+// MPOL_LOCAL, so everything it allocates (the connections, its buffer and
+// parser pools, the caches of its handler) comes from its own node.
+//
+class cpu_placement {
+private:
+    std::vector<std::vector<int>> worker_cpus_;
+    bool numa_;
+
+public:
+    cpu_placement() : numa_(false) {}
+    ~cpu_placement() {}
+
+    bool is_enabled() const { return (!this->worker_cpus_.empty() || this->numa_); }
+
+    //
+    // @cpu_list is "" (no pinning), "all" (the allowed CPUs), or a cpu list;
+    // the workers are pinned to the CPUs round robin, one CPU each. With
+    // @numa and without a cpu list, the workers are spread over the NUMA nodes
+    // round robin, each one may run on any CPU of its node.
+    //
+    bool init(const std::string & cpu_list, bool numa, uint32_t worker_num) {
+        this->worker_cpus_.clear();
+        this->numa_ = numa;
+
+        if (!cpu_list.empty()) {
+            std::vector<int> cpus;
+            if (cpu_list == "all") {
+                cpus = get_allowed_cpus();
+            }
+            else if (!parse_cpu_list(cpu_list, cpus)) {
+                std::cerr << "Error: invalid cpu list \"" << cpu_list << "\"." << std::endl;
+                return false;
+            }
+            if (cpus.empty())
+                return false;
+            for (uint32_t i = 0; i < worker_num; ++i) {
+                this->worker_cpus_.push_back(std::vector<int>(1, cpus[i % cpus.size()]));
+            }
+        }
+        else if (numa) {
+            std::vector<std::vector<int>> nodes = get_numa_nodes();
+            std::vector<int> allowed = get_allowed_cpus();
+            // Only the nodes which have some allowed CPUs.
+            std::vector<std::vector<int>> usable;
+            for (std::size_t n = 0; n < nodes.size(); ++n) {
+                std::vector<int> cpus;
+                for (std::size_t i = 0; i < nodes[n].size(); ++i) {
+                    for (std::size_t j = 0; j < allowed.size(); ++j) {
+                        if (nodes[n][i] == allowed[j]) {
+                            cpus.push_back(nodes[n][i]);
+                            break;
+                        }
+                    }
+                }
+                if (!cpus.empty())
+                    usable.push_back(cpus);
+            }
+            if (!usable.empty()) {
+                for (uint32_t i = 0; i < worker_num; ++i) {
+                    this->worker_cpus_.push_back(usable[i % usable.size()]);
+                }
+            }
+        }
+        return true;
+    }
+
+    // The CPU the listening socket of @worker is steered to, or -1.
+    int incoming_cpu(uint32_t worker) const {
+        if (worker < this->worker_cpus_.size() && this->worker_cpus_[worker].size() == 1)
+            return this->worker_cpus_[worker][0];
+        return -1;
+    }
+
+    // Call it on the worker thread, before it allocates anything.
+    bool apply(uint32_t worker) const {
+        bool ok = true;
+        if (worker < this->worker_cpus_.size()) {
+            const std::vector<int> & cpus = this->worker_cpus_[worker];
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (std::size_t i = 0; i < cpus.size(); ++i) {
+                CPU_SET(cpus[i], &set);
+            }
+            int ret = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+            if (ret != 0) {
+                std::cerr << "Warning: pin reactor #" << worker << " failed, errno = " << ret << std::endl;
+                ok = false;
+            }
+        }
+#if defined(SYS_set_mempolicy)
+        if (this->numa_) {
+            // It fails without NUMA support, the default policy is fine then.
+            ::syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0);
+        }
+#endif
+        return ok;
+    }
+};
+
+} // namespace jimi
+
+#endif // __linux__
@@ -0,0 +1,67 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <cstddef>
+
+#include "jimi/basic/stddef.h"
+
+#include "server_config.hpp"
+#include "connection.hpp"
+#include "control_mailbox.hpp"
+#include "server_stats.hpp"
+
+namespace jimi {
+
+//
+// The echo handler: the client sends fixed size packets of packet_size bytes,
+// up to pipeline packets at once, and the server echoes every complete packet
+// back (or only consumes it if need_echo is 0). It measures the networking
+// ceiling of the server without any http parsing.
+//
+class echo_handler {
+private:
+    std::size_t packet_size_;
+    std::size_t batch_size_;
+    bool        need_echo_;
+
+public:
+    echo_handler(const server_config & config)
+        : packet_size_((config.packet_size > 0) ? config.packet_size : 1),
+          batch_size_(0), need_echo_(config.need_echo != 0) {
+        std::size_t pipeline = (config.pipeline > 0) ? config.pipeline : 1;
+        this->batch_size_ = this->packet_size_ * pipeline;
+    }
+
+    ~echo_handler() {}
+
+    void on_accept(connection & conn) {
+        // Make room for a whole pipelined batch, so it's read and echoed at once.
+        conn.reserve(this->batch_size_, this->need_echo_ ? this->batch_size_ : 0);
+    }
+
+    void on_close(connection & conn) {}
+    void on_control(const control_message & msg) {}
+
+    template <typename Func>
+    int on_tick(Func && flush) { return -1; }
+
+    int event_fd() const { return -1; }
+    void on_event() {}
+
+    bool on_read(connection & conn) {
+        std::size_t packets = conn.size() / this->packet_size_;
+        if (likely(packets > 0)) {
+            std::size_t length = packets * this->packet_size_;
+            if (likely(this->need_echo_))
+                conn.write(conn.data(), length);
+            conn.consume(length);
+            stats_shard::local().queries.add(packets);
+        }
+        return true;
+    }
+};
+
+} // namespace jimi
@@ -0,0 +1,485 @@
+
+#pragma once
+
+#if defined(__linux__)
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <vector>
+#include <iostream>
+
+#include "jimi/basic/stddef.h"
+
+#include "server_config.hpp"
+#include "socket_utils.hpp"
+#include "connection.hpp"
+#include "connection_timers.hpp"
+#include "control_mailbox.hpp"
+#include "offload_pool.hpp"
+#include "server_stats.hpp"
+#include "admission_control.hpp"
+
+namespace jimi {
+
+//
+// One edge-triggered epoll reactor, run by one thread.
+//
+// Handler is constructed per reactor and must provide:
+//
+//   void on_accept(connection & conn);
+//   bool on_read(connection & conn);    // Return false to close after flushing.
+//   void on_close(connection & conn);
+//   void on_control(const control_message & msg);
+//
+//   // Called once per loop iteration: resume the deferred work, call
+//   // flush(connection &) for each connection it has queued output to, and
+//   // return the longest time in ms the reactor may wait, -1 for no limit.
+//   template <typename Func> int on_tick(Func && flush);
+//
+//   // An fd of the handler the reactor waits on too, -1 for none, and the
+//   // call when it's readable, e.g. the epoll fd of the upstream sockets of
+//   // the proxy. The output queued by on_event() is flushed by on_tick().
+//   int event_fd() const;
+//   void on_event();
+//
+// With the load shedding on, an input which has waited longer than the
+// admission_control allows is handed to on_read() with the kOverloaded flag
+// of its connection set. The readiness of an event is taken as the return
+// of the epoll_wait() which reported it, or of the one before if that one
+// returned a full batch: the events left over were ready then.
+//
+template <typename Handler>
+class epoll_reactor {
+public:
+    typedef Handler handler_type;
+
+    static const int kMaxEvents = 256;
+    static const int kWaitTimeout = 100;    // In milliseconds.
+    static const int kMaxIovecs = 64;
+
+    // Stop reading from a connection while this many bytes wait to be written.
+    static const std::size_t kMaxPendingWrite = 1024 * 1024;
+
+private:
+    int epoll_fd_;
+    int listen_fd_;
+    bool own_listen_fd_;
+    uint32_t id_;
+    const server_config & config_;
+    handler_type handler_;
+    connection * head_;
+    std::size_t conn_count_;
+    connection_timers timers_;
+    control_mailbox * mailbox_;
+    offload_inbox * inbox_;
+    admission_control admission_;
+    // The readiness time of the events of the current batch, and the return
+    // time of its epoll_wait(), in us.
+    uint64_t ready_us_;
+    uint64_t batch_us_;
+
+public:
+    epoll_reactor(uint32_t id, const server_config & config)
+        : epoll_fd_(-1), listen_fd_(-1), own_listen_fd_(false), id_(id),
+          config_(config), handler_(config), head_(nullptr), conn_count_(0),
+          timers_(config), mailbox_(nullptr), inbox_(nullptr), admission_(config),
+          ready_us_(0), batch_us_(0) {}
+
+    ~epoll_reactor() {
+        this->close_all();
+        if (this->listen_fd_ >= 0 && this->own_listen_fd_) {
+            ::close(this->listen_fd_);
+        }
+        if (this->epoll_fd_ >= 0) {
+            ::close(this->epoll_fd_);
+        }
+    }
+
+    uint32_t id() const { return this->id_; }
+    int listen_fd() const { return this->listen_fd_; }
+    std::size_t connections() const { return this->conn_count_; }
+    handler_type & handler() { return this->handler_; }
+
+    // The control messages to the reactor, handled by run().
+    void set_mailbox(control_mailbox * mailbox) { this->mailbox_ = mailbox; }
+
+    // The offloaded jobs returned to the reactor, if the server has an offload pool.
+    void set_offload_inbox(offload_inbox * inbox) { this->inbox_ = inbox; }
+
+    //
+    // If shared_listen_fd is -1, the reactor creates its own SO_REUSEPORT
+    // listening socket, otherwise it waits on the shared one with EPOLLEXCLUSIVE.
+    //
+    bool open(int shared_listen_fd = -1) {
+        this->epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+        if (this->epoll_fd_ < 0) {
+            std::cerr << "Error: epoll_create1() failed, errno = " << errno << std::endl;
+            return false;
+        }
+
+        struct epoll_event event;
+        event.data.ptr = nullptr;
+        if (shared_listen_fd < 0) {
+            this->listen_fd_ = create_listen_socket(this->config_.host, this->config_.port, true);
+            if (this->listen_fd_ < 0)
+                return false;
+            this->own_listen_fd_ = true;
+            event.events = EPOLLIN;
+        }
+        else {
+            this->listen_fd_ = shared_listen_fd;
+            this->own_listen_fd_ = false;
+            event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        }
+
+        if (::epoll_ctl(this->epoll_fd_, EPOLL_CTL_ADD, this->listen_fd_, &event) != 0) {
+            std::cerr << "Error: epoll_ctl(listen_fd) failed, errno = " << errno << std::endl;
+            return false;
+        }
+
+        if (this->inbox_ != nullptr) {
+            event.events = EPOLLIN;
+            event.data.ptr = this->inbox_;
+            if (::epoll_ctl(this->epoll_fd_, EPOLL_CTL_ADD, this->inbox_->event_fd(), &event) != 0) {
+                std::cerr << "Error: epoll_ctl(event_fd) failed, errno = " << errno << std::endl;
+                return false;
+            }
+        }
+
+        int handler_fd = this->handler_.event_fd();
+        if (handler_fd >= 0) {
+            event.events = EPOLLIN;
+            event.data.ptr = &this->handler_;
+            if (::epoll_ctl(this->epoll_fd_, EPOLL_CTL_ADD, handler_fd, &event) != 0) {
+                std::cerr << "Error: epoll_ctl(handler_fd) failed, errno = " << errno << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void run(const std::atomic<bool> & stop) {
+        struct epoll_event events[kMaxEvents];
+        int timeout = kWaitTimeout;
+        bool batch_full = false;
+        offload_inbox::local() = this->inbox_;
+        while (likely(!stop.load(std::memory_order_relaxed))) {
+            int nfds = ::epoll_wait(this->epoll_fd_, events, kMaxEvents, timeout);
+            if (unlikely(nfds < 0)) {
+                if (errno == EINTR)
+                    continue;
+                std::cerr << "Error: epoll_wait() failed, errno = " << errno << std::endl;
+                break;
+            }
+            if (unlikely(this->admission_.enabled())) {
+                uint64_t now = admission_control::now_us();
+                this->ready_us_ = batch_full ? this->batch_us_ : now;
+                this->batch_us_ = now;
+                batch_full = (nfds == kMaxEvents);
+            }
+            for (int i = 0; i < nfds; ++i) {
+                void * ptr = events[i].data.ptr;
+                if (unlikely(ptr == nullptr)) {
+                    this->handle_accept();
+                    continue;
+                }
+                if (unlikely(ptr == this->inbox_)) {
+                    // Drained below.
+                    this->inbox_->clear_event();
+                    continue;
+                }
+                if (unlikely(ptr == &this->handler_)) {
+                    this->handler_.on_event();
+                    continue;
+                }
+                connection * conn = static_cast<connection *>(ptr);
+                uint32_t ev = events[i].events;
+                if (unlikely((ev & (EPOLLERR | EPOLLHUP)) != 0)) {
+                    this->close_connection(conn);
+                    continue;
+                }
+                if (likely((ev & EPOLLIN) != 0)) {
+                    if (!this->handle_read(conn, ev))
+                        continue;
+                }
+                if ((ev & EPOLLOUT) != 0) {
+                    if (!this->handle_write(conn))
+                        continue;
+                }
+                this->update_timer(conn);
+            }
+            if (this->mailbox_ != nullptr)
+                this->drain_mailbox();
+            if (this->inbox_ != nullptr)
+                this->inbox_->drain();
+            int tick = this->handler_.on_tick([this](connection & conn) {
+                if (this->handle_write(&conn))
+                    this->update_timer(&conn);
+            });
+            timeout = (tick >= 0 && tick < kWaitTimeout) ? tick : kWaitTimeout;
+            this->timers_.template expire<connection>([this](connection * conn) {
+                this->close_connection(conn);
+            });
+        }
+        // The buffers must be given back on this thread.
+        this->close_all();
+    }
+
+    void close_all() {
+        while (this->head_ != nullptr) {
+            this->close_connection(this->head_);
+        }
+    }
+
+private:
+    void drain_mailbox() {
+        control_message msg;
+        while (this->mailbox_->pop(msg)) {
+            this->handler_.on_control(msg);
+        }
+    }
+
+    void link(connection * conn) {
+        conn->prev = nullptr;
+        conn->next = this->head_;
+        if (this->head_ != nullptr)
+            this->head_->prev = conn;
+        this->head_ = conn;
+        this->conn_count_++;
+    }
+
+    void unlink(connection * conn) {
+        if (conn->prev != nullptr)
+            conn->prev->next = conn->next;
+        else
+            this->head_ = conn->next;
+        if (conn->next != nullptr)
+            conn->next->prev = conn->prev;
+        conn->prev = conn->next = nullptr;
+        this->conn_count_--;
+    }
+
+    void handle_accept() {
+        for (;;) {
+            int fd = ::accept4(this->listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR)
+                    continue;
+                // EAGAIN: no more pending connections (or another reactor took it).
+                break;
+            }
+            if (this->config_.nodelay)
+                set_nodelay(fd, true);
+
+            connection * conn = new connection(fd);
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.ptr = conn;
+            if (::epoll_ctl(this->epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+                ::close(fd);
+                delete conn;
+                continue;
+            }
+            this->link(conn);
+            stats_shard::local().accepted.inc();
+            this->handler_.on_accept(*conn);
+            this->update_timer(conn);
+        }
+    }
+
+    void update_timer(connection * conn) {
+        this->timers_.update(conn, (conn->pending_write() != 0 || conn->pending_file() != 0));
+    }
+
+    //
+    // Read with the epoll @events of the connection, and write the responses.
+    // Return false if the connection has been closed.
+    //
+    bool handle_read(connection * conn, uint32_t events) {
+        bool resume_read;
+        do {
+            if (!this->read_input(conn, events))
+                return false;
+            if (!this->flush(conn, resume_read))
+                return false;
+            // The output is flushed after the back pressure, read again,
+            // there is no epoll event for the data already received.
+            events = 0;
+        } while (unlikely(resume_read));
+        conn->release_idle_buffers();
+        return true;
+    }
+
+    // Return false if the connection has been closed.
+    bool handle_write(connection * conn) {
+        bool resume_read;
+        if (!this->flush(conn, resume_read))
+            return false;
+        if (unlikely(resume_read))
+            return this->handle_read(conn, 0);
+        return true;
+    }
+
+    //
+    // Read with the epoll @events of the connection, 0 when it's resumed,
+    // and hand the input to the handler.
+    // Return false if the connection has been closed.
+    //
+    bool read_input(connection * conn, uint32_t events) {
+        bool peer_closed = false;
+        for (;;) {
+            if (unlikely(conn->pending_write() >= kMaxPendingWrite ||
+                         (conn->pending_file() != 0 && conn->size() >= kMaxPendingWrite))) {
+                // Apply back pressure, resume reading when the output is flushed.
+                conn->flags |= connection::kReadPaused;
+                break;
+            }
+            char * buf = conn->prepare_read();
+            if (unlikely(buf == nullptr)) {
+                // Out of buffers.
+                this->close_connection(conn);
+                return false;
+            }
+            std::size_t space = conn->read_space();
+            ssize_t n = ::recv(conn->fd, buf, space, 0);
+            if (likely(n > 0)) {
+                conn->commit_read((std::size_t)n);
+                stats_shard::local().recv_bytes.add((uint64_t)n);
+                if (likely((std::size_t)n < space)) {
+                    // The socket receive buffer is drained, the FIN may have come
+                    // with the last data, edge-triggered it won't be reported again.
+                    if (unlikely((events & EPOLLRDHUP) != 0))
+                        peer_closed = true;
+                    break;
+                }
+            }
+            else if (n == 0) {
+                peer_closed = true;
+                break;
+            }
+            else {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                this->close_connection(conn);
+                return false;
+            }
+        }
+
+        if (likely(conn->size() > 0)) {
+            if (unlikely(this->admission_.enabled()) &&
+                !this->admission_.admit(this->ready_us_, admission_control::now_us())) {
+                conn->flags |= connection::kOverloaded;
+                if (!this->handler_.on_read(*conn))
+                    conn->set_close_after_write();
+                conn->flags &= ~connection::kOverloaded;
+            }
+            else if (!this->handler_.on_read(*conn)) {
+                conn->set_close_after_write();
+            }
+        }
+        if (unlikely(peer_closed)) {
+            conn->set_close_after_write();
+        }
+        return true;
+    }
+
+    //
+    // Send the pending output. Return false if the connection has been closed,
+    // @resume_read is true if the paused read is to be resumed by the caller:
+    // it isn't done here, or the read and the write could call each other
+    // without bound.
+    //
+    bool flush(connection * conn, bool & resume_read) {
+        resume_read = false;
+        for (;;) {
+            // Hold the header of a file response until the body is sent.
+            int send_flags = (conn->pending_file() == 0) ? MSG_NOSIGNAL : (MSG_NOSIGNAL | MSG_MORE);
+            latency_scope timer((this->config_.latency_stats != 0 && conn->pending_write() > 0) ?
+                                &latency_shard::local().write : nullptr);
+            while (conn->pending_write() > 0) {
+                // All the queued responses are gathered into one sendmsg().
+                struct iovec iov[kMaxIovecs];
+                struct msghdr msg;
+                ::memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = iov;
+                msg.msg_iovlen = (std::size_t)conn->gather_write(iov, kMaxIovecs);
+                ssize_t n = ::sendmsg(conn->fd, &msg, send_flags);
+                if (likely(n > 0)) {
+                    conn->commit_write((std::size_t)n);
+                    stats_shard::local().send_bytes.add((uint64_t)n);
+                }
+                else if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    // Wait for EPOLLOUT.
+                    return true;
+                }
+                else {
+                    this->close_connection(conn);
+                    return false;
+                }
+            }
+
+            if (likely(conn->pending_file() == 0))
+                break;
+
+            // The file body follows the response header, sent from the page cache.
+            ssize_t n = conn->file->transfer(conn->fd, conn->file_offset, (std::size_t)conn->pending_file());
+            if (likely(n > 0)) {
+                conn->commit_file((uint64_t)n);
+                stats_shard::local().send_bytes.add((uint64_t)n);
+                if (conn->pending_file() == 0 && conn->size() > 0 && !conn->is_close_after_write()) {
+                    // The handler stopped at the file response, serve the pipelined requests.
+                    if (!this->handler_.on_read(*conn))
+                        conn->set_close_after_write();
+                }
+            }
+            else if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return true;
+            }
+            else {
+                // An error, or the file has been truncated.
+                this->close_connection(conn);
+                return false;
+            }
+        }
+
+        if (unlikely(conn->is_close_after_write())) {
+            this->close_connection(conn);
+            return false;
+        }
+        if (unlikely((conn->flags & connection::kReadPaused) != 0)) {
+            conn->flags &= ~connection::kReadPaused;
+            resume_read = true;
+        }
+        return true;
+    }
+
+    void close_connection(connection * conn) {
+        this->timers_.cancel(conn);
+        this->handler_.on_close(*conn);
+        ::epoll_ctl(this->epoll_fd_, EPOLL_CTL_DEL, conn->fd, nullptr);
+        ::close(conn->fd);
+        this->unlink(conn);
+        stats_shard::local().closed.inc();
+        delete conn;
+    }
+};
+
+} // namespace jimi
+
+#endif // __linux__
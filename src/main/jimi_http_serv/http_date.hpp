@@ -0,0 +1,78 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <cstddef>
+
+#include "jimi/basic/stddef.h"
+
+namespace jimi {
+
+//
+// The per-thread cached "Date: <IMF-fixdate>\r\n" header field, it's only
+// formatted again when the second changes.
+//
+// The field is copied into the responses, not referred to: it changes while
+// a slow connection may still have an older one to send.
+//
+class http_date {
+public:
+    typedef std::size_t size_type;
+
+    // "Sun, 06 Nov 1994 08:49:37 GMT"
+    static const size_type kDateSize = 29;
+
+private:
+    time_t now_;
+    size_type field_size_;
+    char field_[64];
+
+public:
+    http_date() : now_(0), field_size_(0) {
+        this->field_[0] = '\0';
+        this->update();
+    }
+    ~http_date() {}
+
+    static http_date & local() {
+        static thread_local http_date date;
+        return date;
+    }
+
+    time_t now() const { return this->now_; }
+
+    // The whole header field, with the CRLF.
+    const char * field() const { return this->field_; }
+    size_type field_size() const { return this->field_size_; }
+
+    // The date only.
+    const char * date() const { return (this->field_ + 6); }
+
+    // Call it once per batch of requests.
+    time_t update() {
+        time_t now = ::time(nullptr);
+        if (unlikely(now != this->now_)) {
+            this->now_ = now;
+            ::memcpy(this->field_, "Date: ", 6);
+            int len = format(now, this->field_ + 6, sizeof(this->field_) - 6);
+            ::memcpy(this->field_ + 6 + len, "\r\n", 3);
+            this->field_size_ = 6 + len + 2;
+        }
+        return now;
+    }
+
+    static int format(time_t time, char * buf, size_type size) {
+        struct tm tm;
+#if defined(_MSC_VER)
+        ::gmtime_s(&tm, &time);
+#else
+        ::gmtime_r(&time, &tm);
+#endif
+        return (int)::strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    }
+};
+
+} // namespace jimi
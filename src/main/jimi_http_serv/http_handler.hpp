@@ -0,0 +1,398 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <cstddef>
+#include <string>
+
+#include "jimi/basic/stddef.h"
+#include "jimi/StringRef.h"
+#include "jimi/http/Common.h"
+#include "jimi/http/FastParser.h"
+#include "jimi/http/ParserPool.h"
+
+#include "server_config.hpp"
+#include "connection.hpp"
+#include "control_mailbox.hpp"
+#include "http_date.hpp"
+#include "response_header.hpp"
+#include "server_stats.hpp"
+#include "timer_wheel.hpp"
+#include "rate_limiter.hpp"
+#include "access_log.hpp"
+
+namespace jimi {
+
+//
+// The http handler: parses every complete request in the read buffer with
+// BasicFastParser (borrowed from the per-thread parser pool only while the
+// request is parsed) and answers it with a pre-rendered response.
+//
+// A response is queued as the pre-rendered status line and fields, the cached
+// Date field and the body, and the responses to a batch of pipelined requests
+// are sent with one gathered write. The header and the body are queued with
+// write_ref(), but a piece under write_queue::kMinRefSize (4 KB) is copied to
+// the write buffer, so only a body of --packet-size 4096 or more is sent from
+// its own memory, the default 64-byte one is copied.
+//
+class http_handler {
+public:
+    typedef http::BasicFastParser<StringRef>    parser_type;
+    typedef http::BasicParserPool<parser_type>  parser_pool;
+
+    // The limit of the request header block.
+    static const std::size_t kMaxHeaderSize = 64 * 1024;
+    // The limit of the request body.
+    static const std::size_t kMaxContentLength = 16 * 1024 * 1024;
+
+private:
+    std::string body_;
+    std::string header_;
+    std::string header_close_;
+    bool stats_endpoint_;
+    bool latency_stats_;
+    bool rate_limit_;
+    bool access_log_;
+
+public:
+    http_handler(const server_config & config)
+        : stats_endpoint_(config.stats_endpoint != 0), latency_stats_(config.latency_stats != 0),
+          rate_limit_(config.rate_limit != 0), access_log_(!config.access_log.empty()) {
+        std::size_t body_size = (config.packet_size > 0) ? config.packet_size : 1;
+        this->body_.resize(body_size);
+        for (std::size_t i = 0; i < body_size; ++i) {
+            this->body_[i] = (char)('a' + (i % 26));
+        }
+        this->header_ = render_header(body_size, true);
+        this->header_close_ = render_header(body_size, false);
+    }
+
+    ~http_handler() {}
+
+    void on_accept(connection & conn) {}
+    void on_close(connection & conn) {}
+    void on_control(const control_message & msg) {}
+
+    template <typename Func>
+    int on_tick(Func && flush) { return -1; }
+
+    int event_fd() const { return -1; }
+    void on_event() {}
+
+    // Return false to close the connection after the responses are flushed.
+    bool on_read(connection & conn) {
+        parser_pool & pool = parser_pool::local();
+        http_date & date = http_date::local();
+        date.update();
+        latency_shard * latency = nullptr;
+        latency_shard::time_point_t start, parsed;
+        if (unlikely(this->latency_stats_)) {
+            latency = &latency_shard::local();
+            start = latency_shard::now();
+        }
+        while (likely(conn.size() > 0)) {
+            framed_request req;
+            if (unlikely(!frame_request(conn, req))) {
+                if (req.error == 0)
+                    break;
+                write_error(conn, req.error);
+                return false;
+            }
+            parser_type * parser = req.parser;
+
+            if (unlikely(latency != nullptr)) {
+                parsed = latency_shard::now();
+                latency->parse.record(start, parsed);
+            }
+
+            bool keep_alive = is_keep_alive(*parser);
+            bool is_head = (parser->getMethodStr().size() == 4 &&
+                            ::memcmp(parser->getMethodStr().data(), "HEAD", 4) == 0);
+            bool is_stats = (this->stats_endpoint_ && is_stats_request(*parser));
+            bool is_shed = (unlikely(conn.is_overloaded()) && !is_stats);
+            bool is_limited = (this->rate_limit_ && !is_stats && !is_shed && !admit(conn, *parser));
+
+            uint32_t status = 200;
+            std::size_t body_size = 0;
+            if (likely(!is_stats && !is_limited && !is_shed)) {
+                const std::string & header = likely(keep_alive) ? this->header_ : this->header_close_;
+                conn.write_ref(header.data(), header.size());
+                conn.write(date.field(), date.field_size());
+                conn.write("\r\n", 2);
+                if (likely(!is_head)) {
+                    conn.write_ref(this->body_.data(), this->body_.size());
+                    body_size = this->body_.size();
+                }
+            }
+            else if (is_shed) {
+                write_overloaded(conn);
+                keep_alive = false;
+                status = 503;
+            }
+            else if (is_limited) {
+                write_limited(conn, keep_alive);
+                status = 429;
+            }
+            else {
+                body_size = write_stats(conn, keep_alive, is_head);
+            }
+            if (unlikely(this->access_log_))
+                log_request(conn, *parser, status, body_size);
+            pool.release(parser);
+            stats_shard::local().queries.inc();
+            if (unlikely(latency != nullptr)) {
+                // The next pipelined request starts here.
+                start = latency_shard::now();
+                latency->handler.record(parsed, start);
+            }
+
+            conn.consume(req.header_size + req.content_length);
+            if (unlikely(!keep_alive))
+                return false;
+        }
+        return true;
+    }
+
+private:
+    static std::string render_header(std::size_t content_length, bool keep_alive) {
+        response_header & header = response_header::local();
+        header.begin(200);
+        header.add_field("Content-Type", "text/plain");
+        header.add_content_length(content_length);
+        // The Date field and the empty line follow.
+        header.add_connection(keep_alive);
+        return std::string(header.data(), header.size());
+    }
+
+public:
+    // The request framing helpers, shared with the other http handlers.
+
+    // A request framed by frame_request().
+    struct framed_request {
+        parser_type * parser;           // Borrowed from the parser pool.
+        std::size_t   header_size;
+        std::size_t   content_length;
+        uint32_t      error;            // 0 to wait for more input, or 400, 431, 501.
+    };
+
+    //
+    // Frame the request at the front of the read buffer of @conn: its header
+    // block is parsed and its body is in the buffer. Return true if it is,
+    // req.parser must then be released to the parser pool, or false: if
+    // req.error is 0 the rest of it hasn't arrived yet, else answer with the
+    // status req.error and close.
+    //
+    static bool frame_request(connection & conn, framed_request & req) {
+        if (unlikely(!detect_request(conn, req)))
+            return false;
+        if (unlikely(!parse_request(conn.data(), req)))
+            return false;
+        if (unlikely(req.header_size + req.content_length > conn.size())) {
+            // Wait for the rest of the body, the header will be parsed again.
+            parser_pool::local().release(req.parser);
+            req.parser = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    //
+    // The first step of frame_request(), for a handler which moves the header
+    // block out of the read buffer before it's parsed: find the end of the
+    // header block of @conn, in req.header_size.
+    //
+    static bool detect_request(connection & conn, framed_request & req) {
+        req.parser = nullptr;
+        req.header_size = 0;
+        req.content_length = 0;
+        req.error = 0;
+        if (unlikely(conn.size() == 0))
+            return false;
+        std::size_t header_size = conn.detector.detect(conn.data(), conn.size());
+        if (unlikely(header_size == 0)) {
+            if (unlikely(conn.size() > kMaxHeaderSize))
+                req.error = 431;
+            // Else wait for the rest of the header block.
+            return false;
+        }
+        if (unlikely(header_size > kMaxHeaderSize)) {
+            // It may have arrived in one read, the parser can't address it.
+            req.error = 431;
+            return false;
+        }
+        req.header_size = header_size;
+        return true;
+    }
+
+    //
+    // The second step of frame_request(): parse the header block of
+    // req.header_size bytes at @data with a parser from the pool, and check
+    // the framing of its body, in req.content_length.
+    //
+    static bool parse_request(const char * data, framed_request & req) {
+        parser_pool & pool = parser_pool::local();
+        parser_type * parser = pool.acquire();
+        int ec = parser->parseRequest(data, req.header_size);
+        StringRef value;
+        if (unlikely(ec != http::error_code::Succeed))
+            req.error = 400;
+        else if (unlikely(parser->findField("Transfer-Encoding", value)))
+            req.error = 501;
+        else if (unlikely(parser->findField("Content-Length", value) &&
+                          (!parse_content_length(value, req.content_length) ||
+                           req.content_length > kMaxContentLength)))
+            req.error = 400;
+        if (unlikely(req.error != 0)) {
+            pool.release(parser);
+            return false;
+        }
+        req.parser = parser;
+        return true;
+    }
+
+    static void write_error(connection & conn, uint32_t status) {
+        response_header & response = response_header::local();
+        response.begin(status);
+        response.add_content_length(0);
+        response.add_connection(false);
+        response.end();
+        conn.write(response.data(), response.size());
+    }
+
+    static bool parse_content_length(const StringRef & value, std::size_t & length) {
+        if (value.size() == 0 || value.size() > 18)
+            return false;
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < value.size(); ++i) {
+            char ch = value.data()[i];
+            if (ch < '0' || ch > '9')
+                return false;
+            n = n * 10 + (std::size_t)(ch - '0');
+        }
+        length = n;
+        return true;
+    }
+
+    // Whether the path of the request URI is "/__stats".
+    static bool is_stats_request(const parser_type & parser) {
+        StringRef uri = parser.getURI();
+        static const std::size_t kPathSize = sizeof("/__stats") - 1;
+        return (uri.size() >= kPathSize && ::memcmp(uri.data(), "/__stats", kPathSize) == 0 &&
+                (uri.size() == kPathSize || uri.data()[kPathSize] == '?'));
+    }
+
+    // Answer with the last snapshot of the stats aggregator, in JSON, return
+    // the size of the body sent.
+    static std::size_t write_stats(connection & conn, bool keep_alive, bool is_head) {
+        std::string body = server_stats::instance().snapshot().to_json();
+        response_header & header = response_header::local();
+        header.begin(200);
+        header.add_field("Content-Type", "application/json");
+        header.add_field("Cache-Control", "no-store");
+        header.add_content_length(body.size());
+        header.add_connection(keep_alive);
+        header.add_date();
+        header.end();
+        conn.write(header.data(), header.size());
+        if (is_head)
+            return 0;
+        conn.write(body.data(), body.size());
+        return body.size();
+    }
+
+    //
+    // Take a token of the client of the request from the rate limiter, return
+    // false if it's over its rate. The client is the value of the configured
+    // key field, or the peer address of @conn.
+    //
+    static bool admit(connection & conn, const parser_type & parser) {
+        rate_limiter & limiter = rate_limiter::instance();
+        const std::string & key_field = limiter.key_field();
+        StringRef value;
+        uint64_t key;
+        if (!key_field.empty() && parser.findField(key_field.c_str(), key_field.size(), value)) {
+            key = rate_limiter::hash(value.data(), value.size());
+        }
+        else {
+            key = peer_key(conn.load_peer());
+        }
+        if (likely(limiter.acquire(key, timer_wheel::monotonic_ms())))
+            return true;
+        stats_shard::local().rate_limited.inc();
+        return false;
+    }
+
+    // The rate limiter key of the peer address @peer.
+    static uint64_t peer_key(const peer_address & peer) {
+        uint64_t hash = 0;
+        if (peer.family == AF_INET)
+            hash = rate_limiter::hash(peer.bytes, 4);
+        else if (peer.family == AF_INET6)
+            hash = rate_limiter::hash(peer.bytes, 16);
+        // All the clients of a unix socket share one bucket.
+        return ((hash != 0) ? hash : 1);
+    }
+
+    // Answer a request over the rate of its client, without a body.
+    static void write_limited(connection & conn, bool keep_alive) {
+        static const char kKeepAlive[] = "HTTP/1.1 429 Too Many Requests\r\n"
+                                         "Server: jimi_http_serv\r\n"
+                                         "Retry-After: 1\r\n"
+                                         "Content-Length: 0\r\n"
+                                         "Connection: keep-alive\r\n\r\n";
+        static const char kClose[] = "HTTP/1.1 429 Too Many Requests\r\n"
+                                     "Server: jimi_http_serv\r\n"
+                                     "Retry-After: 1\r\n"
+                                     "Content-Length: 0\r\n"
+                                     "Connection: close\r\n\r\n";
+        if (likely(keep_alive))
+            conn.write(kKeepAlive, sizeof(kKeepAlive) - 1);
+        else
+            conn.write(kClose, sizeof(kClose) - 1);
+    }
+
+    //
+    // Answer a request which the reactor sheds, see admission_control, and
+    // close: the rest of the input waited as long.
+    //
+    static void write_overloaded(connection & conn) {
+        static const char kResponse[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                        "Server: jimi_http_serv\r\n"
+                                        "Retry-After: 1\r\n"
+                                        "Content-Length: 0\r\n"
+                                        "Connection: close\r\n\r\n";
+        conn.write(kResponse, sizeof(kResponse) - 1);
+        stats_shard::local().shed.inc();
+    }
+
+    // Log the request @parser, answered with @status and a body of @body_size.
+    static void log_request(connection & conn, const parser_type & parser,
+                            uint32_t status, uint64_t body_size) {
+        access_log::instance().append(conn, parser.getMethodStr(), parser.getURI(),
+                                      is_http_1_0(parser) ? 0 : 1, status, body_size);
+    }
+
+    static bool is_http_1_0(const parser_type & parser) {
+        return (parser.getVersionStr().size() == 8 &&
+                ::memcmp(parser.getVersionStr().data(), "HTTP/1.0", 8) == 0);
+    }
+
+    static bool is_keep_alive(const parser_type & parser) {
+        StringRef value;
+        bool is_http_1_0 = http_handler::is_http_1_0(parser);
+        if (parser.findField("Connection", value)) {
+            if (value.size() == 5 && parser_type::equalsIgnoreCase(value.data(), "close", 5))
+                return false;
+            if (value.size() == 10 && parser_type::equalsIgnoreCase(value.data(), "keep-alive", 10))
+                return true;
+        }
+        return !is_http_1_0;
+    }
+};
+
+} // namespace jimi
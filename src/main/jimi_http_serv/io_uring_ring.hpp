@@ -0,0 +1,380 @@
+
+#pragma once
+
+//
+// A minimal io_uring wrapper on top of the raw system calls, so that the
+// server doesn't depend on liburing. It's only compiled when the kernel
+// headers are new enough to provide multishot accept / recv and the
+// provided buffer rings (Linux 6.0+).
+//
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT) && defined(IORING_FEAT_EXT_ARG)
+#define JIMI_HAS_IO_URING   1
+#endif
+#endif
+#endif
+
+#ifndef JIMI_HAS_IO_URING
+#define JIMI_HAS_IO_URING   0
+#endif
+
+#if JIMI_HAS_IO_URING
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <cstddef>
+
+#include "jimi/basic/stddef.h"
+
+namespace jimi {
+
+class io_uring_ring {
+public:
+    typedef struct io_uring_sqe sqe_type;
+    typedef struct io_uring_cqe cqe_type;
+
+private:
+    int         ring_fd_;
+    uint32_t    features_;
+    bool        disabled_;
+
+    // The submission queue.
+    uint32_t *  sq_head_;
+    uint32_t *  sq_tail_;
+    uint32_t    sq_mask_;
+    uint32_t    sq_entries_;
+    uint32_t    sq_local_tail_;
+    sqe_type *  sqes_;
+
+    // The completion queue.
+    uint32_t *  cq_head_;
+    uint32_t *  cq_tail_;
+    uint32_t    cq_mask_;
+    cqe_type *  cqes_;
+
+    void *      sq_ring_ptr_;
+    std::size_t sq_ring_size_;
+    void *      cq_ring_ptr_;
+    std::size_t cq_ring_size_;
+    std::size_t sqes_size_;
+
+    // The provided buffer ring, the ring tail is overlaid with bufs[0].resv.
+    // Don't use struct io_uring_buf_ring, its flexible array member gets an
+    // extra leading byte in C++.
+    struct io_uring_buf * buf_ring_;
+    uint16_t *  buf_tail_;
+    std::size_t buf_ring_size_;
+    char *      buf_base_;
+    std::size_t buf_size_;
+    uint32_t    buf_count_;
+    uint16_t    buf_mask_;
+    uint16_t    buf_group_;
+
+    // The number of io_uring_enter() calls, for the statistics.
+    uint64_t    enter_calls_;
+
+public:
+    io_uring_ring() : ring_fd_(-1), features_(0), disabled_(false),
+        sq_head_(nullptr), sq_tail_(nullptr), sq_mask_(0), sq_entries_(0), sq_local_tail_(0), sqes_(nullptr),
+        cq_head_(nullptr), cq_tail_(nullptr), cq_mask_(0), cqes_(nullptr),
+        sq_ring_ptr_(MAP_FAILED), sq_ring_size_(0), cq_ring_ptr_(MAP_FAILED), cq_ring_size_(0), sqes_size_(0),
+        buf_ring_(nullptr), buf_tail_(nullptr), buf_ring_size_(0), buf_base_(nullptr), buf_size_(0), buf_count_(0),
+        buf_mask_(0), buf_group_(0), enter_calls_(0) {}
+
+    ~io_uring_ring() {
+        this->close();
+    }
+
+    int fd() const { return this->ring_fd_; }
+    bool is_open() const { return (this->ring_fd_ >= 0); }
+    uint64_t enter_calls() const { return this->enter_calls_; }
+
+    // Return 0 if succeed, otherwise return the negative errno.
+    int open(uint32_t entries) {
+        struct io_uring_params params;
+        // Try the cheapest task running mode first, and fall back on old kernels.
+        // A single issuer ring is created disabled, then enabled by the thread
+        // which runs it, because only that thread may submit to it.
+        static const uint32_t kSetupFlags[] = {
+            IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+            IORING_SETUP_R_DISABLED,
+            IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+            0
+        };
+        int fd = -1;
+        for (std::size_t i = 0; i < sizeof(kSetupFlags) / sizeof(kSetupFlags[0]); ++i) {
+            ::memset(&params, 0, sizeof(params));
+            params.flags = kSetupFlags[i] | IORING_SETUP_CQSIZE;
+            params.cq_entries = entries * 4;
+            fd = (int)::syscall(__NR_io_uring_setup, entries, &params);
+            if (fd >= 0 || errno != EINVAL)
+                break;
+        }
+        if (fd < 0)
+            return -errno;
+
+        this->ring_fd_ = fd;
+        this->features_ = params.features;
+        this->disabled_ = ((params.flags & IORING_SETUP_R_DISABLED) != 0);
+        if ((params.features & IORING_FEAT_EXT_ARG) == 0) {
+            this->close();
+            return -ENOSYS;
+        }
+
+        this->sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        this->cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(cqe_type);
+        if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+            if (this->cq_ring_size_ > this->sq_ring_size_)
+                this->sq_ring_size_ = this->cq_ring_size_;
+            this->cq_ring_size_ = 0;
+        }
+
+        this->sq_ring_ptr_ = ::mmap(nullptr, this->sq_ring_size_, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (this->sq_ring_ptr_ == MAP_FAILED)
+            return this->fail(-errno);
+
+        char * cq_ptr;
+        if (this->cq_ring_size_ != 0) {
+            this->cq_ring_ptr_ = ::mmap(nullptr, this->cq_ring_size_, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (this->cq_ring_ptr_ == MAP_FAILED)
+                return this->fail(-errno);
+            cq_ptr = (char *)this->cq_ring_ptr_;
+        }
+        else {
+            cq_ptr = (char *)this->sq_ring_ptr_;
+        }
+
+        this->sqes_size_ = params.sq_entries * sizeof(sqe_type);
+        void * sqes = ::mmap(nullptr, this->sqes_size_, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return this->fail(-errno);
+        this->sqes_ = (sqe_type *)sqes;
+
+        char * sq_ptr = (char *)this->sq_ring_ptr_;
+        this->sq_head_ = (uint32_t *)(sq_ptr + params.sq_off.head);
+        this->sq_tail_ = (uint32_t *)(sq_ptr + params.sq_off.tail);
+        this->sq_mask_ = *(uint32_t *)(sq_ptr + params.sq_off.ring_mask);
+        this->sq_entries_ = *(uint32_t *)(sq_ptr + params.sq_off.ring_entries);
+        this->sq_local_tail_ = *this->sq_tail_;
+
+        // The sqe at index i is always published at the array slot i.
+        uint32_t * sq_array = (uint32_t *)(sq_ptr + params.sq_off.array);
+        for (uint32_t i = 0; i < this->sq_entries_; ++i) {
+            sq_array[i] = i;
+        }
+
+        this->cq_head_ = (uint32_t *)(cq_ptr + params.cq_off.head);
+        this->cq_tail_ = (uint32_t *)(cq_ptr + params.cq_off.tail);
+        this->cq_mask_ = *(uint32_t *)(cq_ptr + params.cq_off.ring_mask);
+        this->cqes_ = (cqe_type *)(cq_ptr + params.cq_off.cqes);
+        return 0;
+    }
+
+    // Enable a disabled ring, must be called by the thread which submits to it.
+    int enable() {
+        if (this->disabled_) {
+            int ret = (int)::syscall(__NR_io_uring_register, this->ring_fd_, IORING_REGISTER_ENABLE_RINGS, nullptr, 0);
+            if (ret != 0)
+                return -errno;
+            this->disabled_ = false;
+        }
+        return 0;
+    }
+
+    void close() {
+        // Closing the ring fd cancels the in-flight operations and
+        // unregisters the buffer ring, then the memory can be unmapped.
+        if (this->ring_fd_ >= 0) {
+            ::close(this->ring_fd_);
+            this->ring_fd_ = -1;
+        }
+        this->release_buffers();
+        if (this->sqes_ != nullptr) {
+            ::munmap(this->sqes_, this->sqes_size_);
+            this->sqes_ = nullptr;
+        }
+        if (this->cq_ring_ptr_ != MAP_FAILED) {
+            ::munmap(this->cq_ring_ptr_, this->cq_ring_size_);
+            this->cq_ring_ptr_ = MAP_FAILED;
+        }
+        if (this->sq_ring_ptr_ != MAP_FAILED) {
+            ::munmap(this->sq_ring_ptr_, this->sq_ring_size_);
+            this->sq_ring_ptr_ = MAP_FAILED;
+        }
+    }
+
+    //
+    // Register a provided buffer ring of @count buffers (a power of 2),
+    // every one is @size bytes, the kernel picks one for every completed recv.
+    //
+    int register_buffers(uint16_t group, uint32_t count, std::size_t size) {
+        assert(count > 0 && count <= 32768 && (count & (count - 1)) == 0);
+        this->buf_ring_size_ = count * sizeof(struct io_uring_buf);
+        void * ring = ::mmap(nullptr, this->buf_ring_size_, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED)
+            return -errno;
+        void * base = ::mmap(nullptr, count * size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            int err = errno;
+            ::munmap(ring, this->buf_ring_size_);
+            return -err;
+        }
+
+        // Touch the ring before it's registered, otherwise the kernel may pin
+        // the shared zero page, and never see the buffers we add to it.
+        ::memset(ring, 0, this->buf_ring_size_);
+
+        struct io_uring_buf_reg reg;
+        ::memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)ring;
+        reg.ring_entries = count;
+        reg.bgid = group;
+        int ret = (int)::syscall(__NR_io_uring_register, this->ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1);
+        if (ret != 0) {
+            int err = errno;
+            ::munmap(base, count * size);
+            ::munmap(ring, this->buf_ring_size_);
+            return -err;
+        }
+
+        this->buf_ring_ = (struct io_uring_buf *)ring;
+        this->buf_tail_ = &this->buf_ring_[0].resv;
+        this->buf_base_ = (char *)base;
+        this->buf_size_ = size;
+        this->buf_count_ = count;
+        this->buf_mask_ = (uint16_t)(count - 1);
+        this->buf_group_ = group;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            this->add_buffer((uint16_t)i, (uint16_t)i);
+        }
+        __atomic_store_n(this->buf_tail_, (uint16_t)count, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    uint16_t buffer_group() const { return this->buf_group_; }
+
+    const char * buffer(uint16_t bid) const {
+        return (this->buf_base_ + (std::size_t)bid * this->buf_size_);
+    }
+
+    // Give the buffer back to the kernel.
+    void recycle_buffer(uint16_t bid) {
+        uint16_t tail = *this->buf_tail_;
+        this->add_buffer(bid, tail);
+        __atomic_store_n(this->buf_tail_, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+    }
+
+    // Return a zeroed sqe, submit the queued sqes first if the queue is full.
+    sqe_type * get_sqe() {
+        uint32_t head = __atomic_load_n(this->sq_head_, __ATOMIC_ACQUIRE);
+        if (unlikely(this->sq_local_tail_ - head >= this->sq_entries_)) {
+            this->submit();
+            head = __atomic_load_n(this->sq_head_, __ATOMIC_ACQUIRE);
+            if (unlikely(this->sq_local_tail_ - head >= this->sq_entries_))
+                return nullptr;
+        }
+        sqe_type * sqe = &this->sqes_[this->sq_local_tail_ & this->sq_mask_];
+        ::memset(sqe, 0, sizeof(sqe_type));
+        this->sq_local_tail_++;
+        return sqe;
+    }
+
+    // Submit the queued sqes without waiting.
+    int submit() {
+        return this->enter(0, nullptr);
+    }
+
+    //
+    // Submit the queued sqes and wait for at least one completion or the timeout,
+    // it's the only system call of an event loop iteration.
+    //
+    int submit_and_wait(uint32_t timeout_ms) {
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+        return this->enter(1, &ts);
+    }
+
+    // Call @func for every ready cqe, return the number of cqes.
+    template <typename Func>
+    uint32_t for_each_cqe(Func && func) {
+        uint32_t head = *this->cq_head_;
+        uint32_t tail = __atomic_load_n(this->cq_tail_, __ATOMIC_ACQUIRE);
+        uint32_t count = tail - head;
+        while (head != tail) {
+            const cqe_type * cqe = &this->cqes_[head & this->cq_mask_];
+            func(cqe);
+            head++;
+        }
+        __atomic_store_n(this->cq_head_, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+private:
+    void release_buffers() {
+        if (this->buf_ring_ != nullptr) {
+            ::munmap(this->buf_base_, this->buf_count_ * this->buf_size_);
+            ::munmap(this->buf_ring_, this->buf_ring_size_);
+            this->buf_ring_ = nullptr;
+            this->buf_tail_ = nullptr;
+            this->buf_base_ = nullptr;
+        }
+    }
+
+    int fail(int err) {
+        this->close();
+        return err;
+    }
+
+    // Fill the ring slot @index, the caller publishes it by advancing the tail.
+    void add_buffer(uint16_t bid, uint16_t index) {
+        struct io_uring_buf * buf = &this->buf_ring_[index & this->buf_mask_];
+        buf->addr = (uint64_t)(uintptr_t)this->buffer(bid);
+        buf->len = (uint32_t)this->buf_size_;
+        buf->bid = bid;
+    }
+
+    int enter(uint32_t min_complete, struct __kernel_timespec * ts) {
+        uint32_t head = __atomic_load_n(this->sq_head_, __ATOMIC_ACQUIRE);
+        uint32_t to_submit = this->sq_local_tail_ - head;
+        if (to_submit == 0 && min_complete == 0)
+            return 0;
+        __atomic_store_n(this->sq_tail_, this->sq_local_tail_, __ATOMIC_RELEASE);
+
+        uint32_t flags = 0;
+        struct io_uring_getevents_arg arg;
+        void * argp = nullptr;
+        std::size_t argsz = 0;
+        if (min_complete > 0) {
+            ::memset(&arg, 0, sizeof(arg));
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = (uint64_t)(uintptr_t)ts;
+            argp = &arg;
+            argsz = sizeof(arg);
+            flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        }
+        this->enter_calls_++;
+        int ret = (int)::syscall(__NR_io_uring_enter, this->ring_fd_, to_submit, min_complete,
+                                 flags, argp, argsz);
+        return (ret >= 0) ? ret : -errno;
+    }
+};
+
+} // namespace jimi
+
+#endif // JIMI_HAS_IO_URING
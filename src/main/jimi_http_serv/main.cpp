@@ -1,8 +1,26 @@
 
 #include "boost_asio_msvc.h"
 
+#if __SSE4_2__
+// Support SSE 4.2: _mm_crc32_u32(), _mm_crc32_u64(), for the response cache.
+#define SUPPORT_SSE42_CRC32C    1
+#endif
+
+// String compare mode of the jstd containers, the keys of the response cache
+// are StringRef, which aren't null terminated.
+#define STRING_COMPARE_STDC     0
+#define STRING_COMPARE_U64      1
+#define STRING_COMPARE_SSE42    2
+
+#if __SSE4_2__
+#define STRING_COMPARE_MODE     STRING_COMPARE_SSE42
+#else
+#define STRING_COMPARE_MODE     STRING_COMPARE_U64
+#endif
+
 #include <iostream>
 #include <string>
+#include <vector>
 #include <atomic>
 #include <thread>
 #include <chrono>
@@ -11,41 +29,66 @@
 
 #include "utils.hpp"
 #include "padding_atomic.hpp"
+#include "server_config.hpp"
+
+#if !defined(__linux__)
+#error "jimi_http_serv runs on the epoll reactors, it only supports Linux."
+#endif
+
+#include "http_handler.hpp"
+#include "echo_handler.hpp"
+#include "static_file_handler.hpp"
+#include "coro_handler.hpp"
+#include "coro_demo_app.hpp"
+#include "proxy_handler.hpp"
+#include "server.hpp"
+#include "cpu_affinity.hpp"
 
 #define DEFAULT_PACKET_SIZE 32
 #define MAX_PACKET_SIZE     (128 * 1024)
 
-enum http_server_mode_t {
-    http_server_mode,
-    echo_server_mode,
-};
+using jimi::http_server_mode;
+using jimi::echo_server_mode;
+using jimi::static_server_mode;
+using jimi::coro_server_mode;
+using jimi::proxy_server_mode;
 
 std::string g_server_ip;
 std::string g_server_port;
 
-uint32_t g_mode         = http_server_mode_t::http_server_mode;
+uint32_t g_mode         = http_server_mode;
 uint32_t g_nodelay      = 0;
 uint32_t g_need_echo    = 1;
+uint32_t g_pipeline     = 1;
 uint32_t g_packet_size  = 64;
+uint32_t g_io_engine    = jimi::io_engine_epoll;
+
+uint32_t g_idle_timeout     = 60;
+uint32_t g_header_timeout   = 10;
+uint32_t g_body_timeout     = 30;
+
+uint32_t g_stats_endpoint   = 0;
+uint32_t g_stats_interval   = 1000;
+uint32_t g_latency_stats    = 0;
+uint32_t g_numa             = 0;
+uint32_t g_offload_threads  = 0;
+uint32_t g_upstream_timeout = 30;
+uint32_t g_upstream_conns   = 64;
+uint32_t g_cache_size       = 0;
+uint32_t g_rate_limit       = 0;
+uint32_t g_rate_burst       = 0;
+uint32_t g_shed_target      = 0;
+uint32_t g_shed_interval    = 100;
+
+std::string g_cpu_affinity;
+std::string g_upstreams;
+std::string g_rate_key;
+std::string g_access_log;
 
 std::string g_mode_str      = "echo";
 std::string g_nodelay_str   = "false";
-
-namespace jimi {
-
-extern padding_atomic<uint64_t> g_query_count;
-extern padding_atomic<uint32_t> g_client_count;
-
-extern padding_atomic<uint64_t> g_recv_bytes;
-extern padding_atomic<uint64_t> g_send_bytes;
-
-} // namespace jimi
-
-jimi::padding_atomic<uint64_t> jimi::g_query_count(0);
-jimi::padding_atomic<uint32_t> jimi::g_client_count(0);
-
-jimi::padding_atomic<uint64_t> jimi::g_recv_bytes(0);
-jimi::padding_atomic<uint64_t> jimi::g_send_bytes(0);
+std::string g_io_str        = "epoll";
+std::string g_doc_root      = ".";
 
 struct Foo
 {
@@ -163,18 +206,115 @@ void run_padding_atomic_test()
     printf("\n");
 }
 
-void run_http_server(const std::string & host, const std::string & port,
-                     uint32_t packet_size, uint32_t thread_num,
-                     bool confirm = false)
+void init_server_config(jimi::server_config & config,
+                        const std::string & host, const std::string & port,
+                        uint32_t mode, uint32_t packet_size, uint32_t thread_num)
+{
+    config.host = host;
+    config.port = port;
+    config.mode = mode;
+    config.thread_num = thread_num;
+    config.packet_size = packet_size;
+    config.pipeline = g_pipeline;
+    config.nodelay = g_nodelay;
+    config.need_echo = g_need_echo;
+    config.io_engine = g_io_engine;
+    config.doc_root = g_doc_root;
+    config.idle_timeout = g_idle_timeout;
+    config.header_timeout = g_header_timeout;
+    config.body_timeout = g_body_timeout;
+    config.stats_endpoint = g_stats_endpoint;
+    config.stats_interval = g_stats_interval;
+    config.latency_stats = g_latency_stats;
+    config.cpu_affinity = g_cpu_affinity;
+    config.numa = g_numa;
+    config.offload_threads = g_offload_threads;
+    config.upstreams = g_upstreams;
+    config.upstream_timeout = g_upstream_timeout;
+    config.upstream_conns = g_upstream_conns;
+    config.cache_size = g_cache_size;
+    config.rate_limit = g_rate_limit;
+    config.rate_burst = g_rate_burst;
+    config.rate_key = g_rate_key;
+    config.access_log = g_access_log;
+    config.shed_target = g_shed_target;
+    config.shed_interval = g_shed_interval;
+}
+
+//
+// Every reactor thread listens on its own SO_REUSEPORT socket.
+//
+int run_http_server(const std::string & host, const std::string & port,
+                    uint32_t packet_size, uint32_t thread_num,
+                    bool confirm = false)
+{
+    jimi::server_config config;
+    init_server_config(config, host, port, http_server_mode, packet_size, thread_num);
+    config.reuse_port = true;
+
+    return jimi::run_server<jimi::http_handler>(config);
+}
+
+//
+// The echo server runs on the same reactors as the http server.
+//
+int run_echo_server(const std::string & host, const std::string & port,
+                    uint32_t packet_size, uint32_t thread_num,
+                    bool confirm = false)
+{
+    jimi::server_config config;
+    init_server_config(config, host, port, echo_server_mode, packet_size, thread_num);
+    config.reuse_port = true;
+
+    return jimi::run_server<jimi::echo_handler>(config);
+}
+
+//
+// The static file server serves the files under --root with sendfile().
+//
+int run_static_server(const std::string & host, const std::string & port,
+                      uint32_t packet_size, uint32_t thread_num,
+                      bool confirm = false)
 {
-    //
+    jimi::server_config config;
+    init_server_config(config, host, port, static_server_mode, packet_size, thread_num);
+    config.reuse_port = true;
+
+    return jimi::run_server<jimi::static_file_handler>(config);
 }
 
-void run_http_server_ex(const std::string & host, const std::string & port,
-                        uint32_t packet_size, uint32_t thread_num,
-                        bool confirm = false)
+//
+// The coroutine handler sample, it needs a C++20 build (JIMI_HTTP_COROUTINES).
+//
+int run_coro_server(const std::string & host, const std::string & port,
+                    uint32_t packet_size, uint32_t thread_num,
+                    bool confirm = false)
 {
-    //
+#if JIMI_HAS_COROUTINES
+    jimi::server_config config;
+    init_server_config(config, host, port, coro_server_mode, packet_size, thread_num);
+    config.reuse_port = true;
+
+    return jimi::run_server<jimi::coro_handler<jimi::coro_demo_app>>(config);
+#else
+    std::cerr << "Error: the coro mode needs the coroutines of C++20, "
+                 "configure with -DJIMI_HTTP_COROUTINES=ON." << std::endl;
+    return -1;
+#endif
+}
+
+//
+// The reverse proxy forwards the requests to the --upstream backends.
+//
+int run_proxy_server(const std::string & host, const std::string & port,
+                     uint32_t packet_size, uint32_t thread_num,
+                     bool confirm = false)
+{
+    jimi::server_config config;
+    init_server_config(config, host, port, proxy_server_mode, packet_size, thread_num);
+    config.reuse_port = true;
+
+    return jimi::run_server<jimi::proxy_handler>(config);
 }
 
 void make_spaces(std::string & spaces, std::size_t size)
@@ -194,7 +334,7 @@ void print_usage(const std::string & app_name, const boost::program_options::opt
 
     std::cerr << "Usage: " << std::endl << std::endl
               << "  " << app_name.c_str()      << " --host=<host> --port=<port> --mode=<mode> --test=<test>" << std::endl
-              << "  " << leader_spaces.c_str() << " [--pipeline=1] [--packet_size=64] [--thread-num=0]" << std::endl
+              << "  " << leader_spaces.c_str() << " [--pipeline=1] [--packet_size=64] [--thread-num=0] [--io=epoll]" << std::endl
               << std::endl
               << "For example: " << std::endl << std::endl
               << "  " << app_name.c_str()      << " --host=127.0.0.1 --port=9000 --mode=echo --test=pingpong" << std::endl
@@ -208,9 +348,15 @@ int main(int argc, char * argv[])
 {
     std::string app_name;
     std::string server_ip, server_port;
-    std::string mode_str, test_str, nodelay_str, cmd, cmd_value;
+    std::string mode_str, test_str, nodelay_str, io_str, doc_root, cmd, cmd_value;
     int32_t mode = 0;
     int32_t pipeline = 1, packet_size = 0, thread_num = 0, need_echo = 1;
+    int32_t idle_timeout = 60, header_timeout = 10, body_timeout = 30;
+    int32_t stats_endpoint = 0, stats_interval = 1000, latency_stats = 0;
+    int32_t numa = 0, shared_nothing = 0, offload_threads = 0;
+    int32_t upstream_timeout = 30, upstream_conns = 64, cache_size = 0;
+    int32_t rate_limit = 0, rate_burst = 0, shed_target = 0, shed_interval = 100;
+    std::string cpu_affinity, upstreams, rate_key, access_log;
 
     namespace options = boost::program_options;
     options::options_description desc("Command list");
@@ -218,12 +364,34 @@ int main(int argc, char * argv[])
         ("help,h",                                                                                  "usage info")
         ("host,s",          options::value<std::string>(&server_ip)->default_value("127.0.0.1"),    "server host or ip address")
         ("port,p",          options::value<std::string>(&server_port)->default_value("9000"),       "server port")
-        ("mode,m",          options::value<std::string>(&mode_str)->default_value("http"),          "server mode = [http]")
+        ("mode,m",          options::value<std::string>(&mode_str)->default_value("http"),          "server mode = [http, echo, static, coro or proxy]")
         ("packet-size,k",   options::value<int32_t>(&packet_size)->default_value(64),               "packet size")
         ("thread-num,n",    options::value<int32_t>(&thread_num)->default_value(0),                 "thread numbers")
         ("nodelay,y",       options::value<std::string>(&nodelay_str)->default_value("false"),      "TCP socket nodelay = [0 or 1, true or false]")
         ("echo,e",          options::value<int32_t>(&need_echo)->default_value(1),                  "whether the server need echo")
         ("pipeline,l",      options::value<int32_t>(&pipeline)->default_value(1),                   "pipeline numbers")
+        ("io,i",            options::value<std::string>(&io_str)->default_value("epoll"),           "I/O engine = [epoll or uring]")
+        ("root,r",          options::value<std::string>(&doc_root)->default_value("."),             "document root of the static mode")
+        ("idle-timeout",    options::value<int32_t>(&idle_timeout)->default_value(60),              "keep-alive idle timeout in seconds, 0 = none")
+        ("header-timeout",  options::value<int32_t>(&header_timeout)->default_value(10),            "request header timeout in seconds, 0 = none")
+        ("body-timeout",    options::value<int32_t>(&body_timeout)->default_value(30),              "request body timeout in seconds, 0 = none")
+        ("stats",           options::value<int32_t>(&stats_endpoint)->default_value(0),             "whether to serve the /__stats endpoint = [0 or 1]")
+        ("stats-interval",  options::value<int32_t>(&stats_interval)->default_value(1000),          "stats aggregation interval in milliseconds")
+        ("latency",         options::value<int32_t>(&latency_stats)->default_value(0),              "whether to record the latency histograms = [0 or 1]")
+        ("cpu-affinity",    options::value<std::string>(&cpu_affinity)->default_value(""),         "pin the reactor threads to the cpus = [all or a cpu list, e.g. 0-7,16-23]")
+        ("numa",            options::value<int32_t>(&numa)->default_value(0),                       "whether to allocate the memory of the reactors on their NUMA node = [0 or 1]")
+        ("shared-nothing",  options::value<int32_t>(&shared_nothing)->default_value(0),             "one reactor per cpu, pinned, on its NUMA node = [0 or 1]")
+        ("offload-threads", options::value<int32_t>(&offload_threads)->default_value(0),           "threads of the pool running the slow jobs of the handlers, 0 = inline")
+        ("upstream",        options::value<std::string>(&upstreams)->default_value(""),            "backends of the proxy mode = [host:port,host:port...]")
+        ("upstream-timeout", options::value<int32_t>(&upstream_timeout)->default_value(30),         "backend response timeout of the proxy mode in seconds, 0 = none")
+        ("upstream-conns",  options::value<int32_t>(&upstream_conns)->default_value(64),            "idle keep-alive connections per backend and reactor thread")
+        ("cache-size",      options::value<int32_t>(&cache_size)->default_value(0),                 "response cache of the proxy mode in MB per reactor thread, 0 = none")
+        ("rate-limit",      options::value<int32_t>(&rate_limit)->default_value(0),                 "requests per second of each client, 0 = no limit")
+        ("rate-burst",      options::value<int32_t>(&rate_burst)->default_value(0),                 "burst requests of each client, 0 = the rate limit")
+        ("rate-key",        options::value<std::string>(&rate_key)->default_value(""),             "request field of the client key, e.g. X-API-Key, \"\" = the client address")
+        ("access-log",      options::value<std::string>(&access_log)->default_value(""),           "access log file, \"-\" = stdout, \"\" = none")
+        ("shed-target",     options::value<int32_t>(&shed_target)->default_value(0),                "queueing delay target of the load shedding in milliseconds, 0 = none")
+        ("shed-interval",   options::value<int32_t>(&shed_interval)->default_value(100),            "interval of the load shedding in milliseconds")
         ;
 
     // parse command line
@@ -274,11 +442,24 @@ int main(int argc, char * argv[])
         g_mode = echo_server_mode;
         g_mode_str = "Http Echo Server";
     }
+    else if (mode_str == "static") {
+        g_mode = static_server_mode;
+        g_mode_str = "Http Static File Server";
+    }
+    else if (mode_str == "coro") {
+        g_mode = coro_server_mode;
+        g_mode_str = "Http Coroutine Server";
+    }
+    else if (mode_str == "proxy") {
+        g_mode = proxy_server_mode;
+        g_mode_str = "Http Reverse Proxy";
+    }
     else {
         // Default mode
         g_mode = http_server_mode;
         g_mode_str = "Http Server";
     }
+    mode = (int32_t)g_mode;
     std::cout << "mode str:  " << mode_str.c_str() << std::endl;
     std::cout << "mode info: " << g_mode_str.c_str() << std::endl;
 
@@ -296,15 +477,58 @@ int main(int argc, char * argv[])
     g_packet_size = packet_size;
     std::cout << "packet-size: " << packet_size << std::endl;
 
+    // cpu-affinity, numa
+    if (args_map.count("cpu-affinity") > 0) {
+        cpu_affinity = args_map["cpu-affinity"].as<std::string>();
+    }
+    if (args_map.count("numa") > 0) {
+        numa = args_map["numa"].as<int32_t>();
+    }
+    if (args_map.count("shared-nothing") > 0) {
+        shared_nothing = args_map["shared-nothing"].as<int32_t>();
+    }
+    if (shared_nothing != 0) {
+        // Each reactor owns a cpu, and allocates everything on its own node.
+        if (cpu_affinity.empty())
+            cpu_affinity = "all";
+        numa = 1;
+    }
+    std::vector<int> affinity_cpus;
+    if (cpu_affinity == "all") {
+        affinity_cpus = jimi::get_allowed_cpus();
+    }
+    else if (!cpu_affinity.empty() && !jimi::parse_cpu_list(cpu_affinity, affinity_cpus)) {
+        std::cerr << "Error: cpu-affinity \"" << cpu_affinity.c_str() << "\" format is wrong." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    g_cpu_affinity = cpu_affinity;
+    g_numa = (numa != 0) ? 1 : 0;
+    std::cout << "cpu-affinity: " << (cpu_affinity.empty() ? "none" : cpu_affinity.c_str())
+              << ", numa: " << g_numa << std::endl;
+
     // thread-num
     if (args_map.count("thread-num") > 0) {
         thread_num = args_map["thread-num"].as<int32_t>();
     }
     std::cout << "thread-num: " << thread_num << std::endl;
     if (thread_num <= 0) {
-        thread_num = std::thread::hardware_concurrency();
-        std::cout << ">>> thread-num: std::thread::hardware_concurrency() = " << thread_num << std::endl;
+        if (!affinity_cpus.empty()) {
+            // One reactor per pinned cpu.
+            thread_num = (int32_t)affinity_cpus.size();
+            std::cout << ">>> thread-num: the cpus of cpu-affinity = " << thread_num << std::endl;
+        }
+        else {
+            thread_num = std::thread::hardware_concurrency();
+            std::cout << ">>> thread-num: std::thread::hardware_concurrency() = " << thread_num << std::endl;
+        }
+    }
+
+    // offload-threads
+    if (args_map.count("offload-threads") > 0) {
+        offload_threads = args_map["offload-threads"].as<int32_t>();
     }
+    g_offload_threads = (offload_threads > 0) ? (uint32_t)offload_threads : 0;
+    std::cout << "offload-threads: " << g_offload_threads << std::endl;
 
     // nodelay
     if (args_map.count("nodelay") > 0) {
@@ -320,24 +544,179 @@ int main(int argc, char * argv[])
     }
     std::cout << "TCP scoket no-delay: " << g_nodelay_str.c_str() << std::endl;
 
+    // io
+    if (args_map.count("io") > 0) {
+        io_str = args_map["io"].as<std::string>();
+    }
+    if (io_str == "uring" || io_str == "io_uring") {
+        g_io_engine = jimi::io_engine_uring;
+        g_io_str = "io_uring";
+    }
+    else if (io_str == "epoll") {
+        g_io_engine = jimi::io_engine_epoll;
+        g_io_str = "epoll";
+    }
+    else {
+        std::cerr << "Error: unknown I/O engine \"" << io_str.c_str() << "\", it must be epoll or uring." << std::endl;
+        print_usage(app_name, desc);
+        exit(EXIT_FAILURE);
+    }
+    std::cout << "I/O engine: " << g_io_str.c_str() << std::endl;
+
+    // pipeline
+    if (args_map.count("pipeline") > 0) {
+        pipeline = args_map["pipeline"].as<int32_t>();
+    }
+    if (pipeline <= 0)
+        pipeline = 1;
+    g_pipeline = pipeline;
+    std::cout << "pipeline: " << pipeline << std::endl;
+
+    // echo
+    if (args_map.count("echo") > 0) {
+        need_echo = args_map["echo"].as<int32_t>();
+    }
+    g_need_echo = (need_echo != 0) ? 1 : 0;
+    std::cout << "need echo: " << g_need_echo << std::endl;
+
+    // root
+    if (args_map.count("root") > 0) {
+        doc_root = args_map["root"].as<std::string>();
+    }
+    g_doc_root = doc_root;
+    if (mode == static_server_mode) {
+        std::cout << "document root: " << g_doc_root.c_str() << std::endl;
+    }
+
+    // upstream
+    if (args_map.count("upstream") > 0) {
+        upstreams = args_map["upstream"].as<std::string>();
+    }
+    if (args_map.count("upstream-timeout") > 0) {
+        upstream_timeout = args_map["upstream-timeout"].as<int32_t>();
+    }
+    if (args_map.count("upstream-conns") > 0) {
+        upstream_conns = args_map["upstream-conns"].as<int32_t>();
+    }
+    if (args_map.count("cache-size") > 0) {
+        cache_size = args_map["cache-size"].as<int32_t>();
+    }
+    g_upstreams = upstreams;
+    g_upstream_timeout = (upstream_timeout > 0) ? (uint32_t)upstream_timeout : 0;
+    g_upstream_conns = (upstream_conns > 0) ? (uint32_t)upstream_conns : 0;
+    g_cache_size = (cache_size > 0) ? (uint32_t)cache_size : 0;
+    if (mode == proxy_server_mode) {
+        std::vector<jimi::upstream_addr> backends;
+        if (!jimi::parse_upstreams(g_upstreams, backends)) {
+            std::cerr << "Error: --upstream \"" << g_upstreams.c_str()
+                      << "\" must be a list of host:port." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::cout << "upstream: " << g_upstreams.c_str() << ", timeout = " << g_upstream_timeout
+                  << "s, idle conns = " << g_upstream_conns
+                  << ", cache = " << g_cache_size << " MB" << std::endl;
+    }
+
+    // rate limit
+    if (args_map.count("rate-limit") > 0) {
+        rate_limit = args_map["rate-limit"].as<int32_t>();
+    }
+    if (args_map.count("rate-burst") > 0) {
+        rate_burst = args_map["rate-burst"].as<int32_t>();
+    }
+    if (args_map.count("rate-key") > 0) {
+        rate_key = args_map["rate-key"].as<std::string>();
+    }
+    g_rate_limit = (rate_limit > 0) ? (uint32_t)rate_limit : 0;
+    g_rate_burst = (rate_burst > 0) ? (uint32_t)rate_burst : 0;
+    g_rate_key = rate_key;
+    if (g_rate_limit > 0) {
+        std::cout << "rate limit: " << g_rate_limit << " req/s, burst = "
+                  << ((g_rate_burst > 0) ? g_rate_burst : g_rate_limit) << ", key = "
+                  << (g_rate_key.empty() ? "client address" : g_rate_key.c_str()) << std::endl;
+    }
+
+    // access log
+    if (args_map.count("access-log") > 0) {
+        access_log = args_map["access-log"].as<std::string>();
+    }
+    g_access_log = access_log;
+    if (!g_access_log.empty()) {
+        std::cout << "access log: " << g_access_log.c_str() << std::endl;
+    }
+
+    // load shedding
+    if (args_map.count("shed-target") > 0) {
+        shed_target = args_map["shed-target"].as<int32_t>();
+    }
+    if (args_map.count("shed-interval") > 0) {
+        shed_interval = args_map["shed-interval"].as<int32_t>();
+    }
+    g_shed_target   = (shed_target > 0) ? (uint32_t)shed_target : 0;
+    g_shed_interval = (shed_interval > 0) ? (uint32_t)shed_interval : 100;
+    if (g_shed_target > 0) {
+        std::cout << "load shedding: target = " << g_shed_target << " ms, interval = "
+                  << g_shed_interval << " ms" << std::endl;
+    }
+
+    // timeouts
+    if (args_map.count("idle-timeout") > 0) {
+        idle_timeout = args_map["idle-timeout"].as<int32_t>();
+    }
+    if (args_map.count("header-timeout") > 0) {
+        header_timeout = args_map["header-timeout"].as<int32_t>();
+    }
+    if (args_map.count("body-timeout") > 0) {
+        body_timeout = args_map["body-timeout"].as<int32_t>();
+    }
+    g_idle_timeout   = (idle_timeout > 0) ? (uint32_t)idle_timeout : 0;
+    g_header_timeout = (header_timeout > 0) ? (uint32_t)header_timeout : 0;
+    g_body_timeout   = (body_timeout > 0) ? (uint32_t)body_timeout : 0;
+    std::cout << "timeouts: idle = " << g_idle_timeout << "s, header = " << g_header_timeout
+              << "s, body = " << g_body_timeout << "s" << std::endl;
+
+    // stats
+    if (args_map.count("stats") > 0) {
+        stats_endpoint = args_map["stats"].as<int32_t>();
+    }
+    if (args_map.count("stats-interval") > 0) {
+        stats_interval = args_map["stats-interval"].as<int32_t>();
+    }
+    if (args_map.count("latency") > 0) {
+        latency_stats = args_map["latency"].as<int32_t>();
+    }
+    g_stats_endpoint = (stats_endpoint != 0) ? 1 : 0;
+    g_stats_interval = (stats_interval > 0) ? (uint32_t)stats_interval : 1000;
+    g_latency_stats = (latency_stats != 0) ? 1 : 0;
+    std::cout << "stats endpoint: " << g_stats_endpoint
+              << ", interval: " << g_stats_interval << " ms"
+              << ", latency: " << g_latency_stats << std::endl;
+
     // Run the server
     std::cout << std::endl;
     std::cout << app_name.c_str() << " begin ..." << std::endl;
     std::cout << std::endl;
     std::cout << "listen " << server_ip.c_str() << ":" << server_port.c_str() << std::endl;
     std::cout << "mode: " << mode_str.c_str() << std::endl;
-    std::cout << "packet_size: " << packet_size << ", thread_num: " << thread_num << std::endl;
+    std::cout << "packet_size: " << packet_size << ", thread_num: " << thread_num
+              << ", pipeline: " << pipeline << std::endl;
     std::cout << std::endl;
 
+    int result = 0;
     if (mode == http_server_mode) {
-        run_http_server(server_ip, server_port, packet_size, thread_num);
+        result = run_http_server(server_ip, server_port, packet_size, thread_num);
     }
     else if (mode == echo_server_mode) {
-        // TODO: echo server
-        std::cout << "TODO: echo_server_mode." << std::endl;
+        result = run_echo_server(server_ip, server_port, packet_size, thread_num);
     }
-    else {
-        run_http_server_ex(server_ip, server_port, packet_size, thread_num);
+    else if (mode == static_server_mode) {
+        result = run_static_server(server_ip, server_port, packet_size, thread_num);
+    }
+    else if (mode == coro_server_mode) {
+        result = run_coro_server(server_ip, server_port, packet_size, thread_num);
+    }
+    else if (mode == proxy_server_mode) {
+        result = run_proxy_server(server_ip, server_port, packet_size, thread_num);
     }
 
 #if 0
@@ -347,5 +726,6 @@ int main(int argc, char * argv[])
 #ifdef _WIN32
     ::system("pause");
 #endif
-    return 0;
+    // A listen socket which couldn't be opened, or a reactor which failed.
+    return ((result == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
 }
@@ -0,0 +1,90 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <assert.h>
+
+#include <cstddef>
+#include <atomic>
+
+#include "jimi/basic/stddef.h"
+
+namespace jimi {
+
+// The link of an item of a mpsc_queue, embedded in the item.
+struct mpsc_node {
+    std::atomic<mpsc_node *> next;
+
+    mpsc_node() : next(nullptr) {}
+};
+
+//
+// An unbounded intrusive queue of many producer threads and one consumer
+// thread (Vyukov's MPSC queue). A push is one atomic exchange, and a pop
+// doesn't write any shared cache line but the consumer's own.
+//
+// A push which is halfway done hides the items behind it from pop() for
+// a moment, so pop() may return nullptr while the queue isn't empty. The
+// consumer must be woken up again by the producer, see offload_inbox.
+//
+class mpsc_queue {
+private:
+    // The producers' side.
+    std::atomic<mpsc_node *>    tail_;
+    char                        padding0_[64];
+
+    // The consumer's side.
+    mpsc_node *                 head_;
+    mpsc_node                   stub_;
+
+public:
+    mpsc_queue() : tail_(&stub_), head_(&stub_) {}
+    ~mpsc_queue() {}
+
+    mpsc_queue(const mpsc_queue &) = delete;
+    mpsc_queue & operator = (const mpsc_queue &) = delete;
+
+    // By any thread.
+    void push(mpsc_node * node) {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        mpsc_node * prev = this->tail_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // By the consumer only, the oldest node or nullptr.
+    mpsc_node * pop() {
+        mpsc_node * head = this->head_;
+        mpsc_node * next = head->next.load(std::memory_order_acquire);
+        if (head == &this->stub_) {
+            if (next == nullptr)
+                return nullptr;
+            // Skip the stub.
+            this->head_ = next;
+            head = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            this->head_ = next;
+            return head;
+        }
+        // head is the last node: put the stub back behind it, so that it
+        // can be taken without leaving the queue without a node.
+        if (head != this->tail_.load(std::memory_order_acquire))
+            return nullptr;
+        this->push(&this->stub_);
+        next = head->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            this->head_ = next;
+            return head;
+        }
+        return nullptr;
+    }
+
+    // By the consumer only, may return true while a push is halfway done.
+    bool is_empty() const {
+        return (this->head_ == &this->stub_ &&
+                this->stub_.next.load(std::memory_order_acquire) == nullptr);
+    }
+};
+
+} // namespace jimi
@@ -0,0 +1,534 @@
+
+#pragma once
+
+#if defined(__linux__)
+
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <cstddef>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <exception>
+#include <iostream>
+
+#include "jimi/basic/stddef.h"
+
+#include "mpsc_queue.hpp"
+#include "chase_lev_deque.hpp"
+#include "coro_scheduler.hpp"
+
+namespace jimi {
+
+class offload_inbox;
+
+//
+// A piece of work which is too slow for a reactor thread: CPU heavy (the
+// templating, the compression) or blocking (a call without an async API).
+//
+// run() is called on a thread of the offload_pool, then complete() on the
+// reactor thread which submitted the job, which owns the job again from then
+// on. The jobs which are still queued when the server stops are deleted
+// without being completed.
+//
+class offload_job : public mpsc_node {
+public:
+    // The inbox of the reactor to return to, set by offload_pool::submit().
+    offload_inbox * inbox;
+
+    offload_job() : inbox(nullptr) {}
+    virtual ~offload_job() {}
+
+    virtual void run() = 0;
+    virtual void complete() = 0;
+};
+
+//
+// The jobs which have been run by the offload_pool, returned to the reactor
+// which submitted them. Any thread of the pool posts, the reactor drains it
+// every loop iteration. The first post after a drain also writes the eventfd,
+// which the reactor waits on, so a finished job doesn't wait for the timeout
+// of epoll_wait() (io_uring_enter()).
+//
+class offload_inbox {
+private:
+    mpsc_queue          queue_;
+    std::atomic<bool>   pending_;
+    int                 event_fd_;
+
+public:
+    offload_inbox() : pending_(false), event_fd_(-1) {}
+    ~offload_inbox() {
+        // The reactor has gone, nobody will complete them.
+        mpsc_node * node;
+        while ((node = this->queue_.pop()) != nullptr) {
+            delete static_cast<offload_job *>(node);
+        }
+        if (this->event_fd_ >= 0) {
+            ::close(this->event_fd_);
+        }
+    }
+
+    offload_inbox(const offload_inbox &) = delete;
+    offload_inbox & operator = (const offload_inbox &) = delete;
+
+    // The inbox of the reactor running on this thread, if there is a pool.
+    static offload_inbox *& local() {
+        static thread_local offload_inbox * inbox = nullptr;
+        return inbox;
+    }
+
+    bool open() {
+        this->event_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (this->event_fd_ < 0) {
+            std::cerr << "Error: eventfd() failed, errno = " << errno << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    int event_fd() const { return this->event_fd_; }
+
+    // By any thread.
+    void post(offload_job * job) {
+        this->queue_.push(job);
+        if (!this->pending_.exchange(true, std::memory_order_acq_rel)) {
+            uint64_t one = 1;
+            ssize_t n = ::write(this->event_fd_, &one, sizeof(one));
+            (void)n;
+        }
+    }
+
+    // By the reactor, when its epoll wait is woken up by the eventfd.
+    void clear_event() {
+        uint64_t value;
+        ssize_t n = ::read(this->event_fd_, &value, sizeof(value));
+        (void)n;
+    }
+
+    // By the reactor, complete the posted jobs and return how many.
+    std::size_t drain() {
+        if (likely(!this->pending_.load(std::memory_order_relaxed)))
+            return 0;
+        // Clear it first: a job posted while draining writes the eventfd again.
+        this->pending_.exchange(false, std::memory_order_acq_rel);
+        std::size_t count = 0;
+        mpsc_node * node;
+        while ((node = this->queue_.pop()) != nullptr) {
+            static_cast<offload_job *>(node)->complete();
+            count++;
+        }
+        return count;
+    }
+};
+
+//
+// The thread pool the reactors offload their slow jobs to, so that a slow
+// handler doesn't stall every connection of its reactor.
+//
+// Each worker owns a Chase-Lev deque. The reactors submit to a shared MPSC
+// injection queue, which one worker at a time moves to its own deque, in
+// batches; the idle workers then steal from the busy ones, so the jobs are
+// spread over the pool without any lock on the way. A worker which finds
+// nothing to do sleeps on a condition variable until the next submit().
+//
+class offload_pool {
+public:
+    typedef std::size_t size_type;
+
+    static const size_type kDequeSize = 256;
+    // The most jobs a worker moves from the injection queue at a time.
+    static const uint32_t kInjectBatch = 32;
+    // How long an idle worker sleeps before it looks for work again, in case
+    // of a missed wake up.
+    static const uint32_t kIdleWaitMs = 100;
+
+private:
+    struct worker {
+        offload_pool *                  pool;
+        uint32_t                        id;
+        uint32_t                        seed;
+        // The inbox of the job being run, for the jobs it submits.
+        offload_inbox *                 inbox;
+        chase_lev_deque<offload_job>    deque;
+        std::thread                     thread;
+
+        worker(offload_pool * owner, uint32_t index)
+            : pool(owner), id(index), seed(index * 2654435761u + 1), inbox(nullptr),
+              deque(kDequeSize) {}
+    };
+
+    std::vector<std::unique_ptr<worker>> workers_;
+
+    mpsc_queue              inject_;
+    // The jobs in inject_, counted before they're pushed.
+    std::atomic<int64_t>    injected_;
+    std::atomic<bool>       inject_lock_;
+
+    std::atomic<uint32_t>   idle_;
+    std::atomic<bool>       stop_;
+    std::mutex              mutex_;
+    std::condition_variable cond_;
+
+public:
+    offload_pool() : injected_(0), inject_lock_(false), idle_(0), stop_(false) {}
+    ~offload_pool() {
+        this->stop();
+        // The stopped workers have run everything, but a pool which was
+        // never started may have some jobs left.
+        mpsc_node * node;
+        while ((node = this->inject_.pop()) != nullptr) {
+            delete static_cast<offload_job *>(node);
+        }
+    }
+
+    offload_pool(const offload_pool &) = delete;
+    offload_pool & operator = (const offload_pool &) = delete;
+
+    // The pool of the running server, nullptr if the jobs run inline.
+    static offload_pool *& current() {
+        static offload_pool * s_pool = nullptr;
+        return s_pool;
+    }
+
+    size_type threads() const { return this->workers_.size(); }
+
+    void start(uint32_t thread_num) {
+        assert(this->workers_.empty());
+        for (uint32_t i = 0; i < thread_num; ++i) {
+            this->workers_.push_back(std::unique_ptr<worker>(new worker(this, i)));
+        }
+        for (uint32_t i = 0; i < thread_num; ++i) {
+            worker * self = this->workers_[i].get();
+            self->thread = std::thread([this, self]() {
+                this->run_worker(self);
+            });
+        }
+    }
+
+    // Run all the submitted jobs, then join the workers.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            this->stop_.store(true, std::memory_order_seq_cst);
+        }
+        this->cond_.notify_all();
+        for (size_type i = 0; i < this->workers_.size(); ++i) {
+            if (this->workers_[i]->thread.joinable())
+                this->workers_[i]->thread.join();
+        }
+    }
+
+    //
+    // Called by a reactor thread, which completes the job; or by a job while
+    // it runs, which adds the job to the deque of its worker, and the job is
+    // completed by the reactor of the running job. Return false if it isn't
+    // called by either, the job isn't submitted then.
+    //
+    bool submit(offload_job * job) {
+        worker * self = current_worker();
+        if (self != nullptr && self->pool == this && self->inbox != nullptr) {
+            job->inbox = self->inbox;
+            self->deque.push(job);
+        }
+        else {
+            job->inbox = offload_inbox::local();
+            if (unlikely(job->inbox == nullptr))
+                return false;
+            this->injected_.fetch_add(1, std::memory_order_seq_cst);
+            this->inject_.push(job);
+        }
+        this->wake_one();
+        return true;
+    }
+
+private:
+    static worker *& current_worker() {
+        static thread_local worker * s_worker = nullptr;
+        return s_worker;
+    }
+
+    void wake_one() {
+        // Pairs with the idle_ increment of wait_for_work(): either the worker
+        // sees the job when it checks again, or we see it idle.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (this->idle_.load(std::memory_order_relaxed) != 0) {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            this->cond_.notify_one();
+        }
+    }
+
+    void run_worker(worker * self) {
+        current_worker() = self;
+        for (;;) {
+            offload_job * job = self->deque.pop();
+            if (job == nullptr)
+                job = this->take_injected(self);
+            if (job == nullptr)
+                job = this->steal(self);
+            if (job == nullptr) {
+                if (this->stop_.load(std::memory_order_acquire) && !this->has_work())
+                    break;
+                this->wait_for_work();
+                continue;
+            }
+            offload_inbox * inbox = job->inbox;
+            self->inbox = inbox;
+            job->run();
+            self->inbox = nullptr;
+            inbox->post(job);
+        }
+        current_worker() = nullptr;
+    }
+
+    // Move a batch of the injection queue to our deque, return the first job.
+    offload_job * take_injected(worker * self) {
+        if (this->injected_.load(std::memory_order_relaxed) <= 0)
+            return nullptr;
+        if (this->inject_lock_.exchange(true, std::memory_order_acquire))
+            return nullptr;
+        offload_job * first = nullptr;
+        uint32_t moved = 0;
+        for (uint32_t i = 0; i < kInjectBatch; ++i) {
+            mpsc_node * node = this->inject_.pop();
+            if (node == nullptr)
+                break;
+            this->injected_.fetch_sub(1, std::memory_order_relaxed);
+            offload_job * job = static_cast<offload_job *>(node);
+            if (first == nullptr) {
+                first = job;
+            }
+            else {
+                self->deque.push(job);
+                moved++;
+            }
+        }
+        this->inject_lock_.store(false, std::memory_order_release);
+        // There's more than we can run at once, let the others steal it.
+        if (moved != 0)
+            this->wake_one();
+        return first;
+    }
+
+    offload_job * steal(worker * self) {
+        size_type count = this->workers_.size();
+        if (count <= 1)
+            return nullptr;
+        // Start from a random victim, so the thieves don't all hit the same one.
+        self->seed ^= self->seed << 13;
+        self->seed ^= self->seed >> 17;
+        self->seed ^= self->seed << 5;
+        size_type start = self->seed % count;
+        for (size_type i = 0; i < count; ++i) {
+            worker * victim = this->workers_[(start + i) % count].get();
+            if (victim == self)
+                continue;
+            offload_job * job = victim->deque.steal();
+            if (job != nullptr)
+                return job;
+        }
+        return nullptr;
+    }
+
+    bool has_work() const {
+        if (this->injected_.load(std::memory_order_seq_cst) > 0)
+            return true;
+        for (size_type i = 0; i < this->workers_.size(); ++i) {
+            if (!this->workers_[i]->deque.is_empty())
+                return true;
+        }
+        return false;
+    }
+
+    void wait_for_work() {
+        std::unique_lock<std::mutex> lock(this->mutex_);
+        this->idle_.fetch_add(1, std::memory_order_seq_cst);
+        if (!this->stop_.load(std::memory_order_relaxed) && !this->has_work()) {
+            // By value, kIdleWaitMs has no out-of-class definition to bind to.
+            this->cond_.wait_for(lock, std::chrono::milliseconds((uint32_t)kIdleWaitMs));
+        }
+        this->idle_.fetch_sub(1, std::memory_order_relaxed);
+    }
+};
+
+//
+// Run work() on the offload pool, then done() on this reactor thread, see
+// offload_call().
+//
+template <typename Work, typename Done>
+class offload_function_job : public offload_job {
+private:
+    Work work_;
+    Done done_;
+
+public:
+    template <typename W, typename D>
+    offload_function_job(W && work, D && done)
+        : work_(std::forward<W>(work)), done_(std::forward<D>(done)) {}
+    virtual ~offload_function_job() {}
+
+    virtual void run() { this->work_(); }
+    virtual void complete() {
+        this->done_();
+        delete this;
+    }
+};
+
+//
+// The callback form of offloading, for the handlers which aren't coroutines:
+// run work() on the offload pool, then done() on this reactor thread. Both
+// run inline if the server has no pool (--offload-threads=0).
+//
+template <typename Work, typename Done>
+static inline
+void offload_call(Work && work, Done && done)
+{
+    typedef offload_function_job<typename std::decay<Work>::type,
+                                 typename std::decay<Done>::type> job_type;
+    job_type * job = new job_type(std::forward<Work>(work), std::forward<Done>(done));
+    offload_pool * pool = offload_pool::current();
+    if (pool == nullptr || !pool->submit(job)) {
+        job->run();
+        job->complete();
+    }
+}
+
+#if JIMI_HAS_COROUTINES
+
+namespace detail {
+
+template <typename T>
+struct offload_result {
+    std::optional<T> value;
+
+    template <typename Func>
+    void run(Func & func) { this->value.emplace(func()); }
+    T take() { return std::move(*this->value); }
+};
+
+template <>
+struct offload_result<void> {
+    template <typename Func>
+    void run(Func & func) { func(); }
+    void take() {}
+};
+
+} // namespace detail
+
+//
+// co_await offload(func): run func() on the offload pool and resume the
+// coroutine on its reactor thread with the result (or the exception) of it.
+// It runs inline if the server has no pool.
+//
+// func must own what it uses: if the coroutine is destroyed meanwhile (the
+// connection is closed), the job runs to the end and is deleted when it
+// returns to the reactor.
+//
+template <typename Func>
+class coro_offload {
+public:
+    typedef decltype(std::declval<Func &>()()) result_type;
+
+private:
+    struct job_type : public offload_job {
+        Func                                func;
+        detail::offload_result<result_type> result;
+        std::exception_ptr                  error;
+        coro_waiter *                       waiter;
+        bool                                in_flight;
+
+        template <typename F>
+        explicit job_type(F && f)
+            : func(std::forward<F>(f)), waiter(nullptr), in_flight(false) {}
+        virtual ~job_type() {}
+
+        virtual void run() {
+            try {
+                this->result.run(this->func);
+            }
+            catch (...) {
+                this->error = std::current_exception();
+            }
+        }
+
+        virtual void complete() {
+            this->in_flight = false;
+            if (this->waiter != nullptr) {
+                coro_scheduler::local().post(this->waiter);
+                this->waiter = nullptr;
+            }
+            else {
+                // The coroutine has gone.
+                delete this;
+            }
+        }
+    };
+
+    job_type *  job_;
+    coro_waiter waiter_;
+
+public:
+    template <typename F>
+    explicit coro_offload(F && func) : job_(new job_type(std::forward<F>(func))) {}
+    ~coro_offload() {
+        if (this->job_ != nullptr) {
+            if (this->job_->in_flight)
+                this->job_->waiter = nullptr;
+            else
+                delete this->job_;
+        }
+        coro_scheduler::local().cancel(&this->waiter_);
+    }
+
+    coro_offload(const coro_offload &) = delete;
+    coro_offload & operator = (const coro_offload &) = delete;
+
+    bool await_ready() {
+        offload_pool * pool = offload_pool::current();
+        if (pool == nullptr || offload_inbox::local() == nullptr) {
+            this->job_->run();
+            return true;
+        }
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        this->waiter_.handle = handle;
+        this->job_->waiter = &this->waiter_;
+        this->job_->in_flight = true;
+        if (unlikely(!offload_pool::current()->submit(this->job_))) {
+            this->job_->in_flight = false;
+            this->job_->waiter = nullptr;
+            this->job_->run();
+            return false;
+        }
+        return true;
+    }
+
+    result_type await_resume() {
+        if (this->job_->error)
+            std::rethrow_exception(this->job_->error);
+        return this->job_->result.take();
+    }
+};
+
+template <typename Func>
+static inline
+coro_offload<typename std::decay<Func>::type> offload(Func && func)
+{
+    return coro_offload<typename std::decay<Func>::type>(std::forward<Func>(func));
+}
+
+#endif // JIMI_HAS_COROUTINES
+
+} // namespace jimi
+
+#endif // __linux__
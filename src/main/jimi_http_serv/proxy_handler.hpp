@@ -0,0 +1,1218 @@
+
+#pragma once
+
+#if defined(__linux__)
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "jimi/basic/stddef.h"
+#include "jimi/StringRef.h"
+#include "jimi/http/Common.h"
+#include "jimi/http/FastParser.h"
+#include "jimi/http/ParserPool.h"
+#include "jimi/http/ResponseParser.h"
+#include "jimi/http/ChunkedScanner.h"
+
+#include "server_config.hpp"
+#include "connection.hpp"
+#include "control_mailbox.hpp"
+#include "timer_wheel.hpp"
+#include "upstream_pool.hpp"
+#include "response_cache.hpp"
+#include "response_header.hpp"
+#include "access_log.hpp"
+#include "http_handler.hpp"
+#include "http_date.hpp"
+#include "server_stats.hpp"
+
+namespace jimi {
+
+//
+// The reverse proxy handler: every request is forwarded to a backend over a
+// pooled keep-alive connection (see upstream_pool), and the response is
+// relayed back to the client.
+//
+// The request is parsed with BasicFastParser and buffered whole with its
+// body, then it's rewritten: the hop-by-hop fields are dropped, and the
+// client address is appended to X-Forwarded-For. A request which fails on a
+// reused connection before any byte of the response, because the backend
+// has closed the connection meanwhile, is sent again once on a new one.
+//
+// The response header is parsed with ResponseParser and rewritten the same
+// way, then the body is relayed as it arrives: a chunked body is framed by
+// ChunkedScanner, and a large body with a Content-Length is spliced from the
+// backend socket to the client socket through a pipe, without copying it to
+// user space. The reads from the backend are paused while the client is
+// slower than the backend.
+//
+// The upstream sockets are polled by the epoll instance of the pool, whose
+// fd is the event fd of the handler. The pipelined requests of a client are
+// forwarded one by one, in order.
+//
+// With a response cache (--cache-size), a GET or HEAD request is answered
+// from it when it has a fresh response, before a backend is picked: the
+// stored header, Age and Connection are copied to the write queue and the
+// body is queued by reference, so the reactor sends the hit with one
+// gathered write. A cacheable response with a Content-Length is copied into
+// a new entry while it's relayed (it isn't spliced then), and the entry is
+// inserted when the whole body has arrived.
+//
+class proxy_handler {
+public:
+    typedef http_handler::parser_type   parser_type;
+    typedef http_handler::parser_pool   parser_pool;
+
+    static const std::size_t kMaxHeaderSize = http_handler::kMaxHeaderSize;
+    static const std::size_t kMaxContentLength = http_handler::kMaxContentLength;
+
+    // The reads from the backend are paused above this much unsent output.
+    static const std::size_t kMaxPendingWrite = 1024 * 1024;
+    // The bodies of at least this size are spliced.
+    static const uint64_t kSpliceMinSize = 64 * 1024;
+    static const int kPipeSize = 1024 * 1024;
+
+    static const int kMaxEvents = 64;
+    static const int kMaxIovecs = 64;
+    static const uint32_t kTickMs = 100;
+
+private:
+    //
+    // The pipe of a spliced body: the handler splices the body from the
+    // backend socket into it, and the reactor sends it to the client like a
+    // file, the file range is extended by the bytes spliced into the pipe.
+    //
+    class pipe_body : public shared_file {
+    public:
+        int      write_fd;
+        uint64_t capacity;
+
+        pipe_body(int read_fd, int _write_fd, uint64_t _capacity)
+            : shared_file(read_fd), write_fd(_write_fd), capacity(_capacity) {}
+        ~pipe_body() {
+            ::close(this->write_fd);
+        }
+
+        virtual ssize_t transfer(int sock_fd, uint64_t offset, std::size_t count) {
+            return ::splice(this->fd, nullptr, sock_fd, nullptr, count,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        }
+
+        static pipe_body * create() {
+            int fds[2];
+            if (::pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0)
+                return nullptr;
+            // Keep the default size if it's above /proc/sys/fs/pipe-max-size.
+            ::fcntl(fds[1], F_SETPIPE_SZ, kPipeSize);
+            int size = ::fcntl(fds[1], F_GETPIPE_SZ);
+            return new pipe_body(fds[0], fds[1], (size > 0) ? (uint64_t)size : 65536);
+        }
+    };
+
+    enum state_t {
+        kIdle,
+        kWaitResponse,
+        kRelayBody
+    };
+
+    enum body_mode_t {
+        kBodyNone,
+        kBodyLength,
+        kBodyChunked,
+        kBodyUntilClose
+    };
+
+    // What a session is waiting for, see resume().
+    enum wait_t {
+        kWaitNone,
+        kWaitWrite,     // The write queue of the client to drain.
+        kWaitPipe,      // The pipe to drain.
+        kWaitNext       // The spliced body to be sent, before the next request.
+    };
+
+    class session {
+    public:
+        connection *        conn;
+        upstream_conn *     up;
+        uint32_t            state;
+        uint32_t            mode;
+        uint32_t            wait;
+        uint64_t            remain;
+        uint64_t            resume_below;
+        http::ChunkedScanner chunked;
+        // The rewritten request, until the response arrives.
+        std::string         request;
+        std::string         client_ip;
+        // The cache key of the request if its response may be stored, the
+        // entry the response is stored into, and the cached bodies queued
+        // by reference to the client.
+        std::string         cache_key;
+        cache_entry *       fill;
+        std::vector<cache_entry *> pins;
+        pipe_body *         pipe;
+        bool                keep_alive;
+        bool                up_keep_alive;
+        bool                is_head;
+        bool                retried;
+        bool                splicing;
+        bool                waiting;
+        bool                dirty;
+        bool                close;
+        bool                pinned;
+        // HTTP/1.<minor> of the request, and whether its forwarding is yet
+        // to be logged, see log_forwarded().
+        uint8_t             minor;
+        bool                log_pending;
+
+        session(connection * _conn)
+            : conn(_conn), up(nullptr), state(kIdle), mode(kBodyNone), wait(kWaitNone),
+              remain(0), resume_below(0), fill(nullptr), pipe(nullptr), keep_alive(true),
+              up_keep_alive(true), is_head(false), retried(false), splicing(false),
+              waiting(false), dirty(false), close(false), pinned(false), minor(1),
+              log_pending(false) {}
+        ~session() {
+            this->drop_fill();
+            this->unpin();
+            if (this->pipe != nullptr)
+                this->pipe->release();
+        }
+
+        void drop_fill() {
+            if (this->fill != nullptr) {
+                this->fill->release();
+                this->fill = nullptr;
+            }
+        }
+
+        void unpin() {
+            for (std::size_t i = 0; i < this->pins.size(); ++i) {
+                this->pins[i]->release();
+            }
+            this->pins.clear();
+        }
+    };
+
+    upstream_pool           pool_;
+    timer_wheel             timers_;
+    http::ResponseParser    parser_;
+    std::vector<session *>  dirty_;
+    std::vector<session *>  waiting_;
+    std::vector<session *>  resumed_;
+    std::vector<session *>  pinned_;
+    response_cache          cache_;
+    std::string             header_;
+    uint64_t                timeout_ticks_;
+    uint64_t                idle_ticks_;
+    bool                    stats_endpoint_;
+    bool                    rate_limit_;
+    bool                    access_log_;
+
+public:
+    proxy_handler(const server_config & config)
+        : timers_(kTickMs), cache_((std::size_t)config.cache_size * 1024 * 1024),
+          timeout_ticks_(0), idle_ticks_(0),
+          stats_endpoint_(config.stats_endpoint != 0), rate_limit_(config.rate_limit != 0),
+          access_log_(!config.access_log.empty()) {
+        std::vector<upstream_addr> upstreams;
+        // main() has checked the list, all the requests fail with 502 otherwise.
+        if (parse_upstreams(config.upstreams, upstreams))
+            this->pool_.open(upstreams, config.upstream_conns);
+        this->timeout_ticks_ = this->timers_.to_ticks((uint64_t)config.upstream_timeout * 1000);
+        this->idle_ticks_ = this->timers_.to_ticks((uint64_t)config.idle_timeout * 1000);
+    }
+
+    ~proxy_handler() {}
+
+    void on_accept(connection & conn) {
+        session * s = new session(&conn);
+        conn.context = s;
+        const peer_address & peer = conn.load_peer();
+        char ip[INET6_ADDRSTRLEN];
+        if (peer.family != 0 && ::inet_ntop(peer.family, peer.bytes, ip, sizeof(ip)) != nullptr)
+            s->client_ip = ip;
+    }
+
+    void on_close(connection & conn) {
+        session * s = static_cast<session *>(conn.context);
+        if (s != nullptr) {
+            this->detach(*s, false);
+            if (s->dirty)
+                this->dirty_.erase(std::find(this->dirty_.begin(), this->dirty_.end(), s));
+            if (s->waiting)
+                this->waiting_.erase(std::find(this->waiting_.begin(), this->waiting_.end(), s));
+            if (s->pinned)
+                this->pinned_.erase(std::find(this->pinned_.begin(), this->pinned_.end(), s));
+            conn.context = nullptr;
+            delete s;
+            // Not in a batch of upstream events, and on the reactor thread
+            // for the buffers, even from close_all().
+            this->pool_.purge();
+        }
+    }
+
+    void on_control(const control_message & msg) {}
+
+    // Return false to close the connection after the responses are flushed.
+    bool on_read(connection & conn) {
+        session * s = static_cast<session *>(conn.context);
+        if (s->close)
+            return false;
+        if (s->state != kIdle) {
+            // The pipelined requests wait for the response in flight.
+            return (conn.size() <= kMaxHeaderSize + kMaxContentLength);
+        }
+        return this->start_next(*s);
+    }
+
+    //
+    // Expire the upstream timers, resume the sessions whose client has
+    // drained its output, unpin the cached bodies which have been sent, and
+    // call @flush(connection &) for each connection the upstream events have
+    // queued output to.
+    //
+    template <typename Func>
+    int on_tick(Func && flush) {
+        if (!this->pinned_.empty())
+            this->unpin_sent();
+        this->timers_.advance([this](timer_node * node) {
+            connection * conn = static_cast<connection *>(node->owner);
+            this->on_timeout(static_cast<upstream_conn *>(conn));
+        });
+        if (!this->waiting_.empty()) {
+            this->resumed_.swap(this->waiting_);
+            for (std::size_t i = 0; i < this->resumed_.size(); ++i) {
+                session * s = this->resumed_[i];
+                s->waiting = false;
+                this->resume(*s);
+            }
+            this->resumed_.clear();
+        }
+        this->pool_.purge();
+        while (!this->dirty_.empty()) {
+            session * s = this->dirty_.back();
+            this->dirty_.pop_back();
+            s->dirty = false;
+            if (s->close)
+                s->conn->set_close_after_write();
+            // It may close the connection, and destroy the session.
+            flush(*s->conn);
+        }
+        return -1;
+    }
+
+    int event_fd() const { return this->pool_.epoll_fd(); }
+
+    // The upstream sockets are ready.
+    void on_event() {
+        struct epoll_event events[kMaxEvents];
+        int n;
+        do {
+            n = this->pool_.poll(events, kMaxEvents);
+            for (int i = 0; i < n; ++i) {
+                this->handle_upstream(static_cast<upstream_conn *>(events[i].data.ptr),
+                                      events[i].events);
+            }
+            this->pool_.purge();
+        } while (n == kMaxEvents);
+    }
+
+private:
+    void mark_dirty(session & s) {
+        if (!s.dirty) {
+            s.dirty = true;
+            this->dirty_.push_back(&s);
+        }
+    }
+
+    void wait(session & s, uint32_t what, uint64_t resume_below = 0) {
+        s.wait = what;
+        s.resume_below = resume_below;
+        if (!s.waiting) {
+            s.waiting = true;
+            this->waiting_.push_back(&s);
+        }
+        if (s.up != nullptr && what != kWaitNext) {
+            // A slow client doesn't time out the backend.
+            this->timers_.cancel(&s.up->timer);
+            this->update_events(s);
+        }
+    }
+
+    void resume(session & s) {
+        connection & conn = *s.conn;
+        switch (s.wait) {
+        case kWaitWrite:
+        case kWaitPipe:
+            if ((s.wait == kWaitWrite && conn.pending_write() > kMaxPendingWrite / 2) ||
+                (s.wait == kWaitPipe && conn.pending_file() > s.resume_below)) {
+                this->wait(s, s.wait, s.resume_below);
+                return;
+            }
+            s.wait = kWaitNone;
+            if (s.up != nullptr) {
+                this->schedule_timeout(s.up);
+                // The backend socket is level triggered, it's read on the next event.
+                this->update_events(s);
+            }
+            break;
+        case kWaitNext:
+            if (conn.pending_file() != 0) {
+                this->wait(s, kWaitNext);
+                return;
+            }
+            s.wait = kWaitNone;
+            this->start_next(s);
+            this->mark_dirty(s);
+            break;
+        default:
+            break;
+        }
+    }
+
+    void schedule_timeout(upstream_conn * up) {
+        if (this->timeout_ticks_ != 0)
+            this->timers_.reset(&up->timer, this->timeout_ticks_);
+    }
+
+    //
+    // Forward the next request in the read buffer of the client, if there
+    // is no request in flight, return false to close the connection.
+    //
+    bool start_next(session & s) {
+        connection & conn = *s.conn;
+        parser_pool & pool = parser_pool::local();
+        while (s.state == kIdle && !s.close && conn.size() > 0) {
+            if (conn.pending_file() != 0) {
+                // Nothing may be queued behind the spliced body.
+                this->wait(s, kWaitNext);
+                break;
+            }
+            http_handler::framed_request req;
+            if (!http_handler::frame_request(conn, req)) {
+                if (unlikely(req.error != 0))
+                    this->finish(s, req.error);
+                break;
+            }
+            parser_type * parser = req.parser;
+            std::size_t header_size = req.header_size;
+            std::size_t content_length = req.content_length;
+
+            s.keep_alive = http_handler::is_keep_alive(*parser);
+            s.is_head = (parser->getMethodStr().size() == 4 &&
+                         ::memcmp(parser->getMethodStr().data(), "HEAD", 4) == 0);
+            if (unlikely(this->stats_endpoint_ && http_handler::is_stats_request(*parser))) {
+                http_date::local().update();
+                std::size_t body_size = http_handler::write_stats(conn, s.keep_alive, s.is_head);
+                if (unlikely(this->access_log_))
+                    http_handler::log_request(conn, *parser, 200, body_size);
+                pool.release(parser);
+                stats_shard::local().queries.inc();
+                conn.consume(header_size + content_length);
+                if (!s.keep_alive)
+                    s.close = true;
+                this->mark_dirty(s);
+                continue;
+            }
+            if (unlikely(conn.is_overloaded())) {
+                if (unlikely(this->access_log_))
+                    http_handler::log_request(conn, *parser, 503, 0);
+                pool.release(parser);
+                http_handler::write_overloaded(conn);
+                stats_shard::local().queries.inc();
+                conn.consume(header_size + content_length);
+                s.close = true;
+                this->mark_dirty(s);
+                continue;
+            }
+            if (unlikely(this->rate_limit_ && !http_handler::admit(conn, *parser))) {
+                if (unlikely(this->access_log_))
+                    http_handler::log_request(conn, *parser, 429, 0);
+                pool.release(parser);
+                http_handler::write_limited(conn, s.keep_alive);
+                stats_shard::local().queries.inc();
+                conn.consume(header_size + content_length);
+                if (!s.keep_alive)
+                    s.close = true;
+                this->mark_dirty(s);
+                continue;
+            }
+            uint32_t status;
+            uint64_t body_size;
+            if (this->cache_.enabled() && this->serve_cached(s, *parser, status, body_size)) {
+                if (unlikely(this->access_log_))
+                    http_handler::log_request(conn, *parser, status, body_size);
+                pool.release(parser);
+                conn.consume(header_size + content_length);
+                if (!s.keep_alive)
+                    s.close = true;
+                this->mark_dirty(s);
+                continue;
+            }
+
+            upstream_backend * backend = this->pool_.pick(timer_wheel::monotonic_ms());
+            if (likely(backend != nullptr))
+                this->build_request(s, *parser, conn.data() + header_size, content_length, *backend);
+            s.minor = http_handler::is_http_1_0(*parser) ? 0 : 1;
+            s.log_pending = this->access_log_;
+            pool.release(parser);
+            conn.consume(header_size + content_length);
+            s.retried = false;
+            if (unlikely(backend == nullptr || !this->forward(s, backend, false)))
+                this->finish(s, 502);
+        }
+        return !s.close;
+    }
+
+    //
+    // Send the request of @s to @backend, return false if no connection
+    // could be opened. A send error is handled as any upstream failure.
+    //
+    bool forward(session & s, upstream_backend * backend, bool fresh) {
+        upstream_conn * up = this->pool_.acquire(backend, fresh);
+        if (up == nullptr) {
+            this->pool_.mark_down(backend, timer_wheel::monotonic_ms());
+            return false;
+        }
+        backend->outstanding++;
+        s.up = up;
+        s.state = kWaitResponse;
+        up->context = &s;
+        up->write(s.request.data(), s.request.size());
+        if (this->timeout_ticks_ != 0)
+            this->timers_.schedule(&up->timer, this->timeout_ticks_);
+        else
+            this->timers_.cancel(&up->timer);
+        if (up->state == upstream_conn::kActive)
+            this->flush_upstream(s);
+        else
+            this->update_events(s);
+        return true;
+    }
+
+    // Release the upstream connection of @s, back to the pool if @reusable.
+    void detach(session & s, bool reusable) {
+        upstream_conn * up = s.up;
+        if (up == nullptr)
+            return;
+        up->backend->outstanding--;
+        s.up = nullptr;
+        up->context = nullptr;
+        if (s.wait == kWaitWrite || s.wait == kWaitPipe)
+            s.wait = kWaitNone;
+        if (reusable && this->pool_.release(up)) {
+            if (this->idle_ticks_ != 0)
+                this->timers_.schedule(&up->timer, this->idle_ticks_);
+            else
+                this->timers_.cancel(&up->timer);
+        }
+        else {
+            this->close_upstream(up);
+        }
+    }
+
+    void close_upstream(upstream_conn * up) {
+        this->timers_.cancel(&up->timer);
+        this->pool_.close(up);
+    }
+
+    void update_events(session & s) {
+        upstream_conn * up = s.up;
+        uint32_t events = 0;
+        if (up->state == upstream_conn::kConnecting || up->pending_write() > 0)
+            events |= EPOLLOUT;
+        if (up->state != upstream_conn::kConnecting && s.wait != kWaitWrite && s.wait != kWaitPipe)
+            events |= EPOLLIN;
+        this->pool_.set_events(up, events);
+    }
+
+    //
+    // Answer the request in flight with @status, or cut the response if it
+    // has started, and close the client connection.
+    //
+    void finish(session & s, uint32_t status) {
+        bool started = (s.state == kRelayBody);
+        if (unlikely(s.log_pending))
+            this->log_forwarded(s, status, 0);
+        this->detach(s, false);
+        s.drop_fill();
+        if (!started) {
+            http_handler::write_error(*s.conn, status);
+            stats_shard::local().queries.inc();
+        }
+        s.state = kIdle;
+        s.splicing = false;
+        s.close = true;
+        this->mark_dirty(s);
+    }
+
+    void on_timeout(upstream_conn * up) {
+        if (up->state == upstream_conn::kIdle) {
+            this->close_upstream(up);
+            return;
+        }
+        session * s = static_cast<session *>(up->context);
+        if (s != nullptr)
+            this->finish(*s, 504);
+    }
+
+    //
+    // The request has failed on the connection: resend it once if nothing of
+    // the response has arrived and the connection was reused from the pool
+    // (the backend may have closed it) or refused (to another backend).
+    //
+    void upstream_failed(session & s, bool connect_failed) {
+        upstream_conn * up = s.up;
+        upstream_backend * backend = up->backend;
+        uint64_t now = timer_wheel::monotonic_ms();
+        bool retry = (!s.retried && s.state == kWaitResponse && up->size() == 0 &&
+                      (up->reused || connect_failed));
+        if (connect_failed)
+            this->pool_.mark_down(backend, now);
+        this->detach(s, false);
+        if (retry) {
+            s.retried = true;
+            s.state = kIdle;
+            if (connect_failed)
+                backend = this->pool_.pick(now);
+            if (this->forward(s, backend, true))
+                return;
+            s.state = kWaitResponse;
+        }
+        this->finish(s, 502);
+    }
+
+    void handle_upstream(upstream_conn * up, uint32_t events) {
+        if (up->state == upstream_conn::kClosed)
+            return;
+        if (up->state == upstream_conn::kIdle) {
+            // Closed by the backend, or an unexpected response.
+            this->close_upstream(up);
+            return;
+        }
+        session & s = *static_cast<session *>(up->context);
+        if (up->state == upstream_conn::kConnecting) {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if ((events & (EPOLLERR | EPOLLHUP)) != 0 ||
+                ::getsockopt(up->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0) {
+                this->upstream_failed(s, true);
+                return;
+            }
+            up->state = upstream_conn::kActive;
+        }
+        if (up->pending_write() > 0) {
+            if (!this->flush_upstream(s))
+                return;
+        }
+        if ((events & (EPOLLERR | EPOLLHUP)) != 0 && s.wait != kWaitNone && s.wait != kWaitNext) {
+            // Paused, the socket wouldn't be read.
+            this->upstream_failed(s, false);
+            return;
+        }
+        if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0)
+            this->read_upstream(s);
+    }
+
+    // Return false if the connection has failed.
+    bool flush_upstream(session & s) {
+        upstream_conn * up = s.up;
+        while (up->pending_write() > 0) {
+            struct iovec iov[kMaxIovecs];
+            struct msghdr msg;
+            ::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = (std::size_t)up->gather_write(iov, kMaxIovecs);
+            ssize_t n = ::sendmsg(up->fd, &msg, MSG_NOSIGNAL);
+            if (likely(n > 0)) {
+                up->commit_write((std::size_t)n);
+            }
+            else if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            else {
+                this->upstream_failed(s, false);
+                return false;
+            }
+        }
+        this->update_events(s);
+        return true;
+    }
+
+    void read_upstream(session & s) {
+        for (;;) {
+            upstream_conn * up = s.up;
+            if (up == nullptr || (s.wait != kWaitNone && s.wait != kWaitNext))
+                return;
+            if (s.splicing) {
+                this->splice_body(s);
+                return;
+            }
+            char * buf = up->prepare_read();
+            if (unlikely(buf == nullptr)) {
+                this->upstream_failed(s, false);
+                return;
+            }
+            std::size_t space = up->read_space();
+            ssize_t n = ::recv(up->fd, buf, space, 0);
+            if (likely(n > 0)) {
+                up->commit_read((std::size_t)n);
+                this->schedule_timeout(up);
+                if (!this->process_response(s) || (std::size_t)n < space)
+                    return;
+            }
+            else if (n == 0) {
+                if (s.state == kRelayBody && s.mode == kBodyUntilClose)
+                    this->complete(s);
+                else
+                    this->upstream_failed(s, false);
+                return;
+            }
+            else if (errno == EINTR) {
+                continue;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            else {
+                this->upstream_failed(s, false);
+                return;
+            }
+        }
+    }
+
+    // Return false to stop reading the upstream connection.
+    bool process_response(session & s) {
+        upstream_conn * up = s.up;
+        if (s.state == kWaitResponse) {
+            for (;;) {
+                std::size_t header_size = up->detector.detect(up->data(), up->size());
+                if (header_size == 0) {
+                    if (unlikely(up->size() > kMaxHeaderSize)) {
+                        this->finish(s, 502);
+                        return false;
+                    }
+                    return true;
+                }
+                http::ResponseParser & parser = this->parser_;
+                int status = 0;
+                if (likely(parser.parseResponse(up->data(), header_size) == http::error_code::Succeed))
+                    status = parser.getStatusCode();
+                if (unlikely(status < 100 || status == 101)) {
+                    // Malformed, or an upgrade, which isn't relayed.
+                    this->finish(s, 502);
+                    return false;
+                }
+                if (status >= 200) {
+                    this->start_response(s, parser, up->data());
+                    up->consume(header_size);
+                    break;
+                }
+                // An interim response, dropped.
+                up->consume(header_size);
+            }
+        }
+        return this->relay_body(s);
+    }
+
+    void start_response(session & s, const http::ResponseParser & parser, const char * data) {
+        int status = parser.getStatusCode();
+        s.up_keep_alive = parser.isKeepAlive();
+        s.remain = 0;
+        if (s.is_head || status == 204 || status == 304) {
+            s.mode = kBodyNone;
+        }
+        else if (parser.isChunked()) {
+            s.mode = kBodyChunked;
+            s.chunked.reset();
+        }
+        else if (parser.getContentLength() >= 0) {
+            s.mode = kBodyLength;
+            s.remain = (uint64_t)parser.getContentLength();
+        }
+        else {
+            // The body ends when the backend closes the connection.
+            s.mode = kBodyUntilClose;
+            s.keep_alive = false;
+        }
+        s.state = kRelayBody;
+        if (!s.cache_key.empty() && s.mode == kBodyLength)
+            this->start_fill(s, parser, data);
+        this->write_response_header(s, parser, data);
+        if (unlikely(s.log_pending))
+            this->log_forwarded(s, (uint32_t)status, (s.mode == kBodyLength) ? s.remain : 0);
+        stats_shard::local().queries.inc();
+    }
+
+    // Log the forwarded request of @s, its request line is the first line
+    // of s.request.
+    void log_forwarded(session & s, uint32_t status, uint64_t body_size) {
+        s.log_pending = false;
+        const char * line = s.request.data();
+        const char * end = line + s.request.size();
+        const char * method_end = (const char *)::memchr(line, ' ', end - line);
+        if (method_end == nullptr)
+            return;
+        const char * uri = method_end + 1;
+        const char * uri_end = (const char *)::memchr(uri, ' ', end - uri);
+        if (uri_end == nullptr)
+            return;
+        access_log::instance().append(*s.conn, StringRef(line, (std::size_t)(method_end - line)),
+                                      StringRef(uri, (std::size_t)(uri_end - uri)),
+                                      s.minor, status, body_size);
+    }
+
+    // Return false to stop reading the upstream connection.
+    bool relay_body(session & s) {
+        upstream_conn * up = s.up;
+        connection & conn = *s.conn;
+        switch (s.mode) {
+        case kBodyLength: {
+            std::size_t n = (std::size_t)std::min<uint64_t>(s.remain, up->size());
+            if (n > 0) {
+                conn.write(up->data(), n);
+                if (s.fill != nullptr)
+                    s.fill->fill(up->data(), n);
+                up->consume(n);
+                s.remain -= n;
+            }
+            if (s.remain == 0) {
+                this->complete(s);
+                return false;
+            }
+            if (s.remain >= kSpliceMinSize && up->size() == 0 && s.fill == nullptr &&
+                this->prepare_pipe(s)) {
+                s.splicing = true;
+                this->mark_dirty(s);
+                this->splice_body(s);
+                return false;
+            }
+            break;
+        }
+        case kBodyChunked: {
+            std::size_t n = s.chunked.scan(up->data(), up->size());
+            if (n > 0) {
+                conn.write(up->data(), n);
+                up->consume(n);
+            }
+            if (unlikely(s.chunked.isError())) {
+                this->finish(s, 502);
+                return false;
+            }
+            if (s.chunked.isDone()) {
+                this->complete(s);
+                return false;
+            }
+            break;
+        }
+        case kBodyUntilClose:
+            conn.write(up->data(), up->size());
+            up->consume(up->size());
+            break;
+        default:
+            this->complete(s);
+            return false;
+        }
+        this->mark_dirty(s);
+        if (conn.pending_write() >= kMaxPendingWrite) {
+            this->wait(s, kWaitWrite);
+            return false;
+        }
+        return true;
+    }
+
+    bool prepare_pipe(session & s) {
+        if (s.pipe == nullptr)
+            s.pipe = pipe_body::create();
+        return (s.pipe != nullptr);
+    }
+
+    //
+    // Splice the body from the backend into the pipe, as far as the pipe has
+    // room, the reactor sends the pipe to the client.
+    //
+    void splice_body(session & s) {
+        connection & conn = *s.conn;
+        pipe_body * pipe = s.pipe;
+        for (;;) {
+            upstream_conn * up = s.up;
+            uint64_t in_pipe = (conn.file == pipe) ? conn.pending_file() : 0;
+            if (in_pipe >= pipe->capacity) {
+                this->wait(s, kWaitPipe, pipe->capacity / 2);
+                return;
+            }
+            std::size_t count = (std::size_t)std::min<uint64_t>(s.remain, pipe->capacity - in_pipe);
+            ssize_t n = ::splice(up->fd, nullptr, pipe->write_fd, nullptr, count,
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (likely(n > 0)) {
+                if (conn.file == pipe)
+                    conn.extend_file((uint64_t)n);
+                else
+                    conn.send_file(pipe, 0, (uint64_t)n);
+                s.remain -= (uint64_t)n;
+                this->schedule_timeout(up);
+                this->mark_dirty(s);
+                if (s.remain == 0) {
+                    this->complete(s);
+                    return;
+                }
+            }
+            else if (n == 0) {
+                this->upstream_failed(s, false);
+                return;
+            }
+            else if (errno == EINTR) {
+                continue;
+            }
+            else if (errno == EAGAIN) {
+                // The pipe may be full before its capacity, its slots hold
+                // partial pages, wait for it to drain if the socket has data.
+                int readable = 0;
+                if (in_pipe > 0 && ::ioctl(up->fd, FIONREAD, &readable) == 0 && readable > 0)
+                    this->wait(s, kWaitPipe, in_pipe / 2);
+                return;
+            }
+            else {
+                this->upstream_failed(s, false);
+                return;
+            }
+        }
+    }
+
+    // The response has been relayed, go on with the next request.
+    void complete(session & s) {
+        bool reusable = (s.up_keep_alive && s.mode != kBodyUntilClose && s.up->size() == 0);
+        this->detach(s, reusable);
+        if (s.fill != nullptr) {
+            if (s.fill->is_complete())
+                this->cache_.insert(s.fill);
+            else
+                s.fill->release();
+            s.fill = nullptr;
+        }
+        s.state = kIdle;
+        s.splicing = false;
+        if (!s.keep_alive)
+            s.close = true;
+        this->mark_dirty(s);
+        if (!s.close)
+            this->start_next(s);
+    }
+
+    static bool is_field(const StringRef & key, const char * name, std::size_t len) {
+        return (key.size() == len && parser_type::equalsIgnoreCase(key.data(), name, len));
+    }
+
+    // Whether @key is one of the comma separated tokens of @list.
+    static bool is_listed(const StringRef & list, const StringRef & key) {
+        const char * cur = list.data();
+        const char * end = list.data() + list.size();
+        while (cur < end) {
+            const char * comma = (const char *)::memchr(cur, ',', end - cur);
+            const char * last = (comma != nullptr) ? comma : end;
+            const char * first = cur;
+            while (first < last && (*first == ' ' || *first == '\t'))
+                first++;
+            while (last > first && (last[-1] == ' ' || last[-1] == '\t'))
+                last--;
+            if ((std::size_t)(last - first) == key.size() &&
+                parser_type::equalsIgnoreCase(first, key.data(), key.size()))
+                return true;
+            cur = (comma != nullptr) ? (comma + 1) : end;
+        }
+        return false;
+    }
+
+    //
+    // The hop-by-hop fields (RFC 7230, 6.1), which are never forwarded: the
+    // standard ones and the ones named by the Connection field.
+    //
+    static bool is_hop_by_hop(const StringRef & key, bool has_connection, const StringRef & connection) {
+        if (is_field(key, "Connection", 10) || is_field(key, "Keep-Alive", 10) ||
+            is_field(key, "Proxy-Connection", 16) || is_field(key, "TE", 2) ||
+            is_field(key, "Trailer", 7) || is_field(key, "Upgrade", 7))
+            return true;
+        return (has_connection && is_listed(connection, key));
+    }
+
+    void build_request(session & s, const parser_type & parser, const char * body,
+                       std::size_t body_size, const upstream_backend & backend) {
+        std::string & out = s.request;
+        StringRef method = parser.getMethodStr();
+        StringRef uri = parser.getURI();
+        out.assign(method.data(), method.size());
+        out += ' ';
+        out.append(uri.data(), uri.size());
+        out += " HTTP/1.1\r\n";
+
+        StringRef connection;
+        bool has_connection = parser.findField("Connection", connection);
+        bool has_host = false;
+        StringRef key, value;
+        for (std::size_t i = 0; i < parser.getFieldSize(); ++i) {
+            parser.getField(i, key, value);
+            // The body has been buffered, the client isn't waiting for a 100.
+            if (is_hop_by_hop(key, has_connection, connection) || is_field(key, "Expect", 6))
+                continue;
+            if (is_field(key, "Host", 4))
+                has_host = true;
+            out.append(key.data(), key.size());
+            out += ": ";
+            out.append(value.data(), value.size());
+            out += "\r\n";
+        }
+        if (!has_host) {
+            out += "Host: ";
+            out += backend.addr.name;
+            out += "\r\n";
+        }
+        // A second X-Forwarded-For field appends to the list of the first.
+        if (!s.client_ip.empty()) {
+            out += "X-Forwarded-For: ";
+            out += s.client_ip;
+            out += "\r\n";
+        }
+        out += "Connection: keep-alive\r\n\r\n";
+        out.append(body, body_size);
+    }
+
+    //
+    // Render the status line, as HTTP/1.1, and the end-to-end fields of the
+    // response to header_, without Connection and the empty line, and also
+    // without Age for the cache.
+    //
+    void render_header(const http::ResponseParser & parser, const char * data, bool for_cache) {
+        std::string & out = this->header_;
+        out.assign("HTTP/1.1", 8);
+        out.append(data + 8, parser.getStatusLineSize() - 8);
+        out += "\r\n";
+
+        StringRef connection;
+        bool has_connection = parser.findField("Connection", connection);
+        StringRef key, value;
+        for (std::size_t i = 0; i < parser.getFieldSize(); ++i) {
+            parser.getField(i, key, value);
+            if (is_hop_by_hop(key, has_connection, connection) ||
+                (for_cache && is_field(key, "Age", 3)))
+                continue;
+            out.append(key.data(), key.size());
+            out += ": ";
+            out.append(value.data(), value.size());
+            out += "\r\n";
+        }
+    }
+
+    void write_response_header(session & s, const http::ResponseParser & parser, const char * data) {
+        this->render_header(parser, data, false);
+        std::string & out = this->header_;
+        out += s.keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        s.conn->write(out.data(), out.size());
+    }
+
+    // Find the field @name of the rewritten request @request.
+    static bool find_request_field(const std::string & request, const char * name,
+                                   std::size_t len, StringRef & value) {
+        const char * end = request.data() + request.size();
+        const char * eol = (const char *)::memmem(request.data(), request.size(), "\r\n", 2);
+        while (eol != nullptr) {
+            const char * cur = eol + 2;
+            eol = (const char *)::memmem(cur, end - cur, "\r\n", 2);
+            if (eol == nullptr || eol == cur) {
+                // The end of the header block.
+                break;
+            }
+            if ((std::size_t)(eol - cur) > len && cur[len] == ':' &&
+                parser_type::equalsIgnoreCase(cur, name, len)) {
+                const char * first = cur + len + 1;
+                while (first < eol && (*first == ' ' || *first == '\t'))
+                    first++;
+                value = StringRef(first, (std::size_t)(eol - first));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //
+    // Answer the request from the response cache if it has a fresh response,
+    // otherwise set the cache key of the session if the response may be
+    // stored. The requests with credentials, a Range or a condition bypass
+    // the cache, and a HEAD request is answered by a cached GET.
+    //
+    bool serve_cached(session & s, const parser_type & parser, uint32_t & status,
+                      uint64_t & body_size) {
+        s.cache_key.clear();
+        StringRef method = parser.getMethodStr();
+        if (!s.is_head && !(method.size() == 3 && ::memcmp(method.data(), "GET", 3) == 0))
+            return false;
+        StringRef value, arg;
+        if (parser.findField("Authorization", value) || parser.findField("Range", value) ||
+            parser.findField("If-None-Match", value) || parser.findField("If-Modified-Since", value))
+            return false;
+
+        bool no_store = false, no_cache = false;
+        if (parser.findField("Cache-Control", value)) {
+            uint64_t max_age = 0;
+            no_store = response_cache::find_directive(value, "no-store");
+            no_cache = (no_store || response_cache::find_directive(value, "no-cache") ||
+                        (response_cache::find_directive(value, "max-age", &arg) &&
+                         response_cache::parse_seconds(arg, max_age) && max_age == 0));
+        }
+        else if (parser.findField("Pragma", value)) {
+            no_cache = response_cache::find_directive(value, "no-cache");
+        }
+
+        std::string & key = s.cache_key;
+        key.assign("GET ", 4);
+        if (parser.findField("Host", value))
+            key.append(value.data(), value.size());
+        StringRef uri = parser.getURI();
+        key.append(uri.data(), uri.size());
+        // The capacity of the string is the padding of the key.
+        key.reserve(key.size() + response_cache::kKeyPadding);
+
+        stats_shard & stats = stats_shard::local();
+        if (!no_cache) {
+            uint64_t now = timer_wheel::monotonic_ms();
+            cache_entry * entry = this->cache_.find(StringRef(key.data(), key.size()), parser, now);
+            if (entry != nullptr) {
+                this->write_cached(s, entry, now);
+                // The header begins with "HTTP/1.1 200".
+                status = (uint32_t)::atoi(entry->header() + 9);
+                body_size = s.is_head ? 0 : entry->body_size;
+                stats.cache_hits.inc();
+                stats.queries.inc();
+                key.clear();
+                return true;
+            }
+        }
+        stats.cache_misses.inc();
+        if (no_store || s.is_head)
+            key.clear();
+        return false;
+    }
+
+    // Queue the cached response, its body by reference unless it's small.
+    void write_cached(session & s, cache_entry * entry, uint64_t now) {
+        connection & conn = *s.conn;
+        conn.write(entry->header(), entry->header_size);
+        char age[32] = "Age: ";
+        char * last = response_header::format_uint((now - entry->date) / 1000, age + 5);
+        *last++ = '\r';
+        *last++ = '\n';
+        conn.write(age, (std::size_t)(last - age));
+        static const char kKeepAlive[] = "Connection: keep-alive\r\n\r\n";
+        static const char kClose[] = "Connection: close\r\n\r\n";
+        if (s.keep_alive)
+            conn.write(kKeepAlive, sizeof(kKeepAlive) - 1);
+        else
+            conn.write(kClose, sizeof(kClose) - 1);
+        if (!s.is_head && entry->body_size > 0) {
+            conn.write_ref(entry->body(), entry->body_size);
+            if (entry->body_size >= write_queue::kMinRefSize) {
+                // Not copied, the entry is held until it's sent.
+                entry->retain();
+                s.pins.push_back(entry);
+                if (!s.pinned) {
+                    s.pinned = true;
+                    this->pinned_.push_back(&s);
+                }
+            }
+        }
+    }
+
+    // Release the cached entries whose bodies have been sent.
+    void unpin_sent() {
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < this->pinned_.size(); ++i) {
+            session * s = this->pinned_[i];
+            if (s->conn->pending_write() == 0) {
+                s->unpin();
+                s->pinned = false;
+            }
+            else {
+                this->pinned_[count++] = s;
+            }
+        }
+        this->pinned_.resize(count);
+    }
+
+    //
+    // Store the response into a new cache entry while it's relayed, if a
+    // shared cache may store it, see response_cache::is_storable().
+    //
+    void start_fill(session & s, const http::ResponseParser & parser, const char * data) {
+        if (s.remain > this->cache_.max_entry_size())
+            return;
+        uint64_t max_age = 0, age = 0;
+        if (!response_cache::is_storable(parser, max_age, age))
+            return;
+        StringRef value;
+
+        // The names of the request fields it varies on, and their values.
+        std::string vary, variant;
+        if (parser.findField("Vary", value)) {
+            const char * cur = value.data();
+            const char * end = value.data() + value.size();
+            while (cur < end) {
+                const char * comma = (const char *)::memchr(cur, ',', end - cur);
+                const char * last = (comma != nullptr) ? comma : end;
+                while (cur < last && (*cur == ' ' || *cur == '\t'))
+                    cur++;
+                while (last > cur && (last[-1] == ' ' || last[-1] == '\t'))
+                    last--;
+                std::size_t len = (std::size_t)(last - cur);
+                if (len == 1 && *cur == '*')
+                    return;
+                if (len != 0) {
+                    for (std::size_t i = 0; i < len; ++i) {
+                        vary += (char)::tolower((unsigned char)cur[i]);
+                    }
+                    vary += '\n';
+                    StringRef field;
+                    if (find_request_field(s.request, cur, len, field))
+                        variant.append(field.data(), field.size());
+                    variant += '\n';
+                }
+                cur = (comma != nullptr) ? (comma + 1) : end;
+            }
+        }
+
+        this->render_header(parser, data, true);
+        cache_entry * entry = this->cache_.create(StringRef(s.cache_key.data(), s.cache_key.size()),
+                                                  this->header_, (std::size_t)s.remain);
+        if (entry == nullptr)
+            return;
+        uint64_t now = timer_wheel::monotonic_ms();
+        entry->vary.swap(vary);
+        entry->variant.swap(variant);
+        entry->date = (now > age * 1000) ? (now - age * 1000) : 0;
+        entry->expires = entry->date + max_age * 1000;
+        s.fill = entry;
+    }
+};
+
+} // namespace jimi
+
+#endif // __linux__
@@ -0,0 +1,203 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "jimi/basic/stddef.h"
+
+#include "timer_wheel.hpp"
+#include "server_stats.hpp"
+
+namespace jimi {
+
+//
+// The token buckets of the clients, shared by all the reactor threads
+// without a lock.
+//
+// The buckets are the slots of a fixed table, probed linearly from the hash
+// of the client key: the client address, or the value of a request field
+// such as an API key. A slot holds the key, and a 64-bit state word which
+// packs the time of its last update (in ms, the high 32 bits) with its
+// tokens (in 1/1000 of a token, the low 32 bits), it's only updated with a
+// CAS. A request takes one token, the tokens refill at the rate up to the
+// burst.
+//
+// A free slot is claimed with a CAS of its key. A bucket which hasn't been
+// used for the time to refill it is full, the same as a new one, so the
+// next key probing it takes it over: the stale buckets are evicted lazily.
+// If all the probed slots hold live buckets, the request is admitted and
+// counted as an overflow (see stats_shard).
+//
+class rate_limiter {
+public:
+    static const uint32_t kDefaultSlots = 1U << 17;
+    static const uint32_t kProbes = 16;
+    // The tokens are counted in 1/kUnit of a token.
+    static const uint64_t kUnit = 1000;
+    static const uint64_t kMaxBurst = 0xFFFFFFFFULL / kUnit;
+    // How far behind the others the clock of a thread may be, in ms.
+    static const uint32_t kMaxClockSkew = 10 * 1000;
+
+private:
+    struct slot {
+        std::atomic<uint64_t> key;
+        std::atomic<uint64_t> state;
+    };
+
+    std::unique_ptr<slot[]> slots_;
+    uint64_t                mask_;
+    // In tokens per second, which is kUnit per ms.
+    uint64_t                rate_;
+    // In kUnit.
+    uint64_t                burst_;
+    // The time to refill an empty bucket, in ms.
+    uint64_t                refill_ms_;
+    uint64_t                start_ms_;
+    std::string             key_field_;
+
+public:
+    rate_limiter() : mask_(0), rate_(0), burst_(0), refill_ms_(0), start_ms_(0) {}
+    ~rate_limiter() {}
+
+    static rate_limiter & instance() {
+        static rate_limiter limiter;
+        return limiter;
+    }
+
+    //
+    // Limit each client to @rate requests per second, with bursts of @burst
+    // requests (@rate if it's 0), keyed by the request field @key_field, or
+    // by the client address if it's "" or the request has no such field.
+    // Call it before the reactors start.
+    //
+    void configure(uint32_t rate, uint32_t burst, const std::string & key_field,
+                   uint32_t slots = kDefaultSlots) {
+        uint32_t size = 1;
+        while (size < slots)
+            size <<= 1;
+        if (burst == 0)
+            burst = rate;
+        this->rate_ = rate;
+        this->burst_ = ((burst < kMaxBurst) ? burst : kMaxBurst) * kUnit;
+        this->refill_ms_ = (rate != 0) ? ((this->burst_ + this->rate_ - 1) / this->rate_) : 0;
+        this->start_ms_ = timer_wheel::monotonic_ms();
+        this->key_field_ = key_field;
+        this->slots_.reset(new slot[size]);
+        this->mask_ = size - 1;
+        // A new bucket is full.
+        for (uint32_t i = 0; i < size; ++i) {
+            this->slots_[i].key.store(0, std::memory_order_relaxed);
+            this->slots_[i].state.store(pack(0, this->burst_), std::memory_order_relaxed);
+        }
+    }
+
+    bool enabled() const { return (this->rate_ != 0); }
+
+    const std::string & key_field() const { return this->key_field_; }
+
+    // Take a token from the bucket of the client @key, return false if it's empty.
+    bool acquire(uint64_t key, uint64_t now_ms) {
+        // 0 marks a free slot.
+        if (unlikely(key == 0))
+            key = 1;
+        uint32_t now = (uint32_t)(now_ms - this->start_ms_);
+        slot * bucket = this->find(key, now);
+        if (unlikely(bucket == nullptr)) {
+            stats_shard::local().rate_overflows.inc();
+            return true;
+        }
+        uint64_t state = bucket->state.load(std::memory_order_relaxed);
+        for (;;) {
+            uint32_t last = (uint32_t)(state >> 32);
+            uint64_t tokens = this->refill(state, now);
+            if (tokens < kUnit)
+                return false;
+            uint32_t time = is_behind(last, now) ? last : now;
+            if (bucket->state.compare_exchange_weak(state, pack(time, tokens - kUnit),
+                                                    std::memory_order_relaxed))
+                return true;
+        }
+    }
+
+    // The FNV-1a hash of a client key, with a final mix.
+    static uint64_t hash(const void * data, std::size_t size) {
+        const unsigned char * bytes = (const unsigned char *)data;
+        uint64_t hash = 14695981039346656037ULL;
+        for (std::size_t i = 0; i < size; ++i) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+private:
+    static uint64_t pack(uint32_t time, uint64_t tokens) {
+        return (((uint64_t)time << 32) | tokens);
+    }
+
+    // Whether @now is not after @last: the clocks of the threads may be a little
+    // behind each other. Further behind, it's a bucket idle for over 2^31 ms.
+    static bool is_behind(uint32_t last, uint32_t now) {
+        int32_t elapsed = (int32_t)(now - last);
+        return (elapsed <= 0 && elapsed >= -(int32_t)kMaxClockSkew);
+    }
+
+    // The tokens of @state at @now, the time is wrapped every 49 days.
+    uint64_t refill(uint64_t state, uint32_t now) const {
+        uint32_t last = (uint32_t)(state >> 32);
+        uint64_t tokens = (state & 0xFFFFFFFFULL);
+        if (!is_behind(last, now)) {
+            uint32_t elapsed = now - last;
+            if ((uint64_t)elapsed >= this->refill_ms_)
+                return this->burst_;
+            tokens += (uint64_t)elapsed * this->rate_;
+            if (tokens > this->burst_)
+                tokens = this->burst_;
+        }
+        return tokens;
+    }
+
+    bool is_stale(const slot & s, uint32_t now) const {
+        uint64_t state = s.state.load(std::memory_order_relaxed);
+        return (this->refill(state, now) == this->burst_);
+    }
+
+    slot * find(uint64_t key, uint32_t now) {
+        slot * stale = nullptr;
+        uint64_t index = key;
+        for (uint32_t i = 0; i < kProbes; ++i, ++index) {
+            slot & s = this->slots_[index & this->mask_];
+            uint64_t owner = s.key.load(std::memory_order_acquire);
+            if (owner == key)
+                return &s;
+            if (owner == 0) {
+                if (s.key.compare_exchange_strong(owner, key, std::memory_order_acq_rel) ||
+                    owner == key)
+                    return &s;
+            }
+            else if (stale == nullptr && this->is_stale(s, now)) {
+                stale = &s;
+            }
+        }
+        if (stale != nullptr) {
+            // A full bucket, it's handed over as it is.
+            uint64_t owner = stale->key.load(std::memory_order_acquire);
+            if (this->is_stale(*stale, now) &&
+                (stale->key.compare_exchange_strong(owner, key, std::memory_order_acq_rel) ||
+                 owner == key))
+                return stale;
+        }
+        return nullptr;
+    }
+};
+
+} // namespace jimi
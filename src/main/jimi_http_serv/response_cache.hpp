@@ -0,0 +1,373 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#include <cstddef>
+#include <string>
+
+#include "jimi/basic/stddef.h"
+#include "jimi/StringRef.h"
+#include "jimi/jstd/dictionary.h"
+
+#include "buffer_pool.hpp"
+
+#if !defined(STRING_COMPARE_MODE) || (STRING_COMPARE_MODE == STRING_COMPARE_STDC)
+#error "The keys of the response cache aren't null terminated, see STRING_COMPARE_MODE in main.cpp."
+#endif
+
+namespace jimi {
+
+//
+// A cached response, serialized in one block borrowed from the buffer_pool:
+// the key, the status line and the header fields, each one ending with a
+// CRLF, but without Connection and Age, which are written per hit, and the
+// body.
+//
+// The entries are reference counted: a hit whose body is queued by reference
+// (see write_queue::write_ref()) holds its entry until the body is sent, an
+// entry evicted or replaced meanwhile is freed then.
+//
+class cache_entry {
+public:
+    cache_entry *   prev;           // The LRU list of the cache.
+    cache_entry *   next;
+    cache_entry *   next_variant;   // The next variant of the same key.
+    io_buffer       block;
+    uint32_t        key_size;
+    uint32_t        header_size;
+    uint32_t        body_size;
+    // The bytes of the body received so far.
+    uint32_t        filled;
+    uint32_t        refs;
+    // The names of the Vary fields of the response, in lowercase, and the
+    // values of these fields in the request it has answered, each one ending
+    // with a '\n'.
+    std::string     vary;
+    std::string     variant;
+    // In ms of timer_wheel::monotonic_ms(): when the backend has generated
+    // it (when it was received, minus its Age), and when it goes stale.
+    uint64_t        date;
+    uint64_t        expires;
+
+    cache_entry()
+        : prev(nullptr), next(nullptr), next_variant(nullptr), key_size(0), header_size(0),
+          body_size(0), filled(0), refs(1), date(0), expires(0) {}
+    ~cache_entry() {
+        buffer_pool::local().give_back(this->block);
+    }
+
+    StringRef key() const { return StringRef(this->block.data, this->key_size); }
+    const char * header() const { return (this->block.data + this->key_size); }
+    const char * body() const { return (this->block.data + this->key_size + this->header_size); }
+    char * body() { return (this->block.data + this->key_size + this->header_size); }
+
+    bool is_complete() const { return (this->filled == this->body_size); }
+
+    // The memory charged to the cache.
+    std::size_t charge() const {
+        return (sizeof(cache_entry) + this->block.capacity + this->vary.size() + this->variant.size());
+    }
+
+    void retain() { this->refs++; }
+    void release() {
+        assert(this->refs > 0);
+        if (--this->refs == 0)
+            delete this;
+    }
+
+    // Append the value @data of @size bytes to the body.
+    void fill(const char * data, std::size_t size) {
+        assert(this->filled + size <= this->body_size);
+        ::memcpy(this->body() + this->filled, data, size);
+        this->filled += (uint32_t)size;
+    }
+};
+
+//
+// The per-reactor cache of the full responses, bounded by the bytes of its
+// entries, evicted least recently used first.
+//
+// The entries are indexed by "method host uri" in a jstd::dictionary, hashed
+// with CRC32C when SSE 4.2 is supported. The responses which vary on some
+// request fields (Vary) are chained under the same key, a lookup takes the
+// first fresh one whose fields match the request. A stale entry is dropped
+// when it's found, the freshness is only given by s-maxage or max-age.
+//
+// Only the proxy_handler has one, in front of the backends: the http handler
+// answers with pre-rendered responses and the static file handler from the
+// page cache, a lookup would cost them more than it saves.
+//
+class response_cache {
+public:
+    typedef std::size_t size_type;
+
+#if SUPPORT_SSE42_CRC32C
+    typedef jstd::basic_dictionary<StringRef, cache_entry *, jstd::HashFunc_CRC32C> table_type;
+#else
+    typedef jstd::basic_dictionary<StringRef, cache_entry *, jstd::HashFunc_Time31> table_type;
+#endif
+
+    // The limit of an entry, and of 1/8 of the capacity.
+    static const size_type kMaxEntrySize = 1024 * 1024;
+    // The keys are compared 16 bytes at a time (STRING_COMPARE_SSE42), so
+    // there must be 16 readable bytes after the end of every key.
+    static const size_type kKeyPadding = 16;
+
+private:
+    // The key of the table is the key of the first variant of the chain.
+    table_type  table_;
+    // The sentinel of the LRU list, its next is the most recently used.
+    cache_entry lru_;
+    size_type   capacity_;
+    size_type   size_;
+    size_type   count_;
+
+public:
+    response_cache(size_type capacity) : capacity_(capacity), size_(0), count_(0) {
+        this->lru_.prev = &this->lru_;
+        this->lru_.next = &this->lru_;
+    }
+
+    ~response_cache() {
+        while (this->lru_.prev != &this->lru_) {
+            this->remove(this->lru_.prev);
+        }
+    }
+
+    bool enabled() const { return (this->capacity_ != 0); }
+
+    size_type capacity() const { return this->capacity_; }
+    size_type size() const { return this->size_; }
+    size_type count() const { return this->count_; }
+
+    size_type max_entry_size() const {
+        size_type limit = this->capacity_ / 8;
+        return ((limit < kMaxEntrySize) ? limit : kMaxEntrySize);
+    }
+
+    //
+    // A fresh entry of @key whose Vary fields have the values of @request,
+    // or nullptr. @request is a parser with findField(name, len, value).
+    // @key must be followed by kKeyPadding readable bytes.
+    //
+    template <typename Request>
+    cache_entry * find(const StringRef & key, const Request & request, uint64_t now) {
+        cache_entry * entry = this->first(key);
+        while (entry != nullptr) {
+            cache_entry * next = entry->next_variant;
+            if (entry->expires <= now) {
+                this->remove(entry);
+            }
+            else if (matches(*entry, request)) {
+                this->touch(entry);
+                return entry;
+            }
+            entry = next;
+        }
+        return nullptr;
+    }
+
+    //
+    // A new entry of @key with the header @header, to fill with a body of
+    // @body_size bytes, or nullptr if it's too big. It's owned by the caller
+    // until it's inserted, or released.
+    //
+    cache_entry * create(const StringRef & key, const std::string & header, size_type body_size) {
+        size_type size = key.size() + header.size() + body_size;
+        if (size > this->max_entry_size())
+            return nullptr;
+        cache_entry * entry = new cache_entry;
+        entry->block = buffer_pool::local().borrow(size + kKeyPadding);
+        if (unlikely(entry->block.empty())) {
+            delete entry;
+            return nullptr;
+        }
+        ::memcpy(entry->block.data, key.data(), key.size());
+        ::memcpy(entry->block.data + key.size(), header.data(), header.size());
+        entry->key_size = (uint32_t)key.size();
+        entry->header_size = (uint32_t)header.size();
+        entry->body_size = (uint32_t)body_size;
+        return entry;
+    }
+
+    // Take the complete @entry from create(), it replaces the variant which
+    // has answered the same request.
+    void insert(cache_entry * entry) {
+        assert(entry->is_complete());
+        StringRef key = entry->key();
+        for (cache_entry * variant = this->first(key); variant != nullptr;
+             variant = variant->next_variant) {
+            if (variant->vary == entry->vary && variant->variant == entry->variant) {
+                this->remove(variant);
+                break;
+            }
+        }
+        size_type charge = entry->charge();
+        while (this->size_ + charge > this->capacity_ && this->lru_.prev != &this->lru_) {
+            this->remove(this->lru_.prev);
+        }
+
+        cache_entry * head = this->first(key);
+        if (head != nullptr)
+            this->table_.erase(key);
+        entry->next_variant = head;
+        this->table_.insert(key, entry);
+
+        entry->prev = &this->lru_;
+        entry->next = this->lru_.next;
+        this->lru_.next->prev = entry;
+        this->lru_.next = entry;
+        this->size_ += charge;
+        this->count_++;
+    }
+
+    //
+    // Find the directive @name of a Cache-Control (or Pragma) field, and its
+    // argument, without the quotes, if @arg isn't nullptr.
+    //
+    static bool find_directive(const StringRef & list, const char * name, StringRef * arg = nullptr) {
+        std::size_t len = ::strlen(name);
+        const char * cur = list.data();
+        const char * end = list.data() + list.size();
+        while (cur < end) {
+            const char * comma = (const char *)::memchr(cur, ',', end - cur);
+            const char * last = (comma != nullptr) ? comma : end;
+            while (cur < last && (*cur == ' ' || *cur == '\t'))
+                cur++;
+            if ((std::size_t)(last - cur) >= len && ::strncasecmp(cur, name, len) == 0) {
+                const char * rest = cur + len;
+                while (rest < last && (*rest == ' ' || *rest == '\t'))
+                    rest++;
+                if (rest == last || *rest == '=') {
+                    if (arg != nullptr) {
+                        const char * first = (rest < last) ? (rest + 1) : last;
+                        while (first < last && (*first == ' ' || *first == '"'))
+                            first++;
+                        const char * stop = last;
+                        while (stop > first && (stop[-1] == ' ' || stop[-1] == '\t' || stop[-1] == '"'))
+                            stop--;
+                        *arg = StringRef(first, (std::size_t)(stop - first));
+                    }
+                    return true;
+                }
+            }
+            cur = (comma != nullptr) ? (comma + 1) : end;
+        }
+        return false;
+    }
+
+    //
+    // Whether a shared cache may store the response @response: a status which
+    // is cacheable by default, an explicit lifetime (s-maxage or max-age) over
+    // its Age, and no private data. @response is a parser with getStatusCode()
+    // and findField(name, value).
+    //
+    template <typename Response>
+    static bool is_storable(const Response & response, uint64_t & max_age, uint64_t & age) {
+        int status = response.getStatusCode();
+        if (status != 200 && status != 203 && status != 301 && status != 404 && status != 410)
+            return false;
+        StringRef value, arg;
+        if (response.findField("Set-Cookie", value) || !response.findField("Cache-Control", value))
+            return false;
+        if (find_directive(value, "no-store") || find_directive(value, "no-cache") ||
+            find_directive(value, "private"))
+            return false;
+        if (!(find_directive(value, "s-maxage", &arg) || find_directive(value, "max-age", &arg)) ||
+            !parse_seconds(arg, max_age))
+            return false;
+        age = 0;
+        if (response.findField("Age", value) && !parse_seconds(value, age))
+            return false;
+        return (age < max_age);
+    }
+
+    // Parse the seconds of max-age or Age, return false if it's not a number.
+    static bool parse_seconds(const StringRef & value, uint64_t & seconds) {
+        if (value.size() == 0 || value.size() > 10)
+            return false;
+        uint64_t n = 0;
+        for (std::size_t i = 0; i < value.size(); ++i) {
+            char ch = value.data()[i];
+            if (ch < '0' || ch > '9')
+                return false;
+            n = n * 10 + (uint64_t)(ch - '0');
+        }
+        seconds = n;
+        return true;
+    }
+
+private:
+    cache_entry * first(const StringRef & key) {
+        typename table_type::iterator iter = this->table_.find(key);
+        return ((iter != this->table_.end()) ? iter->pair.second : nullptr);
+    }
+
+    void touch(cache_entry * entry) {
+        if (this->lru_.next != entry) {
+            entry->prev->next = entry->next;
+            entry->next->prev = entry->prev;
+            entry->prev = &this->lru_;
+            entry->next = this->lru_.next;
+            this->lru_.next->prev = entry;
+            this->lru_.next = entry;
+        }
+    }
+
+    void remove(cache_entry * entry) {
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+        entry->prev = nullptr;
+        entry->next = nullptr;
+        this->size_ -= entry->charge();
+        this->count_--;
+
+        StringRef key = entry->key();
+        cache_entry * head = this->first(key);
+        assert(head != nullptr);
+        if (head == entry) {
+            // The key of the table points into the first variant.
+            this->table_.erase(key);
+            if (entry->next_variant != nullptr)
+                this->table_.insert(entry->next_variant->key(), entry->next_variant);
+        }
+        else {
+            cache_entry * prev = head;
+            while (prev->next_variant != entry) {
+                prev = prev->next_variant;
+            }
+            prev->next_variant = entry->next_variant;
+        }
+        entry->next_variant = nullptr;
+        entry->release();
+    }
+
+    template <typename Request>
+    static bool matches(const cache_entry & entry, const Request & request) {
+        const char * name = entry.vary.data();
+        const char * name_end = name + entry.vary.size();
+        const char * value = entry.variant.data();
+        const char * value_end = value + entry.variant.size();
+        while (name < name_end && value < value_end) {
+            const char * name_last = (const char *)::memchr(name, '\n', name_end - name);
+            const char * value_last = (const char *)::memchr(value, '\n', value_end - value);
+            assert(name_last != nullptr && value_last != nullptr);
+            StringRef field;
+            std::size_t size = 0;
+            if (request.findField(name, (std::size_t)(name_last - name), field))
+                size = field.size();
+            if (size != (std::size_t)(value_last - value) ||
+                (size != 0 && ::memcmp(field.data(), value, size) != 0))
+                return false;
+            name = name_last + 1;
+            value = value_last + 1;
+        }
+        return true;
+    }
+};
+
+} // namespace jimi
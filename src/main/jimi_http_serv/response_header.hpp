@@ -0,0 +1,301 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <cstddef>
+#include <new>
+#include <string>
+
+#include "jimi/basic/stddef.h"
+#include "jimi/StringRef.h"
+
+#include "http_date.hpp"
+
+namespace jimi {
+
+//
+// The pre-rendered status lines, "HTTP/1.1 200 OK\r\n", indexed by status.
+//
+class status_lines {
+public:
+    typedef std::size_t size_type;
+
+    static const uint32_t kMinStatus = 100;
+    static const uint32_t kMaxStatus = 599;
+
+private:
+    struct line_t {
+        uint32_t     status;
+        const char * line;
+        uint32_t     size;
+    };
+
+    // The index + 1 of the line of each status, 0 if it has none.
+    uint8_t index_[kMaxStatus - kMinStatus + 1];
+
+#define JIMI_STATUS_LINE(status, reason) \
+    { status, "HTTP/1.1 " #status " " reason "\r\n", sizeof("HTTP/1.1 " #status " " reason "\r\n") - 1 }
+
+    static const line_t * lines(size_type & count) {
+        static const line_t kLines[] = {
+            JIMI_STATUS_LINE(100, "Continue"),
+            JIMI_STATUS_LINE(101, "Switching Protocols"),
+            JIMI_STATUS_LINE(200, "OK"),
+            JIMI_STATUS_LINE(201, "Created"),
+            JIMI_STATUS_LINE(202, "Accepted"),
+            JIMI_STATUS_LINE(204, "No Content"),
+            JIMI_STATUS_LINE(206, "Partial Content"),
+            JIMI_STATUS_LINE(301, "Moved Permanently"),
+            JIMI_STATUS_LINE(302, "Found"),
+            JIMI_STATUS_LINE(303, "See Other"),
+            JIMI_STATUS_LINE(304, "Not Modified"),
+            JIMI_STATUS_LINE(307, "Temporary Redirect"),
+            JIMI_STATUS_LINE(308, "Permanent Redirect"),
+            JIMI_STATUS_LINE(400, "Bad Request"),
+            JIMI_STATUS_LINE(401, "Unauthorized"),
+            JIMI_STATUS_LINE(403, "Forbidden"),
+            JIMI_STATUS_LINE(404, "Not Found"),
+            JIMI_STATUS_LINE(405, "Method Not Allowed"),
+            JIMI_STATUS_LINE(408, "Request Timeout"),
+            JIMI_STATUS_LINE(411, "Length Required"),
+            JIMI_STATUS_LINE(412, "Precondition Failed"),
+            JIMI_STATUS_LINE(413, "Payload Too Large"),
+            JIMI_STATUS_LINE(414, "URI Too Long"),
+            JIMI_STATUS_LINE(416, "Range Not Satisfiable"),
+            JIMI_STATUS_LINE(429, "Too Many Requests"),
+            JIMI_STATUS_LINE(431, "Request Header Fields Too Large"),
+            JIMI_STATUS_LINE(500, "Internal Server Error"),
+            JIMI_STATUS_LINE(501, "Not Implemented"),
+            JIMI_STATUS_LINE(502, "Bad Gateway"),
+            JIMI_STATUS_LINE(503, "Service Unavailable"),
+            JIMI_STATUS_LINE(504, "Gateway Timeout")
+        };
+        count = sizeof(kLines) / sizeof(kLines[0]);
+        return kLines;
+    }
+
+#undef JIMI_STATUS_LINE
+
+    status_lines() {
+        ::memset(this->index_, 0, sizeof(this->index_));
+        size_type count;
+        const line_t * table = lines(count);
+        for (size_type i = 0; i < count; ++i) {
+            this->index_[table[i].status - kMinStatus] = (uint8_t)(i + 1);
+        }
+    }
+
+public:
+    static const status_lines & instance() {
+        static const status_lines table;
+        return table;
+    }
+
+    // The status line of @status, empty if it isn't in the table.
+    StringRef find(uint32_t status) const {
+        if (likely(status >= kMinStatus && status <= kMaxStatus)) {
+            uint8_t index = this->index_[status - kMinStatus];
+            if (likely(index != 0)) {
+                size_type count;
+                const line_t & line = lines(count)[index - 1];
+                return StringRef(line.line, line.size);
+            }
+        }
+        return StringRef();
+    }
+};
+
+//
+// The builder of the response header blocks, into an output buffer which
+// is reused by all the responses of the thread (see local()): it only grows,
+// so the fields are appended without an allocation.
+//
+// The status line comes from status_lines, the Date field from the cached
+// one of http_date, and the numbers are rendered two digits at a time by
+// format_uint(), without snprintf() or std::to_string().
+//
+class response_header {
+public:
+    typedef std::size_t size_type;
+
+    static const size_type kInitCapacity = 1024;
+    // The digits of UINT64_MAX.
+    static const size_type kMaxDigits = 20;
+
+private:
+    char *      data_;
+    size_type   size_;
+    size_type   capacity_;
+
+public:
+    response_header(size_type capacity = kInitCapacity)
+        : data_(nullptr), size_(0), capacity_(0) {
+        this->reserve(capacity);
+    }
+    ~response_header() {
+        ::free(this->data_);
+    }
+
+    // The buffer of the current thread, the header built in it is copied
+    // out (see connection::write()) before the next one is begun.
+    static response_header & local() {
+        static thread_local response_header header;
+        return header;
+    }
+
+    const char * data() const { return this->data_; }
+    size_type size() const { return this->size_; }
+
+    void clear() { this->size_ = 0; }
+
+    // Begin with the status line of @status, and the Server field.
+    void begin(uint32_t status) {
+        this->size_ = 0;
+        StringRef line = status_lines::instance().find(status);
+        if (likely(line.size() != 0)) {
+            this->append(line.data(), line.size());
+        }
+        else {
+            this->append("HTTP/1.1 ", 9);
+            this->append_uint(status);
+            this->append(" Unknown\r\n", 10);
+        }
+        this->append_server();
+    }
+
+    void add_field(const char * name, size_type name_size, const char * value, size_type value_size) {
+        this->reserve(this->size_ + name_size + value_size + 4);
+        char * cur = this->data_ + this->size_;
+        ::memcpy(cur, name, name_size);
+        cur += name_size;
+        *cur++ = ':';
+        *cur++ = ' ';
+        ::memcpy(cur, value, value_size);
+        cur += value_size;
+        *cur++ = '\r';
+        *cur++ = '\n';
+        this->size_ = (size_type)(cur - this->data_);
+    }
+
+    template <size_type N, size_type M>
+    void add_field(const char (&name)[N], const char (&value)[M]) {
+        this->add_field(name, N - 1, value, M - 1);
+    }
+
+    template <size_type N>
+    void add_field(const char (&name)[N], const StringRef & value) {
+        this->add_field(name, N - 1, value.data(), value.size());
+    }
+
+    template <size_type N>
+    void add_field(const char (&name)[N], const std::string & value) {
+        this->add_field(name, N - 1, value.data(), value.size());
+    }
+
+    template <size_type N>
+    void add_field(const char (&name)[N], uint64_t value) {
+        this->reserve(this->size_ + N + 2 + kMaxDigits + 2);
+        this->append(name, N - 1);
+        this->append(": ", 2);
+        this->append_uint(value);
+        this->append("\r\n", 2);
+    }
+
+    void add_content_length(uint64_t length) {
+        this->add_field("Content-Length", length);
+    }
+
+    void add_connection(bool keep_alive) {
+        static const char kKeepAlive[] = "Connection: keep-alive\r\n";
+        static const char kClose[] = "Connection: close\r\n";
+        if (likely(keep_alive))
+            this->append(kKeepAlive, sizeof(kKeepAlive) - 1);
+        else
+            this->append(kClose, sizeof(kClose) - 1);
+    }
+
+    // The cached Date field of the thread, call http_date::update() first.
+    void add_date() {
+        const http_date & date = http_date::local();
+        this->append(date.field(), date.field_size());
+    }
+
+    // The empty line at the end of the header block.
+    void end() {
+        this->append("\r\n", 2);
+    }
+
+    // Append the header fields @data, each one ending with a CRLF.
+    void append(const char * data, size_type size) {
+        this->reserve(this->size_ + size);
+        ::memcpy(this->data_ + this->size_, data, size);
+        this->size_ += size;
+    }
+
+    void append_uint(uint64_t value) {
+        this->reserve(this->size_ + kMaxDigits);
+        this->size_ = (size_type)(format_uint(value, this->data_ + this->size_) - this->data_);
+    }
+
+    //
+    // Write the decimal digits of @value to @buf, which has room for
+    // kMaxDigits, and return the end of them.
+    //
+    static char * format_uint(uint64_t value, char * buf) {
+        static const char kDigits[] =
+            "00010203040506070809"
+            "10111213141516171819"
+            "20212223242526272829"
+            "30313233343536373839"
+            "40414243444546474849"
+            "50515253545556575859"
+            "60616263646566676869"
+            "70717273747576777879"
+            "80818283848586878889"
+            "90919293949596979899";
+        char digits[kMaxDigits];
+        char * cur = digits + kMaxDigits;
+        while (value >= 100) {
+            uint32_t i = (uint32_t)(value % 100) * 2;
+            value /= 100;
+            *--cur = kDigits[i + 1];
+            *--cur = kDigits[i];
+        }
+        if (value >= 10) {
+            uint32_t i = (uint32_t)value * 2;
+            *--cur = kDigits[i + 1];
+            *--cur = kDigits[i];
+        }
+        else {
+            *--cur = (char)('0' + value);
+        }
+        size_type size = (size_type)(digits + kMaxDigits - cur);
+        ::memcpy(buf, cur, size);
+        return (buf + size);
+    }
+
+private:
+    void append_server() {
+        static const char kServer[] = "Server: jimi_http_serv\r\n";
+        this->append(kServer, sizeof(kServer) - 1);
+    }
+
+    void reserve(size_type capacity) {
+        if (unlikely(capacity > this->capacity_)) {
+            size_type new_capacity = (this->capacity_ != 0) ? this->capacity_ : kInitCapacity;
+            while (new_capacity < capacity)
+                new_capacity *= 2;
+            char * data = (char *)::realloc(this->data_, new_capacity);
+            if (data == nullptr)
+                throw std::bad_alloc();
+            this->data_ = data;
+            this->capacity_ = new_capacity;
+        }
+    }
+};
+
+} // namespace jimi
@@ -0,0 +1,259 @@
+
+#pragma once
+
+#if defined(__linux__)
+
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <iostream>
+
+#include "server_config.hpp"
+#include "socket_utils.hpp"
+#include "epoll_reactor.hpp"
+#include "uring_reactor.hpp"
+#include "server_stats.hpp"
+#include "cpu_affinity.hpp"
+#include "control_mailbox.hpp"
+#include "offload_pool.hpp"
+#include "rate_limiter.hpp"
+#include "access_log.hpp"
+
+namespace jimi {
+
+static inline
+std::atomic<bool> & server_stop_flag()
+{
+    static std::atomic<bool> s_stop(false);
+    return s_stop;
+}
+
+// Set by SIGHUP, the main thread asks the reactors to flush their caches.
+static inline
+std::atomic<bool> & server_reload_flag()
+{
+    static std::atomic<bool> s_reload(false);
+    return s_reload;
+}
+
+static inline
+void server_signal_handler(int sig)
+{
+    if (sig == SIGHUP)
+        server_reload_flag().store(true, std::memory_order_relaxed);
+    else
+        server_stop_flag().store(true, std::memory_order_relaxed);
+}
+
+static inline
+void install_server_signals()
+{
+    struct sigaction action;
+    ::memset(&action, 0, sizeof(action));
+    action.sa_handler = server_signal_handler;
+    ::sigemptyset(&action.sa_mask);
+    ::sigaction(SIGINT, &action, nullptr);
+    ::sigaction(SIGTERM, &action, nullptr);
+    ::sigaction(SIGHUP, &action, nullptr);
+
+    // The send()s use MSG_NOSIGNAL, but ignore SIGPIPE anyway.
+    ::signal(SIGPIPE, SIG_IGN);
+}
+
+// The control messages which may wait for a reactor, and how often the main
+// thread checks the signals.
+static const uint32_t kMailboxSize = 64;
+static const uint32_t kMainPollMs = 100;
+
+//
+// Run config.thread_num reactors, one per thread, until SIGINT or SIGTERM.
+//
+// If config.reuse_port is true, every reactor listens on its own SO_REUSEPORT
+// socket, otherwise they share one listening socket and wait on it with
+// EPOLLEXCLUSIVE, so that only one reactor is woken up per connection.
+//
+// Each reactor is created, opened and destroyed by its own thread, after the
+// thread has been placed by config.cpu_affinity and config.numa, so all its
+// memory is allocated on the node it runs on. A reactor pinned to one CPU has
+// its SO_REUSEPORT socket steered to that CPU with SO_INCOMING_CPU.
+//
+// The reactors share nothing on the request path. The only cross-thread work
+// is posted to the control mailbox of each reactor by the main thread, e.g.
+// the cache flush on SIGHUP, the stats shards are summed by the stats
+// aggregator thread, and the access log records are drained by its writer
+// thread. With config.offload_threads, the slow jobs of the
+// handlers run on the offload pool and come back to the inbox of their
+// reactor.
+//
+template <typename Reactor>
+int run_reactors(const server_config & config)
+{
+    typedef Reactor reactor_type;
+
+    install_server_signals();
+    std::atomic<bool> & stop = server_stop_flag();
+
+    int shared_listen_fd = -1;
+    if (!config.reuse_port) {
+        shared_listen_fd = create_listen_socket(config.host, config.port, false);
+        if (shared_listen_fd < 0)
+            return -1;
+    }
+
+    uint32_t thread_num = (config.thread_num > 0) ? config.thread_num : 1;
+    cpu_placement placement;
+    if (!placement.init(config.cpu_affinity, config.numa != 0, thread_num)) {
+        if (shared_listen_fd >= 0)
+            ::close(shared_listen_fd);
+        return -1;
+    }
+
+    if (!config.access_log.empty() && !access_log::instance().open(config.access_log)) {
+        if (shared_listen_fd >= 0)
+            ::close(shared_listen_fd);
+        return -1;
+    }
+
+    stats_aggregator aggregator(config.stats_interval);
+    std::thread stats_thread([&aggregator, &stop]() {
+        aggregator.run(stop);
+    });
+
+    std::vector<std::unique_ptr<control_mailbox>> mailboxes;
+    for (uint32_t i = 0; i < thread_num; ++i) {
+        mailboxes.push_back(std::unique_ptr<control_mailbox>(new control_mailbox(kMailboxSize)));
+    }
+
+    // The pool is stopped after the reactors, and before their inboxes are gone.
+    std::vector<std::unique_ptr<offload_inbox>> inboxes;
+    std::unique_ptr<offload_pool> pool;
+    if (config.offload_threads > 0) {
+        for (uint32_t i = 0; i < thread_num; ++i) {
+            inboxes.push_back(std::unique_ptr<offload_inbox>(new offload_inbox()));
+            if (!inboxes[i]->open()) {
+                stop.store(true, std::memory_order_relaxed);
+                stats_thread.join();
+                if (shared_listen_fd >= 0)
+                    ::close(shared_listen_fd);
+                return -1;
+            }
+        }
+        pool.reset(new offload_pool());
+        pool->start(config.offload_threads);
+        offload_pool::current() = pool.get();
+    }
+
+    // The buckets are shared by all the reactors.
+    if (config.rate_limit > 0)
+        rate_limiter::instance().configure(config.rate_limit, config.rate_burst, config.rate_key);
+
+    // The writer of the access log is stopped after the reactors, to drain
+    // their last records.
+    std::atomic<bool> log_stop(false);
+    std::thread log_thread;
+    if (access_log::instance().is_open()) {
+        log_thread = std::thread([&log_stop]() {
+            access_log::instance().run(log_stop);
+        });
+    }
+
+    std::atomic<uint32_t> failed(0);
+    std::atomic<uint32_t> running(thread_num);
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < thread_num; ++i) {
+        control_mailbox * mailbox = mailboxes[i].get();
+        offload_inbox * inbox = (i < inboxes.size()) ? inboxes[i].get() : nullptr;
+        workers.push_back(std::thread([i, shared_listen_fd, mailbox, inbox, &config, &placement,
+                                       &failed, &running, &stop]() {
+            placement.apply(i);
+            std::unique_ptr<reactor_type> reactor(new reactor_type(i, config));
+            reactor->set_mailbox(mailbox);
+            reactor->set_offload_inbox(inbox);
+            if (!reactor->open(shared_listen_fd)) {
+                std::cerr << "Error: open reactor #" << i << " failed." << std::endl;
+                failed.fetch_add(1, std::memory_order_relaxed);
+                stop.store(true, std::memory_order_relaxed);
+                running.fetch_sub(1, std::memory_order_relaxed);
+                return;
+            }
+            int cpu = placement.incoming_cpu(i);
+            if (cpu >= 0 && shared_listen_fd < 0) {
+                if (set_incoming_cpu(reactor->listen_fd(), cpu) != 0)
+                    std::cerr << "Warning: setsockopt(SO_INCOMING_CPU) failed, errno = " << errno << std::endl;
+            }
+            reactor->run(stop);
+            running.fetch_sub(1, std::memory_order_relaxed);
+        }));
+    }
+
+    std::atomic<bool> & reload = server_reload_flag();
+    while (!stop.load(std::memory_order_relaxed) && running.load(std::memory_order_relaxed) != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(kMainPollMs));
+        if (reload.exchange(false, std::memory_order_relaxed)) {
+            for (std::size_t i = 0; i < mailboxes.size(); ++i) {
+                if (!mailboxes[i]->push(control_message(kControlFlushCaches)))
+                    std::cerr << "Warning: the mailbox of reactor #" << i << " is full." << std::endl;
+            }
+        }
+    }
+
+    for (std::size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+    // The reactors may also have stopped on an error.
+    stop.store(true, std::memory_order_relaxed);
+    if (log_thread.joinable()) {
+        log_stop.store(true, std::memory_order_release);
+        log_thread.join();
+        access_log::instance().close();
+    }
+    stats_thread.join();
+    if (pool) {
+        pool->stop();
+        offload_pool::current() = nullptr;
+    }
+
+    stats_snapshot total = server_stats::instance().collect();
+    std::cout << "queries: " << total.queries << ", connections: " << total.accepted
+              << ", recv bytes: " << total.recv_bytes
+              << ", send bytes: " << total.send_bytes << std::endl;
+    if (config.latency_stats != 0) {
+        std::cout << "latency (ns): parse " << total.parse_latency.to_json() << std::endl;
+        std::cout << "latency (ns): handler " << total.handler_latency.to_json() << std::endl;
+        std::cout << "latency (ns): write " << total.write_latency.to_json() << std::endl;
+    }
+
+    if (shared_listen_fd >= 0)
+        ::close(shared_listen_fd);
+    return ((failed.load(std::memory_order_relaxed) == 0) ? 0 : -1);
+}
+
+//
+// Run the reactors of the I/O engine selected by config.io_engine, fall back
+// to epoll if io_uring isn't supported by the headers or the running kernel.
+//
+template <typename Handler>
+int run_server(const server_config & config)
+{
+    if (config.io_engine == io_engine_uring) {
+#if JIMI_HAS_IO_URING
+        if (uring_reactor<Handler>::is_supported())
+            return run_reactors<uring_reactor<Handler>>(config);
+        std::cerr << "Warning: io_uring isn't supported by the kernel, fall back to epoll." << std::endl;
+#else
+        std::cerr << "Warning: io_uring isn't supported by this build, fall back to epoll." << std::endl;
+#endif
+    }
+    return run_reactors<epoll_reactor<Handler>>(config);
+}
+
+} // namespace jimi
+
+#endif // __linux__
@@ -0,0 +1,105 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+namespace jimi {
+
+enum http_server_mode_t {
+    http_server_mode,
+    echo_server_mode,
+    static_server_mode,
+    coro_server_mode,
+    proxy_server_mode,
+};
+
+enum io_engine_t {
+    io_engine_epoll,
+    io_engine_uring,
+};
+
+struct server_config {
+    std::string host;
+    std::string port;
+
+    uint32_t mode;
+    uint32_t thread_num;
+    uint32_t packet_size;
+    uint32_t pipeline;
+    uint32_t nodelay;
+    uint32_t need_echo;
+    uint32_t io_engine;
+
+    // The static file server mode: the document root, and the number
+    // of the open files cached by each reactor thread.
+    std::string doc_root;
+    uint32_t file_cache_size;
+
+    // The timeouts in seconds, 0 means no timeout: the keep-alive idle time,
+    // the time to receive a whole request header, and the longest gap while
+    // receiving a request body.
+    uint32_t idle_timeout;
+    uint32_t header_timeout;
+    uint32_t body_timeout;
+
+    // Serve the aggregated counters at /__stats (the http and static modes),
+    // and the interval of the stats aggregator thread in milliseconds.
+    uint32_t stats_endpoint;
+    uint32_t stats_interval;
+    // Record the latency histograms of the parse, handler and write phases.
+    uint32_t latency_stats;
+
+    // The CPUs to pin the reactor threads to, round robin: "" (none), "all"
+    // (the allowed CPUs) or a cpu list like "0-7,16-23". With numa, the
+    // reactor threads allocate their memory on their local NUMA node, and
+    // without a cpu list they're spread over the nodes.
+    std::string cpu_affinity;
+    uint32_t numa;
+
+    // The threads of the offload pool, which runs the slow jobs of the
+    // handlers off the reactor threads, 0 means the jobs run inline.
+    uint32_t offload_threads;
+
+    // The reverse proxy mode: the backends "host:port[,host:port...]", the
+    // timeout of a backend response in seconds (0 means no timeout), and the
+    // idle keep-alive connections kept per backend by each reactor thread.
+    std::string upstreams;
+    uint32_t upstream_timeout;
+    uint32_t upstream_conns;
+    // The size of the response cache of each reactor thread in MB, 0 means
+    // the responses aren't cached.
+    uint32_t cache_size;
+
+    // The rate limit of each client in requests per second (0 means no
+    // limit) and its burst (0 means the rate), and the request field of the
+    // client key, e.g. "X-API-Key", "" means the client address.
+    uint32_t rate_limit;
+    uint32_t rate_burst;
+    std::string rate_key;
+
+    // The path of the access log, "-" means the stdout, "" means none.
+    std::string access_log;
+
+    // The load shedding: the target of the queueing delay of a reactor in ms
+    // (0 means no shedding) and the interval it's measured over, see
+    // admission_control.
+    uint32_t shed_target;
+    uint32_t shed_interval;
+
+    // Use one SO_REUSEPORT listening socket per reactor thread,
+    // otherwise all reactors share one listening socket (EPOLLEXCLUSIVE).
+    bool reuse_port;
+
+    server_config() : host("127.0.0.1"), port("9000"),
+        mode(http_server_mode), thread_num(1), packet_size(64),
+        pipeline(1), nodelay(0), need_echo(1), io_engine(io_engine_epoll),
+        doc_root("."), file_cache_size(4096),
+        idle_timeout(60), header_timeout(10), body_timeout(30),
+        stats_endpoint(0), stats_interval(1000), latency_stats(0),
+        numa(0), offload_threads(0), upstream_timeout(30), upstream_conns(64),
+        cache_size(0), rate_limit(0), rate_burst(0),
+        shed_target(0), shed_interval(100), reuse_port(true) {}
+};
+
+} // namespace jimi
@@ -0,0 +1,392 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+
+#include <cstddef>
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+
+#include "jimi/basic/stddef.h"
+#include "jimi/support/LatencyHistogram.h"
+
+namespace jimi {
+
+//
+// A counter which is written by one thread only, so an increment is a plain
+// load and store instead of a locked read-modify-write, and it may be read
+// by any thread.
+//
+class stats_counter {
+private:
+    std::atomic<uint64_t> value_;
+
+public:
+    stats_counter() : value_(0) {}
+
+    void add(uint64_t n) {
+        this->value_.store(this->value_.load(std::memory_order_relaxed) + n,
+                           std::memory_order_relaxed);
+    }
+    void inc() { this->add(1); }
+
+    uint64_t load() const { return this->value_.load(std::memory_order_relaxed); }
+};
+
+//
+// The counters of one thread, in a cache line of their own.
+//
+struct alignas(64) stats_shard {
+    static const std::size_t kCacheLineSize = 64;
+
+    stats_counter queries;
+    stats_counter accepted;
+    stats_counter closed;
+    stats_counter recv_bytes;
+    stats_counter send_bytes;
+    // The lookups of the response cache of the proxy mode.
+    stats_counter cache_hits;
+    stats_counter cache_misses;
+    // The requests rejected by the rate limiter, and the ones admitted
+    // because its table was full.
+    stats_counter rate_limited;
+    stats_counter rate_overflows;
+    // The records of the access log dropped on a full ring.
+    stats_counter log_dropped;
+    // The requests rejected by the load shedding, see admission_control.
+    stats_counter shed;
+
+    // The shard of the calling thread, registered on the first call.
+    static stats_shard & local();
+};
+
+//
+// The latency histograms of one thread, in nanoseconds:
+//
+//   parse:   from the start of a request (the first one of a read, or the end
+//            of the previous one) until its header is parsed.
+//   handler: from then until the response is queued.
+//   write:   the time to flush the queued responses: the sendmsg()s of the
+//            epoll engine, or from submit to completion of an io_uring send.
+//
+struct latency_shard {
+    typedef LatencyHistogram::time_point_t time_point_t;
+
+    LatencyHistogram parse;
+    LatencyHistogram handler;
+    LatencyHistogram write;
+
+    static time_point_t now() { return LatencyHistogram::now(); }
+
+    // The shard of the calling thread, registered on the first call.
+    static latency_shard & local();
+};
+
+//
+// Record the time spent in its scope to @histogram, unless it's nullptr.
+//
+class latency_scope {
+private:
+    LatencyHistogram *              histogram_;
+    LatencyHistogram::time_point_t  start_;
+
+public:
+    latency_scope(LatencyHistogram * histogram) : histogram_(histogram) {
+        if (unlikely(histogram != nullptr))
+            this->start_ = LatencyHistogram::now();
+    }
+    ~latency_scope() {
+        if (unlikely(this->histogram_ != nullptr))
+            this->histogram_->record(this->start_, LatencyHistogram::now());
+    }
+};
+
+struct latency_summary {
+    uint64_t count;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+    double   mean;
+
+    latency_summary() : count(0), p50(0), p99(0), p999(0), max(0), mean(0.0) {}
+    latency_summary(const LatencyHistogram::Snapshot & snapshot)
+        : count(snapshot.count()), p50(snapshot.p50()), p99(snapshot.p99()),
+          p999(snapshot.p999()), max(snapshot.max()), mean(snapshot.mean()) {}
+
+    std::string to_json() const {
+        char buf[192];
+        int len = ::snprintf(buf, sizeof(buf),
+            "{\"count\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu,\"mean\":%.1f}",
+            (unsigned long long)this->count, (unsigned long long)this->p50,
+            (unsigned long long)this->p99, (unsigned long long)this->p999,
+            (unsigned long long)this->max, this->mean);
+        return std::string(buf, (len > 0) ? (std::size_t)len : 0);
+    }
+};
+
+struct stats_snapshot {
+    uint64_t queries;
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t recv_bytes;
+    uint64_t send_bytes;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t rate_limited;
+    uint64_t rate_overflows;
+    uint64_t log_dropped;
+    uint64_t shed;
+    uint32_t threads;
+
+    // Per second, over the last interval of the aggregator.
+    double   query_rate;
+    double   recv_rate;
+    double   send_rate;
+
+    // Since the start, in nanoseconds, if the latencies are recorded.
+    latency_summary parse_latency;
+    latency_summary handler_latency;
+    latency_summary write_latency;
+
+    stats_snapshot() : queries(0), accepted(0), closed(0), recv_bytes(0), send_bytes(0),
+        cache_hits(0), cache_misses(0), rate_limited(0), rate_overflows(0),
+        log_dropped(0), shed(0), threads(0), query_rate(0.0), recv_rate(0.0), send_rate(0.0) {}
+
+    uint64_t connections() const {
+        return ((this->accepted >= this->closed) ? (this->accepted - this->closed) : 0);
+    }
+
+    std::string to_json() const {
+        char buf[512];
+        int len = ::snprintf(buf, sizeof(buf),
+            "{\"queries\":%llu,\"connections\":%llu,\"accepted\":%llu,\"closed\":%llu,"
+            "\"recv_bytes\":%llu,\"send_bytes\":%llu,\"threads\":%u,"
+            "\"query_rate\":%.1f,\"recv_rate\":%.1f,\"send_rate\":%.1f",
+            (unsigned long long)this->queries, (unsigned long long)this->connections(),
+            (unsigned long long)this->accepted, (unsigned long long)this->closed,
+            (unsigned long long)this->recv_bytes, (unsigned long long)this->send_bytes,
+            this->threads, this->query_rate, this->recv_rate, this->send_rate);
+        std::string json(buf, (len > 0) ? (std::size_t)len : 0);
+        if (this->cache_hits != 0 || this->cache_misses != 0) {
+            len = ::snprintf(buf, sizeof(buf), ",\"cache\":{\"hits\":%llu,\"misses\":%llu}",
+                             (unsigned long long)this->cache_hits,
+                             (unsigned long long)this->cache_misses);
+            json.append(buf, (len > 0) ? (std::size_t)len : 0);
+        }
+        if (this->rate_limited != 0 || this->rate_overflows != 0) {
+            len = ::snprintf(buf, sizeof(buf), ",\"rate_limit\":{\"limited\":%llu,\"overflows\":%llu}",
+                             (unsigned long long)this->rate_limited,
+                             (unsigned long long)this->rate_overflows);
+            json.append(buf, (len > 0) ? (std::size_t)len : 0);
+        }
+        if (this->log_dropped != 0) {
+            len = ::snprintf(buf, sizeof(buf), ",\"access_log\":{\"dropped\":%llu}",
+                             (unsigned long long)this->log_dropped);
+            json.append(buf, (len > 0) ? (std::size_t)len : 0);
+        }
+        if (this->shed != 0) {
+            len = ::snprintf(buf, sizeof(buf), ",\"shed\":%llu", (unsigned long long)this->shed);
+            json.append(buf, (len > 0) ? (std::size_t)len : 0);
+        }
+        if (this->parse_latency.count != 0 || this->write_latency.count != 0) {
+            json += ",\"latency_ns\":{\"parse\":";
+            json += this->parse_latency.to_json();
+            json += ",\"handler\":";
+            json += this->handler_latency.to_json();
+            json += ",\"write\":";
+            json += this->write_latency.to_json();
+            json += "}";
+        }
+        json += "}\n";
+        return json;
+    }
+};
+
+//
+// The registry of the per-thread stats shards. The request path only touches
+// the shard of its own thread; the aggregator sums all the shards once per
+// interval and publishes the snapshot, which is what snapshot() returns.
+//
+// The shards are never freed while the process runs, so the counts of the
+// threads which have exited are still in the sums. The latency shards are
+// only created by the threads which record the latencies.
+//
+class server_stats {
+private:
+    std::mutex                      mutex_;
+    std::vector<stats_shard *>      shards_;
+    std::vector<latency_shard *>    latency_shards_;
+    stats_snapshot                  last_;
+
+public:
+    server_stats() {}
+    ~server_stats() {
+        for (std::size_t i = 0; i < this->shards_.size(); ++i) {
+            destroy_shard(this->shards_[i]);
+        }
+        for (std::size_t i = 0; i < this->latency_shards_.size(); ++i) {
+            delete this->latency_shards_[i];
+        }
+    }
+
+    static server_stats & instance() {
+        static server_stats stats;
+        return stats;
+    }
+
+    stats_shard * add_shard() {
+        stats_shard * shard = create_shard();
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        this->shards_.push_back(shard);
+        return shard;
+    }
+
+    latency_shard * add_latency_shard() {
+        latency_shard * shard = new latency_shard();
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        this->latency_shards_.push_back(shard);
+        return shard;
+    }
+
+    // Sum the current values of all the shards, the rates are left zero.
+    stats_snapshot collect() {
+        stats_snapshot total;
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        if (!this->latency_shards_.empty()) {
+            LatencyHistogram::Snapshot parse, handler, write;
+            for (std::size_t i = 0; i < this->latency_shards_.size(); ++i) {
+                const latency_shard * shard = this->latency_shards_[i];
+                shard->parse.snapshot(parse);
+                shard->handler.snapshot(handler);
+                shard->write.snapshot(write);
+            }
+            total.parse_latency = latency_summary(parse);
+            total.handler_latency = latency_summary(handler);
+            total.write_latency = latency_summary(write);
+        }
+        for (std::size_t i = 0; i < this->shards_.size(); ++i) {
+            const stats_shard * shard = this->shards_[i];
+            total.queries    += shard->queries.load();
+            total.accepted   += shard->accepted.load();
+            total.closed     += shard->closed.load();
+            total.recv_bytes += shard->recv_bytes.load();
+            total.send_bytes += shard->send_bytes.load();
+            total.cache_hits   += shard->cache_hits.load();
+            total.cache_misses += shard->cache_misses.load();
+            total.rate_limited   += shard->rate_limited.load();
+            total.rate_overflows += shard->rate_overflows.load();
+            total.log_dropped    += shard->log_dropped.load();
+            total.shed           += shard->shed.load();
+        }
+        total.threads = (uint32_t)this->shards_.size();
+        return total;
+    }
+
+    void publish(const stats_snapshot & snapshot) {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        this->last_ = snapshot;
+    }
+
+    // The last snapshot published by the aggregator.
+    stats_snapshot snapshot() {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        return this->last_;
+    }
+
+private:
+    static stats_shard * create_shard() {
+        void * ptr;
+#if defined(_MSC_VER)
+        ptr = ::_aligned_malloc(sizeof(stats_shard), stats_shard::kCacheLineSize);
+#else
+        if (::posix_memalign(&ptr, stats_shard::kCacheLineSize, sizeof(stats_shard)) != 0)
+            ptr = nullptr;
+#endif
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+        return new (ptr) stats_shard();
+    }
+
+    static void destroy_shard(stats_shard * shard) {
+        shard->~stats_shard();
+#if defined(_MSC_VER)
+        ::_aligned_free(shard);
+#else
+        ::free(shard);
+#endif
+    }
+};
+
+inline
+stats_shard & stats_shard::local() {
+    static thread_local stats_shard * s_shard = nullptr;
+    if (unlikely(s_shard == nullptr))
+        s_shard = server_stats::instance().add_shard();
+    return *s_shard;
+}
+
+inline
+latency_shard & latency_shard::local() {
+    static thread_local latency_shard * s_shard = nullptr;
+    if (unlikely(s_shard == nullptr))
+        s_shard = server_stats::instance().add_latency_shard();
+    return *s_shard;
+}
+
+//
+// The background thread which sums the shards every interval, computes the
+// rates and publishes the snapshot.
+//
+class stats_aggregator {
+public:
+    // The granularity of the stop check.
+    static const uint32_t kPollMs = 100;
+
+private:
+    uint32_t interval_ms_;
+
+public:
+    stats_aggregator(uint32_t interval_ms = 1000)
+        : interval_ms_((interval_ms != 0) ? interval_ms : 1000) {}
+    ~stats_aggregator() {}
+
+    void run(const std::atomic<bool> & stop) {
+        typedef std::chrono::steady_clock clock_type;
+        server_stats & stats = server_stats::instance();
+        stats_snapshot prev = stats.collect();
+        stats.publish(prev);
+        clock_type::time_point last = clock_type::now();
+        while (!stop.load(std::memory_order_relaxed)) {
+            // By value, kPollMs has no out-of-class definition to bind to.
+            std::this_thread::sleep_for(std::chrono::milliseconds((uint32_t)kPollMs));
+            clock_type::time_point now = clock_type::now();
+            double elapsed = std::chrono::duration<double>(now - last).count();
+            if (elapsed * 1000.0 < (double)this->interval_ms_)
+                continue;
+
+            stats_snapshot current = stats.collect();
+            current.query_rate = (double)(current.queries - prev.queries) / elapsed;
+            current.recv_rate = (double)(current.recv_bytes - prev.recv_bytes) / elapsed;
+            current.send_rate = (double)(current.send_bytes - prev.send_bytes) / elapsed;
+            stats.publish(current);
+            prev = current;
+            last = now;
+        }
+        // The final totals.
+        stats_snapshot current = stats.collect();
+        stats.publish(current);
+    }
+};
+
+} // namespace jimi
@@ -0,0 +1,113 @@
+
+#pragma once
+
+#if defined(__linux__)
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <string>
+#include <iostream>
+
+#if !defined(SO_INCOMING_CPU)
+#define SO_INCOMING_CPU     49
+#endif
+
+namespace jimi {
+
+static inline
+int set_nonblocking(int fd)
+{
+    int flags = ::fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return ::fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static inline
+int set_nodelay(int fd, bool nodelay)
+{
+    int on = nodelay ? 1 : 0;
+    return ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+static inline
+bool resolve_ip_v4(const std::string & host, const std::string & port, struct sockaddr_in & addr)
+{
+    ::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)::atoi(port.c_str()));
+    if (host.empty() || host == "0.0.0.0") {
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        return true;
+    }
+    return (::inet_pton(AF_INET, host.c_str(), &addr.sin_addr) == 1);
+}
+
+//
+// Create a nonblocking listening socket, if reuse_port is true, every caller
+// gets its own socket bound to the same address (SO_REUSEPORT), and the kernel
+// spreads the incoming connections among them without a shared accept lock.
+//
+static inline
+int create_listen_socket(const std::string & host, const std::string & port,
+                         bool reuse_port, int backlog = 4096)
+{
+    struct sockaddr_in addr;
+    if (!resolve_ip_v4(host, port, addr)) {
+        std::cerr << "Error: invalid listen address " << host << ":" << port << std::endl;
+        return -1;
+    }
+
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        std::cerr << "Error: socket() failed, errno = " << errno << std::endl;
+        return -1;
+    }
+
+    int on = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (reuse_port) {
+        if (::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+            std::cerr << "Error: setsockopt(SO_REUSEPORT) failed, errno = " << errno << std::endl;
+            ::close(fd);
+            return -1;
+        }
+    }
+
+    if (::bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        std::cerr << "Error: bind() " << host << ":" << port << " failed, errno = " << errno << std::endl;
+        ::close(fd);
+        return -1;
+    }
+
+    if (::listen(fd, backlog) != 0) {
+        std::cerr << "Error: listen() failed, errno = " << errno << std::endl;
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//
+// Steer the connections which are received on @cpu to the SO_REUSEPORT
+// listening socket @fd, the one of the reactor pinned to that CPU.
+//
+static inline
+int set_incoming_cpu(int fd, int cpu)
+{
+    return ::setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+}
+
+} // namespace jimi
+
+#endif // __linux__
@@ -0,0 +1,97 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <assert.h>
+
+#include <cstddef>
+#include <atomic>
+#include <vector>
+
+#include "jimi/basic/stddef.h"
+
+namespace jimi {
+
+//
+// A bounded lock-free ring of one producer thread and one consumer thread.
+//
+// The head (written by the consumer) and the tail (written by the producer)
+// are kept in cache lines of their own, and each side keeps a cached copy of
+// the index of the other side, which it only reloads when the ring looks full
+// (or empty) by the cached copy, so the two sides rarely read each other's
+// cache line while the ring is neither full nor empty.
+//
+template <typename T>
+class spsc_ring {
+public:
+    typedef T           value_type;
+    typedef std::size_t size_type;
+
+    static const size_type kCacheLineSize = 64;
+
+private:
+    std::vector<T>  items_;
+    size_type       mask_;
+
+    // Padded rather than aligned, the ring may be allocated by a plain new.
+    char            padding0_[kCacheLineSize];
+
+    // The consumer side.
+    std::atomic<size_type> head_;
+    size_type       cached_tail_;
+    char            padding1_[kCacheLineSize];
+
+    // The producer side.
+    std::atomic<size_type> tail_;
+    size_type       cached_head_;
+    char            padding2_[kCacheLineSize];
+
+public:
+    // The capacity is rounded up to a power of 2.
+    spsc_ring(size_type capacity = 256)
+        : mask_(0), head_(0), cached_tail_(0), tail_(0), cached_head_(0) {
+        size_type size = 2;
+        while (size < capacity)
+            size <<= 1;
+        this->items_.resize(size);
+        this->mask_ = size - 1;
+    }
+    ~spsc_ring() {}
+
+    size_type capacity() const { return this->items_.size(); }
+
+    // Only exact when called by the producer or the consumer, with the other idle.
+    size_type size() const {
+        return (this->tail_.load(std::memory_order_acquire) - this->head_.load(std::memory_order_acquire));
+    }
+
+    bool is_empty() const { return (this->size() == 0); }
+
+    // By the producer only, return false if the ring is full.
+    bool push(const T & item) {
+        size_type tail = this->tail_.load(std::memory_order_relaxed);
+        if (unlikely(tail - this->cached_head_ > this->mask_)) {
+            this->cached_head_ = this->head_.load(std::memory_order_acquire);
+            if (tail - this->cached_head_ > this->mask_)
+                return false;
+        }
+        this->items_[tail & this->mask_] = item;
+        this->tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // By the consumer only, return false if the ring is empty.
+    bool pop(T & item) {
+        size_type head = this->head_.load(std::memory_order_relaxed);
+        if (head == this->cached_tail_) {
+            this->cached_tail_ = this->tail_.load(std::memory_order_acquire);
+            if (head == this->cached_tail_)
+                return false;
+        }
+        item = this->items_[head & this->mask_];
+        this->head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+} // namespace jimi
@@ -0,0 +1,557 @@
+
+#pragma once
+
+#if defined(__linux__)
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <cstddef>
+#include <string>
+
+#include "jimi/basic/stddef.h"
+#include "jimi/StringRef.h"
+#include "jimi/http/Common.h"
+#include "jimi/http/FastParser.h"
+#include "jimi/http/ParserPool.h"
+#include "jimi/jstd/lru_cache.h"
+
+#include "server_config.hpp"
+#include "connection.hpp"
+#include "control_mailbox.hpp"
+#include "http_handler.hpp"
+#include "http_date.hpp"
+#include "response_header.hpp"
+#include "server_stats.hpp"
+
+namespace jimi {
+
+//
+// The static file handler: serves the files under config.doc_root for GET
+// and HEAD, with single byte Range requests and the conditional GETs
+// (If-None-Match, If-Modified-Since and If-Range).
+//
+// The file bodies are never copied through user space, the engine sends them
+// with sendfile(). The open file descriptors and their stat results are kept
+// in a per-thread LRU cache, a cached file is only stat()'ed again once per
+// kRevalidateSeconds to find out if it has been changed.
+//
+class static_file_handler {
+public:
+    typedef http_handler::parser_type   parser_type;
+    typedef http_handler::parser_pool   parser_pool;
+
+    static const time_t kRevalidateSeconds = 1;
+
+    class file_entry : public shared_file {
+    public:
+        uint64_t     size;
+        time_t       mtime;
+        dev_t        dev;
+        ino_t        ino;
+        time_t       checked;
+        const char * content_type;
+        std::string  etag;
+        std::string  last_modified;
+
+    public:
+        file_entry(int _fd) : shared_file(_fd), size(0), mtime(0), dev(0), ino(0),
+            checked(0), content_type(nullptr) {}
+        ~file_entry() {}
+
+        bool is_same(const struct stat & st) const {
+            return (st.st_ino == this->ino && st.st_dev == this->dev &&
+                    st.st_mtime == this->mtime && (uint64_t)st.st_size == this->size);
+        }
+    };
+
+    typedef jstd::lru_cache<std::string, file_entry *> file_cache;
+
+private:
+    enum range_result_t {
+        kRangeNone,
+        kRangeSatisfiable,
+        kRangeNotSatisfiable
+    };
+
+    std::string root_;
+    file_cache  cache_;
+    std::string path_;
+    response_header header_;
+    time_t      now_;
+    bool        stats_endpoint_;
+    bool        latency_stats_;
+    bool        rate_limit_;
+    bool        access_log_;
+
+public:
+    static_file_handler(const server_config & config)
+        : root_(config.doc_root), cache_(config.file_cache_size), now_(0),
+          stats_endpoint_(config.stats_endpoint != 0), latency_stats_(config.latency_stats != 0),
+          rate_limit_(config.rate_limit != 0), access_log_(!config.access_log.empty()) {
+        // Strip the trailing '/', the request path starts with one.
+        while (this->root_.size() > 1 && this->root_[this->root_.size() - 1] == '/')
+            this->root_.resize(this->root_.size() - 1);
+        this->now_ = http_date::local().update();
+    }
+
+    ~static_file_handler() {
+        this->cache_.clear([](file_entry * entry) {
+            entry->release();
+        });
+    }
+
+    void on_accept(connection & conn) {}
+    void on_close(connection & conn) {}
+
+    void on_control(const control_message & msg) {
+        if (msg.type == kControlFlushCaches) {
+            // The connections still sending a file hold their own reference.
+            this->cache_.clear([](file_entry * entry) {
+                entry->release();
+            });
+        }
+    }
+
+    template <typename Func>
+    int on_tick(Func && flush) { return -1; }
+
+    int event_fd() const { return -1; }
+    void on_event() {}
+
+    // Return false to close the connection after the responses are flushed.
+    bool on_read(connection & conn) {
+        parser_pool & pool = parser_pool::local();
+        this->now_ = http_date::local().update();
+        latency_shard * latency = nullptr;
+        latency_shard::time_point_t start, parsed;
+        if (unlikely(this->latency_stats_)) {
+            latency = &latency_shard::local();
+            start = latency_shard::now();
+        }
+        while (likely(conn.size() > 0)) {
+            if (unlikely(conn.pending_file() != 0)) {
+                // The next response must wait for the file body,
+                // the engine calls us again once it's been sent.
+                break;
+            }
+
+            http_handler::framed_request req;
+            if (unlikely(!http_handler::frame_request(conn, req))) {
+                if (req.error == 0)
+                    break;
+                http_handler::write_error(conn, req.error);
+                return false;
+            }
+            parser_type * parser = req.parser;
+
+            if (unlikely(latency != nullptr)) {
+                parsed = latency_shard::now();
+                latency->parse.record(start, parsed);
+            }
+
+            bool keep_alive = http_handler::is_keep_alive(*parser);
+            uint64_t body_size;
+            uint32_t status = this->serve(conn, *parser, keep_alive, body_size);
+            // Only a shed request is answered with 503, it closes.
+            if (unlikely(status == 503))
+                keep_alive = false;
+            if (unlikely(this->access_log_))
+                http_handler::log_request(conn, *parser, status, body_size);
+            pool.release(parser);
+            stats_shard::local().queries.inc();
+            if (unlikely(latency != nullptr)) {
+                start = latency_shard::now();
+                latency->handler.record(parsed, start);
+            }
+
+            conn.consume(req.header_size + req.content_length);
+            if (unlikely(!keep_alive))
+                return false;
+        }
+        return true;
+    }
+
+private:
+    // Answer the request, return its status and the size of the body sent.
+    uint32_t serve(connection & conn, const parser_type & parser, bool keep_alive,
+                   uint64_t & body_size) {
+        body_size = 0;
+        StringRef method = parser.getMethodStr();
+        bool is_head;
+        if (likely(method.size() == 3 && ::memcmp(method.data(), "GET", 3) == 0))
+            is_head = false;
+        else if (method.size() == 4 && ::memcmp(method.data(), "HEAD", 4) == 0)
+            is_head = true;
+        else {
+            this->write_status(conn, 405, keep_alive, "Allow: GET, HEAD\r\n");
+            return 405;
+        }
+        if (unlikely(this->stats_endpoint_ && http_handler::is_stats_request(parser))) {
+            body_size = http_handler::write_stats(conn, keep_alive, is_head);
+            return 200;
+        }
+        if (unlikely(conn.is_overloaded())) {
+            http_handler::write_overloaded(conn);
+            return 503;
+        }
+        if (unlikely(this->rate_limit_ && !http_handler::admit(conn, parser))) {
+            http_handler::write_limited(conn, keep_alive);
+            return 429;
+        }
+
+        if (unlikely(!this->map_path(parser.getURI()))) {
+            this->write_status(conn, 400, keep_alive);
+            return 400;
+        }
+        file_entry * entry = this->lookup(this->path_);
+        if (unlikely(entry == nullptr)) {
+            this->write_status(conn, 404, keep_alive);
+            return 404;
+        }
+
+        if (this->is_not_modified(parser, *entry)) {
+            this->begin_header(304, keep_alive, *entry);
+            this->header_.end();
+            conn.write(this->header_.data(), this->header_.size());
+            return 304;
+        }
+
+        uint64_t offset = 0, length = entry->size;
+        range_result_t range = kRangeNone;
+        uint32_t status = 200;
+        StringRef value;
+        if (parser.findField("Range", value) && this->is_range_fresh(parser, *entry)) {
+            range = parse_range(value, entry->size, offset, length);
+        }
+
+        if (likely(range == kRangeNone)) {
+            this->begin_header(200, keep_alive, *entry);
+        }
+        else if (range == kRangeSatisfiable) {
+            status = 206;
+            this->begin_header(status, keep_alive, *entry);
+            this->header_.append("Content-Range: bytes ", 21);
+            this->header_.append_uint(offset);
+            this->header_.append("-", 1);
+            this->header_.append_uint(offset + length - 1);
+            this->header_.append("/", 1);
+            this->header_.append_uint(entry->size);
+            this->header_.append("\r\n", 2);
+        }
+        else {
+            this->begin_status(416, keep_alive);
+            this->header_.append("Content-Range: bytes */", 23);
+            this->header_.append_uint(entry->size);
+            this->header_.append("\r\n", 2);
+            this->header_.add_content_length(0);
+            this->header_.end();
+            conn.write(this->header_.data(), this->header_.size());
+            return 416;
+        }
+
+        this->header_.add_field("Content-Type", 12, entry->content_type, ::strlen(entry->content_type));
+        this->header_.add_content_length(length);
+        this->header_.end();
+        conn.write(this->header_.data(), this->header_.size());
+
+        if (likely(!is_head)) {
+            conn.send_file(entry, offset, length);
+            body_size = length;
+        }
+        return status;
+    }
+
+    //
+    // Map the request URI to a file path under the document root, percent
+    // decoded and without the query. Reject the ".." segments.
+    //
+    bool map_path(const StringRef & uri) {
+        const char * cur = uri.data();
+        const char * end = cur + uri.size();
+        if (unlikely(cur == end || *cur != '/'))
+            return false;
+
+        this->path_ = this->root_;
+        std::size_t segment = this->path_.size();
+        while (cur < end && *cur != '?' && *cur != '#') {
+            char ch = *cur++;
+            if (unlikely(ch == '%')) {
+                int hi, lo;
+                if (end - cur < 2 || (hi = hex_value(cur[0])) < 0 || (lo = hex_value(cur[1])) < 0)
+                    return false;
+                ch = (char)((hi << 4) | lo);
+                cur += 2;
+                if (unlikely(ch == '\0'))
+                    return false;
+            }
+            if (ch == '/') {
+                if (is_dot_dot(this->path_, segment))
+                    return false;
+                segment = this->path_.size();
+            }
+            this->path_ += ch;
+        }
+        if (is_dot_dot(this->path_, segment))
+            return false;
+        if (this->path_[this->path_.size() - 1] == '/')
+            this->path_ += "index.html";
+        return true;
+    }
+
+    // Whether the last segment, which begins with '/' at @segment, is "/..".
+    static bool is_dot_dot(const std::string & path, std::size_t segment) {
+        return (path.size() - segment == 3 && path[segment + 1] == '.' && path[segment + 2] == '.');
+    }
+
+    static int hex_value(char ch) {
+        if (ch >= '0' && ch <= '9')
+            return (ch - '0');
+        if (ch >= 'a' && ch <= 'f')
+            return (ch - 'a' + 10);
+        if (ch >= 'A' && ch <= 'F')
+            return (ch - 'A' + 10);
+        return -1;
+    }
+
+    // Find the open file of @path in the cache, or open it.
+    file_entry * lookup(const std::string & path) {
+        file_entry ** found = this->cache_.find(path);
+        if (likely(found != nullptr)) {
+            file_entry * entry = *found;
+            if (likely(this->now_ - entry->checked < kRevalidateSeconds))
+                return entry;
+            struct stat st;
+            if (::stat(path.c_str(), &st) == 0 && entry->is_same(st)) {
+                entry->checked = this->now_;
+                return entry;
+            }
+            // The file has been changed or removed, the connections which
+            // are sending it keep their reference to the old one.
+            file_entry * old_entry = nullptr;
+            if (this->cache_.erase(path, &old_entry))
+                old_entry->release();
+        }
+
+        // O_NONBLOCK: don't hang on a fifo, it isn't a regular file anyway.
+        int fd = ::open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0)
+            return nullptr;
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ::close(fd);
+            return nullptr;
+        }
+
+        file_entry * entry = new file_entry(fd);
+        entry->size = (uint64_t)st.st_size;
+        entry->mtime = st.st_mtime;
+        entry->dev = st.st_dev;
+        entry->ino = st.st_ino;
+        entry->checked = this->now_;
+        entry->content_type = get_content_type(path);
+
+        char buf[64];
+        int len = ::snprintf(buf, sizeof(buf), "\"%llx-%llx\"",
+                             (unsigned long long)st.st_mtime, (unsigned long long)st.st_size);
+        entry->etag.assign(buf, len);
+        len = http_date::format(st.st_mtime, buf, sizeof(buf));
+        entry->last_modified.assign(buf, len);
+
+        file_entry * evicted = nullptr;
+        if (this->cache_.insert(path, entry, &evicted) && evicted != nullptr)
+            evicted->release();
+        return entry;
+    }
+
+    bool is_not_modified(const parser_type & parser, const file_entry & entry) const {
+        StringRef value;
+        // If-None-Match takes precedence over If-Modified-Since.
+        if (parser.findField("If-None-Match", value))
+            return match_etag(value, entry.etag);
+        if (parser.findField("If-Modified-Since", value)) {
+            time_t since;
+            if (parse_http_date(value, since))
+                return (entry.mtime <= since);
+        }
+        return false;
+    }
+
+    // A Range with an If-Range which doesn't match the current file is ignored.
+    bool is_range_fresh(const parser_type & parser, const file_entry & entry) const {
+        StringRef value;
+        if (!parser.findField("If-Range", value))
+            return true;
+        if (value.size() > 0 && value.data()[0] == '"')
+            return (value.size() == entry.etag.size() &&
+                    ::memcmp(value.data(), entry.etag.data(), value.size()) == 0);
+        return (value.size() == entry.last_modified.size() &&
+                ::memcmp(value.data(), entry.last_modified.data(), value.size()) == 0);
+    }
+
+    // Match an If-None-Match list ("*", or comma separated tags) with the weak comparison.
+    static bool match_etag(const StringRef & value, const std::string & etag) {
+        const char * cur = value.data();
+        const char * end = cur + value.size();
+        while (cur < end) {
+            while (cur < end && (*cur == ' ' || *cur == '\t' || *cur == ','))
+                cur++;
+            const char * tag = cur;
+            while (cur < end && *cur != ',')
+                cur++;
+            const char * tag_end = cur;
+            while (tag_end > tag && (tag_end[-1] == ' ' || tag_end[-1] == '\t'))
+                tag_end--;
+            if (tag_end - tag == 1 && *tag == '*')
+                return true;
+            if (tag_end - tag > 2 && tag[0] == 'W' && tag[1] == '/')
+                tag += 2;
+            if ((std::size_t)(tag_end - tag) == etag.size() && ::memcmp(tag, etag.data(), etag.size()) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    //
+    // Parse a single "bytes=" range. A malformed Range or a multi-range
+    // is ignored, the whole file is sent with 200 then (RFC 7233, 3.1).
+    //
+    static range_result_t parse_range(const StringRef & value, uint64_t size,
+                                      uint64_t & offset, uint64_t & length) {
+        const char * cur = value.data();
+        const char * end = cur + value.size();
+        if (end - cur < 6 || !parser_type::equalsIgnoreCase(cur, "bytes=", 6))
+            return kRangeNone;
+        cur += 6;
+        if (::memchr(cur, ',', end - cur) != nullptr)
+            return kRangeNone;
+
+        uint64_t first = 0, last = 0;
+        bool has_first = parse_uint64(cur, end, first);
+        if (cur >= end || *cur != '-')
+            return kRangeNone;
+        cur++;
+        bool has_last = parse_uint64(cur, end, last);
+        if (cur != end || (!has_first && !has_last))
+            return kRangeNone;
+
+        if (has_first) {
+            if (has_last && last < first)
+                return kRangeNone;
+            if (first >= size)
+                return kRangeNotSatisfiable;
+            if (!has_last || last >= size)
+                last = size - 1;
+        }
+        else {
+            // The suffix range: the last @last bytes.
+            if (last == 0 || size == 0)
+                return kRangeNotSatisfiable;
+            if (last > size)
+                last = size;
+            first = size - last;
+            last = size - 1;
+        }
+        offset = first;
+        length = last - first + 1;
+        return kRangeSatisfiable;
+    }
+
+    static bool parse_uint64(const char *& cur, const char * end, uint64_t & value) {
+        const char * start = cur;
+        uint64_t n = 0;
+        while (cur < end && *cur >= '0' && *cur <= '9') {
+            if (cur - start >= 18)
+                return false;
+            n = n * 10 + (uint64_t)(*cur - '0');
+            cur++;
+        }
+        value = n;
+        return (cur != start);
+    }
+
+    static bool parse_http_date(const StringRef & value, time_t & time) {
+        char buf[64];
+        if (value.size() >= sizeof(buf))
+            return false;
+        ::memcpy(buf, value.data(), value.size());
+        buf[value.size()] = '\0';
+        struct tm tm;
+        ::memset(&tm, 0, sizeof(tm));
+        const char * end = ::strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if (end == nullptr || *end != '\0')
+            return false;
+        time = ::timegm(&tm);
+        return true;
+    }
+
+    void begin_status(uint32_t status, bool keep_alive) {
+        this->header_.begin(status);
+        this->header_.add_date();
+        this->header_.add_connection(keep_alive);
+    }
+
+    void begin_header(uint32_t status, bool keep_alive, const file_entry & entry) {
+        this->begin_status(status, keep_alive);
+        this->header_.add_field("Accept-Ranges", "bytes");
+        this->header_.add_field("Last-Modified", entry.last_modified);
+        this->header_.add_field("ETag", entry.etag);
+    }
+
+    void write_status(connection & conn, uint32_t status, bool keep_alive,
+                      const char * extra_fields = "") {
+        this->begin_status(status, keep_alive);
+        this->header_.append(extra_fields, ::strlen(extra_fields));
+        this->header_.add_content_length(0);
+        this->header_.end();
+        conn.write(this->header_.data(), this->header_.size());
+    }
+
+    static const char * get_content_type(const std::string & path) {
+        static const struct {
+            const char * ext;
+            const char * type;
+        } kContentTypes[] = {
+            { "html",  "text/html; charset=utf-8" },
+            { "htm",   "text/html; charset=utf-8" },
+            { "css",   "text/css; charset=utf-8" },
+            { "js",    "application/javascript; charset=utf-8" },
+            { "json",  "application/json" },
+            { "txt",   "text/plain; charset=utf-8" },
+            { "xml",   "text/xml; charset=utf-8" },
+            { "svg",   "image/svg+xml" },
+            { "png",   "image/png" },
+            { "jpg",   "image/jpeg" },
+            { "jpeg",  "image/jpeg" },
+            { "gif",   "image/gif" },
+            { "webp",  "image/webp" },
+            { "ico",   "image/x-icon" },
+            { "woff",  "font/woff" },
+            { "woff2", "font/woff2" },
+            { "wasm",  "application/wasm" },
+            { "pdf",   "application/pdf" },
+            { "mp4",   "video/mp4" },
+        };
+        std::size_t dot = path.rfind('.');
+        std::size_t slash = path.rfind('/');
+        if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+            const char * ext = path.c_str() + dot + 1;
+            std::size_t ext_len = path.size() - dot - 1;
+            for (std::size_t i = 0; i < sizeof(kContentTypes) / sizeof(kContentTypes[0]); ++i) {
+                if (::strlen(kContentTypes[i].ext) == ext_len &&
+                    parser_type::equalsIgnoreCase(ext, kContentTypes[i].ext, ext_len))
+                    return kContentTypes[i].type;
+            }
+        }
+        return "application/octet-stream";
+    }
+};
+
+} // namespace jimi
+
+#endif // __linux__
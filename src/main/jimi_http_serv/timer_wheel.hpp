@@ -0,0 +1,164 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include <cstddef>
+
+#include "jimi/basic/stddef.h"
+
+namespace jimi {
+
+//
+// An intrusive timer, embedded in the object it times out.
+//
+struct timer_node {
+    timer_node * prev;
+    timer_node * next;
+    uint64_t     expire;    // In ticks.
+    void *       owner;
+
+    timer_node() : prev(nullptr), next(nullptr), expire(0), owner(nullptr) {}
+
+    bool is_scheduled() const { return (this->next != nullptr); }
+};
+
+//
+// A per-thread hashed timer wheel: kSlots circular lists of the timers, a
+// timer is linked into the slot (expire % kSlots), and a slot may hold the
+// timers of the later rounds too, they are skipped until their round comes.
+//
+// schedule() and cancel() are O(1) list operations. A timer which is only
+// pushed back (the keep-alive timer reset by every request) is not moved at
+// all, reset() just stores the new expire tick, and the timer is moved to its
+// new slot lazily when its old slot is reached. So resetting a timer costs
+// a compare and a store, and there is no clock read per request either: the
+// reactor calls advance() once per loop iteration.
+//
+class timer_wheel {
+public:
+    typedef std::size_t size_type;
+
+    static const uint32_t kSlots = 1024;
+    static const uint32_t kSlotMask = kSlots - 1;
+
+private:
+    timer_node  slots_[kSlots];
+    uint32_t    tick_ms_;
+    uint64_t    start_ms_;
+    // All the slots up to this tick have been processed.
+    uint64_t    current_;
+    size_type   count_;
+
+public:
+    timer_wheel(uint32_t tick_ms = 100)
+        : tick_ms_((tick_ms != 0) ? tick_ms : 1), start_ms_(monotonic_ms()),
+          current_(0), count_(0) {
+        for (uint32_t i = 0; i < kSlots; ++i) {
+            this->slots_[i].prev = &this->slots_[i];
+            this->slots_[i].next = &this->slots_[i];
+        }
+    }
+    ~timer_wheel() {}
+
+    uint32_t tick_ms() const { return this->tick_ms_; }
+    uint64_t current() const { return this->current_; }
+    size_type size() const { return this->count_; }
+
+    // The number of ticks of @ms milliseconds, rounded up.
+    uint64_t to_ticks(uint64_t ms) const {
+        return ((ms + this->tick_ms_ - 1) / this->tick_ms_);
+    }
+
+    // (Re)schedule @node to expire @ticks ticks later than now.
+    void schedule(timer_node * node, uint64_t ticks) {
+        if (node->is_scheduled())
+            unlink(node);
+        else
+            this->count_++;
+        node->expire = this->current_ + ((ticks != 0) ? ticks : 1);
+        this->link(node);
+    }
+
+    // Like schedule(), but a timer which is only pushed back isn't moved.
+    void reset(timer_node * node, uint64_t ticks) {
+        uint64_t expire = this->current_ + ((ticks != 0) ? ticks : 1);
+        if (likely(node->is_scheduled() && expire >= node->expire))
+            node->expire = expire;
+        else
+            this->schedule(node, ticks);
+    }
+
+    void cancel(timer_node * node) {
+        if (node->is_scheduled()) {
+            unlink(node);
+            this->count_--;
+        }
+    }
+
+    //
+    // Move the wheel to the current time, and call @on_expire(timer_node *)
+    // for every timer which has expired, it's been unlinked before the call.
+    //
+    template <typename Func>
+    void advance(Func && on_expire) {
+        this->advance_to((monotonic_ms() - this->start_ms_) / this->tick_ms_, on_expire);
+    }
+
+    // Like advance(), to the tick @now since the wheel was created.
+    template <typename Func>
+    void advance_to(uint64_t now, Func && on_expire) {
+        if (now <= this->current_)
+            return;
+        // After a long stall, one revolution visits every slot.
+        uint64_t tick = (now - this->current_ > kSlots) ? (now - kSlots) : this->current_;
+        while (tick < now) {
+            tick++;
+            timer_node * head = &this->slots_[tick & kSlotMask];
+            timer_node * node = head->next;
+            while (node != head) {
+                timer_node * next = node->next;
+                if (node->expire <= now) {
+                    unlink(node);
+                    this->count_--;
+                    on_expire(node);
+                }
+                else if ((node->expire & kSlotMask) != (tick & kSlotMask)) {
+                    // It has been reset to a later tick, move it.
+                    unlink(node);
+                    this->link(node);
+                }
+                node = next;
+            }
+        }
+        this->current_ = now;
+    }
+
+    static uint64_t monotonic_ms() {
+        struct timespec ts;
+#if defined(CLOCK_MONOTONIC_COARSE)
+        ::clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+        return ((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000);
+    }
+
+private:
+    void link(timer_node * node) {
+        timer_node * head = &this->slots_[node->expire & kSlotMask];
+        node->prev = head->prev;
+        node->next = head;
+        head->prev->next = node;
+        head->prev = node;
+    }
+
+    static void unlink(timer_node * node) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+    }
+};
+
+} // namespace jimi
@@ -0,0 +1,308 @@
+
+#pragma once
+
+#if defined(__linux__)
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <memory>
+#include <iostream>
+
+#include "jimi/basic/stddef.h"
+
+#include "socket_utils.hpp"
+#include "connection.hpp"
+#include "timer_wheel.hpp"
+
+namespace jimi {
+
+// A backend of the reverse proxy.
+struct upstream_addr {
+    std::string             name;       // "host:port", also the Host of the requests without one.
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+
+    upstream_addr() : addr_len(0) {
+        ::memset(&this->addr, 0, sizeof(this->addr));
+    }
+};
+
+//
+// Parse and resolve a backend list "host:port[,host:port...]", e.g.
+// "127.0.0.1:9001,127.0.0.1:9002", return false if it's empty or wrong.
+//
+static inline
+bool parse_upstreams(const std::string & list, std::vector<upstream_addr> & upstreams)
+{
+    upstreams.clear();
+    std::size_t pos = 0;
+    while (pos < list.size()) {
+        std::size_t comma = list.find(',', pos);
+        if (comma == std::string::npos)
+            comma = list.size();
+        std::string item = list.substr(pos, comma - pos);
+        pos = comma + 1;
+        if (item.empty())
+            continue;
+
+        std::size_t colon = item.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == item.size())
+            return false;
+        std::string host = item.substr(0, colon);
+        std::string port = item.substr(colon + 1);
+
+        struct addrinfo hints;
+        ::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo * result = nullptr;
+        if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 || result == nullptr)
+            return false;
+        upstream_addr upstream;
+        upstream.name = item;
+        ::memcpy(&upstream.addr, result->ai_addr, result->ai_addrlen);
+        upstream.addr_len = (socklen_t)result->ai_addrlen;
+        ::freeaddrinfo(result);
+        upstreams.push_back(upstream);
+    }
+    return !upstreams.empty();
+}
+
+class upstream_backend;
+
+//
+// A connection to a backend, with the buffers of a client connection: the
+// request is queued to the write queue, the response is received into the
+// read buffer. The timer is the response timeout while it serves a request,
+// and the idle timeout while it waits in the pool.
+//
+class upstream_conn : public connection {
+public:
+    enum state_t {
+        kConnecting,
+        kIdle,
+        kActive,
+        kClosed
+    };
+
+    upstream_backend * backend;
+    uint32_t    state;
+    // The events it's registered for.
+    uint32_t    events;
+    // Whether it has been taken from the pool: the backend may have closed
+    // it meanwhile, so a request which fails on it before any response is
+    // retried once on a new connection.
+    bool        reused;
+
+public:
+    upstream_conn(int _fd, upstream_backend * _backend)
+        : connection(_fd), backend(_backend), state(kConnecting), events(0), reused(false) {}
+    ~upstream_conn() {}
+};
+
+class upstream_backend {
+public:
+    upstream_addr   addr;
+    // The requests in flight from this reactor thread.
+    uint32_t        outstanding;
+    // The backend is skipped until then after a failed connect, in ms of
+    // timer_wheel::monotonic_ms().
+    uint64_t        down_until;
+    // The idle keep-alive connections, the most recently used at the back.
+    std::vector<upstream_conn *> idle;
+
+    upstream_backend(const upstream_addr & _addr) : addr(_addr), outstanding(0), down_until(0) {}
+};
+
+//
+// The per-reactor pool of the keep-alive connections to the backends, and
+// the epoll instance of their sockets: the reactor waits on its fd (see
+// Handler::event_fd()), and the proxy handler polls it without blocking.
+//
+// A request goes to the backend with the least outstanding requests of this
+// reactor, the ties are broken round robin; a backend which refused a
+// connection is skipped for kDownMs, unless all of them are down. The idle
+// connections are reused last in, first out, the warmest one first, and at
+// most max_idle of them are kept per backend.
+//
+// A closed connection is only freed by purge(), the events of a batch from
+// poll() may still point to it.
+//
+class upstream_pool {
+public:
+    static const uint64_t kDownMs = 1000;
+
+private:
+    int         epoll_fd_;
+    uint32_t    max_idle_;
+    uint32_t    next_;
+    std::vector<std::unique_ptr<upstream_backend>> backends_;
+    std::vector<upstream_conn *> closed_;
+
+public:
+    upstream_pool() : epoll_fd_(-1), max_idle_(0), next_(0) {}
+    ~upstream_pool() {
+        for (std::size_t i = 0; i < this->backends_.size(); ++i) {
+            upstream_backend * backend = this->backends_[i].get();
+            while (!backend->idle.empty()) {
+                this->close(backend->idle.back());
+            }
+        }
+        this->purge();
+        if (this->epoll_fd_ >= 0) {
+            ::close(this->epoll_fd_);
+        }
+    }
+
+    int epoll_fd() const { return this->epoll_fd_; }
+    std::size_t size() const { return this->backends_.size(); }
+
+    bool open(const std::vector<upstream_addr> & upstreams, uint32_t max_idle) {
+        this->epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+        if (this->epoll_fd_ < 0) {
+            std::cerr << "Error: epoll_create1() failed, errno = " << errno << std::endl;
+            return false;
+        }
+        for (std::size_t i = 0; i < upstreams.size(); ++i) {
+            this->backends_.push_back(std::unique_ptr<upstream_backend>(new upstream_backend(upstreams[i])));
+        }
+        this->max_idle_ = max_idle;
+        return true;
+    }
+
+    upstream_backend * pick(uint64_t now) {
+        upstream_backend * best = nullptr;
+        bool best_up = false;
+        std::size_t count = this->backends_.size();
+        for (std::size_t i = 0; i < count; ++i) {
+            upstream_backend * backend = this->backends_[(this->next_ + i) % count].get();
+            bool is_up = (backend->down_until <= now);
+            if (best == nullptr || (is_up && !best_up) ||
+                (is_up == best_up && backend->outstanding < best->outstanding)) {
+                best = backend;
+                best_up = is_up;
+            }
+        }
+        this->next_++;
+        return best;
+    }
+
+    void mark_down(upstream_backend * backend, uint64_t now) {
+        backend->down_until = now + kDownMs;
+    }
+
+    //
+    // An idle connection to @backend, or a new one (in kConnecting until its
+    // socket is writable), or nullptr if the connect failed at once. A new
+    // connection is always opened if @fresh is true.
+    //
+    upstream_conn * acquire(upstream_backend * backend, bool fresh) {
+        if (!fresh && !backend->idle.empty()) {
+            upstream_conn * conn = backend->idle.back();
+            backend->idle.pop_back();
+            conn->state = upstream_conn::kActive;
+            conn->reused = true;
+            return conn;
+        }
+
+        const struct sockaddr * addr = (const struct sockaddr *)&backend->addr.addr;
+        int fd = ::socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return nullptr;
+        if (addr->sa_family != AF_UNIX)
+            set_nodelay(fd, true);
+        upstream_conn * conn = new upstream_conn(fd, backend);
+        int ret = ::connect(fd, addr, backend->addr.addr_len);
+        if (ret == 0) {
+            conn->state = upstream_conn::kActive;
+        }
+        else if (errno != EINPROGRESS) {
+            delete conn;
+            ::close(fd);
+            return nullptr;
+        }
+
+        struct epoll_event event;
+        event.events = (conn->state == upstream_conn::kConnecting) ? EPOLLOUT : EPOLLIN;
+        event.data.ptr = conn;
+        if (::epoll_ctl(this->epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+            delete conn;
+            ::close(fd);
+            return nullptr;
+        }
+        conn->events = event.events;
+        return conn;
+    }
+
+    // Put @conn back to the pool after it's received a whole response,
+    // return false if the pool is full, the caller closes it then.
+    bool release(upstream_conn * conn) {
+        upstream_backend * backend = conn->backend;
+        if (backend->idle.size() >= this->max_idle_ || conn->size() != 0)
+            return false;
+        conn->state = upstream_conn::kIdle;
+        conn->context = nullptr;
+        conn->release_idle_buffers();
+        // A readable idle connection has been closed by the backend.
+        this->set_events(conn, EPOLLIN);
+        backend->idle.push_back(conn);
+        return true;
+    }
+
+    void close(upstream_conn * conn) {
+        if (conn->state == upstream_conn::kIdle) {
+            std::vector<upstream_conn *> & idle = conn->backend->idle;
+            for (std::size_t i = 0; i < idle.size(); ++i) {
+                if (idle[i] == conn) {
+                    idle.erase(idle.begin() + i);
+                    break;
+                }
+            }
+        }
+        ::epoll_ctl(this->epoll_fd_, EPOLL_CTL_DEL, conn->fd, nullptr);
+        ::close(conn->fd);
+        conn->fd = -1;
+        conn->state = upstream_conn::kClosed;
+        conn->context = nullptr;
+        this->closed_.push_back(conn);
+    }
+
+    // Free the closed connections, out of a batch of events.
+    void purge() {
+        for (std::size_t i = 0; i < this->closed_.size(); ++i) {
+            delete this->closed_[i];
+        }
+        this->closed_.clear();
+    }
+
+    void set_events(upstream_conn * conn, uint32_t events) {
+        if (conn->events != events) {
+            struct epoll_event event;
+            event.events = events;
+            event.data.ptr = conn;
+            ::epoll_ctl(this->epoll_fd_, EPOLL_CTL_MOD, conn->fd, &event);
+            conn->events = events;
+        }
+    }
+
+    // The ready connections, without blocking.
+    int poll(struct epoll_event * events, int max_events) {
+        int n = ::epoll_wait(this->epoll_fd_, events, max_events, 0);
+        return ((n > 0) ? n : 0);
+    }
+};
+
+} // namespace jimi
+
+#endif // __linux__
@@ -0,0 +1,696 @@
+
+#pragma once
+
+#include "io_uring_ring.hpp"
+
+#if JIMI_HAS_IO_URING
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <poll.h>
+
+#include <atomic>
+#include <vector>
+#include <iostream>
+
+#include "jimi/basic/stddef.h"
+
+#include "server_config.hpp"
+#include "socket_utils.hpp"
+#include "connection.hpp"
+#include "connection_timers.hpp"
+#include "control_mailbox.hpp"
+#include "offload_pool.hpp"
+#include "server_stats.hpp"
+#include "admission_control.hpp"
+
+namespace jimi {
+
+//
+// The connection state of the io_uring engine.
+//
+// The kernel may still read the buffers of an in-flight send after it's been
+// submitted, so the handler never appends to them: the pending output is
+// moved from the connection's write queue to the send queue when a send
+// starts, and it's sent with one IORING_OP_SENDMSG of all its segments.
+//
+// io_uring has no sendfile operation, so a file body is sent by the reactor
+// thread with sendfile() on the non-blocking socket once the send buffer is
+// flushed, and a poll operation waits for the socket to be writable again.
+//
+class uring_connection : public connection {
+public:
+    enum uring_flag_t {
+        kRecvArmed  = 0x0001,
+        kSending    = 0x0002,
+        kClosing    = 0x0004,
+        kPolling    = 0x0008,
+    };
+
+    write_queue     sq;
+    // The iovec array of the in-flight sendmsg.
+    io_buffer       siov;
+    struct msghdr   smsg;
+    // When the in-flight send was queued, if the latencies are recorded.
+    latency_shard::time_point_t send_start;
+
+    uint32_t    uring_flags;
+    // The number of the in-flight operations which refer to this connection.
+    uint32_t    inflight;
+
+public:
+    uring_connection(int _fd = -1) : connection(_fd), uring_flags(0), inflight(0) {
+        ::memset(&this->smsg, 0, sizeof(this->smsg));
+    }
+    ~uring_connection() {
+        buffer_pool::local().give_back(this->siov);
+    }
+
+    size_type pending_send() const { return this->sq.pending(); }
+    size_type pending_total() const { return (this->pending_write() + this->pending_send()); }
+};
+
+//
+// One io_uring reactor, run by one thread, with the same Handler API as
+// epoll_reactor<Handler>. It uses a multishot accept on the listening socket,
+// a multishot recv per connection which picks the buffers from a provided
+// buffer ring, and queues the sends of all connections served in one loop
+// iteration, so the whole iteration costs a single io_uring_enter().
+//
+template <typename Handler>
+class uring_reactor {
+public:
+    typedef Handler handler_type;
+
+    static const uint32_t kRingEntries = 1024;
+    static const uint32_t kWaitTimeout = 100;       // In milliseconds.
+
+    static const uint16_t kBufferGroup = 0;
+    static const uint32_t kBufferCount = 1024;
+    static const std::size_t kBufferSize = connection::kReadChunkSize;
+
+    // Stop reading from a connection while this many bytes wait to be written.
+    static const std::size_t kMaxPendingWrite = 1024 * 1024;
+
+private:
+    // The low 3 bits of user_data tag the operation, the rest is the connection.
+    enum op_tag_t {
+        kOpAccept = 1,
+        kOpRecv   = 2,
+        kOpSend   = 3,
+        kOpCancel = 4,
+        kOpPoll   = 5,
+        kOpWakeup = 6,
+        kOpEvent  = 7,
+        kOpMask   = 7
+    };
+
+    io_uring_ring ring_;
+    int listen_fd_;
+    bool own_listen_fd_;
+    bool accept_armed_;
+    uint32_t id_;
+    const server_config & config_;
+    handler_type handler_;
+    uring_connection * head_;
+    std::size_t conn_count_;
+    connection_timers timers_;
+    control_mailbox * mailbox_;
+    offload_inbox * inbox_;
+    bool wakeup_armed_;
+    // The event fd of the handler, and whether a poll on it is in flight.
+    int event_fd_;
+    bool event_armed_;
+    admission_control admission_;
+    // The readiness time of the current completions: the return of the
+    // submit_and_wait() which reaped them, in us.
+    uint64_t ready_us_;
+
+public:
+    uring_reactor(uint32_t id, const server_config & config)
+        : listen_fd_(-1), own_listen_fd_(false), accept_armed_(false), id_(id),
+          config_(config), handler_(config), head_(nullptr), conn_count_(0),
+          timers_(config), mailbox_(nullptr), inbox_(nullptr),
+          wakeup_armed_(false), event_fd_(-1), event_armed_(false), admission_(config),
+          ready_us_(0) {}
+
+    ~uring_reactor() {
+        // Closing the ring first cancels all the in-flight operations.
+        this->ring_.close();
+        this->close_all();
+        if (this->listen_fd_ >= 0 && this->own_listen_fd_) {
+            ::close(this->listen_fd_);
+        }
+    }
+
+    uint32_t id() const { return this->id_; }
+    int listen_fd() const { return this->listen_fd_; }
+    std::size_t connections() const { return this->conn_count_; }
+    handler_type & handler() { return this->handler_; }
+    uint64_t enter_calls() const { return this->ring_.enter_calls(); }
+
+    // The control messages to the reactor, handled by run().
+    void set_mailbox(control_mailbox * mailbox) { this->mailbox_ = mailbox; }
+
+    // The offloaded jobs returned to the reactor, if the server has an offload pool.
+    void set_offload_inbox(offload_inbox * inbox) { this->inbox_ = inbox; }
+
+    // Whether the running kernel supports all the io_uring features we use.
+    static bool is_supported() {
+        io_uring_ring ring;
+        if (ring.open(8) != 0)
+            return false;
+        return (ring.register_buffers(kBufferGroup, 8, 4096) == 0);
+    }
+
+    //
+    // If shared_listen_fd is -1, the reactor creates its own SO_REUSEPORT
+    // listening socket, otherwise all reactors accept on the shared one.
+    //
+    bool open(int shared_listen_fd = -1) {
+        int ret = this->ring_.open(kRingEntries);
+        if (ret != 0) {
+            std::cerr << "Error: io_uring_setup() failed, errno = " << -ret << std::endl;
+            return false;
+        }
+        ret = this->ring_.register_buffers(kBufferGroup, kBufferCount, kBufferSize);
+        if (ret != 0) {
+            std::cerr << "Error: io_uring register buffer ring failed, errno = " << -ret << std::endl;
+            return false;
+        }
+
+        if (shared_listen_fd < 0) {
+            this->listen_fd_ = create_listen_socket(this->config_.host, this->config_.port, true);
+            if (this->listen_fd_ < 0)
+                return false;
+            this->own_listen_fd_ = true;
+        }
+        else {
+            this->listen_fd_ = shared_listen_fd;
+            this->own_listen_fd_ = false;
+        }
+        return true;
+    }
+
+    void run(const std::atomic<bool> & stop) {
+        int ret = this->ring_.enable();
+        if (ret != 0) {
+            std::cerr << "Error: io_uring enable rings failed, errno = " << -ret << std::endl;
+            return;
+        }
+        this->arm_accept();
+        offload_inbox::local() = this->inbox_;
+        if (this->inbox_ != nullptr)
+            this->arm_wakeup();
+        this->event_fd_ = this->handler_.event_fd();
+        if (this->event_fd_ >= 0)
+            this->arm_event();
+        uint32_t timeout = kWaitTimeout;
+        while (likely(!stop.load(std::memory_order_relaxed))) {
+            ret = this->ring_.submit_and_wait(timeout);
+            if (unlikely(ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EBUSY)) {
+                std::cerr << "Error: io_uring_enter() failed, errno = " << -ret << std::endl;
+                break;
+            }
+            if (unlikely(this->admission_.enabled()))
+                this->ready_us_ = admission_control::now_us();
+            this->ring_.for_each_cqe([this](const io_uring_ring::cqe_type * cqe) {
+                this->dispatch(cqe);
+            });
+            if (this->mailbox_ != nullptr)
+                this->drain_mailbox();
+            if (this->inbox_ != nullptr)
+                this->inbox_->drain();
+            int tick = this->handler_.on_tick([this](connection & base) {
+                uring_connection * conn = static_cast<uring_connection *>(&base);
+                if ((conn->uring_flags & uring_connection::kClosing) == 0 &&
+                    this->flush(conn) && this->check_idle(conn))
+                    this->update_timer(conn);
+            });
+            timeout = (tick >= 0 && (uint32_t)tick < kWaitTimeout) ? (uint32_t)tick : kWaitTimeout;
+            this->timers_.template expire<uring_connection>([this](uring_connection * conn) {
+                this->begin_close(conn);
+            });
+            if (unlikely(!this->accept_armed_))
+                this->arm_accept();
+            if (unlikely(this->inbox_ != nullptr && !this->wakeup_armed_))
+                this->arm_wakeup();
+            if (this->event_fd_ >= 0 && !this->event_armed_)
+                this->arm_event();
+        }
+        // Cancel the in-flight operations, the buffers must be given back on this thread.
+        this->ring_.close();
+        this->close_all();
+    }
+
+    void close_all() {
+        while (this->head_ != nullptr) {
+            uring_connection * conn = this->head_;
+            this->timers_.cancel(conn);
+            this->handler_.on_close(*conn);
+            ::close(conn->fd);
+            this->unlink(conn);
+            stats_shard::local().closed.inc();
+            delete conn;
+        }
+    }
+
+private:
+    static uint64_t make_user_data(uring_connection * conn, uint32_t tag) {
+        return ((uint64_t)(uintptr_t)conn | tag);
+    }
+
+    void drain_mailbox() {
+        control_message msg;
+        while (this->mailbox_->pop(msg)) {
+            this->handler_.on_control(msg);
+        }
+    }
+
+    void link(uring_connection * conn) {
+        conn->prev = nullptr;
+        conn->next = this->head_;
+        if (this->head_ != nullptr)
+            this->head_->prev = conn;
+        this->head_ = conn;
+        this->conn_count_++;
+    }
+
+    void unlink(uring_connection * conn) {
+        if (conn->prev != nullptr)
+            conn->prev->next = conn->next;
+        else
+            this->head_ = static_cast<uring_connection *>(conn->next);
+        if (conn->next != nullptr)
+            conn->next->prev = conn->prev;
+        conn->prev = conn->next = nullptr;
+        this->conn_count_--;
+    }
+
+    void arm_accept() {
+        io_uring_ring::sqe_type * sqe = this->ring_.get_sqe();
+        if (unlikely(sqe == nullptr))
+            return;
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = this->listen_fd_;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = make_user_data(nullptr, kOpAccept);
+        this->accept_armed_ = true;
+    }
+
+    // Poll the eventfd of the offload inbox, its completion wakes the loop up.
+    void arm_wakeup() {
+        io_uring_ring::sqe_type * sqe = this->ring_.get_sqe();
+        if (unlikely(sqe == nullptr))
+            return;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = this->inbox_->event_fd();
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = make_user_data(nullptr, kOpWakeup);
+        this->wakeup_armed_ = true;
+    }
+
+    // Poll the event fd of the handler, on_event() is called when it's readable.
+    void arm_event() {
+        io_uring_ring::sqe_type * sqe = this->ring_.get_sqe();
+        if (unlikely(sqe == nullptr))
+            return;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = this->event_fd_;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = make_user_data(nullptr, kOpEvent);
+        this->event_armed_ = true;
+    }
+
+    void arm_recv(uring_connection * conn) {
+        io_uring_ring::sqe_type * sqe = this->ring_.get_sqe();
+        if (unlikely(sqe == nullptr)) {
+            this->begin_close(conn);
+            return;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = this->ring_.buffer_group();
+        sqe->user_data = make_user_data(conn, kOpRecv);
+        conn->uring_flags |= uring_connection::kRecvArmed;
+        conn->inflight++;
+    }
+
+    void cancel_recv(uring_connection * conn) {
+        io_uring_ring::sqe_type * sqe = this->ring_.get_sqe();
+        if (unlikely(sqe == nullptr))
+            return;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = make_user_data(conn, kOpRecv);
+        sqe->user_data = make_user_data(nullptr, kOpCancel);
+    }
+
+    // Queue a send of the pending output if there isn't one in flight,
+    // return false if the connection is closing (it may have been freed).
+    bool flush(uring_connection * conn) {
+        if ((conn->uring_flags & (uring_connection::kSending | uring_connection::kPolling)) != 0)
+            return true;
+        while (conn->pending_send() == 0) {
+            if (conn->pending_write() == 0) {
+                if (likely(conn->pending_file() == 0))
+                    return true;
+                bool is_sent;
+                if (!this->send_file(conn, is_sent))
+                    return false;
+                if (!is_sent)
+                    return true;
+                // The output of the pipelined requests after the file.
+                continue;
+            }
+            // Move the pending output to the send queue.
+            conn->sq.swap(conn->wq);
+        }
+
+        if (conn->siov.empty()) {
+            conn->siov = buffer_pool::local().borrow(buffer_pool::class_size(0));
+            if (unlikely(conn->siov.empty())) {
+                this->begin_close(conn);
+                return false;
+            }
+        }
+        io_uring_ring::sqe_type * sqe = this->ring_.get_sqe();
+        if (unlikely(sqe == nullptr)) {
+            this->begin_close(conn);
+            return false;
+        }
+        struct iovec * iov = (struct iovec *)conn->siov.data;
+        int count = conn->sq.gather(iov, (int)(conn->siov.capacity / sizeof(struct iovec)));
+        if (likely(count == 1)) {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->addr = (uint64_t)(uintptr_t)iov[0].iov_base;
+            sqe->len = (uint32_t)iov[0].iov_len;
+        }
+        else {
+            conn->smsg.msg_iov = iov;
+            conn->smsg.msg_iovlen = (std::size_t)count;
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->addr = (uint64_t)(uintptr_t)&conn->smsg;
+            sqe->len = 1;
+        }
+        sqe->fd = conn->fd;
+        // Hold the header of a file response until the body is sent.
+        sqe->msg_flags = (conn->pending_file() == 0) ? MSG_NOSIGNAL : (MSG_NOSIGNAL | MSG_MORE);
+        sqe->user_data = make_user_data(conn, kOpSend);
+        if (unlikely(this->config_.latency_stats != 0))
+            conn->send_start = latency_shard::now();
+        conn->uring_flags |= uring_connection::kSending;
+        conn->inflight++;
+        return true;
+    }
+
+    //
+    // Send the file body, the header has been sent before it. Return false if
+    // the connection is closing, @is_sent is false if it waits for POLLOUT.
+    // The output which follows is flushed by the caller.
+    //
+    bool send_file(uring_connection * conn, bool & is_sent) {
+        is_sent = false;
+        while (conn->pending_file() > 0) {
+            ssize_t n = conn->file->transfer(conn->fd, conn->file_offset, (std::size_t)conn->pending_file());
+            if (likely(n > 0)) {
+                conn->commit_file((uint64_t)n);
+                stats_shard::local().send_bytes.add((uint64_t)n);
+            }
+            else if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return this->arm_poll_out(conn);
+            }
+            else {
+                // An error, or the file has been truncated.
+                this->begin_close(conn);
+                return false;
+            }
+        }
+
+        if (conn->size() > 0 && !conn->is_close_after_write()) {
+            // The handler stopped at the file response, serve the pipelined requests.
+            if (!this->handler_.on_read(*conn))
+                conn->set_close_after_write();
+        }
+        this->try_resume_read(conn);
+        is_sent = true;
+        return true;
+    }
+
+    bool arm_poll_out(uring_connection * conn) {
+        io_uring_ring::sqe_type * sqe = this->ring_.get_sqe();
+        if (unlikely(sqe == nullptr)) {
+            this->begin_close(conn);
+            return false;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = conn->fd;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = make_user_data(conn, kOpPoll);
+        conn->uring_flags |= uring_connection::kPolling;
+        conn->inflight++;
+        return true;
+    }
+
+    bool need_pause_read(uring_connection * conn) const {
+        return (conn->pending_total() >= kMaxPendingWrite ||
+                (conn->pending_file() != 0 && conn->size() >= kMaxPendingWrite));
+    }
+
+    // Resume reading if the back pressure has been released.
+    void try_resume_read(uring_connection * conn) {
+        if (unlikely((conn->flags & connection::kReadPaused) != 0 &&
+                     conn->pending_total() < kMaxPendingWrite / 2 &&
+                     conn->pending_file() == 0)) {
+            conn->flags &= ~connection::kReadPaused;
+            if ((conn->uring_flags & uring_connection::kRecvArmed) == 0 &&
+                !conn->is_close_after_write()) {
+                this->arm_recv(conn);
+                // Handle the requests which were left in the read buffer.
+                if (conn->size() > 0 && !this->handler_.on_read(*conn))
+                    conn->set_close_after_write();
+            }
+        }
+    }
+
+    void dispatch(const io_uring_ring::cqe_type * cqe) {
+        uint32_t tag = (uint32_t)(cqe->user_data & kOpMask);
+        uring_connection * conn = (uring_connection *)(uintptr_t)(cqe->user_data & ~(uint64_t)kOpMask);
+        switch (tag) {
+        case kOpAccept:
+            this->on_accept(cqe);
+            break;
+        case kOpRecv:
+            this->on_recv(conn, cqe);
+            break;
+        case kOpSend:
+            this->on_send(conn, cqe);
+            break;
+        case kOpPoll:
+            this->on_poll(conn, cqe);
+            break;
+        case kOpWakeup:
+            // Drained below, and re-armed at the end of the loop iteration.
+            this->inbox_->clear_event();
+            this->wakeup_armed_ = false;
+            break;
+        case kOpEvent:
+            // Re-armed at the end of the loop iteration.
+            this->event_armed_ = false;
+            this->handler_.on_event();
+            break;
+        default:
+            break;
+        }
+    }
+
+    void on_accept(const io_uring_ring::cqe_type * cqe) {
+        if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+            // Re-armed at the end of the loop iteration.
+            this->accept_armed_ = false;
+        }
+        if (unlikely(cqe->res < 0))
+            return;
+
+        int fd = cqe->res;
+        if (this->config_.nodelay)
+            set_nodelay(fd, true);
+
+        uring_connection * conn = new uring_connection(fd);
+        this->link(conn);
+        stats_shard::local().accepted.inc();
+        this->handler_.on_accept(*conn);
+        this->update_timer(conn);
+        this->arm_recv(conn);
+    }
+
+    void on_recv(uring_connection * conn, const io_uring_ring::cqe_type * cqe) {
+        int res = cqe->res;
+        if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+            conn->uring_flags &= ~uring_connection::kRecvArmed;
+            conn->inflight--;
+        }
+
+        if (likely(res > 0)) {
+            assert((cqe->flags & IORING_CQE_F_BUFFER) != 0);
+            uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            if (likely((conn->uring_flags & uring_connection::kClosing) == 0)) {
+                char * buf = conn->prepare_read((std::size_t)res);
+                if (likely(buf != nullptr)) {
+                    ::memcpy(buf, this->ring_.buffer(bid), (std::size_t)res);
+                    conn->commit_read((std::size_t)res);
+                }
+                else {
+                    // Out of buffers, the input is lost.
+                    conn->set_close_after_write();
+                }
+            }
+            this->ring_.recycle_buffer(bid);
+            stats_shard::local().recv_bytes.add((uint64_t)res);
+        }
+
+        if (unlikely((conn->uring_flags & uring_connection::kClosing) != 0)) {
+            this->try_destroy(conn);
+            return;
+        }
+
+        if (likely(res > 0)) {
+            if (unlikely(this->admission_.enabled()) &&
+                !this->admission_.admit(this->ready_us_, admission_control::now_us())) {
+                conn->flags |= connection::kOverloaded;
+                if (!this->handler_.on_read(*conn))
+                    conn->set_close_after_write();
+                conn->flags &= ~connection::kOverloaded;
+            }
+            else if (!this->handler_.on_read(*conn)) {
+                conn->set_close_after_write();
+            }
+        }
+        else if (res == 0 || (res != -ENOBUFS && res != -ECANCELED)) {
+            // The peer has closed, or a socket error.
+            conn->set_close_after_write();
+        }
+
+        if (unlikely(conn->is_close_after_write())) {
+            if ((conn->uring_flags & uring_connection::kRecvArmed) != 0) {
+                // Don't read any more.
+                this->cancel_recv(conn);
+            }
+        }
+        else if (unlikely(this->need_pause_read(conn))) {
+            // Apply back pressure, resume reading when the output is flushed.
+            if ((conn->flags & connection::kReadPaused) == 0) {
+                conn->flags |= connection::kReadPaused;
+                if ((conn->uring_flags & uring_connection::kRecvArmed) != 0)
+                    this->cancel_recv(conn);
+            }
+        }
+        else if ((conn->uring_flags & uring_connection::kRecvArmed) == 0 &&
+                 (conn->flags & connection::kReadPaused) == 0) {
+            this->arm_recv(conn);
+        }
+
+        if (likely(this->flush(conn) && this->check_idle(conn))) {
+            conn->release_idle_buffers();
+            this->update_timer(conn);
+        }
+    }
+
+    void on_send(uring_connection * conn, const io_uring_ring::cqe_type * cqe) {
+        int res = cqe->res;
+        conn->uring_flags &= ~uring_connection::kSending;
+        conn->inflight--;
+
+        if (unlikely((conn->uring_flags & uring_connection::kClosing) != 0)) {
+            this->try_destroy(conn);
+            return;
+        }
+        if (unlikely(res < 0)) {
+            this->begin_close(conn);
+            return;
+        }
+
+        conn->sq.commit((std::size_t)res);
+        stats_shard::local().send_bytes.add((uint64_t)res);
+        if (unlikely(this->config_.latency_stats != 0))
+            latency_shard::local().write.record(conn->send_start, latency_shard::now());
+        if (conn->sq.is_empty())
+            buffer_pool::local().give_back(conn->siov);
+
+        this->try_resume_read(conn);
+        if (this->flush(conn) && this->check_idle(conn))
+            this->update_timer(conn);
+    }
+
+    void on_poll(uring_connection * conn, const io_uring_ring::cqe_type * cqe) {
+        conn->uring_flags &= ~uring_connection::kPolling;
+        conn->inflight--;
+
+        if (unlikely((conn->uring_flags & uring_connection::kClosing) != 0)) {
+            this->try_destroy(conn);
+            return;
+        }
+        if (unlikely(cqe->res < 0 || (cqe->res & (POLLERR | POLLHUP)) != 0)) {
+            this->begin_close(conn);
+            return;
+        }
+        if (this->flush(conn) && this->check_idle(conn))
+            this->update_timer(conn);
+    }
+
+    // Close the connection if it's done with all the output,
+    // return false if it's closing (it may have been freed).
+    bool check_idle(uring_connection * conn) {
+        if (unlikely(conn->is_close_after_write() &&
+                     (conn->uring_flags & uring_connection::kSending) == 0 &&
+                     conn->pending_total() == 0 && conn->pending_file() == 0)) {
+            this->begin_close(conn);
+            return false;
+        }
+        return true;
+    }
+
+    void update_timer(uring_connection * conn) {
+        bool writing = ((conn->uring_flags & (uring_connection::kSending | uring_connection::kPolling)) != 0 ||
+                        conn->pending_total() != 0 || conn->pending_file() != 0);
+        this->timers_.update(conn, writing);
+    }
+
+    void begin_close(uring_connection * conn) {
+        if ((conn->uring_flags & uring_connection::kClosing) != 0)
+            return;
+        conn->uring_flags |= uring_connection::kClosing;
+        this->timers_.cancel(conn);
+        if ((conn->uring_flags & uring_connection::kRecvArmed) != 0)
+            this->cancel_recv(conn);
+        this->try_destroy(conn);
+    }
+
+    // Free the connection when the last in-flight operation has completed.
+    void try_destroy(uring_connection * conn) {
+        if (conn->inflight != 0)
+            return;
+        if ((conn->uring_flags & uring_connection::kClosing) == 0)
+            return;
+        this->handler_.on_close(*conn);
+        ::close(conn->fd);
+        this->unlink(conn);
+        stats_shard::local().closed.inc();
+        delete conn;
+    }
+};
+
+} // namespace jimi
+
+#endif // JIMI_HAS_IO_URING
@@ -0,0 +1,214 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <utility>
+
+#include "jimi/basic/stddef.h"
+
+#include "buffer_pool.hpp"
+
+namespace jimi {
+
+//
+// The output queue of a connection, a list of segments which are gathered
+// into one iovec array and flushed with a single sendmsg() (or one io_uring
+// send), however many responses have been queued in one read.
+//
+// A segment is either copied into the write buffer [pos, len), with write(),
+// or refers to the memory of the handler, with write_ref(): the pre-rendered
+// status lines and bodies, which must stay unchanged until they are flushed.
+// The adjacent copied segments are merged, and their bytes are implicit: the
+// write buffer is consumed in the order of the segments.
+//
+// Both the write buffer and the segment array are borrowed from the
+// buffer_pool only while the queue isn't empty. If the pool is out of memory,
+// the write fails and so do the next ones until release(), the output stream
+// is broken and the connection must be closed after it's flushed.
+//
+class write_queue {
+public:
+    typedef std::size_t size_type;
+
+    struct segment {
+        const char * data;      // nullptr: the next bytes of the write buffer.
+        size_type    size;
+    };
+
+    // A smaller reference is copied: with 16 pipelined responses, gathering
+    // the small pieces of every response costs more in the kernel than one
+    // memcpy to the write buffer, the iovecs only win for the big bodies.
+    static const size_type kMinRefSize = 4096;
+
+private:
+    io_buffer   buf_;
+    size_type   pos_;
+    size_type   len_;
+
+    io_buffer   segs_;
+    uint32_t    head_;
+    uint32_t    tail_;
+    // The bytes sent of the head segment.
+    size_type   seg_pos_;
+    size_type   total_;
+    bool        failed_;
+
+public:
+    // The minimum size of the write buffer to borrow.
+    uint32_t    hint;
+
+public:
+    write_queue() : pos_(0), len_(0), head_(0), tail_(0), seg_pos_(0), total_(0), failed_(false), hint(0) {}
+    ~write_queue() {
+        this->release();
+    }
+
+    size_type pending() const { return this->total_; }
+    bool is_empty() const { return (this->total_ == 0); }
+
+    // Return false if out of memory.
+    bool write(const char * data, size_type len) {
+        if (unlikely(len == 0 || this->failed_))
+            return !this->failed_;
+        if (unlikely(this->buf_.capacity - this->len_ < len)) {
+            if (this->pos_ > 0) {
+                // Move the unsent bytes to the head of buffer.
+                ::memmove(this->buf_.data, this->buf_.data + this->pos_, this->len_ - this->pos_);
+                this->len_ -= this->pos_;
+                this->pos_ = 0;
+            }
+            if (this->buf_.capacity - this->len_ < len) {
+                size_type new_size = this->len_ + len;
+                if (new_size < this->hint)
+                    new_size = this->hint;
+                if (unlikely(!buffer_pool::local().grow(this->buf_, new_size, this->len_)))
+                    return this->fail();
+            }
+        }
+
+        segment * segs = (segment *)this->segs_.data;
+        if (likely(this->tail_ > this->head_ && segs[this->tail_ - 1].data == nullptr))
+            segs[this->tail_ - 1].size += len;
+        else if (unlikely(!this->push_segment(nullptr, len)))
+            return this->fail();
+        ::memcpy(this->buf_.data + this->len_, data, len);
+        this->len_ += len;
+        this->total_ += len;
+        return true;
+    }
+
+    // Return false if out of memory.
+    bool write_ref(const char * data, size_type len) {
+        if (len < kMinRefSize)
+            return this->write(data, len);
+        if (unlikely(this->failed_ || !this->push_segment(data, len)))
+            return this->fail();
+        this->total_ += len;
+        return true;
+    }
+
+    // Fill @iov with the pending segments, return the number of the iovecs.
+    int gather(struct iovec * iov, int max_iov) const {
+        const segment * segs = (const segment *)this->segs_.data;
+        size_type offset = this->pos_;
+        int count = 0;
+        for (uint32_t i = this->head_; i < this->tail_ && count < max_iov; ++i) {
+            size_type skip = (i == this->head_) ? this->seg_pos_ : 0;
+            size_type size = segs[i].size - skip;
+            if (segs[i].data != nullptr) {
+                iov[count].iov_base = (void *)(segs[i].data + skip);
+            }
+            else {
+                iov[count].iov_base = (void *)(this->buf_.data + offset);
+                offset += size;
+            }
+            iov[count].iov_len = size;
+            count++;
+        }
+        return count;
+    }
+
+    // @n bytes have been sent.
+    void commit(size_type n) {
+        assert(n <= this->total_);
+        this->total_ -= n;
+        segment * segs = (segment *)this->segs_.data;
+        while (n > 0) {
+            assert(this->head_ < this->tail_);
+            segment & seg = segs[this->head_];
+            size_type remain = seg.size - this->seg_pos_;
+            size_type sent = (n < remain) ? n : remain;
+            if (seg.data == nullptr)
+                this->pos_ += sent;
+            this->seg_pos_ += sent;
+            n -= sent;
+            if (this->seg_pos_ == seg.size) {
+                this->head_++;
+                this->seg_pos_ = 0;
+            }
+        }
+        if (this->total_ == 0)
+            this->release();
+    }
+
+    // Give the buffers back to the pool, and drop the pending segments.
+    void release() {
+        buffer_pool & pool = buffer_pool::local();
+        pool.give_back(this->buf_);
+        pool.give_back(this->segs_);
+        this->pos_ = this->len_ = 0;
+        this->head_ = this->tail_ = 0;
+        this->seg_pos_ = 0;
+        this->total_ = 0;
+        this->failed_ = false;
+    }
+
+    void swap(write_queue & other) {
+        this->buf_.swap(other.buf_);
+        std::swap(this->pos_, other.pos_);
+        std::swap(this->len_, other.len_);
+        this->segs_.swap(other.segs_);
+        std::swap(this->head_, other.head_);
+        std::swap(this->tail_, other.tail_);
+        std::swap(this->seg_pos_, other.seg_pos_);
+        std::swap(this->total_, other.total_);
+        std::swap(this->failed_, other.failed_);
+        // The hint belongs to the owner of the queue, it isn't swapped.
+    }
+
+private:
+    bool fail() {
+        this->failed_ = true;
+        return false;
+    }
+
+    bool push_segment(const char * data, size_type size) {
+        uint32_t capacity = (uint32_t)(this->segs_.capacity / sizeof(segment));
+        if (unlikely(this->tail_ >= capacity)) {
+            if (this->head_ > 0) {
+                ::memmove(this->segs_.data, this->segs_.data + this->head_ * sizeof(segment),
+                          (this->tail_ - this->head_) * sizeof(segment));
+                this->tail_ -= this->head_;
+                this->head_ = 0;
+            }
+            else {
+                size_type used = this->tail_ * sizeof(segment);
+                size_type new_size = (used != 0) ? (used * 2) : buffer_pool::class_size(0);
+                if (unlikely(!buffer_pool::local().grow(this->segs_, new_size, used)))
+                    return false;
+            }
+        }
+        segment * segs = (segment *)this->segs_.data;
+        segs[this->tail_].data = data;
+        segs[this->tail_].size = size;
+        this->tail_++;
+        return true;
+    }
+};
+
+} // namespace jimi
@@ -25,6 +25,7 @@
 #include <iomanip>
 #include <sstream>
 #include <string>
+#include <memory>
 #include <atomic>
 #include <thread>
 #include <ratio>
@@ -66,9 +67,11 @@
 #endif
 
 #include "jimi/http_all.h"
+#include "jimi/http/FastParser.h"
 #include "jimi/crc32c.h"
 #include "jimi/Hash.h"
 #include "jimi/support/StopWatch.h"
+#include "jimi/support/LatencyHistogram.h"
 
 #include "jimi/jstd/hash_table.h"
 #include "jimi/jstd/hash_map.h"
@@ -363,6 +366,624 @@ void http_parser_test()
     std::cout << std::endl;
 }
 
+#define PARSER_POOL_CHECK(expr) \
+    do { \
+        if (!(expr)) { \
+            std::cout << "  FAILED: " << #expr << " (line " << __LINE__ << ")" << std::endl; \
+            failures++; \
+        } \
+    } while (0)
+
+// A request with @fields header fields, "X-Field-<n>: <n>".
+static std::string make_request(std::size_t fields)
+{
+    std::string request = "GET /index.html HTTP/1.1\r\n";
+    for (std::size_t i = 0; i < fields; ++i) {
+        request += "X-Field-" + std::to_string(i) + ": " + std::to_string(i) + "\r\n";
+    }
+    request += "\r\n";
+    return request;
+}
+
+static bool is_value(const StringRef & value, const char * expected)
+{
+    std::size_t size = ::strlen(expected);
+    return (value.size() == size && ::memcmp(value.data(), expected, size) == 0);
+}
+
+//
+// The checks of the parser pool and the O(1) reset of the parsers,
+// return the number of the failed ones.
+//
+int http_parser_pool_test()
+{
+    typedef BasicParserPool< http::Parser<1024> > ParserPool;
+    int failures = 0;
+
+    std::cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << std::endl;
+    std::cout << "  http_parser_pool_test()" << std::endl;
+    std::cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << std::endl;
+    std::cout << std::endl;
+
+    // reset() rewinds to the entries chunks, the next fill allocates none.
+    {
+        std::string data = make_request(200);
+        StringRefList<64> list(data);
+        for (std::size_t i = 0; i < 200; ++i) {
+            list.append(data.data() + i, 1, data.data() + i + 1, 2);
+        }
+        std::size_t capacity = list.capacity();
+        PARSER_POOL_CHECK(list.size() == 200);
+        PARSER_POOL_CHECK(capacity >= 200);
+        list.reset();
+        PARSER_POOL_CHECK(list.size() == 0);
+        PARSER_POOL_CHECK(list.capacity() == capacity);
+        list.setRef(data);
+        for (std::size_t i = 0; i < 200; ++i) {
+            list.append(data.data() + i + 3, 4, data.data() + i + 5, 6);
+        }
+        PARSER_POOL_CHECK(list.capacity() == capacity);
+        PARSER_POOL_CHECK(list.at(63).key.offset == 63 + 3);
+        PARSER_POOL_CHECK(list.at(64).key.offset == 64 + 3);
+        PARSER_POOL_CHECK(list.at(199).key.offset == 199 + 3);
+        PARSER_POOL_CHECK(list.at(199).value.length == 6);
+        list.shrink();
+        PARSER_POOL_CHECK(list.capacity() == StringRefList<64>::kInitCapacity);
+    }
+
+    // The fields past the 64 inline entries are read back through at().
+    {
+        std::string request = make_request(150);
+        http::Parser<1024> parser;
+        int ec = parser.parseRequest(request.data(), request.size());
+        StringRef value;
+        PARSER_POOL_CHECK(ec == http::error_code::Succeed);
+        PARSER_POOL_CHECK(parser.getFieldSize() == 150);
+        PARSER_POOL_CHECK(parser.findField("X-Field-63", value) && is_value(value, "63"));
+        PARSER_POOL_CHECK(parser.findField("X-Field-64", value) && is_value(value, "64"));
+        PARSER_POOL_CHECK(parser.findField("X-Field-149", value) && is_value(value, "149"));
+        PARSER_POOL_CHECK(!parser.findField("X-Field-150", value));
+
+        // And again after reset(), on the reused chunks.
+        parser.reset();
+        request = make_request(100);
+        ec = parser.parseRequest(request.data(), request.size());
+        PARSER_POOL_CHECK(ec == http::error_code::Succeed);
+        PARSER_POOL_CHECK(parser.getFieldSize() == 100);
+        PARSER_POOL_CHECK(parser.findField("X-Field-99", value) && is_value(value, "99"));
+        PARSER_POOL_CHECK(!parser.findField("X-Field-100", value));
+    }
+
+    // The counters of the pool balance, and the released parsers are reused.
+    {
+        ParserPool pool;
+        std::string request = make_request(80);
+        http::Parser<1024> * parsers[8];
+        for (std::size_t round = 0; round < 100; ++round) {
+            for (std::size_t i = 0; i < 8; ++i) {
+                parsers[i] = pool.acquire();
+                PARSER_POOL_CHECK(parsers[i]->getFieldSize() == 0);
+                parsers[i]->parseRequest(request.data(), request.size());
+            }
+            PARSER_POOL_CHECK(pool.in_use() == 8);
+            for (std::size_t i = 0; i < 8; ++i) {
+                pool.release(parsers[i]);
+            }
+        }
+        PARSER_POOL_CHECK(pool.counters().acquired == 800);
+        PARSER_POOL_CHECK(pool.counters().released == 800);
+        PARSER_POOL_CHECK(pool.counters().created == 8);
+        PARSER_POOL_CHECK(pool.in_use() == 0);
+        PARSER_POOL_CHECK(pool.cached() == 8);
+        pool.shrink(2);
+        PARSER_POOL_CHECK(pool.counters().destroyed == 6);
+        PARSER_POOL_CHECK(pool.cached() == 2);
+    }
+
+    // A header block over 64 KB is rejected, its offsets wouldn't fit.
+    {
+        std::string request = "GET / HTTP/1.1\r\nX-Large: ";
+        request.append(75 * 1024, 'a');
+        request += "\r\nConnection: close\r\n\r\n";
+        http::Parser<1024> parser;
+        PARSER_POOL_CHECK(parser.parseRequest(request.data(), request.size()) != http::error_code::Succeed);
+        http::BasicFastParser<StringRef> fast_parser;
+        PARSER_POOL_CHECK(fast_parser.parseRequest(request.data(), request.size()) != http::error_code::Succeed);
+    }
+
+    std::cout << "  " << ((failures == 0) ? "Passed" : "Failed")
+              << ", failures = " << failures << std::endl;
+    std::cout << std::endl;
+    return failures;
+}
+
+#undef PARSER_POOL_CHECK
+
+#define PARSER_TEST_CHECK(expr) \
+    do { \
+        if (!(expr)) { \
+            std::cout << "  FAILED: " << #expr << " (line " << __LINE__ << ")" << std::endl; \
+            failures++; \
+        } \
+    } while (0)
+
+//
+// The checks of HeaderEndDetector: the terminator split at every offset
+// across the calls of detect(), consume() of a pipelined request, and find()
+// around the 16-byte loads, return the number of the failed ones.
+//
+int header_end_detector_test()
+{
+    int failures = 0;
+
+    std::cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << std::endl;
+    std::cout << "  header_end_detector_test()" << std::endl;
+    std::cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << std::endl;
+    std::cout << std::endl;
+
+    const std::string header = "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n"
+                               "Accept: text/html\r\n\r\n";
+    const std::string next = "GET /next HTTP/1.1\r\nHost: www.example.com\r\n\r\n";
+    const std::string input = header + next;
+
+    // The bytes arrive one by one: complete exactly at the last byte of the
+    // terminator.
+    {
+        http::HeaderEndDetector detector;
+        std::size_t first = 0;
+        for (std::size_t len = 0; len <= input.size() && first == 0; ++len) {
+            first = detector.detect(input.data(), len);
+            if (first != 0) {
+                PARSER_TEST_CHECK(len == header.size());
+            }
+        }
+        PARSER_TEST_CHECK(first == header.size());
+        PARSER_TEST_CHECK(detector.is_completed());
+        PARSER_TEST_CHECK(detector.header_size() == header.size());
+    }
+
+    // Split in two calls at every offset.
+    for (std::size_t split = 0; split <= input.size(); ++split) {
+        http::HeaderEndDetector detector;
+        std::size_t size = detector.detect(input.data(), split);
+        PARSER_TEST_CHECK(size == ((split >= header.size()) ? header.size() : 0));
+        PARSER_TEST_CHECK(detector.scanned() <= split);
+        size = detector.detect(input.data(), input.size());
+        PARSER_TEST_CHECK(size == header.size());
+    }
+
+    // consume() of the first request rewinds the scan position to the head
+    // of the next one, and of a partial one to its unscanned tail.
+    for (std::size_t split = header.size(); split <= input.size(); ++split) {
+        http::HeaderEndDetector detector;
+        PARSER_TEST_CHECK(detector.detect(input.data(), split) == header.size());
+        PARSER_TEST_CHECK(detector.scanned() == header.size());
+        detector.consume(header.size());
+        PARSER_TEST_CHECK(detector.scanned() == 0);
+        PARSER_TEST_CHECK(!detector.is_completed());
+        const char * data = input.data() + header.size();
+        std::size_t size = detector.detect(data, split - header.size());
+        if (split < input.size()) {
+            PARSER_TEST_CHECK(size == 0);
+            if (split - header.size() >= 4) {
+                PARSER_TEST_CHECK(detector.scanned() == split - header.size() - 3);
+            }
+        }
+        size = detector.detect(data, next.size());
+        PARSER_TEST_CHECK(size == next.size());
+    }
+    {
+        http::HeaderEndDetector detector;
+        PARSER_TEST_CHECK(detector.detect(input.data(), 30) == 0);
+        PARSER_TEST_CHECK(detector.scanned() == 27);
+        // A part of the scanned bytes is consumed, the scan goes on after them.
+        detector.consume(10);
+        PARSER_TEST_CHECK(detector.scanned() == 17);
+        PARSER_TEST_CHECK(detector.detect(input.data() + 10, header.size() - 10) == header.size() - 10);
+        // More than the scanned bytes.
+        detector.consume(header.size());
+        PARSER_TEST_CHECK(detector.scanned() == 0);
+        detector.reset();
+        PARSER_TEST_CHECK(detector.scanned() == 0 && !detector.is_completed());
+    }
+
+    // find() on buffers of 4 to 40 bytes, the terminator at every position,
+    // across the 16-byte loads and the tail loop. The buffers are exactly
+    // sized for the address sanitizer.
+    for (std::size_t len = 0; len <= 40; ++len) {
+        std::unique_ptr<char[]> buf(new char[len]);
+        char * data = buf.get();
+        ::memset(data, 'a', len);
+        PARSER_TEST_CHECK(http::HeaderEndDetector::find(data, data + len) == nullptr);
+        for (std::size_t pos = 0; pos + 4 <= len; ++pos) {
+            ::memset(data, 'a', len);
+            ::memcpy(data + pos, "\r\n\r\n", 4);
+            PARSER_TEST_CHECK(http::HeaderEndDetector::find(data, data + len) == data + pos);
+            // Cut in the middle of the terminator.
+            for (std::size_t cut = 1; cut < 4; ++cut) {
+                PARSER_TEST_CHECK(http::HeaderEndDetector::find(data, data + pos + cut) == nullptr);
+            }
+            // A decoy before it.
+            if (pos >= 3) {
+                ::memcpy(data + pos - 3, "\r\n\r", 3);
+                PARSER_TEST_CHECK(http::HeaderEndDetector::find(data, data + len) == data + pos);
+            }
+        }
+        // The first of two.
+        if (len >= 8) {
+            ::memset(data, '\n', len);
+            ::memcpy(data + len - 8, "\r\n\r\n\r\n\r\n", 8);
+            PARSER_TEST_CHECK(http::HeaderEndDetector::find(data, data + len) == data + len - 8);
+        }
+    }
+
+    std::cout << "  " << ((failures == 0) ? "Passed" : "Failed")
+              << ", failures = " << failures << std::endl;
+    std::cout << std::endl;
+    return failures;
+}
+
+//
+// The prefix traits without any prefix, every request line is parsed by the
+// generic path of BasicFastParser.
+//
+struct NoRequestLinePrefixes {
+    static const std::size_t kCount = 0;
+
+    static const http::RequestLinePrefix * prefixes() {
+        return nullptr;
+    }
+};
+
+template <typename FastParser, typename GenericParser>
+bool is_same_request(const FastParser & fast, const GenericParser & generic)
+{
+    if (fast.getMethod() != generic.getMethod() ||
+        fast.getMethodStr() != generic.getMethodStr() ||
+        fast.getVersion() != generic.getVersion() ||
+        fast.getVersionStr() != generic.getVersionStr() ||
+        fast.getURI() != generic.getURI() ||
+        fast.getFieldSize() != generic.getFieldSize())
+        return false;
+    for (std::size_t i = 0; i < fast.getFieldSize(); ++i) {
+        StringRef fast_key, fast_value, key, value;
+        fast.getField(i, fast_key, fast_value);
+        generic.getField(i, key, value);
+        if (fast_key.size() != key.size() || fast_value.size() != value.size() ||
+            ::memcmp(fast_key.data(), key.data(), key.size()) != 0 ||
+            ::memcmp(fast_value.data(), value.data(), value.size()) != 0)
+            return false;
+    }
+    return true;
+}
+
+//
+// The checks of the well-known request line prefixes: a request of every
+// DefaultRequestLinePrefixes entry is parsed the same by the fast path and
+// by the generic path, and with less than 16 bytes the matcher falls back
+// to the generic path. Return the number of the failed ones.
+//
+int request_line_prefix_test()
+{
+    typedef http::RequestLineMatcher<http::DefaultRequestLinePrefixes> matcher_type;
+    typedef http::BasicFastParser<std::string, 1024, http::DefaultRequestLinePrefixes> fast_parser_type;
+    typedef http::BasicFastParser<std::string, 1024, NoRequestLinePrefixes> generic_parser_type;
+
+    int failures = 0;
+
+    std::cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << std::endl;
+    std::cout << "  request_line_prefix_test()" << std::endl;
+    std::cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << std::endl;
+    std::cout << std::endl;
+
+    // One request of each prefix, in the order of DefaultRequestLinePrefixes.
+    static const char * const kRequests[http::DefaultRequestLinePrefixes::kCount] = {
+        "GET / HTTP/1.1\r\nHost: www.example.com\r\nAccept: */*\r\n\r\n",
+        "GET / HTTP/1.0\r\nHost: www.example.com\r\n\r\n",
+        "GET /api/users?id=1 HTTP/1.1\r\nHost: api.example.com\r\nX-Request-Id: 42\r\n\r\n",
+        "POST /api/items HTTP/1.0\r\nHost: api.example.com\r\nContent-Length: 0\r\n\r\n",
+        "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\nConnection: close\r\n\r\n",
+        "POST /form HTTP/1.1\r\nHost: www.example.com\r\nContent-Type: text/plain\r\n\r\n",
+    };
+
+    const http::RequestLinePrefix * prefixes = http::DefaultRequestLinePrefixes::prefixes();
+    for (std::size_t i = 0; i < http::DefaultRequestLinePrefixes::kCount; ++i) {
+        const std::string request = kRequests[i];
+        PARSER_TEST_CHECK(matcher_type::match(request.data(), request.size()) == &prefixes[i]);
+
+        fast_parser_type fast;
+        generic_parser_type generic;
+        PARSER_TEST_CHECK(fast.parseRequest(request) == http::error_code::Succeed);
+        PARSER_TEST_CHECK(generic.parseRequest(request) == http::error_code::Succeed);
+        PARSER_TEST_CHECK(fast.getMethod() == prefixes[i].method);
+        PARSER_TEST_CHECK(fast.getFieldSize() >= 1);
+        PARSER_TEST_CHECK(is_same_request(fast, generic));
+
+        // The request line and the fields without the empty line, and no
+        // request line without a header field.
+        const std::size_t line_end = request.find("\r\n") + 2;
+        const std::string no_fields = request.substr(0, line_end) + "\r\n";
+        fast.reset();
+        generic.reset();
+        PARSER_TEST_CHECK(fast.parseRequest(no_fields) == http::error_code::Succeed);
+        PARSER_TEST_CHECK(generic.parseRequest(no_fields) == http::error_code::Succeed);
+        PARSER_TEST_CHECK(fast.getFieldSize() == 0);
+        PARSER_TEST_CHECK(is_same_request(fast, generic));
+    }
+
+    // Less than one 16-byte load: no prefix is matched, even the whole line.
+    {
+        const char * line = "GET / HTTP/1.1\r\n";
+        for (std::size_t len = 0; len < matcher_type::kLoadSize; ++len) {
+            PARSER_TEST_CHECK(matcher_type::match(line, len) == nullptr);
+        }
+        PARSER_TEST_CHECK(matcher_type::match(line, matcher_type::kLoadSize) == &prefixes[0]);
+    }
+
+    // A request which isn't any prefix goes the generic path.
+    {
+        const std::string request = "PUT /api/items HTTP/1.1\r\nHost: api.example.com\r\n\r\n";
+        PARSER_TEST_CHECK(matcher_type::match(request.data(), request.size()) == nullptr);
+        fast_parser_type fast;
+        generic_parser_type generic;
+        PARSER_TEST_CHECK(fast.parseRequest(request) == http::error_code::Succeed);
+        PARSER_TEST_CHECK(generic.parseRequest(request) == http::error_code::Succeed);
+        PARSER_TEST_CHECK(is_same_request(fast, generic));
+    }
+
+    // Every truncated head of the requests, the ones of less than 16 bytes on
+    // the fallback: the fast path fails where the generic path fails. The
+    // generic path stops at the '\0' after the input, as a std::string has,
+    // the buffers are exactly sized for the address sanitizer.
+    for (std::size_t i = 0; i < http::DefaultRequestLinePrefixes::kCount; ++i) {
+        const std::string request = kRequests[i];
+        for (std::size_t len = 1; len < request.size(); ++len) {
+            std::unique_ptr<char[]> buf(new char[len + 1]);
+            ::memcpy(buf.get(), request.data(), len);
+            buf[len] = '\0';
+            fast_parser_type fast;
+            generic_parser_type generic;
+            int fast_ec = fast.parseRequest(buf.get(), len);
+            int generic_ec = generic.parseRequest(buf.get(), len);
+            PARSER_TEST_CHECK((fast_ec == http::error_code::Succeed) == (generic_ec == http::error_code::Succeed));
+            if (fast_ec == http::error_code::Succeed && generic_ec == http::error_code::Succeed) {
+                PARSER_TEST_CHECK(is_same_request(fast, generic));
+            }
+        }
+    }
+
+    std::cout << "  " << ((failures == 0) ? "Passed" : "Failed")
+              << ", failures = " << failures << std::endl;
+    std::cout << std::endl;
+    return failures;
+}
+
+//
+// The bucket @index holds @value, and the highest value of the bucket is
+// within the relative error 1 / 2^SubBucketBits of it.
+//
+template <typename Histogram>
+bool is_value_in_bucket(uint64_t value, uint32_t index)
+{
+    uint64_t lowest = Histogram::lowestValueOf(index);
+    uint64_t highest = Histogram::highestValueOf(index);
+    if (value < lowest || value > highest)
+        return false;
+    if (value < (uint64_t)Histogram::kSubBucketCount)
+        return (lowest == value && highest == value);
+    return ((highest - lowest) <= (value >> Histogram::kSubBucketBits));
+}
+
+//
+// The checks of LatencyHistogram: the round trip of the bucket indexes and
+// values at every sub-bucket boundary, the percentiles of a known
+// distribution, and merging the snapshots, return the number of the failed ones.
+//
+int latency_histogram_test()
+{
+    int failures = 0;
+
+    std::cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << std::endl;
+    std::cout << "  latency_histogram_test()" << std::endl;
+    std::cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << std::endl;
+    std::cout << std::endl;
+
+    // Every value of a small histogram: 8 sub-buckets, up to 1023.
+    {
+        typedef BasicLatencyHistogram<3, 10> histogram_type;
+        uint32_t last_index = 0;
+        for (uint64_t value = 0; value <= histogram_type::kMaxValue; ++value) {
+            uint32_t index = histogram_type::bucketIndexOf(value);
+            PARSER_TEST_CHECK(index < (uint32_t)histogram_type::kBucketCount);
+            PARSER_TEST_CHECK(index == last_index || index == last_index + 1);
+            PARSER_TEST_CHECK(is_value_in_bucket<histogram_type>(value, index));
+            last_index = index;
+        }
+        PARSER_TEST_CHECK(last_index == (uint32_t)histogram_type::kBucketCount - 1);
+        PARSER_TEST_CHECK(histogram_type::highestValueOf(last_index) == (uint64_t)histogram_type::kMaxValue);
+    }
+
+    // The default histogram: every bucket round trips, and the values around
+    // the boundaries of the sub-buckets land in the right ones.
+    {
+        typedef LatencyHistogram histogram_type;
+        for (uint32_t index = 0; index < (uint32_t)histogram_type::kBucketCount; ++index) {
+            uint64_t lowest = histogram_type::lowestValueOf(index);
+            uint64_t highest = histogram_type::highestValueOf(index);
+            PARSER_TEST_CHECK(histogram_type::bucketIndexOf(lowest) == index);
+            PARSER_TEST_CHECK(histogram_type::bucketIndexOf(highest) == index);
+            PARSER_TEST_CHECK(is_value_in_bucket<histogram_type>(lowest, index));
+            PARSER_TEST_CHECK(is_value_in_bucket<histogram_type>(highest, index));
+            if (index > 0) {
+                PARSER_TEST_CHECK(histogram_type::highestValueOf(index - 1) + 1 == lowest);
+                PARSER_TEST_CHECK(histogram_type::bucketIndexOf(lowest - 1) == index - 1);
+            }
+        }
+        PARSER_TEST_CHECK(histogram_type::bucketIndexOf(histogram_type::kMaxValue)
+                          == (uint32_t)histogram_type::kBucketCount - 1);
+        PARSER_TEST_CHECK(histogram_type::highestValueOf((uint32_t)histogram_type::kBucketCount - 1)
+                          == (uint64_t)histogram_type::kMaxValue);
+
+        // The values above the max trackable value are counted in the top bucket.
+        histogram_type histogram;
+        histogram.record(histogram_type::kMaxValue + 1);
+        histogram.record(~0ULL);
+        histogram_type::Snapshot snapshot = histogram.snapshot();
+        PARSER_TEST_CHECK(snapshot.count() == 2);
+        PARSER_TEST_CHECK(snapshot.max() == (uint64_t)histogram_type::kMaxValue);
+        PARSER_TEST_CHECK(snapshot.p50() == (uint64_t)histogram_type::kMaxValue);
+    }
+
+    // The percentiles of 1 to 10000 ns, each once: the value at a percentile
+    // is the highest value of its bucket, within the relative error.
+    {
+        LatencyHistogram histogram;
+        for (uint64_t value = 1; value <= 10000; ++value) {
+            histogram.record(value);
+        }
+        LatencyHistogram::Snapshot snapshot = histogram.snapshot();
+        PARSER_TEST_CHECK(snapshot.count() == 10000);
+        PARSER_TEST_CHECK(snapshot.min() == 1);
+        PARSER_TEST_CHECK(snapshot.max() == 10000);
+        PARSER_TEST_CHECK(snapshot.mean() == 5000.5);
+
+        static const double kPercentiles[] = { 1.0, 10.0, 25.0, 50.0, 75.0, 90.0, 99.0, 99.9 };
+        for (std::size_t i = 0; i < sizeof(kPercentiles) / sizeof(kPercentiles[0]); ++i) {
+            uint64_t expected = (uint64_t)(kPercentiles[i] * 100.0 + 0.5);
+            uint64_t value = snapshot.valueAtPercentile(kPercentiles[i]);
+            PARSER_TEST_CHECK(value >= expected);
+            PARSER_TEST_CHECK(value - expected <= (expected >> LatencyHistogram::kSubBucketBits));
+        }
+        PARSER_TEST_CHECK(snapshot.p50() == snapshot.valueAtPercentile(50.0));
+        PARSER_TEST_CHECK(snapshot.p99() == snapshot.valueAtPercentile(99.0));
+        PARSER_TEST_CHECK(snapshot.p999() == snapshot.valueAtPercentile(99.9));
+        // No more than the max value recorded.
+        PARSER_TEST_CHECK(snapshot.valueAtPercentile(100.0) == 10000);
+        PARSER_TEST_CHECK(snapshot.valueAtPercentile(200.0) == 10000);
+        PARSER_TEST_CHECK(snapshot.valueAtPercentile(0.0) == 1);
+
+        // The small values are exact.
+        histogram.reset();
+        for (uint64_t value = 0; value < 100; ++value) {
+            histogram.record(value);
+        }
+        snapshot = histogram.snapshot();
+        PARSER_TEST_CHECK(snapshot.min() == 0);
+        PARSER_TEST_CHECK(snapshot.p50() == 49);
+        PARSER_TEST_CHECK(snapshot.p99() == 98);
+
+        // An empty one.
+        histogram.reset();
+        snapshot = histogram.snapshot();
+        PARSER_TEST_CHECK(snapshot.count() == 0);
+        PARSER_TEST_CHECK(snapshot.min() == 0 && snapshot.max() == 0);
+        PARSER_TEST_CHECK(snapshot.p99() == 0);
+    }
+
+    // Merging the snapshots of two histograms equals recording into one.
+    {
+        LatencyHistogram first, second, all;
+        uint64_t value = 12345;
+        for (int i = 0; i < 5000; ++i) {
+            // A spread from tens of nanoseconds to a few milliseconds.
+            value = (value * 6364136223846793005ULL + 1442695040888963407ULL);
+            uint64_t latency = (value >> 40) % ((i % 7 == 0) ? 5000000 : 20000) + 10;
+            ((i % 3 == 0) ? first : second).record(latency);
+            all.record(latency);
+        }
+        LatencyHistogram::Snapshot merged = first.snapshot();
+        merged.merge(second.snapshot());
+        LatencyHistogram::Snapshot reversed = second.snapshot();
+        reversed.merge(first.snapshot());
+        LatencyHistogram::Snapshot accumulated;
+        first.snapshot(accumulated);
+        second.snapshot(accumulated);
+        LatencyHistogram::Snapshot expected = all.snapshot();
+
+        PARSER_TEST_CHECK(merged.count() == expected.count());
+        PARSER_TEST_CHECK(merged.min() == expected.min());
+        PARSER_TEST_CHECK(merged.max() == expected.max());
+        PARSER_TEST_CHECK(merged.mean() == expected.mean());
+        PARSER_TEST_CHECK(reversed.min() == expected.min());
+        PARSER_TEST_CHECK(reversed.max() == expected.max());
+        PARSER_TEST_CHECK(accumulated.count() == expected.count());
+        PARSER_TEST_CHECK(accumulated.min() == expected.min());
+        PARSER_TEST_CHECK(accumulated.max() == expected.max());
+        for (int i = 0; i <= 1000; ++i) {
+            double percentile = i / 10.0;
+            PARSER_TEST_CHECK(merged.valueAtPercentile(percentile) == expected.valueAtPercentile(percentile));
+            PARSER_TEST_CHECK(accumulated.valueAtPercentile(percentile) == expected.valueAtPercentile(percentile));
+        }
+    }
+
+    std::cout << "  " << ((failures == 0) ? "Passed" : "Failed")
+              << ", failures = " << failures << std::endl;
+    std::cout << std::endl;
+    return failures;
+}
+
+#if JIMI_HTTP_PARSER_STATS
+
+//
+// The phases of one parse of @ParserTy recorded in its ParserStats.
+//
+template <typename ParserTy>
+int parser_stats_check(const char * name, const std::string & request)
+{
+    int failures = 0;
+
+    http::ParserStats & stats = http::ParserStats::local<ParserTy>();
+    stats.reset();
+    ParserTy parser;
+    PARSER_TEST_CHECK(parser.parseRequest(request.data(), request.size()) == http::error_code::Succeed);
+
+    PARSER_TEST_CHECK(stats.requests() == 1);
+    uint64_t bytes = 0;
+    for (int i = 0; i < http::ParsePhase::MaxPhase; ++i) {
+        PARSER_TEST_CHECK(stats.phase(i).calls == 1);
+        bytes += stats.phase(i).bytes;
+    }
+    PARSER_TEST_CHECK(bytes == request.size());
+    PARSER_TEST_CHECK(stats.phase(http::ParsePhase::Method).bytes == 4);
+    PARSER_TEST_CHECK(stats.phase(http::ParsePhase::HeaderFields).fields == 2);
+
+    stats.dump(std::cout, name);
+    std::cout << std::endl;
+    return failures;
+}
+
+//
+// The checks of the instrumentation build (JIMI_HTTP_PARSER_STATS=1): one
+// parse of each parser records every phase once, return the number of the
+// failed ones.
+//
+int parser_stats_test()
+{
+    int failures = 0;
+
+    std::cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << std::endl;
+    std::cout << "  parser_stats_test()" << std::endl;
+    std::cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << std::endl;
+    std::cout << std::endl;
+
+    const std::string request = "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n"
+                                "Accept: text/html\r\n\r\n";
+    failures += parser_stats_check<http::Parser<1024>>("Parser", request);
+    failures += parser_stats_check<http::BasicFastParser<StringRef>>("FastParser", request);
+    // The fast path of a well-known request line prefix.
+    failures += parser_stats_check<http::BasicFastParser<StringRef>>("FastParser",
+        "GET / HTTP/1.1\r\nHost: www.example.com\r\nAccept: text/html\r\n\r\n");
+
+    std::cout << "  " << ((failures == 0) ? "Passed" : "Failed")
+              << ", failures = " << failures << std::endl;
+    std::cout << std::endl;
+    return failures;
+}
+
+#endif // JIMI_HTTP_PARSER_STATS
+
+#undef PARSER_TEST_CHECK
+
 void http_parser_ref_test()
 {
     StopWatch sw;
@@ -3296,6 +3917,18 @@ int main(int argn, char * argv[])
     std::cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << std::endl;
     std::cout << std::endl;
 
+    int failures = http_parser_pool_test();
+    failures += header_end_detector_test();
+    failures += request_line_prefix_test();
+    failures += latency_histogram_test();
+#if JIMI_HTTP_PARSER_STATS
+    failures += parser_stats_test();
+#endif
+    if (argn > 1 && ::strcmp(argv[1], "--test") == 0) {
+        // Only the unit tests, for ctest.
+        return ((failures == 0) ? 0 : 1);
+    }
+
     http::Parser<1024> http_parser;
     http_parser.parseRequest(http_header, ::strlen(http_header));
     printf("http_parser.getVersion() = %s\n", http_parser.getVersionStr().c_str());
@@ -3347,5 +3980,5 @@ int main(int argn, char * argv[])
 #ifdef _WIN32
     ::system("pause");
 #endif
-    return 0;
+    return ((failures == 0) ? 0 : 1);
 }
@@ -0,0 +1,1710 @@
+
+#if __SSE4_2__
+// Support SSE 4.2: _mm_crc32_u32(), _mm_crc32_u64(), for the response cache.
+#define SUPPORT_SSE42_CRC32C    1
+#endif
+
+// String compare mode of the jstd containers, as in jimi_http_serv, the keys
+// of the response cache are StringRef, which aren't null terminated.
+#define STRING_COMPARE_STDC     0
+#define STRING_COMPARE_U64      1
+#define STRING_COMPARE_SSE42    2
+
+#if __SSE4_2__
+#define STRING_COMPARE_MODE     STRING_COMPARE_SSE42
+#else
+#define STRING_COMPARE_MODE     STRING_COMPARE_U64
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <cstddef>
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <new>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <functional>
+
+#include "jimi/basic/stddef.h"
+
+#include "jimi_http_serv/chase_lev_deque.hpp"
+#include "jimi_http_serv/mpsc_queue.hpp"
+#include "jimi_http_serv/offload_pool.hpp"
+#include "jimi_http_serv/rate_limiter.hpp"
+#include "jimi_http_serv/admission_control.hpp"
+#include "jimi_http_serv/timer_wheel.hpp"
+#include "jimi_http_serv/connection_timers.hpp"
+#include "jimi_http_serv/response_cache.hpp"
+#include "jimi_http_serv/http_date.hpp"
+#include "jimi_http_serv/response_header.hpp"
+#include "jimi_http_serv/proxy_handler.hpp"
+#include "jimi_http_serv/server.hpp"
+
+using namespace jimi;
+
+#define SERV_TEST_CHECK(expr) \
+    do { \
+        if (!(expr)) { \
+            std::cout << "  FAILED: " << #expr << " (line " << __LINE__ << ")" << std::endl; \
+            failures++; \
+        } \
+    } while (0)
+
+static void print_title(const char * title)
+{
+    std::cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << std::endl;
+    std::cout << "  " << title << std::endl;
+    std::cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << std::endl;
+    std::cout << std::endl;
+}
+
+static int print_result(int failures)
+{
+    std::cout << "  " << ((failures == 0) ? "Passed" : "Failed")
+              << ", failures = " << failures << std::endl;
+    std::cout << std::endl;
+    return failures;
+}
+
+struct deque_item {
+    std::atomic<uint32_t> taken;
+
+    deque_item() : taken(0) {}
+};
+
+//
+// The owner pushes @count items and pops some of them while @thieves steal
+// the others, every item must be taken exactly once. A small @capacity makes
+// the deque grow while the thieves are reading from it.
+//
+static int chase_lev_deque_round(std::size_t capacity, uint32_t thieves,
+                                 std::size_t count, uint32_t pop_every)
+{
+    int failures = 0;
+    std::unique_ptr<deque_item[]> items(new deque_item[count]);
+    chase_lev_deque<deque_item> deque(capacity);
+    std::atomic<bool> done(false);
+    std::atomic<std::size_t> stolen(0);
+
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thieves; ++i) {
+        threads.push_back(std::thread([&]() {
+            for (;;) {
+                deque_item * item = deque.steal();
+                if (item != nullptr) {
+                    item->taken.fetch_add(1, std::memory_order_relaxed);
+                    stolen.fetch_add(1, std::memory_order_relaxed);
+                }
+                else if (done.load(std::memory_order_acquire) && deque.is_empty()) {
+                    break;
+                }
+            }
+        }));
+    }
+
+    std::size_t popped = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        deque.push(&items[i]);
+        if (pop_every != 0 && (i % pop_every) == 0) {
+            deque_item * item = deque.pop();
+            if (item != nullptr) {
+                item->taken.fetch_add(1, std::memory_order_relaxed);
+                popped++;
+            }
+        }
+    }
+    // Race the thieves for the rest.
+    deque_item * item;
+    while ((item = deque.pop()) != nullptr) {
+        item->taken.fetch_add(1, std::memory_order_relaxed);
+        popped++;
+    }
+    done.store(true, std::memory_order_release);
+    for (std::size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+
+    std::size_t wrong = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        if (items[i].taken.load(std::memory_order_relaxed) != 1)
+            wrong++;
+    }
+    SERV_TEST_CHECK(wrong == 0);
+    SERV_TEST_CHECK(popped + stolen.load() == count);
+    SERV_TEST_CHECK(deque.is_empty());
+    SERV_TEST_CHECK(deque.pop() == nullptr);
+    SERV_TEST_CHECK(deque.steal() == nullptr);
+    return failures;
+}
+
+int chase_lev_deque_test()
+{
+    int failures = 0;
+    print_title("chase_lev_deque_test()");
+
+    // The owner alone: LIFO at the bottom, FIFO for a thief.
+    {
+        deque_item items[4];
+        chase_lev_deque<deque_item> deque(2);
+        for (int i = 0; i < 4; ++i) {
+            deque.push(&items[i]);
+        }
+        SERV_TEST_CHECK(deque.size() == 4);
+        SERV_TEST_CHECK(deque.pop() == &items[3]);
+        SERV_TEST_CHECK(deque.steal() == &items[0]);
+        SERV_TEST_CHECK(deque.pop() == &items[2]);
+        SERV_TEST_CHECK(deque.pop() == &items[1]);
+        SERV_TEST_CHECK(deque.pop() == nullptr);
+        SERV_TEST_CHECK(deque.is_empty());
+    }
+
+    // Push, pop and steal.
+    for (int round = 0; round < 8; ++round) {
+        failures += chase_lev_deque_round(256, 4, 200000, 3);
+    }
+    // Grow from 2 items to 256K while the thieves steal.
+    for (int round = 0; round < 8; ++round) {
+        failures += chase_lev_deque_round(2, 4, 200000, 0);
+    }
+
+    return print_result(failures);
+}
+
+struct mpsc_item : public mpsc_node {
+    uint32_t producer;
+    uint32_t seq;
+};
+
+//
+// @producers push @count nodes each, the consumer drains them concurrently:
+// every node is popped once, in the order of its producer.
+//
+int mpsc_queue_test()
+{
+    static const uint32_t kProducers = 4;
+    static const uint32_t kCount = 100000;
+
+    int failures = 0;
+    print_title("mpsc_queue_test()");
+
+    {
+        mpsc_queue queue;
+        SERV_TEST_CHECK(queue.is_empty());
+        SERV_TEST_CHECK(queue.pop() == nullptr);
+        mpsc_item items[3];
+        for (int i = 0; i < 3; ++i) {
+            queue.push(&items[i]);
+        }
+        SERV_TEST_CHECK(queue.pop() == &items[0]);
+        SERV_TEST_CHECK(queue.pop() == &items[1]);
+        SERV_TEST_CHECK(queue.pop() == &items[2]);
+        SERV_TEST_CHECK(queue.pop() == nullptr);
+        SERV_TEST_CHECK(queue.is_empty());
+    }
+
+    std::unique_ptr<mpsc_item[]> items(new mpsc_item[kProducers * kCount]);
+    mpsc_queue queue;
+    std::vector<std::thread> threads;
+    for (uint32_t p = 0; p < kProducers; ++p) {
+        threads.push_back(std::thread([&, p]() {
+            for (uint32_t i = 0; i < kCount; ++i) {
+                mpsc_item & item = items[p * kCount + i];
+                item.producer = p;
+                item.seq = i;
+                queue.push(&item);
+            }
+        }));
+    }
+
+    std::vector<uint32_t> next(kProducers, 0);
+    std::size_t received = 0, out_of_order = 0;
+    while (received < kProducers * kCount) {
+        mpsc_node * node = queue.pop();
+        if (node == nullptr) {
+            // A push may be halfway done.
+            std::this_thread::yield();
+            continue;
+        }
+        mpsc_item * item = static_cast<mpsc_item *>(node);
+        if (item->producer >= kProducers || item->seq != next[item->producer])
+            out_of_order++;
+        else
+            next[item->producer]++;
+        received++;
+    }
+    for (std::size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+
+    SERV_TEST_CHECK(out_of_order == 0);
+    for (uint32_t p = 0; p < kProducers; ++p) {
+        SERV_TEST_CHECK(next[p] == kCount);
+    }
+    SERV_TEST_CHECK(queue.pop() == nullptr);
+    SERV_TEST_CHECK(queue.is_empty());
+
+    return print_result(failures);
+}
+
+struct counting_job : public offload_job {
+    std::atomic<uint32_t> * runs;
+    uint32_t *              completes;
+    std::thread::id         reactor;
+    bool *                  wrong_thread;
+    // Submit another job from run(), it's completed by the same inbox.
+    bool                    nested;
+
+    counting_job(std::atomic<uint32_t> * _runs, uint32_t * _completes,
+                 bool * _wrong_thread, bool _nested)
+        : runs(_runs), completes(_completes), reactor(std::this_thread::get_id()),
+          wrong_thread(_wrong_thread), nested(_nested) {}
+    virtual ~counting_job() {}
+
+    virtual void run() {
+        this->runs->fetch_add(1, std::memory_order_relaxed);
+        if (this->nested) {
+            counting_job * job = new counting_job(this->runs + 1, this->completes + 1,
+                                                  this->wrong_thread, false);
+            job->reactor = this->reactor;
+            offload_pool::current()->submit(job);
+        }
+    }
+
+    virtual void complete() {
+        if (std::this_thread::get_id() != this->reactor)
+            *this->wrong_thread = true;
+        (*this->completes)++;
+        delete this;
+    }
+};
+
+//
+// The jobs submitted by a reactor (and by the jobs themselves) are run once
+// by the pool and completed once on the reactor thread.
+//
+int offload_pool_test()
+{
+    static const uint32_t kJobs = 20000;
+
+    int failures = 0;
+    print_title("offload_pool_test()");
+
+    // Two counters per job: the job, and the job it submits.
+    std::unique_ptr<std::atomic<uint32_t>[]> runs(new std::atomic<uint32_t>[kJobs * 2]);
+    std::vector<uint32_t> completes(kJobs * 2, 0);
+    for (uint32_t i = 0; i < kJobs * 2; ++i) {
+        runs[i].store(0, std::memory_order_relaxed);
+    }
+    bool wrong_thread = false;
+
+    offload_pool pool;
+    offload_pool::current() = &pool;
+    pool.start(4);
+
+    offload_inbox inbox;
+    SERV_TEST_CHECK(inbox.open());
+    offload_inbox::local() = &inbox;
+
+    for (uint32_t i = 0; i < kJobs; ++i) {
+        counting_job * job = new counting_job(&runs[i * 2], &completes[i * 2],
+                                              &wrong_thread, (i % 2) == 0);
+        SERV_TEST_CHECK(pool.submit(job));
+    }
+
+    // The reactor loop, without the eventfd wait.
+    std::size_t expected = kJobs + kJobs / 2, completed = 0;
+    for (uint32_t spins = 0; completed < expected && spins < 10000000; ++spins) {
+        std::size_t n = inbox.drain();
+        if (n == 0)
+            std::this_thread::yield();
+        completed += n;
+    }
+    pool.stop();
+    completed += inbox.drain();
+    offload_inbox::local() = nullptr;
+    offload_pool::current() = nullptr;
+
+    SERV_TEST_CHECK(completed == expected);
+    SERV_TEST_CHECK(!wrong_thread);
+    std::size_t wrong = 0;
+    for (uint32_t i = 0; i < kJobs * 2; ++i) {
+        uint32_t times = ((i % 2) == 0 || (i % 4) == 1) ? 1 : 0;
+        if (runs[i].load(std::memory_order_relaxed) != times || completes[i] != times)
+            wrong++;
+    }
+    SERV_TEST_CHECK(wrong == 0);
+
+    // Without a reactor inbox the job isn't submitted.
+    {
+        offload_pool idle_pool;
+        bool unused = false;
+        counting_job job(&runs[0], &completes[0], &unused, false);
+        SERV_TEST_CHECK(!idle_pool.submit(&job));
+    }
+
+    return print_result(failures);
+}
+
+//
+// The token buckets, with the clock given to acquire(): the burst cap, the
+// refill, the lazy takeover of a stale slot and the admission of the clients
+// which find no slot.
+//
+int rate_limiter_test()
+{
+    int failures = 0;
+    print_title("rate_limiter_test()");
+
+    // 10 requests per second, bursts of 5: a token every 100 ms, and 500 ms
+    // to refill an empty bucket.
+    rate_limiter limiter;
+    limiter.configure(10, 5, "", 16);
+    SERV_TEST_CHECK(limiter.enabled());
+    uint64_t t0 = timer_wheel::monotonic_ms();
+    const uint64_t key = rate_limiter::hash("10.0.0.1", 8);
+
+    // A new bucket is full, and holds the burst only.
+    for (int i = 0; i < 5; ++i) {
+        SERV_TEST_CHECK(limiter.acquire(key, t0));
+    }
+    SERV_TEST_CHECK(!limiter.acquire(key, t0));
+
+    // One token per 100 ms.
+    SERV_TEST_CHECK(!limiter.acquire(key, t0 + 99));
+    SERV_TEST_CHECK(limiter.acquire(key, t0 + 100));
+    SERV_TEST_CHECK(!limiter.acquire(key, t0 + 100));
+    SERV_TEST_CHECK(limiter.acquire(key, t0 + 350));
+    SERV_TEST_CHECK(limiter.acquire(key, t0 + 350));
+    SERV_TEST_CHECK(!limiter.acquire(key, t0 + 350));
+
+    // A long idle time refills up to the burst, not more.
+    uint64_t t1 = t0 + 60 * 1000;
+    for (int i = 0; i < 5; ++i) {
+        SERV_TEST_CHECK(limiter.acquire(key, t1));
+    }
+    SERV_TEST_CHECK(!limiter.acquire(key, t1));
+
+    // A clock a little behind doesn't refill, nor rewind the bucket.
+    SERV_TEST_CHECK(!limiter.acquire(key, t1 - 5));
+    SERV_TEST_CHECK(!limiter.acquire(key, t1 + 99));
+    SERV_TEST_CHECK(limiter.acquire(key, t1 + 100));
+
+    // Idle for more than 2^31 ms: full again.
+    uint64_t t2 = t1 + 100 + (1ULL << 31) + 1000;
+    for (int i = 0; i < 5; ++i) {
+        SERV_TEST_CHECK(limiter.acquire(key, t2));
+    }
+    SERV_TEST_CHECK(!limiter.acquire(key, t2));
+
+    // Fill the other 15 slots with live buckets (not full).
+    uint64_t t3 = t2;
+    std::size_t filled = 0;
+    for (uint64_t other = 1; filled < 15; ++other) {
+        if (other == key)
+            continue;
+        SERV_TEST_CHECK(limiter.acquire(other, t3));
+        filled++;
+    }
+    SERV_TEST_CHECK(!limiter.acquire(key, t3));
+
+    // No free nor stale slot: a new client is admitted, and counted.
+    stats_counter & overflows = stats_shard::local().rate_overflows;
+    const uint64_t newcomer = rate_limiter::hash("10.0.0.2", 8);
+    uint64_t overflows_before = overflows.load();
+    for (int i = 0; i < 10; ++i) {
+        SERV_TEST_CHECK(limiter.acquire(newcomer, t3));
+    }
+    SERV_TEST_CHECK(overflows.load() == overflows_before + 10);
+
+    // Once they're refilled the buckets are stale, the newcomer takes one
+    // over and is limited from then on.
+    uint64_t t4 = t3 + 500;
+    overflows_before = overflows.load();
+    for (int i = 0; i < 5; ++i) {
+        SERV_TEST_CHECK(limiter.acquire(newcomer, t4));
+    }
+    SERV_TEST_CHECK(!limiter.acquire(newcomer, t4));
+    SERV_TEST_CHECK(overflows.load() == overflows_before);
+
+    return print_result(failures);
+}
+
+//
+// The CoDel-style admission control, with the ready and current times given:
+// a burst is absorbed, a standing delay over the target turns it overloaded,
+// and one interval under the target recovers.
+//
+int admission_control_test()
+{
+    int failures = 0;
+    print_title("admission_control_test()");
+
+    {
+        server_config config;
+        config.shed_target = 0;
+        admission_control admission(config);
+        SERV_TEST_CHECK(!admission.enabled());
+    }
+
+    // A 5 ms target, a 100 ms interval.
+    server_config config;
+    config.shed_target = 5;
+    config.shed_interval = 100;
+    admission_control admission(config);
+    SERV_TEST_CHECK(admission.enabled());
+    SERV_TEST_CHECK(!admission.overloaded());
+
+    // The first input starts the first interval.
+    uint64_t now = 1000 * 1000;
+    SERV_TEST_CHECK(admission.admit(now, now));
+
+    // A burst: some inputs wait 50 ms, but some don't wait, it's absorbed.
+    for (int i = 0; i < 10; ++i) {
+        now += 5 * 1000;
+        SERV_TEST_CHECK(admission.admit(now - 50 * 1000, now));
+        SERV_TEST_CHECK(admission.admit(now - 1000, now));
+    }
+    // Even then, an input older than the interval is rejected.
+    SERV_TEST_CHECK(!admission.admit(now - 150 * 1000, now));
+    SERV_TEST_CHECK(!admission.overloaded());
+
+    // The next interval begins: still fine, then every input waits 20 ms.
+    now += 60 * 1000;
+    SERV_TEST_CHECK(admission.admit(now - 20 * 1000, now));
+    SERV_TEST_CHECK(!admission.overloaded());
+    for (int i = 0; i < 19; ++i) {
+        now += 5 * 1000;
+        SERV_TEST_CHECK(admission.admit(now - 20 * 1000, now));
+    }
+    SERV_TEST_CHECK(!admission.overloaded());
+
+    // A whole interval over the target: overloaded, the inputs which have
+    // waited longer than the target are rejected, the others are admitted.
+    now += 5 * 1000;
+    SERV_TEST_CHECK(!admission.admit(now - 20 * 1000, now));
+    SERV_TEST_CHECK(admission.overloaded());
+    SERV_TEST_CHECK(admission.admit(now - 5 * 1000, now));
+    SERV_TEST_CHECK(admission.admit(now, now));
+
+    // Meanwhile the delays fall under the target: at the end of the
+    // interval it recovers, a 20 ms delay is admitted again.
+    for (int i = 0; i < 19; ++i) {
+        now += 5 * 1000;
+        SERV_TEST_CHECK(admission.admit(now - 1000, now));
+    }
+    SERV_TEST_CHECK(admission.overloaded());
+    now += 5 * 1000;
+    SERV_TEST_CHECK(admission.admit(now - 20 * 1000, now));
+    SERV_TEST_CHECK(!admission.overloaded());
+
+    // A ready time after now (another clock) is no delay.
+    SERV_TEST_CHECK(admission.admit(now + 1000, now));
+
+    return print_result(failures);
+}
+
+//
+// The expired timers of one advance_to() of a timer wheel.
+//
+struct expired_timers {
+    std::vector<timer_node *> nodes;
+
+    void operator () (timer_node * node) { this->nodes.push_back(node); }
+
+    bool has(const timer_node * node) const {
+        for (std::size_t i = 0; i < this->nodes.size(); ++i) {
+            if (this->nodes[i] == node)
+                return true;
+        }
+        return false;
+    }
+};
+
+//
+// The timer wheel, with the ticks given to advance_to(): the expiry, a reset
+// to a later tick which is moved lazily, cancel, the timers of the later
+// rounds and a stall of more than one revolution.
+//
+int timer_wheel_test()
+{
+    int failures = 0;
+    print_title("timer_wheel_test()");
+
+    const uint64_t kSlots = timer_wheel::kSlots;
+    timer_wheel wheel(100);
+    SERV_TEST_CHECK(wheel.to_ticks(0) == 0);
+    SERV_TEST_CHECK(wheel.to_ticks(1) == 1);
+    SERV_TEST_CHECK(wheel.to_ticks(100) == 1);
+    SERV_TEST_CHECK(wheel.to_ticks(101) == 2);
+
+    // It expires after N ticks, not before.
+    timer_node a, b, c;
+    wheel.schedule(&a, 5);
+    SERV_TEST_CHECK(a.is_scheduled());
+    SERV_TEST_CHECK(a.expire == 5);
+    SERV_TEST_CHECK(wheel.size() == 1);
+    {
+        expired_timers expired;
+        wheel.advance_to(4, expired);
+        SERV_TEST_CHECK(expired.nodes.empty());
+        SERV_TEST_CHECK(wheel.current() == 4);
+        wheel.advance_to(5, expired);
+        SERV_TEST_CHECK(expired.nodes.size() == 1 && expired.has(&a));
+        SERV_TEST_CHECK(!a.is_scheduled());
+        SERV_TEST_CHECK(wheel.size() == 0);
+        // Not before the current tick.
+        wheel.advance_to(3, expired);
+        SERV_TEST_CHECK(wheel.current() == 5);
+    }
+
+    // A reset to a later tick only stores it, the timer is moved to its new
+    // slot when the old one is reached.
+    wheel.schedule(&b, 5);
+    SERV_TEST_CHECK(b.expire == 10);
+    {
+        expired_timers expired;
+        wheel.advance_to(8, expired);
+        wheel.reset(&b, 5);
+        SERV_TEST_CHECK(b.expire == 13);
+        SERV_TEST_CHECK(wheel.size() == 1);
+        wheel.advance_to(10, expired);
+        SERV_TEST_CHECK(expired.nodes.empty());
+        SERV_TEST_CHECK(b.is_scheduled());
+        wheel.advance_to(12, expired);
+        SERV_TEST_CHECK(expired.nodes.empty());
+        wheel.advance_to(13, expired);
+        SERV_TEST_CHECK(expired.nodes.size() == 1 && expired.has(&b));
+    }
+
+    // A reset to an earlier tick moves it at once, a reset of a timer which
+    // isn't scheduled schedules it.
+    wheel.reset(&c, 100);
+    SERV_TEST_CHECK(c.is_scheduled() && c.expire == 113);
+    wheel.reset(&c, 2);
+    SERV_TEST_CHECK(c.expire == 15);
+    SERV_TEST_CHECK(wheel.size() == 1);
+    {
+        expired_timers expired;
+        wheel.advance_to(15, expired);
+        SERV_TEST_CHECK(expired.nodes.size() == 1 && expired.has(&c));
+    }
+
+    // A cancelled timer doesn't expire, a schedule of 0 ticks is one tick.
+    wheel.schedule(&a, 3);
+    wheel.schedule(&b, 0);
+    SERV_TEST_CHECK(b.expire == 16);
+    wheel.cancel(&a);
+    wheel.cancel(&a);
+    SERV_TEST_CHECK(!a.is_scheduled());
+    SERV_TEST_CHECK(wheel.size() == 1);
+    {
+        expired_timers expired;
+        wheel.advance_to(30, expired);
+        SERV_TEST_CHECK(expired.nodes.size() == 1 && expired.has(&b));
+        SERV_TEST_CHECK(wheel.size() == 0);
+    }
+
+    // A timer kSlots + N ticks later shares the slot of the tick N, it's
+    // skipped there until its round comes.
+    wheel.schedule(&a, kSlots + 7);
+    wheel.schedule(&b, 7);
+    SERV_TEST_CHECK((a.expire & timer_wheel::kSlotMask) == (b.expire & timer_wheel::kSlotMask));
+    {
+        expired_timers expired;
+        wheel.advance_to(37, expired);
+        SERV_TEST_CHECK(expired.nodes.size() == 1 && expired.has(&b));
+        SERV_TEST_CHECK(a.is_scheduled());
+        wheel.advance_to(30 + kSlots + 6, expired);
+        SERV_TEST_CHECK(expired.nodes.size() == 1);
+        wheel.advance_to(30 + kSlots + 7, expired);
+        SERV_TEST_CHECK(expired.nodes.size() == 2 && expired.has(&a));
+    }
+
+    // After a stall of more than kSlots ticks, one revolution expires every
+    // timer which is due, and keeps the later ones.
+    uint64_t now = wheel.current();
+    wheel.schedule(&a, 3);
+    wheel.schedule(&b, 500);
+    wheel.schedule(&c, 2000);
+    {
+        expired_timers expired;
+        wheel.advance_to(now + 1500, expired);
+        SERV_TEST_CHECK(expired.nodes.size() == 2 && expired.has(&a) && expired.has(&b));
+        SERV_TEST_CHECK(c.is_scheduled());
+        SERV_TEST_CHECK(wheel.size() == 1);
+        SERV_TEST_CHECK(wheel.current() == now + 1500);
+        wheel.advance_to(now + 1999, expired);
+        SERV_TEST_CHECK(expired.nodes.size() == 2);
+        wheel.advance_to(now + 2000, expired);
+        SERV_TEST_CHECK(expired.nodes.size() == 3 && expired.has(&c));
+    }
+
+    // A timer reset past the stall is moved, not expired.
+    now = wheel.current();
+    wheel.schedule(&a, 10);
+    wheel.reset(&a, 3000);
+    {
+        expired_timers expired;
+        wheel.advance_to(now + 2000, expired);
+        SERV_TEST_CHECK(expired.nodes.empty());
+        SERV_TEST_CHECK(a.is_scheduled());
+        wheel.advance_to(now + 3000, expired);
+        SERV_TEST_CHECK(expired.nodes.size() == 1 && expired.has(&a));
+    }
+    SERV_TEST_CHECK(wheel.size() == 0);
+
+    return print_result(failures);
+}
+
+// Append @text to the read buffer of @conn, as the engine does.
+static void append_input(connection & conn, const char * text)
+{
+    std::size_t len = ::strlen(text);
+    char * buf = conn.prepare_read(len);
+    ::memcpy(buf, text, len);
+    conn.commit_read(len);
+    conn.detector.detect(conn.data(), conn.size());
+}
+
+//
+// The idle, header and body timeouts of the connections, with the ticks
+// given to expire_at(): the header deadline isn't pushed back by the next
+// bytes of the request, the idle and body ones are.
+//
+int connection_timers_test()
+{
+    int failures = 0;
+    print_title("connection_timers_test()");
+
+    // 100 ms ticks: idle 20, header 10 and body 30 ticks.
+    server_config config;
+    config.idle_timeout = 2;
+    config.header_timeout = 1;
+    config.body_timeout = 3;
+    connection_timers timers(config);
+    connection conn;
+    std::vector<connection *> expired;
+    auto on_timeout = [&expired](connection * timed_out) { expired.push_back(timed_out); };
+
+    // Idle, pushed back by every event.
+    timers.update(&conn, false);
+    SERV_TEST_CHECK(conn.timer_state == connection_timers::kTimerIdle);
+    SERV_TEST_CHECK(conn.timer.expire == 20);
+    timers.expire_at<connection>(15, on_timeout);
+    timers.update(&conn, false);
+    SERV_TEST_CHECK(conn.timer.expire == 35);
+    timers.expire_at<connection>(34, on_timeout);
+    SERV_TEST_CHECK(expired.empty());
+
+    // The header deadline is fixed by the first bytes of the request.
+    append_input(conn, "GET / HTTP/1.1\r\n");
+    timers.update(&conn, false);
+    SERV_TEST_CHECK(conn.timer_state == connection_timers::kTimerHeader);
+    SERV_TEST_CHECK(conn.timer.expire == 44);
+    timers.expire_at<connection>(40, on_timeout);
+    append_input(conn, "Host: x\r\n");
+    timers.update(&conn, false);
+    SERV_TEST_CHECK(conn.timer.expire == 44);
+    timers.expire_at<connection>(43, on_timeout);
+    SERV_TEST_CHECK(expired.empty());
+    timers.expire_at<connection>(44, on_timeout);
+    SERV_TEST_CHECK(expired.size() == 1 && expired[0] == &conn);
+    SERV_TEST_CHECK(timers.size() == 0);
+
+    // The body timeout is pushed back by every part of the body.
+    expired.clear();
+    append_input(conn, "Content-Length: 10\r\n\r\n");
+    std::size_t header_size = conn.detector.header_size();
+    SERV_TEST_CHECK(header_size != 0);
+    append_input(conn, "0123");
+    timers.update(&conn, false);
+    SERV_TEST_CHECK(conn.timer_state == connection_timers::kTimerBody);
+    SERV_TEST_CHECK(conn.timer.expire == 74);
+    timers.expire_at<connection>(60, on_timeout);
+    append_input(conn, "4567");
+    timers.update(&conn, false);
+    SERV_TEST_CHECK(conn.timer.expire == 90);
+    // The header deadline of the next request starts once the previous one
+    // is consumed.
+    append_input(conn, "89GET");
+    conn.consume(header_size + 10);
+    conn.detector.detect(conn.data(), conn.size());
+    timers.update(&conn, false);
+    SERV_TEST_CHECK(conn.timer_state == connection_timers::kTimerHeader);
+    SERV_TEST_CHECK(conn.timer.expire == 70);
+    timers.expire_at<connection>(69, on_timeout);
+    SERV_TEST_CHECK(expired.empty());
+
+    // Also when the rest of it and the head of the next one arrive at once.
+    append_input(conn, " / HTTP/1.1\r\n\r\nGE");
+    conn.consume(conn.detector.header_size());
+    conn.detector.detect(conn.data(), conn.size());
+    timers.update(&conn, false);
+    SERV_TEST_CHECK(conn.timer_state == connection_timers::kTimerHeader);
+    SERV_TEST_CHECK(conn.timer.expire == 79);
+
+    // Pending output is idle, whatever the input, and the header deadline
+    // starts again after it.
+    timers.update(&conn, true);
+    SERV_TEST_CHECK(conn.timer_state == connection_timers::kTimerIdle);
+    SERV_TEST_CHECK(conn.timer.expire == 89);
+    timers.update(&conn, false);
+    SERV_TEST_CHECK(conn.timer_state == connection_timers::kTimerHeader);
+    SERV_TEST_CHECK(conn.timer.expire == 79);
+
+    // A timeout of 0 disables the timer of its state.
+    server_config no_header = config;
+    no_header.header_timeout = 0;
+    connection_timers timers2(no_header);
+    connection conn2;
+    append_input(conn2, "GET / HTTP/1.1\r\n");
+    timers2.update(&conn2, false);
+    SERV_TEST_CHECK(conn2.timer_state == connection_timers::kTimerHeader);
+    SERV_TEST_CHECK(!conn2.timer.is_scheduled());
+    SERV_TEST_CHECK(timers2.size() == 0);
+    timers2.update(&conn2, true);
+    SERV_TEST_CHECK(conn2.timer.is_scheduled());
+    timers2.cancel(&conn2);
+    timers.cancel(&conn);
+    SERV_TEST_CHECK(!conn.timer.is_scheduled());
+    SERV_TEST_CHECK(timers.size() == 0);
+
+    return print_result(failures);
+}
+
+// A free TCP port of the loopback, to listen on.
+static std::string free_port()
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    ::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    ::bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    ::getsockname(fd, (struct sockaddr *)&addr, &addr_len);
+    ::close(fd);
+    char port[16];
+    ::snprintf(port, sizeof(port), "%u", (uint32_t)ntohs(addr.sin_port));
+    return port;
+}
+
+// Wait up to @timeout_ms for @fd to be readable.
+static bool wait_readable(int fd, int timeout_ms)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return (::poll(&pfd, 1, timeout_ms) > 0);
+}
+
+//
+// A loopback backend of the proxy, on its own thread: it serves one
+// connection at a time, and @action(conn, request) tells what to do with the
+// request-th request of the conn-th connection, from 0.
+//
+class test_backend {
+public:
+    enum action_t {
+        kReply,     // Answer it and keep the connection alive.
+        kClose,     // Close the connection without an answer.
+        kSilent     // Never answer, until the peer closes.
+    };
+
+    typedef std::function<uint32_t (uint32_t, uint32_t)> action_func;
+
+private:
+    int                     fd_;
+    action_func             action_;
+    std::atomic<bool>       stop_;
+    std::atomic<uint32_t>   accepted_;
+    std::atomic<uint32_t>   requests_;
+    std::thread             thread_;
+
+public:
+    test_backend(const std::string & port, action_func action)
+        : fd_(create_listen_socket("127.0.0.1", port, false)), action_(action),
+          stop_(false), accepted_(0), requests_(0) {
+        if (this->fd_ >= 0)
+            this->thread_ = std::thread([this]() { this->run(); });
+    }
+    ~test_backend() {
+        this->stop_.store(true);
+        if (this->thread_.joinable())
+            this->thread_.join();
+        if (this->fd_ >= 0)
+            ::close(this->fd_);
+    }
+
+    bool is_open() const { return (this->fd_ >= 0); }
+    uint32_t accepted() const { return this->accepted_.load(); }
+    uint32_t requests() const { return this->requests_.load(); }
+
+private:
+    void run() {
+        for (uint32_t n = 0; !this->stop_.load(); ) {
+            if (!wait_readable(this->fd_, 20))
+                continue;
+            int conn = ::accept4(this->fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (conn < 0)
+                continue;
+            this->accepted_++;
+            this->serve(conn, n++);
+            ::close(conn);
+        }
+    }
+
+    void serve(int conn, uint32_t index) {
+        std::string input;
+        uint32_t action = kReply;
+        for (uint32_t request = 0; !this->stop_.load(); ) {
+            std::size_t end = input.find("\r\n\r\n");
+            if (end != std::string::npos && action != kSilent) {
+                input.erase(0, end + 4);
+                this->requests_++;
+                action = this->action_(index, request++);
+                if (action == kClose)
+                    return;
+                if (action == kReply) {
+                    static const char kResponse[] = "HTTP/1.1 200 OK\r\n"
+                                                    "Content-Length: 2\r\n\r\nok";
+                    ::send(conn, kResponse, sizeof(kResponse) - 1, MSG_NOSIGNAL);
+                }
+                continue;
+            }
+            if (!wait_readable(conn, 20))
+                continue;
+            char buf[4096];
+            ssize_t n = ::recv(conn, buf, sizeof(buf), 0);
+            if (n <= 0)
+                return;
+            input.append(buf, (std::size_t)n);
+        }
+    }
+};
+
+// A proxy of one reactor to @upstreams, running until the destructor.
+class test_proxy {
+private:
+    server_config   config_;
+    std::thread     thread_;
+
+public:
+    test_proxy(const std::string & upstreams, uint32_t upstream_timeout) {
+        this->config_.host = "127.0.0.1";
+        this->config_.port = free_port();
+        this->config_.mode = proxy_server_mode;
+        this->config_.thread_num = 1;
+        this->config_.upstreams = upstreams;
+        this->config_.upstream_timeout = upstream_timeout;
+        server_stop_flag().store(false);
+        this->thread_ = std::thread([this]() {
+            run_reactors<epoll_reactor<proxy_handler>>(this->config_);
+        });
+    }
+    ~test_proxy() {
+        server_stop_flag().store(true);
+        this->thread_.join();
+        server_stop_flag().store(false);
+    }
+
+    //
+    // Send a GET of @path, return the status of the response, or 0 if none
+    // came within 5 seconds. The first call waits for the proxy to listen.
+    //
+    uint32_t get(const char * path) {
+        int fd = -1;
+        for (int i = 0; i < 200 && fd < 0; ++i) {
+            fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            struct sockaddr_in addr;
+            resolve_ip_v4(this->config_.host, this->config_.port, addr);
+            if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+                ::close(fd);
+                fd = -1;
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+        if (fd < 0)
+            return 0;
+        std::string request = std::string("GET ") + path + " HTTP/1.1\r\nHost: x\r\n\r\n";
+        ::send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+        std::string response;
+        while (response.find("\r\n") == std::string::npos && wait_readable(fd, 5000)) {
+            char buf[4096];
+            ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0)
+                break;
+            response.append(buf, (std::size_t)n);
+        }
+        ::close(fd);
+        if (response.size() < 12 || response.compare(0, 9, "HTTP/1.1 ") != 0)
+            return 0;
+        return (uint32_t)::atoi(response.c_str() + 9);
+    }
+};
+
+//
+// The reverse proxy against loopback backends: a request which fails on a
+// reused keep-alive connection is retried, a backend which never answers
+// times out with 504, and a refused connect is a 502 and marks the backend
+// down.
+//
+int proxy_handler_test()
+{
+    int failures = 0;
+    print_title("proxy_handler_test()");
+
+    // The backend closes the pooled connection at the second request, it's
+    // resent once on a new connection.
+    {
+        std::string port = free_port();
+        test_backend backend(port, [](uint32_t conn, uint32_t request) -> uint32_t {
+            return ((conn == 0 && request == 1) ? test_backend::kClose : test_backend::kReply);
+        });
+        SERV_TEST_CHECK(backend.is_open());
+        test_proxy proxy("127.0.0.1:" + port, 30);
+        SERV_TEST_CHECK(proxy.get("/1") == 200);
+        SERV_TEST_CHECK(proxy.get("/2") == 200);
+        SERV_TEST_CHECK(backend.accepted() == 2);
+        SERV_TEST_CHECK(backend.requests() == 3);
+    }
+
+    // The backend never answers: 504 after the upstream timeout.
+    {
+        std::string port = free_port();
+        test_backend backend(port, [](uint32_t conn, uint32_t request) -> uint32_t {
+            return test_backend::kSilent;
+        });
+        test_proxy proxy("127.0.0.1:" + port, 1);
+        auto start = std::chrono::steady_clock::now();
+        SERV_TEST_CHECK(proxy.get("/") == 504);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        SERV_TEST_CHECK(elapsed >= std::chrono::milliseconds(900));
+        SERV_TEST_CHECK(backend.requests() == 1);
+    }
+
+    // Nothing listens on the only backend: 502.
+    {
+        std::string port = free_port();
+        test_proxy proxy("127.0.0.1:" + port, 30);
+        SERV_TEST_CHECK(proxy.get("/") == 502);
+    }
+
+    // The first backend refuses the first request, which is resent to the
+    // second one. The first one is skipped for kDownMs from then on, even
+    // once it listens again.
+    {
+        std::string down_port = free_port();
+        std::string up_port = free_port();
+        test_backend up(up_port, [](uint32_t conn, uint32_t request) -> uint32_t {
+            return test_backend::kReply;
+        });
+        test_proxy proxy("127.0.0.1:" + down_port + ",127.0.0.1:" + up_port, 30);
+        SERV_TEST_CHECK(proxy.get("/1") == 200);
+        test_backend down(down_port, [](uint32_t conn, uint32_t request) -> uint32_t {
+            return test_backend::kReply;
+        });
+        SERV_TEST_CHECK(down.is_open());
+        for (int i = 0; i < 4; ++i) {
+            SERV_TEST_CHECK(proxy.get("/2") == 200);
+        }
+        SERV_TEST_CHECK(down.accepted() == 0);
+        SERV_TEST_CHECK(up.requests() == 5);
+    }
+
+    return print_result(failures);
+}
+
+// The request fields of a cache lookup, as the request parser gives them.
+struct test_request {
+    std::vector<std::pair<std::string, std::string>> fields;
+
+    test_request & add(const char * name, const char * value) {
+        this->fields.push_back(std::make_pair(std::string(name), std::string(value)));
+        return *this;
+    }
+
+    bool findField(const char * name, std::size_t len, StringRef & value) const {
+        for (std::size_t i = 0; i < this->fields.size(); ++i) {
+            const std::string & field = this->fields[i].first;
+            if (field.size() == len && ::strncasecmp(field.c_str(), name, len) == 0) {
+                value = StringRef(this->fields[i].second.data(), this->fields[i].second.size());
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// A key of the cache, with the padding of response_cache::kKeyPadding.
+struct padded_key {
+    char      data[64];
+    StringRef ref;
+
+    explicit padded_key(const char * key) {
+        ::memset(this->data, 0, sizeof(this->data));
+        ::strncpy(this->data, key, sizeof(this->data) - response_cache::kKeyPadding);
+        this->ref = StringRef(this->data, ::strlen(this->data));
+    }
+};
+
+// A complete cache entry of @key which varies on @vary, with the @variant.
+static cache_entry * make_cache_entry(response_cache & cache, const char * key,
+                                      const char * vary, const char * variant,
+                                      const char * body, uint64_t expires)
+{
+    static const std::string kHeader = "HTTP/1.1 200 OK\r\n";
+    std::size_t body_size = ::strlen(body);
+    cache_entry * entry = cache.create(StringRef(key, ::strlen(key)), kHeader, body_size);
+    if (entry != nullptr) {
+        entry->fill(body, body_size);
+        entry->vary = vary;
+        entry->variant = variant;
+        entry->expires = expires;
+    }
+    return entry;
+}
+
+static bool is_body(const cache_entry * entry, const char * body)
+{
+    return (entry != nullptr && entry->body_size == ::strlen(body) &&
+            ::memcmp(entry->body(), body, entry->body_size) == 0);
+}
+
+//
+// The response cache: the Cache-Control directives, the storability of the
+// responses, the lookup of the variants of a Vary key, and their freshness.
+//
+int response_cache_test()
+{
+    int failures = 0;
+    print_title("response_cache_test()");
+
+    static const struct {
+        const char * list;
+        const char * name;
+        bool         found;
+        const char * arg;
+    } kDirectives[] = {
+        { "no-store",                   "no-store", true,  ""           },
+        { "no-storex",                  "no-store", false, nullptr      },
+        { "public, no-store",           "no-store", true,  ""           },
+        { "public,no-store ,x",         "no-store", true,  ""           },
+        { "NO-STORE",                   "no-store", true,  ""           },
+        { "x-no-store",                 "no-store", false, nullptr      },
+        { "",                           "no-cache", false, nullptr      },
+        { "max-age=60",                 "max-age",  true,  "60"         },
+        { "max-age = 60 ",              "max-age",  true,  "60"         },
+        { "max-age=\"60\"",             "max-age",  true,  "60"         },
+        { "Max-Age=5",                  "max-age",  true,  "5"          },
+        { "s-maxage=10, max-age=60",    "max-age",  true,  "60"         },
+        { "s-maxage=10, max-age=60",    "s-maxage", true,  "10"         },
+        { "private=\"Set-Cookie\"",     "private",  true,  "Set-Cookie" },
+        { "max-age=",                   "max-age",  true,  ""           },
+    };
+    for (std::size_t i = 0; i < sizeof(kDirectives) / sizeof(kDirectives[0]); ++i) {
+        StringRef list(kDirectives[i].list, ::strlen(kDirectives[i].list));
+        StringRef arg;
+        bool found = response_cache::find_directive(list, kDirectives[i].name, &arg);
+        SERV_TEST_CHECK(found == kDirectives[i].found);
+        if (found && kDirectives[i].arg != nullptr) {
+            SERV_TEST_CHECK(arg.size() == ::strlen(kDirectives[i].arg) &&
+                            ::memcmp(arg.data(), kDirectives[i].arg, arg.size()) == 0);
+        }
+    }
+
+    static const struct {
+        const char * value;
+        bool         valid;
+        uint64_t     seconds;
+    } kSeconds[] = {
+        { "0",           true,  0          },
+        { "60",          true,  60         },
+        { "4294967295",  true,  4294967295 },
+        { "",            false, 0          },
+        { "6a",          false, 0          },
+        { "-1",          false, 0          },
+        { " 1",          false, 0          },
+        { "12345678901", false, 0          },
+    };
+    for (std::size_t i = 0; i < sizeof(kSeconds) / sizeof(kSeconds[0]); ++i) {
+        uint64_t seconds = 0;
+        bool valid = response_cache::parse_seconds(StringRef(kSeconds[i].value, ::strlen(kSeconds[i].value)),
+                                                   seconds);
+        SERV_TEST_CHECK(valid == kSeconds[i].valid);
+        if (valid) {
+            SERV_TEST_CHECK(seconds == kSeconds[i].seconds);
+        }
+    }
+
+    static const struct {
+        const char * response;
+        bool         storable;
+        uint64_t     max_age;
+        uint64_t     age;
+    } kResponses[] = {
+        { "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n\r\n",                    true,  60, 0  },
+        { "HTTP/1.1 200 OK\r\nCache-Control: public, max-age=\"30\"\r\n\r\n",        true,  30, 0  },
+        { "HTTP/1.1 200 OK\r\nCache-Control: s-maxage=10, max-age=60\r\n\r\n",       true,  10, 0  },
+        { "HTTP/1.1 200 OK\r\nCache-Control: max-age=60, s-maxage=10\r\n\r\n",       true,  10, 0  },
+        { "HTTP/1.1 200 OK\r\nCache-Control: no-storex, max-age=60\r\n\r\n",         true,  60, 0  },
+        { "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\nAge: 10\r\n\r\n",         true,  60, 10 },
+        { "HTTP/1.1 404 Not Found\r\nCache-Control: max-age=60\r\n\r\n",             true,  60, 0  },
+        { "HTTP/1.1 200 OK\r\nCache-Control: max-age=60, no-store\r\n\r\n",          false, 0,  0  },
+        { "HTTP/1.1 200 OK\r\nCache-Control: no-cache, max-age=60\r\n\r\n",          false, 0,  0  },
+        { "HTTP/1.1 200 OK\r\nCache-Control: private, max-age=60\r\n\r\n",           false, 0,  0  },
+        { "HTTP/1.1 200 OK\r\nCache-Control: max-age=abc\r\n\r\n",                   false, 0,  0  },
+        { "HTTP/1.1 200 OK\r\nCache-Control: public\r\n\r\n",                        false, 0,  0  },
+        { "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\nAge: 60\r\n\r\n",         false, 0,  0  },
+        { "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\nAge: soon\r\n\r\n",       false, 0,  0  },
+        { "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\nSet-Cookie: a=1\r\n\r\n", false, 0,  0  },
+        { "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n",                            false, 0,  0  },
+        { "HTTP/1.1 302 Found\r\nCache-Control: max-age=60\r\n\r\n",                 false, 0,  0  },
+    };
+    for (std::size_t i = 0; i < sizeof(kResponses) / sizeof(kResponses[0]); ++i) {
+        http::ResponseParser parser;
+        int ec = parser.parseResponse(kResponses[i].response, ::strlen(kResponses[i].response));
+        SERV_TEST_CHECK(ec == http::error_code::Succeed);
+        uint64_t max_age = 0, age = 0;
+        bool storable = response_cache::is_storable(parser, max_age, age);
+        SERV_TEST_CHECK(storable == kResponses[i].storable);
+        if (storable) {
+            SERV_TEST_CHECK(max_age == kResponses[i].max_age);
+            SERV_TEST_CHECK(age == kResponses[i].age);
+        }
+    }
+
+    // The variants of a key which varies on Accept-Encoding, the lookup
+    // takes the one of the value of the request, or of its absence.
+    response_cache cache(1024 * 1024);
+    SERV_TEST_CHECK(cache.enabled());
+    const uint64_t now = 1000000;
+    const char * kKey = "GET x /a";
+    const padded_key padded(kKey);
+    const StringRef key = padded.ref;
+    cache.insert(make_cache_entry(cache, kKey, "accept-encoding\n", "\n", "plain", now + 1000));
+    cache.insert(make_cache_entry(cache, kKey, "accept-encoding\n", "gzip\n", "gzip", now + 2000));
+    cache.insert(make_cache_entry(cache, "GET x /b", "", "", "b", now + 1000));
+    SERV_TEST_CHECK(cache.count() == 3);
+
+    test_request plain, gzip, br;
+    gzip.add("Accept-Encoding", "gzip");
+    br.add("accept-encoding", "br");
+    SERV_TEST_CHECK(is_body(cache.find(key, plain, now), "plain"));
+    SERV_TEST_CHECK(is_body(cache.find(key, gzip, now), "gzip"));
+    SERV_TEST_CHECK(cache.find(key, br, now) == nullptr);
+    SERV_TEST_CHECK(cache.find(padded_key("GET x /c").ref, plain, now) == nullptr);
+    // A key without Vary matches any request.
+    SERV_TEST_CHECK(is_body(cache.find(padded_key("GET x /b").ref, br, now), "b"));
+
+    // A response to the same request replaces its variant only.
+    cache.insert(make_cache_entry(cache, kKey, "accept-encoding\n", "gzip\n", "gzip2", now + 2000));
+    SERV_TEST_CHECK(cache.count() == 3);
+    SERV_TEST_CHECK(is_body(cache.find(key, gzip, now), "gzip2"));
+    SERV_TEST_CHECK(is_body(cache.find(key, plain, now), "plain"));
+
+    // A stale variant is dropped when it's found, the others are kept.
+    SERV_TEST_CHECK(is_body(cache.find(key, plain, now + 999), "plain"));
+    SERV_TEST_CHECK(cache.find(key, plain, now + 1000) == nullptr);
+    SERV_TEST_CHECK(cache.count() == 2);
+    SERV_TEST_CHECK(is_body(cache.find(key, gzip, now + 1000), "gzip2"));
+    SERV_TEST_CHECK(cache.find(key, gzip, now + 2000) == nullptr);
+    SERV_TEST_CHECK(cache.count() == 1);
+    SERV_TEST_CHECK(cache.find(key, plain, now) == nullptr);
+
+    return print_result(failures);
+}
+
+//
+// The operator new of the test fails on demand, in the thread which asks for
+// it only, to check the recovery from std::bad_alloc. They aren't inlined,
+// or the compiler sees the mismatched malloc(), free() and the operators.
+//
+static thread_local bool fail_operator_new = false;
+
+JM_NOINLINE_DECLARE(void *) operator new(std::size_t size)
+{
+    if (fail_operator_new)
+        throw std::bad_alloc();
+    void * ptr = ::malloc((size != 0) ? size : 1);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+JM_NOINLINE_DECLARE(void *) operator new[](std::size_t size)
+{
+    return ::operator new(size);
+}
+
+JM_NOINLINE_DECLARE(void) operator delete(void * ptr) noexcept
+{
+    ::free(ptr);
+}
+
+JM_NOINLINE_DECLARE(void) operator delete[](void * ptr) noexcept
+{
+    ::free(ptr);
+}
+
+#if defined(__cpp_sized_deallocation)
+JM_NOINLINE_DECLARE(void) operator delete(void * ptr, std::size_t size) noexcept
+{
+    ::free(ptr);
+}
+
+JM_NOINLINE_DECLARE(void) operator delete[](void * ptr, std::size_t size) noexcept
+{
+    ::free(ptr);
+}
+#endif
+
+// The size of the virtual memory of the process, in pages.
+static std::size_t mapped_pages()
+{
+    std::size_t pages = 0;
+    FILE * fp = ::fopen("/proc/self/statm", "r");
+    if (fp != nullptr) {
+        if (::fscanf(fp, "%zu", &pages) != 1)
+            pages = 0;
+        ::fclose(fp);
+    }
+    return pages;
+}
+
+//
+// The buffer_pool: the size classes, the carving of the slabs, the heap
+// fallback, grow() and give_back(), and the failures to grow the free list,
+// which don't keep the new slab.
+//
+int buffer_pool_test()
+{
+    int failures = 0;
+    print_title("buffer_pool_test()");
+
+    SERV_TEST_CHECK(buffer_pool::size_to_class(0) == 0);
+    SERV_TEST_CHECK(buffer_pool::size_to_class(2048) == 0);
+    SERV_TEST_CHECK(buffer_pool::size_to_class(2049) == 1);
+    SERV_TEST_CHECK(buffer_pool::size_to_class(16 * 1024 + 1) == 3);
+    SERV_TEST_CHECK(buffer_pool::size_to_class(64 * 1024) == 3);
+    SERV_TEST_CHECK(buffer_pool::size_to_class(64 * 1024 + 1) == (uint32_t)buffer_pool::kHeapClass);
+
+    const std::size_t kPerSlab = buffer_pool::kSlabSize / buffer_pool::class_size(0);
+    {
+        buffer_pool pool;
+        SERV_TEST_CHECK(pool.slabs() == 0);
+
+        // A slab is carved into the buffers of one class, in the address order.
+        std::vector<io_buffer> bufs;
+        for (std::size_t i = 0; i < kPerSlab; ++i) {
+            io_buffer buf = pool.borrow(100);
+            SERV_TEST_CHECK(!buf.empty());
+            SERV_TEST_CHECK(buf.capacity == 2048 && buf.size_class == 0);
+            if (!bufs.empty()) {
+                SERV_TEST_CHECK(buf.data == bufs.back().data + 2048);
+            }
+            ::memset(buf.data, (int)(i & 0xFF), buf.capacity);
+            bufs.push_back(buf);
+        }
+        SERV_TEST_CHECK(pool.slabs() == 1);
+        SERV_TEST_CHECK(pool.stats(0).total == kPerSlab);
+        SERV_TEST_CHECK(pool.stats(0).in_use == kPerSlab);
+        SERV_TEST_CHECK(pool.stats(1).total == 0);
+
+        // The next one carves a second slab.
+        io_buffer extra = pool.borrow(2048);
+        SERV_TEST_CHECK(!extra.empty());
+        SERV_TEST_CHECK(pool.slabs() == 2);
+        SERV_TEST_CHECK(pool.stats(0).total == kPerSlab * 2);
+        pool.give_back(extra);
+        SERV_TEST_CHECK(extra.empty() && extra.capacity == 0);
+
+        // A buffer given back is the next one borrowed.
+        char * data = bufs[10].data;
+        pool.give_back(bufs[10]);
+        SERV_TEST_CHECK(pool.stats(0).in_use == kPerSlab - 1);
+        bufs[10] = pool.borrow(1);
+        SERV_TEST_CHECK(bufs[10].data == data);
+
+        // grow() keeps the used bytes, and gives the small buffer back.
+        io_buffer buf = pool.borrow(10);
+        ::memcpy(buf.data, "0123456789", 10);
+        SERV_TEST_CHECK(pool.grow(buf, 10000, 10));
+        SERV_TEST_CHECK(buf.capacity == 16 * 1024 && buf.size_class == 2);
+        SERV_TEST_CHECK(::memcmp(buf.data, "0123456789", 10) == 0);
+        SERV_TEST_CHECK(pool.stats(2).in_use == 1);
+        SERV_TEST_CHECK(pool.stats(0).in_use == kPerSlab);
+
+        // Larger than the biggest class: on the heap.
+        SERV_TEST_CHECK(pool.grow(buf, 100000, 10));
+        SERV_TEST_CHECK(buf.size_class == (uint32_t)buffer_pool::kHeapClass);
+        SERV_TEST_CHECK(buf.capacity == 100000);
+        SERV_TEST_CHECK(::memcmp(buf.data, "0123456789", 10) == 0);
+        SERV_TEST_CHECK(pool.heap_in_use() == 1);
+        SERV_TEST_CHECK(pool.stats(2).in_use == 0);
+        pool.give_back(buf);
+        SERV_TEST_CHECK(pool.heap_in_use() == 0);
+
+        for (std::size_t i = 0; i < bufs.size(); ++i) {
+            pool.give_back(bufs[i]);
+        }
+        SERV_TEST_CHECK(pool.stats(0).in_use == 0);
+        SERV_TEST_CHECK(pool.stats(0).total == kPerSlab * 2);
+
+        // Out of memory while growing the free list of a class: the borrow
+        // fails and the slab isn't kept, the class is unchanged.
+        for (std::size_t i = 0; i < kPerSlab * 2; ++i) {
+            bufs.push_back(pool.borrow(1));
+        }
+        // A slab which is kept mapped shows in the size of the process, the
+        // sanitizers may map some memory of their own meanwhile.
+        std::size_t slabs = pool.slabs();
+        std::size_t slab_pages = buffer_pool::kSlabSize / (std::size_t)::sysconf(_SC_PAGESIZE);
+        std::size_t pages = mapped_pages();
+        fail_operator_new = true;
+        io_buffer failed = pool.borrow(1);
+        fail_operator_new = false;
+        SERV_TEST_CHECK(failed.empty());
+        SERV_TEST_CHECK(pool.slabs() == slabs);
+        SERV_TEST_CHECK(mapped_pages() < pages + slab_pages);
+        SERV_TEST_CHECK(pool.stats(0).total == kPerSlab * 2);
+        SERV_TEST_CHECK(pool.stats(0).in_use == kPerSlab * 2);
+
+        // The first buffers of a class, on an invalid free list.
+        fail_operator_new = true;
+        failed = pool.borrow(4096);
+        fail_operator_new = false;
+        SERV_TEST_CHECK(failed.empty());
+        SERV_TEST_CHECK(pool.slabs() == slabs);
+        SERV_TEST_CHECK(mapped_pages() < pages + slab_pages);
+        SERV_TEST_CHECK(pool.stats(1).total == 0);
+
+        // And it recovers.
+        io_buffer next = pool.borrow(1);
+        SERV_TEST_CHECK(!next.empty());
+        SERV_TEST_CHECK(pool.slabs() == slabs + 1);
+        SERV_TEST_CHECK(pool.stats(0).total == kPerSlab * 3);
+        pool.give_back(next);
+        next = pool.borrow(4096);
+        SERV_TEST_CHECK(!next.empty() && next.size_class == 1);
+        pool.give_back(next);
+    }
+
+    return print_result(failures);
+}
+
+//
+// Append the pending bytes of @queue gathered into the iovecs to @out,
+// return the number of the iovecs.
+//
+static int gather_all(const write_queue & queue, std::string & out)
+{
+    struct iovec iov[1024];
+    int count = queue.gather(iov, 1024);
+    out.clear();
+    for (int i = 0; i < count; ++i) {
+        out.append((const char *)iov[i].iov_base, iov[i].iov_len);
+    }
+    return count;
+}
+
+//
+// The write_queue: the copied and the referred segments either side of
+// kMinRefSize, and gather() and commit() across the partial writes, against
+// a plain string of the bytes which are still to be sent.
+//
+int write_queue_test()
+{
+    int failures = 0;
+    print_title("write_queue_test()");
+
+    const std::size_t kRefSize = write_queue::kMinRefSize;
+    std::string body(kRefSize * 4, 'x');
+    for (std::size_t i = 0; i < body.size(); ++i) {
+        body[i] = (char)('a' + (i % 26));
+    }
+
+    // A piece under kMinRefSize is copied, and merged with the copied ones
+    // next to it, a piece of kMinRefSize or more is referred to.
+    {
+        write_queue queue;
+        struct iovec iov[8];
+        SERV_TEST_CHECK(queue.write_ref(body.data(), kRefSize - 1));
+        SERV_TEST_CHECK(queue.write("HEAD", 4));
+        SERV_TEST_CHECK(queue.gather(iov, 8) == 1);
+        SERV_TEST_CHECK(iov[0].iov_base != (void *)body.data());
+        SERV_TEST_CHECK(iov[0].iov_len == kRefSize + 3);
+
+        SERV_TEST_CHECK(queue.write_ref(body.data(), kRefSize));
+        SERV_TEST_CHECK(queue.write("TAIL", 4));
+        SERV_TEST_CHECK(queue.gather(iov, 8) == 3);
+        SERV_TEST_CHECK(iov[1].iov_base == (void *)body.data());
+        SERV_TEST_CHECK(iov[1].iov_len == kRefSize);
+        SERV_TEST_CHECK(iov[2].iov_len == 4);
+        SERV_TEST_CHECK(queue.pending() == kRefSize * 2 + 7);
+
+        // No more than @max_iov.
+        SERV_TEST_CHECK(queue.gather(iov, 2) == 2);
+
+        // Partly sent: into the referred body, then past it.
+        queue.commit(kRefSize + 3 + 10);
+        SERV_TEST_CHECK(queue.gather(iov, 8) == 2);
+        SERV_TEST_CHECK(iov[0].iov_base == (void *)(body.data() + 10));
+        SERV_TEST_CHECK(iov[0].iov_len == kRefSize - 10);
+        SERV_TEST_CHECK(::memcmp(iov[1].iov_base, "TAIL", 4) == 0);
+        queue.commit(kRefSize - 10 + 1);
+        SERV_TEST_CHECK(queue.gather(iov, 8) == 1);
+        SERV_TEST_CHECK(iov[0].iov_len == 3 && ::memcmp(iov[0].iov_base, "AIL", 3) == 0);
+        queue.commit(3);
+        SERV_TEST_CHECK(queue.is_empty() && queue.pending() == 0);
+        SERV_TEST_CHECK(queue.gather(iov, 8) == 0);
+    }
+
+    // Random writes and partial commits, all the bytes come out in order.
+    {
+        write_queue queue;
+        std::string expected, gathered;
+        uint64_t seed = 2024;
+        std::size_t sent = 0;
+        for (int round = 0; round < 20000; ++round) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            uint32_t random = (uint32_t)(seed >> 33);
+            uint32_t op = random % 8;
+            if (op < 3) {
+                // A small piece, copied.
+                std::size_t offset = random % 1000;
+                std::size_t len = 1 + (random >> 10) % 300;
+                SERV_TEST_CHECK(queue.write(body.data() + offset, len));
+                expected.append(body.data() + offset, len);
+            }
+            else if (op < 5) {
+                // A piece either side of kMinRefSize.
+                std::size_t len = kRefSize - 64 + (random >> 8) % 128;
+                std::size_t offset = (random >> 16) % (body.size() - len);
+                SERV_TEST_CHECK(queue.write_ref(body.data() + offset, len));
+                expected.append(body.data() + offset, len);
+            }
+            else if (!expected.empty()) {
+                // A partial write, or all of it now and then.
+                std::size_t n = (op == 7) ? expected.size()
+                                          : (1 + (random >> 8) % expected.size());
+                queue.commit(n);
+                expected.erase(0, n);
+                sent += n;
+            }
+            SERV_TEST_CHECK(queue.pending() == expected.size());
+            gather_all(queue, gathered);
+            if (gathered != expected) {
+                SERV_TEST_CHECK(gathered == expected);
+                break;
+            }
+        }
+        SERV_TEST_CHECK(sent > 0);
+        queue.commit(queue.pending());
+        SERV_TEST_CHECK(queue.is_empty());
+    }
+
+    // Many referred segments: the sent ones are dropped from the head of the
+    // segment array when it's full, or the array grows.
+    {
+        write_queue queue;
+        std::string expected, gathered;
+        for (int i = 0; i < 100; ++i) {
+            SERV_TEST_CHECK(queue.write_ref(body.data() + i, kRefSize));
+            SERV_TEST_CHECK(queue.write("|", 1));
+            expected.append(body.data() + i, kRefSize);
+            expected.append("|", 1);
+        }
+        std::size_t n = (kRefSize + 1) * 60 + 5;
+        queue.commit(n);
+        expected.erase(0, n);
+        for (int i = 0; i < 200; ++i) {
+            SERV_TEST_CHECK(queue.write_ref(body.data() + i * 3, kRefSize + i));
+            SERV_TEST_CHECK(queue.write("#", 1));
+            expected.append(body.data() + i * 3, kRefSize + i);
+            expected.append("#", 1);
+        }
+        SERV_TEST_CHECK(gather_all(queue, gathered) == 80 + 400);
+        SERV_TEST_CHECK(gathered == expected);
+        SERV_TEST_CHECK(queue.pending() == expected.size());
+        queue.commit(queue.pending());
+        SERV_TEST_CHECK(queue.is_empty());
+    }
+
+    // The buffers are given back once the queue is empty.
+    {
+        buffer_pool & pool = buffer_pool::local();
+        std::size_t in_use = pool.stats(0).in_use;
+        write_queue queue;
+        SERV_TEST_CHECK(queue.write("abc", 3));
+        SERV_TEST_CHECK(pool.stats(0).in_use == in_use + 2);
+        queue.commit(2);
+        SERV_TEST_CHECK(pool.stats(0).in_use == in_use + 2);
+        queue.commit(1);
+        SERV_TEST_CHECK(pool.stats(0).in_use == in_use);
+    }
+
+    return print_result(failures);
+}
+
+// The decimal digits of @value by format_uint(), which mustn't write past them.
+static std::string format_uint(uint64_t value)
+{
+    char buf[response_header::kMaxDigits + 1];
+    ::memset(buf, '#', sizeof(buf));
+    char * last = response_header::format_uint(value, buf);
+    if (last < buf || last > buf + response_header::kMaxDigits || *last != '#')
+        return std::string();
+    return std::string(buf, (std::size_t)(last - buf));
+}
+
+//
+// The response_header: format_uint() at the boundaries of the digit pairs,
+// the status_lines of the known and the unknown codes, and the exact bytes
+// of the headers of a keep-alive and a close response.
+//
+int response_header_test()
+{
+    int failures = 0;
+    print_title("response_header_test()");
+
+    SERV_TEST_CHECK(format_uint(0) == "0");
+    SERV_TEST_CHECK(format_uint(9) == "9");
+    SERV_TEST_CHECK(format_uint(10) == "10");
+    SERV_TEST_CHECK(format_uint(99) == "99");
+    SERV_TEST_CHECK(format_uint(100) == "100");
+    SERV_TEST_CHECK(format_uint(101) == "101");
+    SERV_TEST_CHECK(format_uint(1000) == "1000");
+    SERV_TEST_CHECK(format_uint(10000000000000000000ULL) == "10000000000000000000");
+    SERV_TEST_CHECK(format_uint(UINT64_MAX) == "18446744073709551615");
+    // Every value up to 100000, and the powers of 10 and their neighbours.
+    for (uint64_t value = 0; value <= 100000; ++value) {
+        char expected[32];
+        ::snprintf(expected, sizeof(expected), "%llu", (unsigned long long)value);
+        if (format_uint(value) != expected) {
+            SERV_TEST_CHECK(format_uint(value) == expected);
+            break;
+        }
+    }
+    for (uint64_t power = 1; power <= 10000000000000000000ULL; power *= 10) {
+        for (uint64_t value = power - 1; value <= power + 1; ++value) {
+            char expected[32];
+            ::snprintf(expected, sizeof(expected), "%llu", (unsigned long long)value);
+            SERV_TEST_CHECK(format_uint(value) == expected);
+        }
+        if (power > UINT64_MAX / 10)
+            break;
+    }
+
+    // The status lines.
+    const status_lines & lines = status_lines::instance();
+    static const struct {
+        uint32_t     status;
+        const char * line;
+    } kLines[] = {
+        { 100, "HTTP/1.1 100 Continue\r\n"                        },
+        { 200, "HTTP/1.1 200 OK\r\n"                              },
+        { 304, "HTTP/1.1 304 Not Modified\r\n"                    },
+        { 404, "HTTP/1.1 404 Not Found\r\n"                       },
+        { 431, "HTTP/1.1 431 Request Header Fields Too Large\r\n" },
+        { 504, "HTTP/1.1 504 Gateway Timeout\r\n"                 },
+    };
+    for (std::size_t i = 0; i < sizeof(kLines) / sizeof(kLines[0]); ++i) {
+        StringRef line = lines.find(kLines[i].status);
+        SERV_TEST_CHECK(std::string(line.data(), line.size()) == kLines[i].line);
+    }
+    static const uint32_t kUnknown[] = { 0, 99, 102, 299, 418, 505, 599, 600, 1000, UINT32_MAX };
+    for (std::size_t i = 0; i < sizeof(kUnknown) / sizeof(kUnknown[0]); ++i) {
+        SERV_TEST_CHECK(lines.find(kUnknown[i]).size() == 0);
+    }
+
+    // A keep-alive response, in a header which grows from a small buffer.
+    response_header header(16);
+    header.begin(200);
+    header.add_field("Content-Type", "text/plain");
+    header.add_content_length(5);
+    header.add_connection(true);
+    header.end();
+    SERV_TEST_CHECK(std::string(header.data(), header.size()) ==
+                    "HTTP/1.1 200 OK\r\n"
+                    "Server: jimi_http_serv\r\n"
+                    "Content-Type: text/plain\r\n"
+                    "Content-Length: 5\r\n"
+                    "Connection: keep-alive\r\n"
+                    "\r\n");
+
+    // A close response, as the errors are written, the header is reused.
+    header.begin(404);
+    header.add_content_length(0);
+    header.add_connection(false);
+    header.end();
+    SERV_TEST_CHECK(std::string(header.data(), header.size()) ==
+                    "HTTP/1.1 404 Not Found\r\n"
+                    "Server: jimi_http_serv\r\n"
+                    "Content-Length: 0\r\n"
+                    "Connection: close\r\n"
+                    "\r\n");
+
+    // A status without a line, the big numbers and the Date field.
+    http_date & date = http_date::local();
+    date.update();
+    header.begin(299);
+    header.add_field("X-Size", (uint64_t)UINT64_MAX);
+    header.add_date();
+    header.end();
+    SERV_TEST_CHECK(std::string(header.data(), header.size()) ==
+                    std::string("HTTP/1.1 299 Unknown\r\n"
+                                "Server: jimi_http_serv\r\n"
+                                "X-Size: 18446744073709551615\r\n") +
+                    std::string(date.field(), date.field_size()) + "\r\n");
+    char formatted[64];
+    SERV_TEST_CHECK(http_date::format(784111777, formatted, sizeof(formatted)) == 29);
+    SERV_TEST_CHECK(::strcmp(formatted, "Sun, 06 Nov 1994 08:49:37 GMT") == 0);
+    SERV_TEST_CHECK(date.field_size() == 6 + 29 + 2);
+    SERV_TEST_CHECK(::memcmp(date.field(), "Date: ", 6) == 0);
+
+    return print_result(failures);
+}
+
+int main(int argn, char * argv[])
+{
+    std::cout << std::endl;
+    std::cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << std::endl;
+    std::cout << "  Program: jimi_http_serv_test" << std::endl;
+    std::cout << "-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=" << std::endl;
+    std::cout << std::endl;
+
+    int failures = 0;
+    failures += chase_lev_deque_test();
+    failures += mpsc_queue_test();
+    failures += offload_pool_test();
+    failures += rate_limiter_test();
+    failures += admission_control_test();
+    failures += timer_wheel_test();
+    failures += connection_timers_test();
+    failures += proxy_handler_test();
+    failures += response_cache_test();
+    failures += buffer_pool_test();
+    failures += write_queue_test();
+    failures += response_header_test();
+
+    std::cout << "  " << ((failures == 0) ? "All passed" : "Some failed")
+              << ", failures = " << failures << std::endl;
+    std::cout << std::endl;
+    return ((failures == 0) ? 0 : 1);
+}